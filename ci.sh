@@ -584,6 +584,157 @@ cmd_gbench() {
   )
 }
 
+# Encodes `image` with cjxl_tiny at distance 1 and the remaining flags, decodes
+# the result with djxl to `out`.pfm and fails if the butteraugli distance to
+# `image` is larger than `max_distance`. Broken transforms, coefficient orders
+# or quantization tables decode to garbage far above it, or fail to decode.
+_roundtrip_lossy() {
+  local image="$1"
+  local out="$2"
+  local max_distance="$3"
+  shift 3
+  "${BUILD_DIR}/encoder/cjxl_tiny" "${image}" "${out}.jxl" -d 1 "$@"
+  "${DJXL}" "${out}.jxl" "${out}.pfm"
+  _roundtrip_check_distance "${image}" "${out}.pfm" "${max_distance}"
+}
+
+# Encodes `image` with cjxl_tiny at distance 1 and the remaining flags, which
+# must only change how the same coefficients are coded, and fails unless djxl
+# decodes the result to the same pixels as `reference`.
+_roundtrip_same() {
+  local image="$1"
+  local out="$2"
+  local reference="$3"
+  shift 3
+  "${BUILD_DIR}/encoder/cjxl_tiny" "${image}" "${out}.jxl" -d 1 "$@"
+  "${DJXL}" "${out}.jxl" "${out}.pfm"
+  cmp "${reference}" "${out}.pfm"
+  echo "${out}.pfm: same pixels as ${reference}"
+}
+
+# Like _roundtrip_lossy, with two passes, but only decodes the file up to the
+# end of the first pass. That pass alone must give the whole image.
+_roundtrip_first_pass() {
+  local image="$1"
+  local out="$2"
+  shift 2
+  "${BUILD_DIR}/encoder/cjxl_tiny" "${image}" "${out}.jxl" -d 1 \
+    --two_passes --stats_json "${out}.json" "$@"
+  python3 "${MYDIR}/tools/jxl_tiny_roundtrip.py" first_pass "${out}.jxl" \
+    "${out}.json" "${out}-first.jxl"
+  "${DJXL}" "${out}-first.jxl" "${out}.pfm" --allow_partial_files
+  _roundtrip_check_distance "${image}" "${out}.pfm" \
+    "${ROUNDTRIP_MAX_FIRST_PASS_DISTANCE}"
+}
+
+# Fails if the butteraugli distance of `decoded` to `image` is larger than
+# `max_distance`.
+_roundtrip_check_distance() {
+  local image="$1"
+  local decoded="$2"
+  local max_distance="$3"
+  local distance
+  distance=$("${BUTTERAUGLI}" "${image}" "${decoded}" | head -n 1)
+  echo "${decoded}: butteraugli ${distance}, at most ${max_distance}"
+  awk -v d="${distance}" -v max="${max_distance}" \
+    'BEGIN { exit !(d <= max) }'
+}
+
+# Encodes the PPM `image` with cjxl_tiny and the remaining flags, decodes the
+# result with djxl and fails if any sample differs from `image` by more than
+# `max_error`.
+_roundtrip_exact() {
+  local image="$1"
+  local out="$2"
+  local max_error="$3"
+  shift 3
+  "${BUILD_DIR}/encoder/cjxl_tiny" "${image}" "${out}.jxl" "$@"
+  "${DJXL}" "${out}.jxl" "${out}.ppm"
+  python3 "${MYDIR}/tools/jxl_tiny_roundtrip.py" compare "${image}" \
+    "${out}.ppm" --max_error "${max_error}"
+}
+
+# Round-trips the output of cjxl_tiny through djxl, the reference decoder, on
+# synthetic images of one and of several groups.
+cmd_roundtrip() {
+  DJXL="${DJXL:-djxl}"
+  BUTTERAUGLI="${BUTTERAUGLI:-butteraugli_main}"
+  ROUNDTRIP_MAX_DISTANCE="${ROUNDTRIP_MAX_DISTANCE:-2.5}"
+  ROUNDTRIP_MAX_FORCED_DISTANCE="${ROUNDTRIP_MAX_FORCED_DISTANCE:-4.0}"
+  ROUNDTRIP_MAX_FIRST_PASS_DISTANCE="${ROUNDTRIP_MAX_FIRST_PASS_DISTANCE:-4.0}"
+  local tool="${MYDIR}/tools/jxl_tiny_roundtrip.py"
+  local required
+  for required in "${BUILD_DIR}/encoder/cjxl_tiny" "${DJXL}" \
+      "${BUTTERAUGLI}"; do
+    if ! command -v "${required}" >/dev/null; then
+      echo "ERROR: roundtrip needs ${required}; set DJXL and BUTTERAUGLI" \
+        "to the libjxl tools and build cjxl_tiny first." >&2
+      return 1
+    fi
+  done
+  local tmpdir
+  tmpdir=$(mktemp -d)
+  CLEANUP_FILES+=("${tmpdir}")
+
+  local size
+  for size in 200x150 600x400; do
+    local image="${tmpdir}/${size}.pfm"
+    python3 "${tool}" synth "${image}" ${size/x/ }
+    # The transforms chosen by the encoder, and each of them on every block.
+    local effort
+    for effort in default slower; do
+      _roundtrip_lossy "${image}" "${tmpdir}/${size}-${effort}" \
+        "${ROUNDTRIP_MAX_DISTANCE}" --effort "${effort}"
+    done
+    local strategy
+    for strategy in dct8 dct16x8 dct8x16 dct16x16 dct32x32 dct32x16 dct16x32 \
+        dct4x4 identity; do
+      _roundtrip_lossy "${image}" "${tmpdir}/${size}-${strategy}" \
+        "${ROUNDTRIP_MAX_FORCED_DISTANCE}" --ac_strategy "${strategy}"
+    done
+    # Entropy codes of a preset trained on the image, the AC groups permuted
+    # in the TOC, and split into two passes: the same coefficients as without
+    # them, so the same pixels.
+    local reference="${tmpdir}/${size}-default.pfm"
+    "${BUILD_DIR}/encoder/jxl_tiny_train_preset" "${tmpdir}/${size}.preset" \
+      "${image}"
+    _roundtrip_same "${image}" "${tmpdir}/${size}-preset" "${reference}" \
+      --preset "${tmpdir}/${size}.preset"
+    local xsize="${size%x*}"
+    local ysize="${size#*x}"
+    local num_groups=$(( ((xsize + 255) / 256) * ((ysize + 255) / 256) ))
+    local priority=""
+    local group
+    for (( group = 0; group < num_groups; ++group )); do
+      priority+="${priority:+,}$(( group * 5 % 7 ))"
+    done
+    _roundtrip_same "${image}" "${tmpdir}/${size}-center" "${reference}" \
+      --group_order center
+    _roundtrip_same "${image}" "${tmpdir}/${size}-priority" "${reference}" \
+      --group_priority "${priority}"
+    _roundtrip_same "${image}" "${tmpdir}/${size}-two" "${reference}" \
+      --two_passes
+    _roundtrip_same "${image}" "${tmpdir}/${size}-center-two" "${reference}" \
+      --two_passes --group_order center
+    _roundtrip_first_pass "${image}" "${tmpdir}/${size}-first"
+    _roundtrip_first_pass "${image}" "${tmpdir}/${size}-center-first" \
+      --group_order center
+    # Lossless and near-lossless coding of 8 and 16-bit samples. Distance 0
+    # runs the vectorized gradient predictor of the build's Highway target.
+    local bits
+    for bits in 8 16; do
+      image="${tmpdir}/${size}-${bits}.ppm"
+      python3 "${tool}" synth "${image}" ${size/x/ } --bits "${bits}"
+      _roundtrip_exact "${image}" "${tmpdir}/${size}-${bits}-d0" 0 -d 0
+      local max_error
+      for max_error in 0 1 2 7; do
+        _roundtrip_exact "${image}" "${tmpdir}/${size}-${bits}-e${max_error}" \
+          "${max_error}" --max_error "${max_error}"
+      done
+    done
+  done
+}
+
 cmd_asan() {
   SANITIZER="asan"
   CMAKE_C_FLAGS+=" -DJXL_ENABLE_ASSERT=1 -g -DADDRESS_SANITIZER \
@@ -1221,6 +1372,11 @@ Where cmd is one of:
  test      Run the tests build by opt, debug, release, asan or msan. Useful when
            building with SKIP_TEST=1.
  gbench    Run the Google benchmark tests.
+ roundtrip Decode the output of cjxl_tiny with djxl and compare it to the input,
+           with butteraugli for lossy and sample by sample for near-lossless
+           images, also the first pass alone of two-pass output. Output that
+           only codes the same coefficients differently must decode to the
+           same pixels. Uses DJXL and BUTTERAUGLI as the tools.
 
  coverage  Buils and run tests with coverage support. Runs coverage_report as
            well.
@@ -1244,6 +1400,11 @@ You can pass some optional environment variables as well:
  - CMAKE_PREFIX_PATH: Installation prefixes to be searched by the find_package.
  - ENABLE_WASM_SIMD=1: enable experimental SIMD in WASM build (only).
  - LINT_OUTPUT: Path to the output patch from the "lint" command.
+ - ROUNDTRIP_MAX_DISTANCE: Largest butteraugli distance accepted by roundtrip
+   at distance 1 (2.5).
+ - ROUNDTRIP_MAX_FORCED_DISTANCE: Same with one transform forced on every
+   block (4.0).
+ - ROUNDTRIP_MAX_FIRST_PASS_DISTANCE: Same for the first of two passes (4.0).
  - SKIP_CPUSET=1: Skip modifying the cpuset in the arm_benchmark.
  - SKIP_TEST=1: Skip the test stage.
  - STORE_IMAGES=0: Makes the benchmark discard the computed images.
@@ -66,6 +66,10 @@ static constexpr size_t BlockContext(size_t c, uint8_t ac_strategy_code) {
 static constexpr size_t kNumACContexts =
     kNumBlockCtxs * (kNonZeroBuckets + kZeroDensityContextCount);
 
+// Number of contexts of the DC and AC metadata tokens, which are the leaves of
+// the context tree written to the DC global section.
+static constexpr size_t kNumDCContexts = 45;
+
 /* This function is used for entropy-sources pre-clustering.
  *
  * Ideally, each combination of |nonzeros_left| and |k| should go to its own
@@ -103,6 +107,40 @@ static constexpr uint32_t NonZeroContext(uint32_t non_zeros,
          block_ctx;
 }
 
+// Fixed clustering of the AC contexts, for encoders that do not cluster the
+// histograms of the image. Y and chroma blocks are kept apart; the contexts
+// for the number of nonzeros are grouped by the predicted number, the ones of
+// the coefficients by the number of nonzeros left, whether the coefficient is
+// among the first few of that range and whether the previous one was zero.
+static inline std::vector<uint8_t> FixedACContextMap() {
+  static constexpr uint16_t kNumNonzeroContextStart[8] = {
+      0, 31, 62, 93, 123, 152, 180, 206};
+  static constexpr uint8_t kNumNonzeroGroup[8] = {0, 1, 2, 2, 3, 3, 3, 3};
+  constexpr uint8_t kNumNonzeroClusters = 2 * 4;
+  std::vector<uint8_t> context_map(kNumACContexts);
+  for (size_t ctx = 0; ctx < kNumACContexts; ++ctx) {
+    if (ctx < kNumBlockCtxs * kNonZeroBuckets) {
+      const size_t block_ctx = ctx % kNumBlockCtxs;
+      const size_t bucket = ctx / kNumBlockCtxs;
+      const uint8_t group =
+          bucket == 0 ? 0 : bucket < 4 ? 1 : bucket < 8 ? 2 : 3;
+      context_map[ctx] = (block_ctx < 7 ? 0 : 4) + group;
+      continue;
+    }
+    const size_t offset = ctx - kNumBlockCtxs * kNonZeroBuckets;
+    const size_t block_ctx = offset / kZeroDensityContextCount;
+    const size_t zero_density_ctx = offset % kZeroDensityContextCount;
+    const size_t prev = zero_density_ctx & 1;
+    const size_t sum = zero_density_ctx >> 1;
+    size_t level = 0;
+    while (level + 1 < 8 && kNumNonzeroContextStart[level + 1] <= sum) ++level;
+    const size_t high_freq = sum - kNumNonzeroContextStart[level] < 8 ? 0 : 1;
+    context_map[ctx] = kNumNonzeroClusters + (block_ctx < 7 ? 0 : 16) +
+                       kNumNonzeroGroup[level] * 4 + high_freq * 2 + prev;
+  }
+  return context_map;
+}
+
 }  // namespace jxl
 
 #endif  // ENCODER_AC_CONTEXT_H_
@@ -44,6 +44,14 @@ class AcStrategy {
     DCT = 0,
     DCT16X8 = 1,
     DCT8X16 = 2,
+    DCT16X16 = 3,
+    DCT32X32 = 4,
+    DCT32X16 = 5,
+    DCT16X32 = 6,
+    // 4x4 DCT of each quarter of the block
+    DCT4X4 = 7,
+    // "Identity" of each quarter of the block, for sharp edges and patterns
+    IDENTITY = 8,
     kNumValidStrategies
   };
 
@@ -61,7 +69,7 @@ class AcStrategy {
   }
 
   JXL_INLINE uint8_t StrategyCode() const {
-    constexpr uint8_t kLut[] = {0, 6, 7};
+    constexpr uint8_t kLut[] = {0, 6, 7, 4, 5, 10, 11, 3, 1};
     return kLut[RawStrategy()];
   }
 
@@ -83,21 +91,21 @@ class AcStrategy {
   // Number of 8x8 blocks that this strategy will cover. 0 for non-top-left
   // blocks inside a multi-block transform.
   JXL_INLINE size_t covered_blocks_x() const {
-    static constexpr uint8_t kLut[] = {1, 1, 2};
+    static constexpr uint8_t kLut[] = {1, 1, 2, 2, 4, 2, 4, 1, 1};
     static_assert(sizeof(kLut) / sizeof(*kLut) == kNumValidStrategies,
                   "Update LUT");
     return kLut[size_t(strategy_)];
   }
 
   JXL_INLINE size_t covered_blocks_y() const {
-    static constexpr uint8_t kLut[] = {1, 2, 1};
+    static constexpr uint8_t kLut[] = {1, 2, 1, 2, 4, 4, 2, 1, 1};
     static_assert(sizeof(kLut) / sizeof(*kLut) == kNumValidStrategies,
                   "Update LUT");
     return kLut[size_t(strategy_)];
   }
 
   JXL_INLINE size_t log2_covered_blocks() const {
-    static constexpr uint8_t kLut[] = {0, 1, 1};
+    static constexpr uint8_t kLut[] = {0, 1, 1, 2, 4, 3, 3, 0, 0};
     static_assert(sizeof(kLut) / sizeof(*kLut) == kNumValidStrategies,
                   "Update LUT");
     return kLut[size_t(strategy_)];
@@ -143,6 +151,13 @@ class AcStrategyImage {
 
   void FillInvalid() { FillImage(INVALID, &layers_); }
 
+  // Copies the strategies of `rect_from` in `from` to `rect_to`. Strategies
+  // must not cross the borders of the rects.
+  void CopyFrom(const Rect& rect_from, const AcStrategyImage& from,
+                const Rect& rect_to) {
+    CopyImageTo(rect_from, from.layers_, rect_to, &layers_);
+  }
+
   void Set(size_t x, size_t y, AcStrategy::Type type) {
 #if JXL_ENABLE_ASSERT
     AcStrategy acs = AcStrategy::FromRawStrategy(type);
@@ -6,8 +6,19 @@
 
 #include "encoder/base/data_parallel.h"
 
+#include <algorithm>
+#include <iterator>
+
 namespace jxl {
 
+namespace {
+
+// The runner whose worker thread this is, if any, and the index of the worker.
+thread_local const ThreadParallelRunner* tls_runner = nullptr;
+thread_local size_t tls_worker = 0;
+
+}  // namespace
+
 // static
 JxlParallelRetCode ThreadParallelRunner::Runner(
     void* runner_opaque, void* jpegxl_opaque, JxlParallelRunInit init,
@@ -17,7 +28,7 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
   if (start_range > end_range) return -1;
   if (start_range == end_range) return 0;
 
-  int ret = init(jpegxl_opaque, std::max<size_t>(self->num_worker_threads_, 1));
+  int ret = init(jpegxl_opaque, self->num_threads_);
   if (ret != 0) return ret;
 
   // Use a sequential run when num_worker_threads_ is zero since we have no
@@ -30,129 +41,160 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
     return 0;
   }
 
-  if (self->depth_.fetch_add(1, std::memory_order_acq_rel) != 0) {
-    return -1;  // Must not re-enter.
-  }
-
-  const WorkerCommand worker_command =
-      (static_cast<WorkerCommand>(start_range) << 32) + end_range;
-  // Ensure the inputs do not result in a reserved command.
-  JXL_ASSERT(worker_command != kWorkerWait);
-  JXL_ASSERT(worker_command != kWorkerOnce);
-  JXL_ASSERT(worker_command != kWorkerExit);
+  // Worker threads use their own queue and index, all other threads share the
+  // last ones. There is only one such thread per call.
+  const size_t queue =
+      tls_runner == self ? tls_worker : self->num_worker_threads_;
+
+  const uint32_t num_tasks = end_range - start_range;
+  Job job;
+  job.func = func;
+  job.jpegxl_opaque = jpegxl_opaque;
+  // A few ranges per thread balance the load without splitting every task
+  // into its own range.
+  job.grain = std::max(num_tasks / (self->num_threads_ * 4), 1u);
+  job.num_remaining.store(num_tasks, std::memory_order_relaxed);
+
+  self->RunRange(Range{&job, start_range, end_range}, queue, queue);
+  self->WaitForJob(&job, queue, queue);
+  return 0;
+}
 
-  self->data_func_ = func;
-  self->jpegxl_opaque_ = jpegxl_opaque;
-  self->num_reserved_.store(0, std::memory_order_relaxed);
+void ThreadParallelRunner::Push(size_t queue, const Range& range) {
+  {
+    std::lock_guard<std::mutex> lock(queues_[queue].mutex);
+    queues_[queue].ranges.push_back(range);
+    range.job->num_queued.fetch_add(1);
+    num_queued_.fetch_add(1);
+  }
+  // Sleeping threads check the counters after announcing themselves in
+  // num_sleeping_, so either they see the new range or we see them here.
+  if (num_sleeping_.load() != 0) {
+    { std::lock_guard<std::mutex> lock(mutex_); }
+    wakeup_cv_.notify_all();
+  }
+}
 
-  self->StartWorkers(worker_command);
-  self->WorkersReadyBarrier();
+bool ThreadParallelRunner::PopBack(size_t queue, const Job* job,
+                                   Range* range) {
+  WorkQueue& q = queues_[queue];
+  std::lock_guard<std::mutex> lock(q.mutex);
+  for (auto it = q.ranges.rbegin(); it != q.ranges.rend(); ++it) {
+    if (job == nullptr || it->job == job) {
+      *range = *it;
+      q.ranges.erase(std::next(it).base());
+      range->job->num_queued.fetch_sub(1);
+      num_queued_.fetch_sub(1);
+      return true;
+    }
+  }
+  return false;
+}
 
-  if (self->depth_.fetch_add(-1, std::memory_order_acq_rel) != 1) {
-    return -1;
+bool ThreadParallelRunner::Steal(size_t thief, const Job* job, Range* range) {
+  const size_t num_queues = num_worker_threads_ + 1;
+  for (size_t i = 1; i < num_queues; ++i) {
+    if (job != nullptr ? job->num_queued.load() == 0
+                       : num_queued_.load() == 0) {
+      return false;
+    }
+    WorkQueue& q = queues_[(thief + i) % num_queues];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    for (auto it = q.ranges.begin(); it != q.ranges.end(); ++it) {
+      if (job == nullptr || it->job == job) {
+        *range = *it;
+        q.ranges.erase(it);
+        range->job->num_queued.fetch_sub(1);
+        num_queued_.fetch_sub(1);
+        return true;
+      }
+    }
   }
-  return 0;
+  return false;
 }
 
-// static
-void ThreadParallelRunner::RunRange(ThreadParallelRunner* self,
-                                    const WorkerCommand command,
-                                    const int thread) {
-  const uint32_t begin = command >> 32;
-  const uint32_t end = command & 0xFFFFFFFF;
-  const uint32_t num_tasks = end - begin;
-  const uint32_t num_worker_threads = self->num_worker_threads_;
-
-  // OpenMP introduced several "schedule" strategies:
-  // "single" (static assignment of exactly one chunk per thread): slower.
-  // "dynamic" (allocates k tasks at a time): competitive for well-chosen k.
-  // "guided" (allocates k tasks, decreases k): computing k = remaining/n
-  //   is faster than halving k each iteration. We prefer this strategy
-  //   because it avoids user-specified parameters.
+void ThreadParallelRunner::RunRange(Range range, size_t queue, size_t thread) {
+  Job* job = range.job;
+  // Leave the upper halves for other threads, the newest (smallest) ones are
+  // taken back by this thread if nobody stole them in the meantime.
+  while (range.end - range.begin > job->grain) {
+    const uint32_t mid = range.begin + (range.end - range.begin) / 2;
+    Push(queue, Range{job, mid, range.end});
+    range.end = mid;
+  }
+  for (uint32_t task = range.begin; task < range.end; ++task) {
+    job->func(job->jpegxl_opaque, task, thread);
+  }
+  const uint32_t num_done = range.end - range.begin;
+  if (job->num_remaining.fetch_sub(num_done) == num_done) {
+    // Wake up the thread waiting for the job.
+    { std::lock_guard<std::mutex> lock(mutex_); }
+    wakeup_cv_.notify_all();
+  }
+}
 
-  for (;;) {
-#if 0
-      // dynamic
-      const uint32_t my_size = std::max(num_tasks / (num_worker_threads * 4), 1);
-#else
-    // guided
-    const uint32_t num_reserved =
-        self->num_reserved_.load(std::memory_order_relaxed);
-    // It is possible that more tasks are reserved than ready to run.
-    const uint32_t num_remaining =
-        num_tasks - std::min(num_reserved, num_tasks);
-    const uint32_t my_size =
-        std::max(num_remaining / (num_worker_threads * 4), 1u);
-#endif
-    const uint32_t my_begin = begin + self->num_reserved_.fetch_add(
-                                          my_size, std::memory_order_relaxed);
-    const uint32_t my_end = std::min(my_begin + my_size, begin + num_tasks);
-    // Another thread already reserved the last task.
-    if (my_begin >= my_end) {
-      break;
+void ThreadParallelRunner::WaitForJob(Job* job, size_t queue, size_t thread) {
+  // Only tasks of this job are run here: tasks of an enclosing call of the
+  // same job would reuse the thread id of the task that is still running on
+  // this thread.
+  while (job->num_remaining.load() != 0) {
+    Range range;
+    if (PopBack(queue, job, &range) || Steal(queue, job, &range)) {
+      RunRange(range, queue, thread);
+      continue;
     }
-    for (uint32_t task = my_begin; task < my_end; ++task) {
-      self->data_func_(self->jpegxl_opaque_, task, thread);
+    // The remaining tasks are running on other threads, which may still split
+    // off ranges of them.
+    std::unique_lock<std::mutex> lock(mutex_);
+    num_sleeping_.fetch_add(1);
+    if (job->num_remaining.load() != 0 && job->num_queued.load() == 0) {
+      wakeup_cv_.wait(lock);
     }
+    num_sleeping_.fetch_sub(1);
   }
 }
 
 // static
 void ThreadParallelRunner::ThreadFunc(ThreadParallelRunner* self,
-                                      const int thread) {
-  // Until kWorkerExit command received:
+                                      const size_t thread) {
+  tls_runner = self;
+  tls_worker = thread;
   for (;;) {
-    std::unique_lock<std::mutex> lock(self->mutex_);
-    // Notify main thread that this thread is ready.
-    if (++self->workers_ready_ == self->num_threads_) {
-      self->workers_ready_cv_.notify_one();
+    Range range;
+    if (self->PopBack(thread, nullptr, &range) ||
+        self->Steal(thread, nullptr, &range)) {
+      self->RunRange(range, thread, thread);
+      continue;
     }
-  RESUME_WAIT:
-    // Wait for a command.
-    self->worker_start_cv_.wait(lock);
-    const WorkerCommand command = self->worker_start_command_;
-    switch (command) {
-      case kWorkerWait:    // spurious wakeup:
-        goto RESUME_WAIT;  // lock still held, avoid incrementing ready.
-      case kWorkerOnce:
-        lock.unlock();
-        self->data_func_(self->jpegxl_opaque_, thread, thread);
-        break;
-      case kWorkerExit:
-        return;  // exits thread
-      default:
-        lock.unlock();
-        RunRange(self, command, thread);
-        break;
+    std::unique_lock<std::mutex> lock(self->mutex_);
+    if (self->exit_) return;
+    self->num_sleeping_.fetch_add(1);
+    if (self->num_queued_.load() == 0) {
+      self->wakeup_cv_.wait(lock);
     }
+    self->num_sleeping_.fetch_sub(1);
   }
 }
 
 ThreadParallelRunner::ThreadParallelRunner(const int num_worker_threads)
     : num_worker_threads_(num_worker_threads),
-      num_threads_(std::max(num_worker_threads, 1)) {
+      // The worker threads plus the thread calling Runner.
+      num_threads_(num_worker_threads == 0 ? 1 : num_worker_threads + 1),
+      queues_(new WorkQueue[num_worker_threads + 1]) {
   threads_.reserve(num_worker_threads_);
-
-  // Suppress "unused-private-field" warning.
-  (void)padding1;
-  (void)padding2;
-
-  // Safely handle spurious worker wakeups.
-  worker_start_command_ = kWorkerWait;
-
   for (uint32_t i = 0; i < num_worker_threads_; ++i) {
+    // Suppress "unused-private-field" warning.
+    (void)queues_[i].padding;
     threads_.emplace_back(ThreadFunc, this, i);
   }
-
-  if (num_worker_threads_ != 0) {
-    WorkersReadyBarrier();
-  }
 }
 
 ThreadParallelRunner::~ThreadParallelRunner() {
-  if (num_worker_threads_ != 0) {
-    StartWorkers(kWorkerExit);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    exit_ = true;
   }
+  wakeup_cv_.notify_all();
 
   for (std::thread& thread : threads_) {
     JXL_ASSERT(thread.joinable());
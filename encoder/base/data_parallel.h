@@ -14,12 +14,16 @@
 #include <stdint.h>
 
 #include <atomic>
+#include <chrono>              //NOLINT
 #include <condition_variable>  //NOLINT
-#include <mutex>               //NOLINT
-#include <thread>              //NOLINT
+#include <deque>
+#include <memory>
+#include <mutex>   //NOLINT
+#include <thread>  //NOLINT
 #include <vector>
 
 #include "encoder/base/bits.h"
+#include "encoder/base/stats.h"
 #include "encoder/base/status.h"
 
 #if JXL_COMPILER_MSVC
@@ -81,6 +85,13 @@ typedef void (*JxlParallelRunFunction)(void* jpegxl_opaque, uint32_t value,
 namespace jxl {
 
 // Main helper class implementing the ::JxlParallelRunner interface.
+//
+// Work-stealing scheduler: every worker thread owns a deque of task ranges.
+// A thread that runs a range larger than the grain size of its call splits off
+// the upper half into its own deque, from which idle threads steal. Calls to
+// Runner may be nested (from inside a task) and may come from several threads
+// at once; the calling thread helps with the tasks of its own call until all
+// of them are done, so independent calls overlap instead of being serialized.
 class ThreadParallelRunner {
  public:
   // ::JxlParallelRunner interface.
@@ -98,55 +109,57 @@ class ThreadParallelRunner {
   // Waits for all threads to exit.
   ~ThreadParallelRunner();
 
+  // The worker threads plus the calling thread, the number of threads passed
+  // to the init functions.
+  uint32_t num_threads() const { return num_threads_; }
+
  private:
-  // After construction and between calls to Run, workers are "ready", i.e.
-  // waiting on worker_start_cv_. They are "started" by sending a "command"
-  // and notifying all worker_start_cv_ waiters. (That is why all workers
-  // must be ready/waiting - otherwise, the notification will not reach all of
-  // them and the main thread waits in vain for them to report readiness.)
-  using WorkerCommand = uint64_t;
-
-  // Special values; all others encode the begin/end parameters. Note that all
-  // these are no-op ranges (begin >= end) and therefore never used to encode
-  // ranges.
-  static constexpr WorkerCommand kWorkerWait = ~1ULL;
-  static constexpr WorkerCommand kWorkerOnce = ~2ULL;
-  static constexpr WorkerCommand kWorkerExit = ~3ULL;
-
-  // Calls f(task, thread). Used for type erasure of Func arguments. The
-  // signature must match JxlParallelRunFunction, hence a void* argument.
-  template <class Closure>
-  static void CallClosure(void* f, const uint32_t task, const size_t thread) {
-    (*reinterpret_cast<const Closure*>(f))(task, thread);
-  }
+  // State of one Runner call.
+  struct Job {
+    JxlParallelRunFunction func;
+    void* jpegxl_opaque;
+    // Ranges with more tasks than this are split before they are run.
+    uint32_t grain;
+    // Tasks that have not finished yet.
+    std::atomic<uint32_t> num_remaining;
+    // Ranges of this job waiting in the queues.
+    std::atomic<uint32_t> num_queued{0};
+  };
 
-  void WorkersReadyBarrier() {
-    std::unique_lock<std::mutex> lock(mutex_);
-    // Typically only a single iteration.
-    while (workers_ready_ != threads_.size()) {
-      workers_ready_cv_.wait(lock);
-    }
-    workers_ready_ = 0;
+  // Unit of work stored in the queues: the tasks [begin, end) of a job.
+  struct Range {
+    Job* job;
+    uint32_t begin;
+    uint32_t end;
+  };
 
-    // Safely handle spurious worker wakeups.
-    worker_start_command_ = kWorkerWait;
-  }
+  struct WorkQueue {
+    std::mutex mutex;
+    std::deque<Range> ranges;
+    // Avoids false sharing between the queues of different threads.
+    uint8_t padding[64];
+  };
 
-  // Precondition: all workers are ready.
-  void StartWorkers(const WorkerCommand worker_command) {
-    mutex_.lock();
-    worker_start_command_ = worker_command;
-    // Workers will need this lock, so release it before they wake up.
-    mutex_.unlock();
-    worker_start_cv_.notify_all();
-  }
+  // Adds a range to the back of the given queue and wakes up sleeping
+  // threads.
+  void Push(size_t queue, const Range& range);
+
+  // Takes the most recently pushed range of `job` (or of any job if null)
+  // from the given queue.
+  bool PopBack(size_t queue, const Job* job, Range* range);
+
+  // Takes the oldest range of `job` (or of any job if null) from a queue other
+  // than `thief`.
+  bool Steal(size_t thief, const Job* job, Range* range);
 
-  // Attempts to reserve and perform some work from the global range of tasks,
-  // which is encoded within "command". Returns after all tasks are reserved.
-  static void RunRange(ThreadParallelRunner* self, const WorkerCommand command,
-                       const int thread);
+  // Runs the tasks of `range` with the given thread id, leaving parts of it
+  // in `queue` for other threads.
+  void RunRange(Range range, size_t queue, size_t thread);
 
-  static void ThreadFunc(ThreadParallelRunner* self, int thread);
+  // Runs tasks of `job` until all of them are finished.
+  void WaitForJob(Job* job, size_t queue, size_t thread);
+
+  static void ThreadFunc(ThreadParallelRunner* self, size_t thread);
 
   // Unmodified after ctor, but cannot be const because we call thread::join().
   std::vector<std::thread> threads_;
@@ -154,22 +167,17 @@ class ThreadParallelRunner {
   const uint32_t num_worker_threads_;  // == threads_.size()
   const uint32_t num_threads_;
 
-  std::atomic<int> depth_{0};  // detects if Run is re-entered (not supported).
-
-  std::mutex mutex_;  // guards both cv and their variables.
-  std::condition_variable workers_ready_cv_;
-  uint32_t workers_ready_ = 0;
-  std::condition_variable worker_start_cv_;
-  WorkerCommand worker_start_command_;
-
-  // Written by main thread, read by workers (after mutex lock/unlock).
-  JxlParallelRunFunction data_func_;
-  void* jpegxl_opaque_;
-
-  // Updated by workers; padding avoids false sharing.
-  uint8_t padding1[64];
-  std::atomic<uint32_t> num_reserved_{0};
-  uint8_t padding2[64];
+  // One queue per worker thread, followed by one shared by all other threads
+  // that call Runner.
+  std::unique_ptr<WorkQueue[]> queues_;
+
+  // Total number of ranges in all queues.
+  std::atomic<uint32_t> num_queued_{0};
+  // Number of threads that are about to sleep or sleeping on wakeup_cv_.
+  std::atomic<uint32_t> num_sleeping_{0};
+  std::mutex mutex_;  // guards wakeup_cv_ and exit_.
+  std::condition_variable wakeup_cv_;
+  bool exit_ = false;
 };
 
 class ThreadPool {
@@ -188,7 +196,9 @@ class ThreadPool {
   // thread(s) for every task in [begin, end). init_func() must return a Status
   // indicating whether the initialization succeeded.
   // "thread" is an integer smaller than num_threads.
-  // Not thread-safe - no two calls to Run may overlap.
+  // Calls may overlap: data_func may itself call Run, and several threads may
+  // call Run at the same time. No two tasks of the same call run with the same
+  // "thread" at the same time.
   // Subsequent calls will reuse the same threads.
   //
   // Precondition: begin <= end.
@@ -197,31 +207,63 @@ class ThreadPool {
              const DataFunc& data_func, const char* caller = "") {
     JXL_ASSERT(begin <= end);
     if (begin == end) return true;
-    RunCallState<InitFunc, DataFunc> call_state(init_func, data_func);
+    EncodeStats* stats = stats_.load(std::memory_order_relaxed);
+    RunCallState<InitFunc, DataFunc> call_state(init_func, data_func, stats);
+    const auto start = EncodeStats::Clock::now();
     // The runner_ uses the C convention and returns 0 in case of error, so we
     // convert it to a Status.
-    return ThreadParallelRunner::Runner(
-               &runner_, static_cast<void*>(&call_state),
-               &call_state.CallInitFunc, &call_state.CallDataFunc, begin,
-               end) == 0;
+    const bool ok = ThreadParallelRunner::Runner(
+                        &runner_, static_cast<void*>(&call_state),
+                        call_state.init_func(), call_state.data_func(), begin,
+                        end) == 0;
+    if (stats) {
+      stats->AddCall(caller, end - begin, call_state.num_threads(), start,
+                     EncodeStats::Clock::now(), call_state.thread_tasks());
+    }
+    return ok;
   }
 
   // Use this as init_func when no initialization is needed.
   static Status NoInit(size_t num_threads) { return true; }
 
+  // Starts reporting every Run call to `stats` (see EncodeStats), which
+  // costs four clock reads per task, or stops it if null. `stats` must outlive
+  // the calls.
+  void SetStats(EncodeStats* stats) { stats_.store(stats); }
+  EncodeStats* stats() const { return stats_.load(); }
+
+  // Number of threads that may run the tasks of a call, one if there are no
+  // worker threads.
+  size_t num_threads() const { return runner_.num_threads(); }
+
  private:
   // class holding the state of a Run() call to pass to the runner_ as an
   // opaque_jpegxl pointer.
   template <class InitFunc, class DataFunc>
   class RunCallState final {
    public:
-    RunCallState(const InitFunc& init_func, const DataFunc& data_func)
-        : init_func_(init_func), data_func_(data_func) {}
+    RunCallState(const InitFunc& init_func, const DataFunc& data_func,
+                 const EncodeStats* stats)
+        : init_func_(init_func),
+          data_func_(data_func),
+          timed_(stats != nullptr),
+          trace_(stats != nullptr && stats->trace()) {}
+
+    JxlParallelRunInit init_func() const { return &CallInitFunc; }
+    JxlParallelRunFunction data_func() const {
+      return timed_ ? &CallTimedDataFunc : &CallDataFunc;
+    }
+    size_t num_threads() const { return num_threads_; }
+    const std::vector<EncodeStats::ThreadTasks>& thread_tasks() const {
+      return thread_tasks_;
+    }
 
     // JxlParallelRunInit interface.
     static int CallInitFunc(void* jpegxl_opaque, size_t num_threads) {
-      const auto* self =
+      auto* self =
           static_cast<RunCallState<InitFunc, DataFunc>*>(jpegxl_opaque);
+      self->num_threads_ = num_threads;
+      if (self->timed_) self->thread_tasks_.resize(num_threads);
       // Returns -1 when the internal init function returns false Status to
       // indicate an error.
       return self->init_func_(num_threads) ? 0 : -1;
@@ -235,12 +277,43 @@ class ThreadPool {
       return self->data_func_(value, thread_id);
     }
 
+    // Only one thread at a time runs tasks with a given thread_id, and it is
+    // the same thread for the whole call, so thread_tasks_[thread_id] needs
+    // no synchronization.
+    static void CallTimedDataFunc(void* jpegxl_opaque, uint32_t value,
+                                  size_t thread_id) {
+      auto* self =
+          static_cast<RunCallState<InitFunc, DataFunc>*>(jpegxl_opaque);
+      const auto start = EncodeStats::Clock::now();
+      const uint64_t cpu_start = EncodeStats::ThreadCpuNanos();
+      self->data_func_(value, thread_id);
+      const uint64_t cpu_nanos = EncodeStats::ThreadCpuNanos() - cpu_start;
+      const auto end = EncodeStats::Clock::now();
+      EncodeStats::ThreadTasks& tasks = self->thread_tasks_[thread_id];
+      if (tasks.num_tasks++ == 0) tasks.thread = std::this_thread::get_id();
+      tasks.busy_nanos +=
+          std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+              .count();
+      tasks.cpu_nanos += cpu_nanos;
+      if (self->trace_) {
+        tasks.start.push_back(start);
+        tasks.end.push_back(end);
+        tasks.cpu_nanos_of.push_back(cpu_nanos);
+      }
+    }
+
    private:
     const InitFunc& init_func_;
     const DataFunc& data_func_;
+    const bool timed_;
+    const bool trace_;
+    size_t num_threads_ = 0;
+    std::vector<EncodeStats::ThreadTasks> thread_tasks_;
   };
 
   ThreadParallelRunner runner_;
+
+  std::atomic<EncodeStats*> stats_{nullptr};
 };
 
 template <class InitFunc, class DataFunc>
@@ -255,6 +328,21 @@ Status RunOnPool(ThreadPool* pool, const uint32_t begin, const uint32_t end,
   }
 }
 
+// Runs first() and second(), which return a Status and may use `pool`
+// themselves, as two concurrent tasks. Returns false if either of them failed.
+template <class First, class Second>
+Status RunConcurrently(ThreadPool* pool, const First& first,
+                       const Second& second, const char* caller) {
+  std::atomic<bool> ok{true};
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, 2, ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /* thread */) {
+        if (!(task == 0 ? first() : second())) ok = false;
+      },
+      caller));
+  return ok.load();
+}
+
 }  // namespace jxl
 #if JXL_COMPILER_MSVC
 #pragma warning(default : 4180)
@@ -0,0 +1,273 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/base/stats.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "encoder/base/printf_macros.h"
+
+namespace jxl {
+
+namespace {
+
+void AppendString(const std::string& s, std::string* out) {
+  out->push_back('"');
+  for (const char c : s) {
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out->append(buf);
+    } else {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
+
+void AppendDouble(double value, std::string* out) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.3f", value);
+  out->append(buf);
+}
+
+void AppendSize(size_t value, std::string* out) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%" PRIuS, value);
+  out->append(buf);
+}
+
+double Micros(EncodeStats::Clock::duration d) {
+  return std::chrono::duration<double, std::micro>(d).count();
+}
+
+}  // namespace
+
+double EncodeStats::Stage::busy_seconds() const {
+  double sum = 0;
+  for (const double seconds : thread_seconds) sum += seconds;
+  return sum;
+}
+
+double EncodeStats::Stage::cpu_seconds() const {
+  double sum = 0;
+  for (const double seconds : thread_cpu_seconds) sum += seconds;
+  return sum;
+}
+
+uint64_t EncodeStats::ThreadCpuNanos() {
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+  timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+#else
+  return 0;
+#endif
+}
+
+EncodeStats::EncodeStats(bool trace) : trace_(trace), origin_(Clock::now()) {}
+
+size_t EncodeStats::ThreadIndex(std::thread::id thread) {
+  auto it = std::find(threads_.begin(), threads_.end(), thread);
+  if (it != threads_.end()) return it - threads_.begin();
+  threads_.push_back(thread);
+  return threads_.size() - 1;
+}
+
+EncodeStats::Stage* EncodeStats::GetStage(const char* name) {
+  auto it = std::find_if(stages_.begin(), stages_.end(),
+                         [name](const Stage& s) { return s.name == name; });
+  if (it != stages_.end()) return &*it;
+  stages_.emplace_back();
+  stages_.back().name = name;
+  return &stages_.back();
+}
+
+void EncodeStats::AddCall(const char* stage, size_t num_tasks,
+                          size_t num_threads, Clock::time_point start,
+                          Clock::time_point end,
+                          const std::vector<ThreadTasks>& threads) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stage* s = GetStage(stage);
+  const size_t stage_index = s - stages_.data();
+  const double wall_seconds =
+      std::chrono::duration<double>(end - start).count();
+  s->num_calls++;
+  s->num_tasks += num_tasks;
+  s->wall_seconds += wall_seconds;
+  double busy_seconds = 0;
+  for (const ThreadTasks& t : threads) {
+    if (t.num_tasks == 0) continue;
+    const size_t thread = ThreadIndex(t.thread);
+    if (s->thread_seconds.size() <= thread) {
+      s->thread_seconds.resize(thread + 1);
+      s->thread_cpu_seconds.resize(thread + 1);
+    }
+    s->thread_seconds[thread] += t.busy_nanos * 1E-9;
+    s->thread_cpu_seconds[thread] += t.cpu_nanos * 1E-9;
+    busy_seconds += t.busy_nanos * 1E-9;
+    if (!trace_) continue;
+    for (size_t i = 0; i < t.start.size(); ++i) {
+      events_.push_back(Event{stage_index, thread, false, t.start[i], t.end[i],
+                              t.cpu_nanos_of[i]});
+    }
+  }
+  s->idle_seconds += std::max(0.0, wall_seconds * num_threads - busy_seconds);
+  if (trace_) {
+    events_.push_back(Event{stage_index,
+                            ThreadIndex(std::this_thread::get_id()), true,
+                            start, end, 0});
+  }
+}
+
+void EncodeStats::AddSpan(const char* stage, Clock::time_point start,
+                          Clock::time_point end, uint64_t cpu_nanos) {
+  ThreadTasks thread;
+  thread.thread = std::this_thread::get_id();
+  thread.num_tasks = 1;
+  thread.busy_nanos =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+          .count();
+  thread.cpu_nanos = cpu_nanos;
+  if (trace_) {
+    thread.start.push_back(start);
+    thread.end.push_back(end);
+    thread.cpu_nanos_of.push_back(cpu_nanos);
+  }
+  AddCall(stage, 1, 1, start, end, {thread});
+}
+
+void EncodeStats::AddSection(const char* name, size_t index, size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  sections_.push_back(Section{name, index, bytes});
+}
+
+void EncodeStats::Reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  origin_ = Clock::now();
+  threads_.clear();
+  stages_.clear();
+  sections_.clear();
+  events_.clear();
+}
+
+std::vector<EncodeStats::Stage> EncodeStats::GetStages() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stages_;
+}
+
+std::vector<EncodeStats::Section> EncodeStats::GetSections() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return sections_;
+}
+
+size_t EncodeStats::num_threads() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return threads_.size();
+}
+
+// Requires mutex_ to be held.
+std::string EncodeStats::SectionsJSON() const {
+  std::string out = "[";
+  for (size_t i = 0; i < sections_.size(); ++i) {
+    const Section& section = sections_[i];
+    out += i == 0 ? "\n    " : ",\n    ";
+    out += "{\"name\": ";
+    AppendString(section.name, &out);
+    out += ", \"index\": ";
+    AppendSize(section.index, &out);
+    out += ", \"bytes\": ";
+    AppendSize(section.bytes, &out);
+    out += "}";
+  }
+  out += sections_.empty() ? "]" : "\n  ]";
+  return out;
+}
+
+std::string EncodeStats::ToJSON() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string out = "{\n  \"stages\": [";
+  for (size_t i = 0; i < stages_.size(); ++i) {
+    const Stage& stage = stages_[i];
+    out += i == 0 ? "\n    " : ",\n    ";
+    out += "{\"name\": ";
+    AppendString(stage.name, &out);
+    out += ", \"calls\": ";
+    AppendSize(stage.num_calls, &out);
+    out += ", \"tasks\": ";
+    AppendSize(stage.num_tasks, &out);
+    out += ", \"wall_ms\": ";
+    AppendDouble(stage.wall_seconds * 1E3, &out);
+    out += ", \"busy_ms\": ";
+    AppendDouble(stage.busy_seconds() * 1E3, &out);
+    out += ", \"idle_ms\": ";
+    AppendDouble(stage.idle_seconds * 1E3, &out);
+    out += ", \"cpu_ms\": ";
+    AppendDouble(stage.cpu_seconds() * 1E3, &out);
+    out += ", \"thread_busy_ms\": [";
+    for (size_t t = 0; t < stage.thread_seconds.size(); ++t) {
+      if (t != 0) out += ", ";
+      AppendDouble(stage.thread_seconds[t] * 1E3, &out);
+    }
+    out += "], \"thread_cpu_ms\": [";
+    for (size_t t = 0; t < stage.thread_cpu_seconds.size(); ++t) {
+      if (t != 0) out += ", ";
+      AppendDouble(stage.thread_cpu_seconds[t] * 1E3, &out);
+    }
+    out += "]}";
+  }
+  out += stages_.empty() ? "],\n" : "\n  ],\n";
+  out += "  \"sections\": " + SectionsJSON() + "\n}\n";
+  return out;
+}
+
+std::string EncodeStats::ToChromeTrace() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string out = "{\n  \"traceEvents\": [";
+  bool first = true;
+  const auto begin_event = [&]() {
+    out += first ? "\n    " : ",\n    ";
+    first = false;
+  };
+  for (size_t t = 0; t < threads_.size(); ++t) {
+    begin_event();
+    out += "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": ";
+    AppendSize(t, &out);
+    out += ", \"args\": {\"name\": \"thread ";
+    AppendSize(t, &out);
+    out += "\"}}";
+  }
+  for (const Event& event : events_) {
+    begin_event();
+    out += "{\"name\": ";
+    AppendString(stages_[event.stage].name, &out);
+    out += event.is_call ? ", \"cat\": \"call\"" : ", \"cat\": \"task\"";
+    out += ", \"ph\": \"X\", \"pid\": 0, \"tid\": ";
+    AppendSize(event.thread, &out);
+    out += ", \"ts\": ";
+    AppendDouble(Micros(event.start - origin_), &out);
+    out += ", \"dur\": ";
+    AppendDouble(Micros(event.end - event.start), &out);
+    if (!event.is_call) {
+      out += ", \"args\": {\"cpu_us\": ";
+      AppendDouble(event.cpu_nanos * 1E-3, &out);
+      out += "}";
+    }
+    out += "}";
+  }
+  out += first ? "],\n" : "\n  ],\n";
+  out += "  \"displayTimeUnit\": \"ms\",\n";
+  out += "  \"otherData\": {\"sections\": " + SectionsJSON() + "}\n}\n";
+  return out;
+}
+
+}  // namespace jxl
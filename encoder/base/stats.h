@@ -0,0 +1,183 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef ENCODER_BASE_STATS_H_
+#define ENCODER_BASE_STATS_H_
+
+// Collection of timings and output sizes of encoder calls.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>  //NOLINT
+#include <mutex>   //NOLINT
+#include <string>
+#include <thread>  //NOLINT
+#include <vector>
+
+namespace jxl {
+
+// Records where the time of encoder calls goes and how large their output
+// sections are. A stage is a set of ThreadPool::Run calls with the same
+// "caller" name (or a serial span, see ScopedStatsSpan); for each stage the
+// number of calls and tasks, the wall time of the calls and, for each thread,
+// the time and the CPU time it spent running its tasks are accumulated. The
+// time of the tasks is measured with the wall clock, so it exceeds their CPU
+// time where the thread was preempted or blocked. The CPU time is read from
+// the per-thread CPU clock (CLOCK_THREAD_CPUTIME_ID) and is zero on platforms
+// without one. The tasks of a call made from a task count for both.
+//
+// Attach it to a ThreadPool with ThreadPool::SetStats (or to an Encoder with
+// Encoder::SetStats); all calls on that pool then report here, and the encoder
+// adds the sizes of the frame sections. The numbers accumulate over all
+// encoded images until Reset().
+//
+// Thread-safe; the pool reports each call once it is finished, so the
+// overhead is four clock reads per task plus one locked update per call.
+// Reading the CPU clock of a thread is a system call on Linux.
+class EncodeStats {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // If `trace` is true, every call and task is also kept as an event for
+  // ToChromeTrace(), which costs memory proportional to the number of tasks.
+  explicit EncodeStats(bool trace = false);
+
+  EncodeStats(const EncodeStats&) = delete;
+  EncodeStats& operator=(const EncodeStats&) = delete;
+
+  struct Stage {
+    std::string name;
+    size_t num_calls = 0;
+    size_t num_tasks = 0;
+    // Sum of the durations of the calls.
+    double wall_seconds = 0;
+    // Time the threads available to the calls did not spend on their tasks,
+    // i.e. were waiting or running tasks of other, overlapping calls.
+    double idle_seconds = 0;
+    // Time spent in the tasks by each thread, indexed by ThreadIndex().
+    std::vector<double> thread_seconds;
+    // CPU time used by the tasks on each thread, with the same index.
+    std::vector<double> thread_cpu_seconds;
+
+    double busy_seconds() const;
+    double cpu_seconds() const;
+  };
+
+  // One section of the encoded frame, in the order of the output.
+  struct Section {
+    // "Headers" (image and frame header), "TOC", "DC global", "DC group",
+    // "AC global", "AC group", "AC refinement" for the second pass of an AC
+    // group, or "All groups" for the single section of an image that fits in
+    // one group.
+    std::string name;
+    // Index among the sections with the same name.
+    size_t index;
+    size_t bytes;
+  };
+
+  // Time and CPU time one thread spent in the tasks of a call; `start`, `end`
+  // and `cpu_nanos_of` of every task are only filled in when tracing.
+  struct ThreadTasks {
+    std::thread::id thread;
+    size_t num_tasks = 0;
+    uint64_t busy_nanos = 0;
+    uint64_t cpu_nanos = 0;
+    std::vector<Clock::time_point> start;
+    std::vector<Clock::time_point> end;
+    std::vector<uint64_t> cpu_nanos_of;
+  };
+
+  bool trace() const { return trace_; }
+
+  // CPU time used by the calling thread so far, or zero if the platform has no
+  // per-thread CPU clock.
+  static uint64_t ThreadCpuNanos();
+
+  // Adds a call of `stage` that ran `num_tasks` tasks on `threads`, of which
+  // up to `num_threads` were available to it.
+  void AddCall(const char* stage, size_t num_tasks, size_t num_threads,
+               Clock::time_point start, Clock::time_point end,
+               const std::vector<ThreadTasks>& threads);
+
+  // Adds a call of `stage` that ran as a single task on the calling thread
+  // and used `cpu_nanos` of its CPU time.
+  void AddSpan(const char* stage, Clock::time_point start,
+               Clock::time_point end, uint64_t cpu_nanos);
+
+  void AddSection(const char* name, size_t index, size_t bytes);
+
+  // Forgets everything recorded so far; the times of later events are
+  // relative to this call.
+  void Reset();
+
+  std::vector<Stage> GetStages() const;
+  std::vector<Section> GetSections() const;
+  // Threads that ran tasks, in the order of ThreadIndex().
+  size_t num_threads() const;
+
+  // {"stages": [...], "sections": [...]} with times in milliseconds.
+  std::string ToJSON() const;
+  // Trace Event Format ("X" events with times in microseconds) for
+  // chrome://tracing or ui.perfetto.dev; calls and tasks are shown on the
+  // threads that ran them, with the CPU time of every task in its "args", and
+  // the sections are listed under "otherData".
+  std::string ToChromeTrace() const;
+
+ private:
+  struct Event {
+    size_t stage;
+    size_t thread;
+    bool is_call;
+    Clock::time_point start;
+    Clock::time_point end;
+    uint64_t cpu_nanos;
+  };
+
+  // Index of `thread` in thread_seconds, assigned in order of first use.
+  size_t ThreadIndex(std::thread::id thread);
+  Stage* GetStage(const char* name);
+  std::string SectionsJSON() const;
+
+  const bool trace_;
+  mutable std::mutex mutex_;
+  Clock::time_point origin_;
+  std::vector<std::thread::id> threads_;
+  std::vector<Stage> stages_;
+  std::vector<Section> sections_;
+  std::vector<Event> events_;
+};
+
+// Adds the time from construction to destruction as a span of `stage` to
+// `stats`, unless it is null. Used for serial parts of the encoder.
+class ScopedStatsSpan {
+ public:
+  ScopedStatsSpan(EncodeStats* stats, const char* stage)
+      : stats_(stats),
+        stage_(stage),
+        start_(stats ? EncodeStats::Clock::now()
+                     : EncodeStats::Clock::time_point()),
+        cpu_start_(stats ? EncodeStats::ThreadCpuNanos() : 0) {}
+  ~ScopedStatsSpan() {
+    if (stats_) {
+      const uint64_t cpu_nanos = EncodeStats::ThreadCpuNanos() - cpu_start_;
+      stats_->AddSpan(stage_, start_, EncodeStats::Clock::now(), cpu_nanos);
+    }
+  }
+
+  ScopedStatsSpan(const ScopedStatsSpan&) = delete;
+  ScopedStatsSpan& operator=(const ScopedStatsSpan&) = delete;
+
+ private:
+  EncodeStats* stats_;
+  const char* stage_;
+  EncodeStats::Clock::time_point start_;
+  uint64_t cpu_start_;
+};
+
+}  // namespace jxl
+
+#endif  // ENCODER_BASE_STATS_H_
@@ -6,8 +6,17 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>  //NOLINT
+#include <string>
+#include <thread>  //NOLINT
+#include <utility>
+#include <vector>
 
 #include "encoder/base/printf_macros.h"
+#include "encoder/base/stats.h"
 #include "encoder/enc_file.h"
 #include "encoder/image.h"
 #include "encoder/read_pfm.h"
@@ -17,6 +26,20 @@ struct CompressArgs {
   const char* file_in = nullptr;
   const char* file_out = nullptr;
   float distance = 1.0;
+  size_t target_size = 0;
+  // Maximum error of a near-lossless encoding, or -1 for VarDCT.
+  long max_error = -1;
+  size_t num_reps = 1;
+  int num_threads = std::thread::hardware_concurrency();
+  bool streaming = false;
+  bool phase_by_phase = false;
+  jxl::EncoderEffort effort = jxl::EncoderEffort::kDefault;
+  bool pool_stats = false;
+  const char* stats_json = nullptr;
+  const char* trace = nullptr;
+  const char* preset = nullptr;
+  const char* preview = nullptr;
+  jxl::FrameLayout layout;
 };
 
 bool WriteFile(const char* filename, const std::vector<uint8_t>& bytes) {
@@ -37,10 +60,59 @@ bool WriteFile(const char* filename, const std::vector<uint8_t>& bytes) {
   return true;
 }
 
+bool WriteFile(const char* filename, const std::string& text) {
+  return WriteFile(filename, std::vector<uint8_t>(text.begin(), text.end()));
+}
+
 void PrintHelp(char* arg0) {
   fprintf(stderr,
-          "Usage: %s <file in> [<file out>] [-d distance]\n\n"
-          "  NOTE: <file in> is a .pfm file in linear SRGB colorspace\n",
+          "Usage: %s <file in> [<file out>] [-d distance] [--num_reps N]\n"
+          "          [--num_threads N] [--effort E] [--streaming]\n"
+          "          [--phase_by_phase] [--pool_stats] [--stats_json FILE]\n"
+          "          [--trace FILE] [--preset FILE] [--target_size N]\n"
+          "          [--group_order O] [--group_priority P,...]\n"
+          "          [--two_passes] [--preview FILE] [--ac_strategy T]\n"
+          "          [--max_error E]\n\n"
+          "  NOTE: <file in> is a .pfm file in linear SRGB colorspace, or a\n"
+          "        binary .ppm file with 8 or 16 bits per sample in sRGB,\n"
+          "        which is coded losslessly at distance 0.\n"
+          "  --num_reps N: how many times to encode the image, reusing the\n"
+          "                same encoder context, and print the timing.\n"
+          "  --effort E: lightning, default or slower; lightning is the\n"
+          "              fastest and produces the largest files.\n"
+          "  --streaming: map the input file and feed it to the encoder one\n"
+          "               band of rows at a time, so that it is never fully\n"
+          "               in memory.\n"
+          "  --phase_by_phase: run each stage of the encoder on the whole\n"
+          "                    image before the next one, instead of all of\n"
+          "                    them on one group at a time. The output is the\n"
+          "                    same, compare the speed with --pool_stats.\n"
+          "  --pool_stats: print the time spent in each stage and the size\n"
+          "                of each section of the output.\n"
+          "  --stats_json FILE: write the same as JSON to FILE.\n"
+          "  --trace FILE: write every task of every stage to FILE in the\n"
+          "                Chrome trace format (chrome://tracing).\n"
+          "  --preset FILE: code the image with the entropy codes of FILE,\n"
+          "                 trained with jxl_tiny_train_preset, instead of\n"
+          "                 computing them.\n"
+          "  --target_size N: search the distance of the largest output of\n"
+          "                   at most N bytes, instead of using -d.\n"
+          "  --group_order O: raster or center; center sends the AC groups\n"
+          "                   closest to the center of the image first.\n"
+          "  --group_priority P,...: send the AC groups by decreasing\n"
+          "                          priority, one per group in raster\n"
+          "                          order.\n"
+          "  --two_passes: send a coarse version of all AC groups first, and\n"
+          "                then their refinement.\n"
+          "  --preview FILE: write the image at 1:8, as computed from the\n"
+          "                  DC of the frame, to FILE as a binary PPM.\n"
+          "  --ac_strategy T: code every block that fits with the transform\n"
+          "                   T (dct8, dct16x8, dct8x16, dct16x16,\n"
+          "                   dct32x32, dct32x16, dct16x32, dct4x4 or\n"
+          "                   identity), for testing decoders.\n"
+          "  --max_error E: code a .ppm input in modular mode such that no\n"
+          "                 decoded sample differs from the input by more\n"
+          "                 than E, instead of using -d.\n",
           arg0);
 }
 
@@ -67,6 +139,171 @@ int main(int argc, char** argv) {
       }
       continue;
     }
+    if (!strcmp("--streaming", argv[i])) {
+      args.streaming = true;
+      continue;
+    }
+    if (!strcmp("--phase_by_phase", argv[i])) {
+      args.phase_by_phase = true;
+      continue;
+    }
+    if (!strcmp("--pool_stats", argv[i])) {
+      args.pool_stats = true;
+      continue;
+    }
+    if (!strcmp("--effort", argv[i])) {
+      if (++i == argc) {
+        fprintf(stderr, "--effort requires an argument\n");
+        return EXIT_FAILURE;
+      }
+      if (!strcmp("lightning", argv[i])) {
+        args.effort = jxl::EncoderEffort::kLightning;
+      } else if (!strcmp("default", argv[i])) {
+        args.effort = jxl::EncoderEffort::kDefault;
+      } else if (!strcmp("slower", argv[i])) {
+        args.effort = jxl::EncoderEffort::kSlower;
+      } else {
+        fprintf(stderr, "Invalid value for --effort: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
+    if (!strcmp("--stats_json", argv[i]) || !strcmp("--trace", argv[i])) {
+      if (++i == argc) {
+        fprintf(stderr, "%s requires an argument\n", argv[i - 1]);
+        return EXIT_FAILURE;
+      }
+      (argv[i - 1][2] == 's' ? args.stats_json : args.trace) = argv[i];
+      continue;
+    }
+    if (!strcmp("--preset", argv[i])) {
+      if (++i == argc) {
+        fprintf(stderr, "--preset requires an argument\n");
+        return EXIT_FAILURE;
+      }
+      args.preset = argv[i];
+      continue;
+    }
+    if (!strcmp("--preview", argv[i])) {
+      if (++i == argc) {
+        fprintf(stderr, "--preview requires an argument\n");
+        return EXIT_FAILURE;
+      }
+      args.preview = argv[i];
+      continue;
+    }
+    if (!strcmp("--num_reps", argv[i]) || !strcmp("--num_threads", argv[i])) {
+      const bool reps = argv[i][6] == 'r';
+      if (++i == argc) {
+        fprintf(stderr, "%s requires an argument\n", argv[i - 1]);
+        return EXIT_FAILURE;
+      }
+      char* end;
+      long value = strtol(argv[i], &end, 10);
+      if (*end != '\0' || value < (reps ? 1 : 0)) {
+        fprintf(stderr, "Invalid value for %s: %s\n", argv[i - 1], argv[i]);
+        return EXIT_FAILURE;
+      }
+      if (reps) {
+        args.num_reps = value;
+      } else {
+        args.num_threads = value;
+      }
+      continue;
+    }
+    if (!strcmp("--max_error", argv[i])) {
+      if (++i == argc) {
+        fprintf(stderr, "--max_error requires an argument\n");
+        return EXIT_FAILURE;
+      }
+      char* end;
+      long value = strtol(argv[i], &end, 10);
+      if (*end != '\0' || value < 0) {
+        fprintf(stderr, "Invalid value for --max_error: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      args.max_error = value;
+      continue;
+    }
+    if (!strcmp("--target_size", argv[i])) {
+      if (++i == argc) {
+        fprintf(stderr, "--target_size requires an argument\n");
+        return EXIT_FAILURE;
+      }
+      char* end;
+      long value = strtol(argv[i], &end, 10);
+      if (*end != '\0' || value < 1) {
+        fprintf(stderr, "Invalid value for --target_size: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      args.target_size = value;
+      continue;
+    }
+    if (!strcmp("--group_order", argv[i])) {
+      if (++i == argc) {
+        fprintf(stderr, "--group_order requires an argument\n");
+        return EXIT_FAILURE;
+      }
+      if (!strcmp("raster", argv[i])) {
+        args.layout.group_order = jxl::GroupOrder::kRaster;
+      } else if (!strcmp("center", argv[i])) {
+        args.layout.group_order = jxl::GroupOrder::kCenterFirst;
+      } else {
+        fprintf(stderr, "Invalid value for --group_order: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
+    if (!strcmp("--group_priority", argv[i])) {
+      if (++i == argc) {
+        fprintf(stderr, "--group_priority requires an argument\n");
+        return EXIT_FAILURE;
+      }
+      args.layout.group_order = jxl::GroupOrder::kPriority;
+      args.layout.group_priority.clear();
+      const char* arg = argv[i];
+      for (;;) {
+        char* end;
+        args.layout.group_priority.push_back(
+            static_cast<float>(strtod(arg, &end)));
+        if (end == arg || (*end != ',' && *end != '\0')) {
+          fprintf(stderr, "Invalid value for --group_priority: %s\n",
+                  argv[i]);
+          return EXIT_FAILURE;
+        }
+        if (*end == '\0') break;
+        arg = end + 1;
+      }
+      continue;
+    }
+    if (!strcmp("--two_passes", argv[i])) {
+      args.layout.two_passes = true;
+      continue;
+    }
+    if (!strcmp("--ac_strategy", argv[i])) {
+      if (++i == argc) {
+        fprintf(stderr, "--ac_strategy requires an argument\n");
+        return EXIT_FAILURE;
+      }
+      static const char* const kNames[] = {
+          "dct8",     "dct16x8",  "dct8x16", "dct16x16", "dct32x32",
+          "dct32x16", "dct16x32", "dct4x4",  "identity"};
+      static_assert(sizeof(kNames) / sizeof(*kNames) ==
+                        jxl::AcStrategy::kNumValidStrategies,
+                    "Update names");
+      size_t type = 0;
+      while (type < jxl::AcStrategy::kNumValidStrategies &&
+             strcmp(kNames[type], argv[i]) != 0) {
+        ++type;
+      }
+      if (type == jxl::AcStrategy::kNumValidStrategies) {
+        fprintf(stderr, "Invalid value for --ac_strategy: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      args.layout.force_ac_strategy = true;
+      args.layout.ac_strategy = static_cast<jxl::AcStrategy::Type>(type);
+      continue;
+    }
     if (!args.file_in) {
       args.file_in = argv[i];
     } else if (!args.file_out) {
@@ -77,25 +314,199 @@ int main(int argc, char** argv) {
     fprintf(stderr, "Missing input file.\n");
     return EXIT_FAILURE;
   }
-  jxl::Image3F image;
-  if (!jxl::ReadPFM(args.file_in, &image)) {
-    fprintf(stderr, "Error reading PFM input file.\n");
+  if (args.streaming && args.target_size != 0) {
+    fprintf(stderr, "--target_size does not support --streaming.\n");
+    return EXIT_FAILURE;
+  }
+  const size_t name_size = strlen(args.file_in);
+  const bool ppm =
+      name_size >= 4 && !strcmp(args.file_in + name_size - 4, ".ppm");
+  if (ppm && args.streaming) {
+    fprintf(stderr, "--streaming needs a .pfm input.\n");
     return EXIT_FAILURE;
   }
-  fprintf(stderr, "Read %" PRIuS "x%" PRIuS " pixels input image.\n",
-          image.xsize(), image.ysize());
+  if (!ppm && args.max_error >= 0) {
+    fprintf(stderr, "--max_error needs a .ppm input.\n");
+    return EXIT_FAILURE;
+  }
+  // The encoder context (thread pool, quantization tables) is created once
+  // and shared by all repetitions, so that the reported time per image is
+  // the steady-state cost of encoding.
+  jxl::Encoder encoder(args.num_threads);
 
+  // In streaming mode the rows are read from the mapped file while encoding,
+  // so the input image is never fully in memory.
+  jxl::PFMFile file;
+  jxl::Image3F image;
+  std::vector<uint8_t> pixels;
+  size_t xsize = 0;
+  size_t ysize = 0;
+  size_t bits_per_sample = 0;
+  if (ppm) {
+    if (!jxl::ReadPPM(args.file_in, &pixels, &xsize, &ysize,
+                      &bits_per_sample)) {
+      fprintf(stderr, "Error reading PPM input file.\n");
+      return EXIT_FAILURE;
+    }
+  } else {
+    if (args.streaming ? !file.Open(args.file_in)
+                       : !jxl::ReadPFM(args.file_in, encoder.pool(), &image)) {
+      fprintf(stderr, "Error reading PFM input file.\n");
+      return EXIT_FAILURE;
+    }
+    xsize = args.streaming ? file.xsize() : image.xsize();
+    ysize = args.streaming ? file.ysize() : image.ysize();
+  }
+  const jxl::InterleavedImage interleaved(pixels.data(), xsize, ysize,
+                                          /*num_channels=*/3, bits_per_sample);
+  fprintf(stderr, "Read %" PRIuS "x%" PRIuS " pixels input image.\n", xsize,
+          ysize);
+
+  jxl::EncodeStats stats(/*trace=*/args.trace != nullptr);
+  if (args.pool_stats || args.stats_json || args.trace) {
+    encoder.SetStats(&stats);
+  }
+  if (args.phase_by_phase) {
+    encoder.SetFramePipeline(jxl::FramePipeline::kPhaseByPhase);
+  }
+  encoder.SetEffort(args.effort);
+  encoder.SetFrameLayout(args.layout);
+  if (args.preset) {
+    jxl::EntropyPreset preset;
+    if (!jxl::ReadEntropyPreset(args.preset, &preset)) {
+      fprintf(stderr, "Error reading entropy preset %s.\n", args.preset);
+      return EXIT_FAILURE;
+    }
+    encoder.SetEntropyPreset(&preset);
+  }
+  jxl::FramePreview preview;
+  if (args.preview) encoder.SetPreview(&preview);
   std::vector<uint8_t> output;
-  if (!jxl::EncodeFile(image, args.distance, &output)) {
-    fprintf(stderr, "Encoding failed.\n");
-    return EXIT_FAILURE;
+  const jxl::ImageRowsCallback get_rows = [&file, &encoder](
+                                              size_t y0, jxl::Image3F* rows) {
+    return file.ReadRows(y0, encoder.pool(), rows);
+  };
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t rep = 0; rep < args.num_reps; ++rep) {
+    const bool ok =
+        args.streaming
+            ? encoder.EncodeStreaming(xsize, ysize, get_rows, args.distance,
+                                      &output)
+        : args.max_error >= 0
+            ? encoder.EncodeNearLossless(interleaved, args.max_error, &output)
+        : args.target_size != 0
+            ? (ppm ? encoder.EncodeTargetSize(interleaved, args.target_size,
+                                              &output, &args.distance)
+                   : encoder.EncodeTargetSize(image, args.target_size, &output,
+                                              &args.distance))
+        : ppm ? encoder.Encode(interleaved, args.distance, &output)
+              : encoder.Encode(image, args.distance, &output);
+    if (!ok) {
+      fprintf(stderr, "Encoding failed.\n");
+      return EXIT_FAILURE;
+    }
   }
+  const auto end = std::chrono::steady_clock::now();
   fprintf(stderr, "Compressed to %" PRIuS " bytes.\n", output.size());
+  if (args.target_size != 0) {
+    fprintf(stderr, "Distance %.3f for the target size.\n", args.distance);
+  }
+  if (args.num_reps > 1) {
+    const double seconds = std::chrono::duration<double>(end - start).count();
+    const double mpixels = xsize * ysize * 1e-6;
+    fprintf(stderr,
+            "%" PRIuS " reps, %.3f ms per image, %.2f MP/s (%d threads)\n",
+            args.num_reps, seconds * 1e3 / args.num_reps,
+            mpixels * args.num_reps / seconds, args.num_threads);
+  }
+
+  if (args.pool_stats) {
+    fprintf(stderr, "%-36s %6s %8s %10s %10s %10s %10s %7s\n", "stage",
+            "calls", "tasks", "wall ms", "busy ms", "cpu ms", "idle ms",
+            "threads");
+    for (const auto& stage : stats.GetStages()) {
+      size_t num_threads = 0;
+      for (double seconds : stage.thread_seconds) num_threads += seconds > 0;
+      fprintf(stderr,
+              "%-36s %6" PRIuS " %8" PRIuS
+              " %10.3f %10.3f %10.3f %10.3f %7" PRIuS "\n",
+              stage.name.c_str(), stage.num_calls, stage.num_tasks,
+              stage.wall_seconds * 1e3, stage.busy_seconds() * 1e3,
+              stage.cpu_seconds() * 1e3, stage.idle_seconds * 1e3,
+              num_threads);
+    }
+    // Sections of the same kind are summed up.
+    std::vector<std::pair<std::string, std::pair<size_t, size_t>>> sections;
+    for (const auto& section : stats.GetSections()) {
+      auto it = std::find_if(
+          sections.begin(), sections.end(),
+          [&section](const decltype(sections)::value_type& s) {
+            return s.first == section.name;
+          });
+      if (it == sections.end()) {
+        sections.emplace_back(section.name, std::make_pair(0, 0));
+        it = sections.end() - 1;
+      }
+      it->second.first++;
+      it->second.second += section.bytes;
+    }
+    fprintf(stderr, "%-36s %6s %10s\n", "section", "count", "bytes");
+    for (const auto& section : sections) {
+      fprintf(stderr, "%-36s %6" PRIuS " %10" PRIuS "\n",
+              section.first.c_str(), section.second.first,
+              section.second.second);
+    }
+    // The sections are in the order of the output: the 1:8 preview can be
+    // shown once the last DC group arrived, and the whole image once the
+    // last AC group of the first pass did.
+    size_t bytes = 0;
+    size_t preview_bytes = 0;
+    size_t first_pass_bytes = 0;
+    for (const auto& section : stats.GetSections()) {
+      // Only the last frame written counts, see --target_size.
+      if (section.name == "Headers") {
+        bytes = preview_bytes = first_pass_bytes = 0;
+      }
+      bytes += section.bytes;
+      if (section.name == "DC group") preview_bytes = bytes;
+      if (section.name == "AC group" || section.name == "All groups") {
+        first_pass_bytes = bytes;
+      }
+    }
+    if (preview_bytes == 0) preview_bytes = first_pass_bytes;
+    fprintf(stderr,
+            "Preview after %" PRIuS " bytes, first full pass after %" PRIuS
+            " bytes.\n",
+            preview_bytes, first_pass_bytes);
+  }
+  if (args.stats_json && !WriteFile(args.stats_json, stats.ToJSON())) {
+    fprintf(stderr, "Failed to write stats to %s\n", args.stats_json);
+    return EXIT_FAILURE;
+  }
+  if (args.trace && !WriteFile(args.trace, stats.ToChromeTrace())) {
+    fprintf(stderr, "Failed to write trace to %s\n", args.trace);
+    return EXIT_FAILURE;
+  }
 
   if (args.file_out && !WriteFile(args.file_out, output)) {
     fprintf(stderr, "Failed to write to output file %s\n", args.file_out);
     return EXIT_FAILURE;
   }
+  if (args.preview) {
+    if (preview.xsize == 0) {
+      fprintf(stderr, "Lossless images have no preview.\n");
+      return EXIT_FAILURE;
+    }
+    char header[64];
+    snprintf(header, sizeof(header), "P6\n%" PRIuS " %" PRIuS "\n255\n",
+             preview.xsize, preview.ysize);
+    std::vector<uint8_t> ppm(header, header + strlen(header));
+    ppm.insert(ppm.end(), preview.srgb.begin(), preview.srgb.end());
+    if (!WriteFile(args.preview, ppm)) {
+      fprintf(stderr, "Failed to write preview to %s\n", args.preview);
+      return EXIT_FAILURE;
+    }
+  }
 
   return EXIT_SUCCESS;
 }
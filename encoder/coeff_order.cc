@@ -0,0 +1,106 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/coeff_order.h"
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "encoder/base/bits.h"
+#include "encoder/common.h"
+
+namespace jxl {
+
+namespace {
+
+// Zig-zag over the coefficients of a cx x cy blocks transform (cx >= cy),
+// where the vertical frequencies of the smaller dimension are stretched to
+// those of the larger one, after the lowest frequencies.
+void ComputeNaturalOrder(size_t cx, size_t cy, coeff_order_t* order) {
+  const size_t xs = cx / cy;
+  const size_t xsm = xs - 1;
+  const size_t xss = CeilLog2Nonzero(xs);
+  const size_t dim = cx * kBlockDim;
+  size_t cur = cx * cy;
+  for (size_t i = 0; i < dim; i++) {
+    for (size_t j = 0; j <= i; j++) {
+      size_t x = j;
+      size_t y = i - j;
+      if (i % 2) std::swap(x, y);
+      if ((y & xsm) != 0) continue;
+      y >>= xss;
+      size_t val = 0;
+      if (x < cx && y < cy) {
+        val = y * cx + x;
+      } else {
+        val = cur++;
+      }
+      order[val] = y * dim + x;
+    }
+  }
+  for (size_t ip = dim - 1; ip > 0; ip--) {
+    size_t i = ip - 1;
+    for (size_t j = 0; j <= i; j++) {
+      size_t x = dim - 1 - (i - j);
+      size_t y = dim - 1 - j;
+      if (i % 2) std::swap(x, y);
+      if ((y & xsm) != 0) continue;
+      y >>= xss;
+      order[cur++] = y * dim + x;
+    }
+  }
+}
+
+class NaturalCoeffOrders {
+ public:
+  NaturalCoeffOrders() {
+    for (size_t i = 0; i < AcStrategy::kNumValidStrategies; ++i) {
+      const AcStrategy acs =
+          AcStrategy::FromRawStrategy(static_cast<AcStrategy::Type>(i));
+      const size_t bx = acs.covered_blocks_x();
+      const size_t by = acs.covered_blocks_y();
+      const size_t cx = std::max(bx, by);
+      const size_t cy = std::min(bx, by);
+      // Transposed transforms share the order.
+      size_t j = 0;
+      while (j < i && !SameShape(static_cast<AcStrategy::Type>(j), cx, cy)) {
+        ++j;
+      }
+      if (j < i) {
+        offsets_[i] = offsets_[j];
+        continue;
+      }
+      offsets_[i] = orders_.size();
+      orders_.resize(orders_.size() + cx * cy * kDCTBlockSize);
+      ComputeNaturalOrder(cx, cy, &orders_[offsets_[i]]);
+    }
+  }
+
+  const coeff_order_t* Get(AcStrategy acs) const {
+    return &orders_[offsets_[acs.RawStrategy()]];
+  }
+
+ private:
+  static bool SameShape(AcStrategy::Type type, size_t cx, size_t cy) {
+    const AcStrategy acs = AcStrategy::FromRawStrategy(type);
+    return std::max(acs.covered_blocks_x(), acs.covered_blocks_y()) == cx &&
+           std::min(acs.covered_blocks_x(), acs.covered_blocks_y()) == cy;
+  }
+
+  std::vector<coeff_order_t> orders_;
+  size_t offsets_[AcStrategy::kNumValidStrategies];
+};
+
+}  // namespace
+
+const coeff_order_t* NaturalCoeffOrder(AcStrategy acs) {
+  static const NaturalCoeffOrders* orders = new NaturalCoeffOrders();
+  return orders->Get(acs);
+}
+
+}  // namespace jxl
@@ -0,0 +1,29 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef ENCODER_COEFF_ORDER_H_
+#define ENCODER_COEFF_ORDER_H_
+
+#include <stdint.h>
+
+#include "encoder/ac_strategy.h"
+
+namespace jxl {
+
+// Needs at least 16 bits. A 32-bit type speeds up DecodeAC by 2% at the cost of
+// more memory.
+using coeff_order_t = uint32_t;
+
+// Returns the natural coefficient order of the transform of `acs`, i.e. the
+// order the decoder uses when the frame does not signal custom orders. The
+// entries index the coefficients in the transposed layout of the transform
+// (more columns than rows), and the first covered_blocks ones are the lowest
+// frequencies that are encoded as part of the DC.
+const coeff_order_t* NaturalCoeffOrder(AcStrategy acs);
+
+}  // namespace jxl
+
+#endif  // ENCODER_COEFF_ORDER_H_
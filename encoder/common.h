@@ -49,6 +49,11 @@ constexpr uint32_t PackSigned(int32_t value)
          ((static_cast<uint32_t>(~value) >> 31) - 1);
 }
 
+// Inverse of PackSigned().
+constexpr int32_t UnpackSigned(uint32_t value) {
+  return static_cast<int32_t>((value >> 1) ^ (((~value) & 1) - 1));
+}
+
 }  // namespace jxl
 
 #endif  // ENCODER_COMMON_H_
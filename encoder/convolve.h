@@ -31,10 +31,23 @@ struct WeightsSymmetric5 {
   float L[4];
 };
 
+// Convolves the pixels of `rect` in `in` and stores them in `out`, which must
+// be at least as large as `rect`. Pixels of `in` outside `rect` are used as the
+// border, the edges of `in` are mirrored. `rect.x0()` must be zero or a
+// multiple of the vector size (16 is enough for all targets).
 void Symmetric5(const ImageF& in, const Rect& rect,
                 const WeightsSymmetric5& weights, ThreadPool* pool,
                 ImageF* JXL_RESTRICT out);
 
+// Number of rows of the bands that Symmetric5InPlace() processes in parallel.
+constexpr size_t kSymmetric5BandRows = 128;
+
+// Convolves all pixels of `in_out` in place, with the same result as
+// Symmetric5() with a separate output. Each band of rows only keeps the input
+// values of its last three rows plus two rows above and below the band.
+void Symmetric5InPlace(const WeightsSymmetric5& weights, ThreadPool* pool,
+                       Image3F* in_out);
+
 }  // namespace jxl
 
 #endif  // ENCODER_CONVOLVE_H_
@@ -6,12 +6,17 @@
 
 #include "encoder/convolve.h"
 
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "encoder/convolve_symmetric5.cc"
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
-#include "encoder/common.h"  // RoundUpTo
+#include "encoder/common.h"  // RoundUpTo, DivCeil
 #include "encoder/convolve-inl.h"
 
 HWY_BEFORE_NAMESPACE();
@@ -23,15 +28,11 @@ using hwy::HWY_NAMESPACE::Add;
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::Vec;
 
-// Weighted sum of 1x5 pixels around ix, iy with [wx2 wx1 wx0 wx1 wx2].
-template <class WrapY>
-static float WeightedSumBorder(const ImageF& in, const WrapY wrap_y,
-                               const int64_t ix, const int64_t iy,
-                               const size_t xsize, const size_t ysize,
-                               const float wx0, const float wx1,
-                               const float wx2) {
+// Weighted sum of 1x5 pixels around ix of `row` with [wx2 wx1 wx0 wx1 wx2].
+static float WeightedSumBorder(const float* JXL_RESTRICT row, const int64_t ix,
+                               const size_t xsize, const float wx0,
+                               const float wx1, const float wx2) {
   const WrapMirror wrap_x;
-  const float* JXL_RESTRICT row = in.ConstRow(wrap_y(iy, ysize));
   const float in_m2 = row[wrap_x(ix - 2, xsize)];
   const float in_p2 = row[wrap_x(ix + 2, xsize)];
   const float in_m1 = row[wrap_x(ix - 1, xsize)];
@@ -43,12 +44,11 @@ static float WeightedSumBorder(const ImageF& in, const WrapY wrap_y,
   return sum_2 + sum_1 + sum_0;
 }
 
-template <class WrapY, class V>
-static V WeightedSum(const ImageF& in, const WrapY wrap_y, const size_t ix,
-                     const int64_t iy, const size_t ysize, const V wx0,
-                     const V wx1, const V wx2) {
+template <class V>
+static V WeightedSum(const float* JXL_RESTRICT row, const size_t ix,
+                     const V wx0, const V wx1, const V wx2) {
   const HWY_FULL(float) d;
-  const float* JXL_RESTRICT center = in.ConstRow(wrap_y(iy, ysize)) + ix;
+  const float* JXL_RESTRICT center = row + ix;
   const auto in_m2 = LoadU(d, center - 2);
   const auto in_p2 = LoadU(d, center + 2);
   const auto in_m1 = LoadU(d, center - 1);
@@ -60,10 +60,11 @@ static V WeightedSum(const ImageF& in, const WrapY wrap_y, const size_t ix,
   return Add(sum_2, Add(sum_1, sum_0));
 }
 
-// Produces result for one pixel
-template <class WrapY>
-float Symmetric5Border(const ImageF& in, const Rect& rect, const int64_t ix,
-                       const int64_t iy, const WeightsSymmetric5& weights) {
+// Produces result for one pixel. `rows` are the input rows from two above to
+// two below the output row, already mirrored at the top and bottom edges.
+static float Symmetric5Border(const float* const* rows, const int64_t ix,
+                              const size_t xsize,
+                              const WeightsSymmetric5& weights) {
   const float w0 = weights.c[0];
   const float w1 = weights.r[0];
   const float w2 = weights.R[0];
@@ -71,26 +72,20 @@ float Symmetric5Border(const ImageF& in, const Rect& rect, const int64_t ix,
   const float w5 = weights.L[0];
   const float w8 = weights.D[0];
 
-  const size_t xsize = rect.xsize();
-  const size_t ysize = rect.ysize();
-  const WrapY wrap_y;
   // Unrolled loop over all 5 rows of the kernel.
-  float sum0 = WeightedSumBorder(in, wrap_y, ix, iy, xsize, ysize, w0, w1, w2);
+  float sum0 = WeightedSumBorder(rows[2], ix, xsize, w0, w1, w2);
 
-  sum0 += WeightedSumBorder(in, wrap_y, ix, iy - 2, xsize, ysize, w2, w5, w8);
-  float sum1 =
-      WeightedSumBorder(in, wrap_y, ix, iy + 2, xsize, ysize, w2, w5, w8);
+  sum0 += WeightedSumBorder(rows[0], ix, xsize, w2, w5, w8);
+  float sum1 = WeightedSumBorder(rows[4], ix, xsize, w2, w5, w8);
 
-  sum0 += WeightedSumBorder(in, wrap_y, ix, iy - 1, xsize, ysize, w1, w4, w5);
-  sum1 += WeightedSumBorder(in, wrap_y, ix, iy + 1, xsize, ysize, w1, w4, w5);
+  sum0 += WeightedSumBorder(rows[1], ix, xsize, w1, w4, w5);
+  sum1 += WeightedSumBorder(rows[3], ix, xsize, w1, w4, w5);
 
   return sum0 + sum1;
 }
 
 // Produces result for one vector's worth of pixels
-template <class WrapY>
-static void Symmetric5Interior(const ImageF& in, const Rect& rect,
-                               const int64_t ix, const int64_t iy,
+static void Symmetric5Interior(const float* const* rows, const int64_t ix,
                                const WeightsSymmetric5& weights,
                                float* JXL_RESTRICT row_out) {
   const HWY_FULL(float) d;
@@ -102,69 +97,131 @@ static void Symmetric5Interior(const ImageF& in, const Rect& rect,
   const auto w5 = LoadDup128(d, weights.L);
   const auto w8 = LoadDup128(d, weights.D);
 
-  const size_t ysize = rect.ysize();
-  const WrapY wrap_y;
   // Unrolled loop over all 5 rows of the kernel.
-  auto sum0 = WeightedSum(in, wrap_y, ix, iy, ysize, w0, w1, w2);
+  auto sum0 = WeightedSum(rows[2], ix, w0, w1, w2);
 
-  sum0 = Add(sum0, WeightedSum(in, wrap_y, ix, iy - 2, ysize, w2, w5, w8));
-  auto sum1 = WeightedSum(in, wrap_y, ix, iy + 2, ysize, w2, w5, w8);
+  sum0 = Add(sum0, WeightedSum(rows[0], ix, w2, w5, w8));
+  auto sum1 = WeightedSum(rows[4], ix, w2, w5, w8);
 
-  sum0 = Add(sum0, WeightedSum(in, wrap_y, ix, iy - 1, ysize, w1, w4, w5));
-  sum1 = Add(sum1, WeightedSum(in, wrap_y, ix, iy + 1, ysize, w1, w4, w5));
+  sum0 = Add(sum0, WeightedSum(rows[1], ix, w1, w4, w5));
+  sum1 = Add(sum1, WeightedSum(rows[3], ix, w1, w4, w5));
 
-  Store(Add(sum0, sum1), d, row_out + ix);
+  Store(Add(sum0, sum1), d, row_out);
 }
 
-template <class WrapY>
-static void Symmetric5Row(const ImageF& in, const Rect& rect, const int64_t iy,
+// Computes the pixels [x0, x1) of a row of width `xsize` from the 5 input
+// `rows` around it and stores them at `row_out`.
+static void Symmetric5Row(const float* const* rows, const size_t xsize,
+                          const size_t x0, const size_t x1,
                           const WeightsSymmetric5& weights,
                           float* JXL_RESTRICT row_out) {
   const int64_t kRadius = 2;
-  const size_t xsize = rect.xsize();
 
-  size_t ix = 0;
+  // The split into border and interior pixels only depends on the position in
+  // the row, so the result of a pixel does not depend on [x0, x1).
+  size_t ix = x0;
   const HWY_FULL(float) d;
   const size_t N = Lanes(d);
   const size_t aligned_x = RoundUpTo(kRadius, N);
-  for (; ix < std::min(aligned_x, xsize); ++ix) {
-    row_out[ix] = Symmetric5Border<WrapY>(in, rect, ix, iy, weights);
+  JXL_DASSERT(x0 < aligned_x || x0 % N == 0);
+  for (; ix < std::min(aligned_x, x1); ++ix) {
+    row_out[ix - x0] = Symmetric5Border(rows, ix, xsize, weights);
   }
-  for (; ix + N + kRadius <= xsize; ix += N) {
-    Symmetric5Interior<WrapY>(in, rect, ix, iy, weights, row_out);
+  for (; ix + N + kRadius <= xsize && ix + N <= x1; ix += N) {
+    Symmetric5Interior(rows, ix, weights, row_out + ix - x0);
   }
-  for (; ix < xsize; ++ix) {
-    row_out[ix] = Symmetric5Border<WrapY>(in, rect, ix, iy, weights);
+  for (; ix < x1; ++ix) {
+    row_out[ix - x0] = Symmetric5Border(rows, ix, xsize, weights);
   }
 }
 
-static JXL_NOINLINE void Symmetric5BorderRow(const ImageF& in, const Rect& rect,
-                                             const int64_t iy,
-                                             const WeightsSymmetric5& weights,
-                                             float* JXL_RESTRICT row_out) {
-  return Symmetric5Row<WrapMirror>(in, rect, iy, weights, row_out);
-}
-
-// Semi-vectorized (interior pixels Fonly); called directly like slow::, unlike
+// Semi-vectorized (interior pixels only); called directly like slow::, unlike
 // the fully vectorized strategies below.
 void Symmetric5(const ImageF& in, const Rect& rect,
                 const WeightsSymmetric5& weights, ThreadPool* pool,
                 ImageF* JXL_RESTRICT out) {
-  const size_t ysize = rect.ysize();
+  JXL_DASSERT(rect.x1() <= in.xsize() && rect.y1() <= in.ysize());
+  const size_t ysize = in.ysize();
   JXL_CHECK(RunOnPool(
-      pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
+      pool, 0, static_cast<uint32_t>(rect.ysize()), ThreadPool::NoInit,
       [&](const uint32_t task, size_t /*thread*/) {
-        const int64_t iy = task;
-
-        if (iy < 2 || iy >= static_cast<ssize_t>(ysize) - 2) {
-          Symmetric5BorderRow(in, rect, iy, weights, out->Row(iy));
-        } else {
-          Symmetric5Row<WrapUnchanged>(in, rect, iy, weights, out->Row(iy));
+        const int64_t iy = rect.y0() + task;
+        const float* rows[5];
+        for (int64_t k = 0; k < 5; ++k) {
+          rows[k] = in.ConstRow(Mirror(iy + k - 2, ysize));
         }
+        Symmetric5Row(rows, in.xsize(), rect.x0(), rect.x1(), weights,
+                      out->Row(task));
       },
       "Symmetric5x5Convolution"));
 }
 
+void Symmetric5InPlace(const WeightsSymmetric5& weights, ThreadPool* pool,
+                       Image3F* in_out) {
+  const size_t xsize = in_out->xsize();
+  const size_t ysize = in_out->ysize();
+  const size_t num_bands = DivCeil(ysize, kSymmetric5BandRows);
+
+  // The bands are convolved in parallel, each one overwrites its own rows, so
+  // the two input rows above and below each band are saved first.
+  Image3F edges(xsize, 4 * num_bands);
+  JXL_CHECK(RunOnPool(
+      pool, 0, static_cast<uint32_t>(3 * num_bands), ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /*thread*/) {
+        const size_t c = task / num_bands;
+        const size_t band = task % num_bands;
+        const int64_t y0 = band * kSymmetric5BandRows;
+        const int64_t y1 = std::min(y0 + kSymmetric5BandRows, ysize);
+        const int64_t edge_rows[4] = {y0 - 2, y0 - 1, y1, y1 + 1};
+        for (size_t k = 0; k < 4; ++k) {
+          const int64_t y = edge_rows[k];
+          if (y < 0 || y >= static_cast<int64_t>(ysize)) continue;
+          memcpy(edges.PlaneRow(c, 4 * band + k), in_out->ConstPlaneRow(c, y),
+                 xsize * sizeof(float));
+        }
+      },
+      "Symmetric5SaveEdges"));
+
+  // Ring of the input values of the last three rows of the band, including
+  // the current one.
+  std::vector<ImageF> history;
+  JXL_CHECK(RunOnPool(
+      pool, 0, static_cast<uint32_t>(3 * num_bands),
+      [&](const size_t num_threads) {
+        history.resize(num_threads);
+        return true;
+      },
+      [&](const uint32_t task, size_t thread) {
+        const size_t c = task / num_bands;
+        const size_t band = task % num_bands;
+        const int64_t y0 = band * kSymmetric5BandRows;
+        const int64_t y1 = std::min(y0 + kSymmetric5BandRows, ysize);
+        if (history[thread].xsize() == 0) {
+          history[thread] = ImageF(xsize, 3);
+        }
+        ImageF& ring = history[thread];
+        for (int64_t y = y0; y < y1; ++y) {
+          float* JXL_RESTRICT row_out = in_out->PlaneRow(c, y);
+          memcpy(ring.Row(y % 3), row_out, xsize * sizeof(float));
+          const float* rows[5];
+          for (int64_t k = 0; k < 5; ++k) {
+            const int64_t iy = Mirror(y + k - 2, ysize);
+            if (iy < y0) {
+              rows[k] = edges.ConstPlaneRow(c, 4 * band + iy - (y0 - 2));
+            } else if (iy >= y1) {
+              rows[k] = edges.ConstPlaneRow(c, 4 * band + 2 + iy - y1);
+            } else if (iy <= y) {
+              rows[k] = ring.ConstRow(iy % 3);
+            } else {
+              rows[k] = in_out->ConstPlaneRow(c, iy);
+            }
+          }
+          Symmetric5Row(rows, xsize, 0, xsize, weights, row_out);
+        }
+      },
+      "Symmetric5x5InPlace"));
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -180,5 +237,11 @@ void Symmetric5(const ImageF& in, const Rect& rect,
   return HWY_DYNAMIC_DISPATCH(Symmetric5)(in, rect, weights, pool, out);
 }
 
+HWY_EXPORT(Symmetric5InPlace);
+void Symmetric5InPlace(const WeightsSymmetric5& weights, ThreadPool* pool,
+                       Image3F* in_out) {
+  return HWY_DYNAMIC_DISPATCH(Symmetric5InPlace)(weights, pool, in_out);
+}
+
 }  // namespace jxl
 #endif  // HWY_ONCE
@@ -57,6 +57,16 @@ struct DCTResampleScales<16, 2> {
   };
 };
 
+template <>
+struct DCTResampleScales<32, 4> {
+  static constexpr float kScales[] = {
+      1.000000000000000000,
+      0.974886821136879522,
+      0.901764195028874394,
+      0.787054918159101335,
+  };
+};
+
 // Inverses of the above.
 template <>
 struct DCTResampleScales<1, 8> {
@@ -73,6 +83,16 @@ struct DCTResampleScales<2, 16> {
   };
 };
 
+template <>
+struct DCTResampleScales<4, 32> {
+  static constexpr float kScales[] = {
+      1.000000000000000000,
+      1.025760096781116015,
+      1.108937353592731823,
+      1.270559368765487251,
+  };
+};
+
 // Constants for DCT implementation. Generated by the following snippet:
 // for i in range(N // 2):
 //    print(1.0 / (2 * math.cos((i + 0.5) * math.pi / N)), end=", ")
@@ -106,6 +126,18 @@ struct WcMultipliers<16> {
   };
 };
 
+template <>
+struct WcMultipliers<32> {
+  static constexpr float kMultipliers[] = {
+      0.5006029982351963, 0.5054709598975436, 0.5154473099226246,
+      0.5310425910897841, 0.5531038960344445, 0.5829349682061339,
+      0.6225041230356648, 0.6748083414550057, 0.7445362710022986,
+      0.8393496454155268, 0.9725682378619608, 1.1694399334328847,
+      1.4841646163141662, 2.057781009953411,  3.407608418468719,
+      10.190008123548033,
+  };
+};
+
 // Apply the DCT algorithm-intrinsic constants to DCTResampleScale.
 template <size_t FROM, size_t TO>
 constexpr float DCTTotalResampleScale(size_t x) {
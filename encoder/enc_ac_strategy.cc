@@ -164,33 +164,58 @@ float EstimateEntropy(const AcStrategy& acs, const Image3F& opsin, size_t bx,
       scratch_space);
 }
 
-void FindBest16x16Transform(const Image3F& opsin, size_t bx, size_t by,
-                            size_t cx, size_t cy, float distance,
-                            const DequantMatrices& matrices, const ImageF& qf,
-                            const ImageF& maskf,
-                            const float* JXL_RESTRICT cmap_factors,
-                            AcStrategyImage* JXL_RESTRICT ac_strategy,
-                            float* block, float* scratch_space) {
+// Chooses the transforms of the 16x16 block at (bx + cx, by + cy) among the
+// 8x8 ones, DCT16X8, DCT8X16 and DCT16X16, and returns their entropy
+// estimate. With `try_4x4`, DCT4X4 and IDENTITY compete with the 8x8 DCT.
+float FindBest16x16Transform(const Image3F& opsin, size_t bx, size_t by,
+                             size_t cx, size_t cy, float distance,
+                             bool try_4x4, const DequantMatrices& matrices,
+                             const ImageF& qf, const ImageF& maskf,
+                             const float* JXL_RESTRICT cmap_factors,
+                             AcStrategyImage* JXL_RESTRICT ac_strategy,
+                             float* block, float* scratch_space) {
   const AcStrategy acs8X8 = AcStrategy::FromRawStrategy(AcStrategy::DCT);
   const AcStrategy acs16X8 = AcStrategy::FromRawStrategy(AcStrategy::DCT16X8);
   const AcStrategy acs8X16 = AcStrategy::FromRawStrategy(AcStrategy::DCT8X16);
+  const AcStrategy acs16X16 =
+      AcStrategy::FromRawStrategy(AcStrategy::DCT16X16);
   // Favor all 8x8 transforms 16x8 at low butteraugli_target distances.
   static const float k8x8mul1 = -0.55 * 0.75f;
   static const float k8x8mul2 = 1.0735757687292623f * 0.75f;
   static const float k8x8base = 1.4;
-  static const float mul8x8 = k8x8mul2 + k8x8mul1 / (distance + k8x8base);
+  const float mul8x8 = k8x8mul2 + k8x8mul1 / (distance + k8x8base);
   static const float k8X16mul1 = -0.55;
   static const float k8X16mul2 = 0.9019587899705066;
   static const float k8X16base = 1.6;
-  static const float mul16x8 = k8X16mul2 + k8X16mul1 / (distance + k8X16base);
+  const float mul16x8 = k8X16mul2 + k8X16mul1 / (distance + k8X16base);
+  // DCT16X16 uses the multiplier of DCT16X8, and DCT4X4 and IDENTITY the one
+  // and the base cost of the 8x8 DCT. Extra factors of 1.05 and 1.2 on them
+  // made the files 5-23% larger at equal PSNR on two of three test images and
+  // 1-3% smaller on the third.
+  const float entropy_base = 3.0f * mul8x8;
   float entropy[2][2] = {};
   for (size_t dy = 0; dy < 2; ++dy) {
     for (size_t dx = 0; dx < 2; ++dx) {
-      float entropy8x8 = 3.0f * mul8x8;
-      entropy8x8 +=
+      float entropy8x8 =
+          entropy_base +
           mul8x8 * EstimateEntropy(acs8X8, opsin, bx + cx + dx, by + cy + dy,
                                    distance, matrices, qf, maskf, cmap_factors,
                                    block, scratch_space);
+      if (try_4x4) {
+        for (const AcStrategy::Type type :
+             {AcStrategy::DCT4X4, AcStrategy::IDENTITY}) {
+          const float entropy4x4 =
+              entropy_base +
+              mul8x8 * EstimateEntropy(AcStrategy::FromRawStrategy(type),
+                                       opsin, bx + cx + dx, by + cy + dy,
+                                       distance, matrices, qf, maskf,
+                                       cmap_factors, block, scratch_space);
+          if (entropy4x4 < entropy8x8) {
+            entropy8x8 = entropy4x4;
+            ac_strategy->Set(bx + cx + dx, by + cy + dy, type);
+          }
+        }
+      }
       entropy[dy][dx] = entropy8x8;
     }
   }
@@ -210,12 +235,20 @@ void FindBest16x16Transform(const Image3F& opsin, size_t bx, size_t by,
       mul16x8 * EstimateEntropy(acs8X16, opsin, bx + cx, by + cy + 1, distance,
                                 matrices, qf, maskf, cmap_factors, block,
                                 scratch_space);
+  float entropy_16X16 =
+      mul16x8 * EstimateEntropy(acs16X16, opsin, bx + cx, by + cy, distance,
+                                matrices, qf, maskf, cmap_factors, block,
+                                scratch_space);
   // Test if this 16x16 block should have 16x8 or 8x16 transforms,
   // because it can have only one or the other.
   float cost16x8 = std::min(entropy_16X8_left, entropy[0][0] + entropy[1][0]) +
                    std::min(entropy_16X8_right, entropy[0][1] + entropy[1][1]);
   float cost8x16 = std::min(entropy_8X16_top, entropy[0][0] + entropy[0][1]) +
                    std::min(entropy_8X16_bottom, entropy[1][0] + entropy[1][1]);
+  if (entropy_16X16 < std::min(cost16x8, cost8x16)) {
+    ac_strategy->Set(bx + cx, by + cy, AcStrategy::DCT16X16);
+    return entropy_16X16;
+  }
   if (cost16x8 < cost8x16) {
     if (entropy_16X8_left < entropy[0][0] + entropy[1][0]) {
       ac_strategy->Set(bx + cx, by + cy, AcStrategy::DCT16X8);
@@ -223,12 +256,92 @@ void FindBest16x16Transform(const Image3F& opsin, size_t bx, size_t by,
     if (entropy_16X8_right < entropy[0][1] + entropy[1][1]) {
       ac_strategy->Set(bx + cx + 1, by + cy, AcStrategy::DCT16X8);
     }
-  } else {
-    if (entropy_8X16_top < entropy[0][0] + entropy[0][1]) {
-      ac_strategy->Set(bx + cx, by + cy, AcStrategy::DCT8X16);
+    return cost16x8;
+  }
+  if (entropy_8X16_top < entropy[0][0] + entropy[0][1]) {
+    ac_strategy->Set(bx + cx, by + cy, AcStrategy::DCT8X16);
+  }
+  if (entropy_8X16_bottom < entropy[1][0] + entropy[1][1]) {
+    ac_strategy->Set(bx + cx, by + cy + 1, AcStrategy::DCT8X16);
+  }
+  return cost8x16;
+}
+
+// Chooses the transforms of the 32x32 block at (bx + cx, by + cy). Its 16x16
+// blocks are searched first; the 32-point DCTs are then only tried in place of
+// DCT16X16 blocks, whose estimates are reused as the cost of not merging them.
+// This is a greedy limit of the search: DCT32X32 is only tried if all four
+// quadrants chose DCT16X16, and DCT32X16 or DCT16X32 only if both quadrants of
+// their half did, so a region split into smaller transforms is never checked
+// against a 32-point one even where that would be cheaper.
+void FindBest32x32Transform(const Image3F& opsin, size_t bx, size_t by,
+                            size_t cx, size_t cy, float distance,
+                            bool try_4x4, const DequantMatrices& matrices,
+                            const ImageF& qf, const ImageF& maskf,
+                            const float* JXL_RESTRICT cmap_factors,
+                            AcStrategyImage* JXL_RESTRICT ac_strategy,
+                            float* block, float* scratch_space) {
+  float entropy[2][2];
+  bool merged[2][2];
+  for (size_t dy = 0; dy < 2; ++dy) {
+    for (size_t dx = 0; dx < 2; ++dx) {
+      entropy[dy][dx] = FindBest16x16Transform(
+          opsin, bx, by, cx + 2 * dx, cy + 2 * dy, distance, try_4x4, matrices,
+          qf, maskf, cmap_factors, ac_strategy, block, scratch_space);
+      const AcStrategy acs =
+          ac_strategy->ConstRow(by + cy + 2 * dy)[bx + cx + 2 * dx];
+      merged[dy][dx] = acs.Strategy() == AcStrategy::DCT16X16;
     }
-    if (entropy_8X16_bottom < entropy[1][0] + entropy[1][1]) {
-      ac_strategy->Set(bx + cx, by + cy + 1, AcStrategy::DCT8X16);
+  }
+  const float k32mul1 = -0.55;
+  const float k32mul2 = 1.0372526084660826;
+  const float k32base = 1.6;
+  const float mul32 = k32mul2 + k32mul1 / (distance + k32base);
+  const auto estimate = [&](AcStrategy::Type type, size_t x, size_t y) {
+    return mul32 * EstimateEntropy(AcStrategy::FromRawStrategy(type), opsin,
+                                   bx + cx + x, by + cy + y, distance,
+                                   matrices, qf, maskf, cmap_factors, block,
+                                   scratch_space);
+  };
+  if (merged[0][0] && merged[0][1] && merged[1][0] && merged[1][1]) {
+    const float entropy_32X32 = estimate(AcStrategy::DCT32X32, 0, 0);
+    if (entropy_32X32 < entropy[0][0] + entropy[0][1] + entropy[1][0] +
+                            entropy[1][1]) {
+      ac_strategy->Set(bx + cx, by + cy, AcStrategy::DCT32X32);
+      return;
+    }
+  }
+  // Same as above for the halves: either the columns or the rows can merge.
+  float cost32x16 = 0;
+  float cost16x32 = 0;
+  bool merge32x16[2] = {};
+  bool merge16x32[2] = {};
+  for (size_t i = 0; i < 2; ++i) {
+    const float column = entropy[0][i] + entropy[1][i];
+    cost32x16 += column;
+    if (merged[0][i] && merged[1][i]) {
+      const float entropy_32X16 = estimate(AcStrategy::DCT32X16, 2 * i, 0);
+      if (entropy_32X16 < column) {
+        cost32x16 += entropy_32X16 - column;
+        merge32x16[i] = true;
+      }
+    }
+    const float row = entropy[i][0] + entropy[i][1];
+    cost16x32 += row;
+    if (merged[i][0] && merged[i][1]) {
+      const float entropy_16X32 = estimate(AcStrategy::DCT16X32, 0, 2 * i);
+      if (entropy_16X32 < row) {
+        cost16x32 += entropy_16X32 - row;
+        merge16x32[i] = true;
+      }
+    }
+  }
+  for (size_t i = 0; i < 2; ++i) {
+    if (cost32x16 <= cost16x32 && merge32x16[i]) {
+      ac_strategy->Set(bx + cx + 2 * i, by + cy, AcStrategy::DCT32X16);
+    }
+    if (cost16x32 < cost32x16 && merge16x32[i]) {
+      ac_strategy->Set(bx + cx, by + cy + 2 * i, AcStrategy::DCT16X32);
     }
   }
 }
@@ -236,7 +349,8 @@ void FindBest16x16Transform(const Image3F& opsin, size_t bx, size_t by,
 Status ComputeAcStrategyImage(const Image3F& opsin, const float distance,
                               const ColorCorrelationMap& cmap,
                               const ImageF& quant_field,
-                              const ImageF& masking_field, ThreadPool* pool,
+                              const ImageF& masking_field,
+                              const bool try_4x4, ThreadPool* pool,
                               const DequantMatrices& matrices,
                               AcStrategyImage* ac_strategy) {
   ac_strategy->FillDCT8();
@@ -260,11 +374,24 @@ Status ComputeAcStrategyImage(const Image3F& opsin, const float distance,
         0.0f,
         cmap.YtoBRatio(cmap.ytob_map.ConstRow(ty)[tx]),
     };
-    for (size_t cy = 0; cy + 1 < rect.ysize(); cy += 2) {
-      for (size_t cx = 0; cx + 1 < rect.xsize(); cx += 2) {
-        FindBest16x16Transform(opsin, bx0, by0, cx, cy, distance, matrices,
-                               quant_field, masking_field, cmap_factors,
-                               ac_strategy, block, scratch_space);
+    // 32x32 blocks where they fit in the tile, 16x16 blocks in the rest.
+    for (size_t cy = 0; cy + 1 < rect.ysize(); cy += 4) {
+      for (size_t cx = 0; cx + 1 < rect.xsize(); cx += 4) {
+        if (cy + 3 < rect.ysize() && cx + 3 < rect.xsize()) {
+          FindBest32x32Transform(opsin, bx0, by0, cx, cy, distance, try_4x4,
+                                 matrices, quant_field, masking_field,
+                                 cmap_factors, ac_strategy, block,
+                                 scratch_space);
+          continue;
+        }
+        for (size_t sy = cy; sy < cy + 4 && sy + 1 < rect.ysize(); sy += 2) {
+          for (size_t sx = cx; sx < cx + 4 && sx + 1 < rect.xsize(); sx += 2) {
+            FindBest16x16Transform(opsin, bx0, by0, sx, sy, distance, try_4x4,
+                                   matrices, quant_field, masking_field,
+                                   cmap_factors, ac_strategy, block,
+                                   scratch_space);
+          }
+        }
       }
     }
   };
@@ -272,31 +399,59 @@ Status ComputeAcStrategyImage(const Image3F& opsin, const float distance,
                    process_tile_acs, "Acs Heuristics");
 }
 
-void AdjustQuantField(const AcStrategyImage& ac_strategy, ImageI* quant_field) {
+void FillAcStrategy(AcStrategy::Type type, AcStrategyImage* ac_strategy) {
+  ac_strategy->FillDCT8();
+  const AcStrategy acs = AcStrategy::FromRawStrategy(type);
+  const size_t cx = acs.covered_blocks_x();
+  const size_t cy = acs.covered_blocks_y();
+  for (size_t by = 0; by + cy <= ac_strategy->ysize(); by += cy) {
+    for (size_t bx = 0; bx + cx <= ac_strategy->xsize(); bx += cx) {
+      ac_strategy->Set(bx, by, type);
+    }
+  }
+}
+
+Status AdjustQuantField(const AcStrategyImage& ac_strategy, ThreadPool* pool,
+                        ImageI* quant_field) {
   // Replace the whole quant_field in non-8x8 blocks with the maximum of each
-  // 8x8 block.
-  size_t stride = quant_field->PixelsPerRow();
-  for (size_t y = 0; y < quant_field->ysize(); ++y) {
-    AcStrategyRow ac_strategy_row = ac_strategy.ConstRow(y);
-    int* JXL_RESTRICT quant_row = quant_field->Row(y);
-    for (size_t x = 0; x < quant_field->xsize(); ++x) {
-      AcStrategy acs = ac_strategy_row[x];
-      if (!acs.IsFirstBlock()) continue;
-      JXL_ASSERT(x + acs.covered_blocks_x() <= quant_field->xsize());
-      JXL_ASSERT(y + acs.covered_blocks_y() <= quant_field->ysize());
-      int max = quant_row[x];
-      for (size_t iy = 0; iy < acs.covered_blocks_y(); iy++) {
-        for (size_t ix = 0; ix < acs.covered_blocks_x(); ix++) {
-          max = std::max(quant_row[x + ix + iy * stride], max);
+  // 8x8 block. The blocks never cross a color tile, so the tiles are
+  // independent.
+  const size_t stride = quant_field->PixelsPerRow();
+  const size_t xsize_blocks = quant_field->xsize();
+  const size_t ysize_blocks = quant_field->ysize();
+  const size_t xsize_tiles = DivCeil(xsize_blocks, kColorTileDimInBlocks);
+  const size_t ysize_tiles = DivCeil(ysize_blocks, kColorTileDimInBlocks);
+  const auto adjust_tile = [&](const uint32_t tid, const size_t /*thread*/) {
+    const size_t tx = tid % xsize_tiles;
+    const size_t ty = tid / xsize_tiles;
+    const size_t by1 =
+        std::min((ty + 1) * kColorTileDimInBlocks, ysize_blocks);
+    const size_t bx1 =
+        std::min((tx + 1) * kColorTileDimInBlocks, xsize_blocks);
+    for (size_t y = ty * kColorTileDimInBlocks; y < by1; ++y) {
+      AcStrategyRow ac_strategy_row = ac_strategy.ConstRow(y);
+      int* JXL_RESTRICT quant_row = quant_field->Row(y);
+      for (size_t x = tx * kColorTileDimInBlocks; x < bx1; ++x) {
+        AcStrategy acs = ac_strategy_row[x];
+        if (!acs.IsFirstBlock()) continue;
+        JXL_ASSERT(x + acs.covered_blocks_x() <= bx1);
+        JXL_ASSERT(y + acs.covered_blocks_y() <= by1);
+        int max = quant_row[x];
+        for (size_t iy = 0; iy < acs.covered_blocks_y(); iy++) {
+          for (size_t ix = 0; ix < acs.covered_blocks_x(); ix++) {
+            max = std::max(quant_row[x + ix + iy * stride], max);
+          }
         }
-      }
-      for (size_t iy = 0; iy < acs.covered_blocks_y(); iy++) {
-        for (size_t ix = 0; ix < acs.covered_blocks_x(); ix++) {
-          quant_row[x + ix + iy * stride] = max;
+        for (size_t iy = 0; iy < acs.covered_blocks_y(); iy++) {
+          for (size_t ix = 0; ix < acs.covered_blocks_x(); ix++) {
+            quant_row[x + ix + iy * stride] = max;
+          }
         }
       }
     }
-  }
+  };
+  return RunOnPool(pool, 0, xsize_tiles * ysize_tiles, ThreadPool::NoInit,
+                   adjust_tile, "AdjustQuantField");
 }
 
 }  // namespace jxl
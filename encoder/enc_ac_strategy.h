@@ -16,14 +16,23 @@
 
 namespace jxl {
 
+// Chooses the transform of every block, from 4x4 to 32x32 DCTs. The 4x4
+// transforms (DCT4X4 and IDENTITY) are only tried with `try_4x4`, which makes
+// the search about 30% slower.
 Status ComputeAcStrategyImage(const Image3F& opsin, const float distance,
                               const ColorCorrelationMap& cmap,
                               const ImageF& quant_field,
-                              const ImageF& masking_field, ThreadPool* pool,
+                              const ImageF& masking_field,
+                              const bool try_4x4, ThreadPool* pool,
                               const DequantMatrices& matrices,
                               AcStrategyImage* ac_strategy);
 
-void AdjustQuantField(const AcStrategyImage& ac_strategy, ImageI* quant_field);
+// Codes every block with `type` where it fits, aligned to its size, and the
+// rest with 8x8 DCTs. The blocks then never cross a color tile.
+void FillAcStrategy(AcStrategy::Type type, AcStrategyImage* ac_strategy);
+
+Status AdjustQuantField(const AcStrategyImage& ac_strategy, ThreadPool* pool,
+                        ImageI* quant_field);
 
 }  // namespace jxl
 
@@ -37,6 +37,7 @@ using hwy::HWY_NAMESPACE::And;
 using hwy::HWY_NAMESPACE::Max;
 using hwy::HWY_NAMESPACE::Rebind;
 using hwy::HWY_NAMESPACE::Sqrt;
+using hwy::HWY_NAMESPACE::Vec;
 using hwy::HWY_NAMESPACE::ZeroIfNegative;
 
 // The following functions modulate an exponent (out_val) and return the updated
@@ -207,10 +208,11 @@ V ColorModulation(const D d, const size_t x, const size_t y,
   return Add(overall_red_coverage, Add(overall_blue_coverage, out_val));
 }
 
-// Change precision in 8x8 blocks that have high frequency content.
-template <class D, class V>
-V HfModulation(const D d, const size_t x, const size_t y, const ImageF& xyb,
-               const V out_val) {
+// Sum of the absolute differences of the pixels of the 8x8 block at (x, y) of
+// `xyb` with their right and bottom neighbours inside the block, in all lanes.
+template <class D>
+Vec<D> BlockGradientSum(const D d, const size_t x, const size_t y,
+                        const ImageF& xyb) {
   // Zero out the invalid differences for the rightmost value per row.
   const Rebind<uint32_t, D> du;
   HWY_ALIGN constexpr uint32_t kMaskRight[kBlockDim] = {~0u, ~0u, ~0u, ~0u,
@@ -243,17 +245,21 @@ V HfModulation(const D d, const size_t x, const size_t y, const ImageF& xyb,
     }
   }
 
-  sum = SumOfLanes(d, sum);
-  return MulAdd(sum, Set(d, -2.0052193233688884f / 112), out_val);
+  return SumOfLanes(d, sum);
 }
 
-void PerBlockModulations(const float butteraugli_target, const ImageF& xyb_x,
-                         const ImageF& xyb_y, const ImageF& xyb_b,
-                         const float scale, const Rect& rect, ImageF* out) {
-  JXL_ASSERT(SameSize(xyb_x, xyb_y));
-  JXL_ASSERT(DivCeil(xyb_x.xsize(), kBlockDim) == out->xsize());
-  JXL_ASSERT(DivCeil(xyb_x.ysize(), kBlockDim) == out->ysize());
+// Change precision in 8x8 blocks that have high frequency content.
+template <class D, class V>
+V HfModulation(const D d, const size_t x, const size_t y, const ImageF& xyb,
+               const V out_val) {
+  const auto sum = BlockGradientSum(d, x, y, xyb);
+  return MulAdd(sum, Set(d, -2.0052193233688884f / 112), out_val);
+}
 
+// Returns the multiplier and offset that map the modulated exponent of a block
+// to its quantization field value.
+void QuantFieldScale(const float butteraugli_target, const float scale,
+                     float* mul, float* add) {
   float base_level = 0.5f * scale;
   float kDampenRampStart = 7.0f;
   float kDampenRampEnd = 14.0f;
@@ -265,8 +271,19 @@ void PerBlockModulations(const float butteraugli_target, const ImageF& xyb_x,
       dampen = 0;
     }
   }
-  const float mul = scale * dampen;
-  const float add = (1.0f - dampen) * base_level;
+  *mul = scale * dampen;
+  *add = (1.0f - dampen) * base_level;
+}
+
+void PerBlockModulations(const float butteraugli_target, const ImageF& xyb_x,
+                         const ImageF& xyb_y, const ImageF& xyb_b,
+                         const float scale, const Rect& rect, ImageF* out) {
+  JXL_ASSERT(SameSize(xyb_x, xyb_y));
+  JXL_ASSERT(DivCeil(xyb_x.xsize(), kBlockDim) == out->xsize());
+  JXL_ASSERT(DivCeil(xyb_x.ysize(), kBlockDim) == out->ysize());
+
+  float mul, add;
+  QuantFieldScale(butteraugli_target, scale, &mul, &add);
   for (size_t iy = rect.y0(); iy < rect.y0() + rect.ysize(); iy++) {
     const size_t y = iy * 8;
     float* const JXL_RESTRICT row_out = out->Row(iy);
@@ -378,9 +395,12 @@ void FuzzyErosion(const Rect& from_rect, const ImageF& from,
   }
 }
 
-void ComputeTile(const Image3F& xyb, const Rect& rect, float distance,
-                 float scale, ImageF* pre_erosion, float* diff_buffer,
-                 ImageF* aq_map, ImageF* mask) {
+// Computes the distance-independent part of the quantization field of the
+// blocks in `rect`, the eroded local pixel differences, in `aq_map`, and the
+// mask for the AC strategy search from them in `mask`.
+void ComputeMaskingTile(const Image3F& xyb, const Rect& rect,
+                        ImageF* pre_erosion, float* diff_buffer,
+                        ImageF* aq_map, ImageF* mask) {
   const size_t xsize = xyb.xsize();
   const size_t ysize = xyb.ysize();
 
@@ -502,23 +522,59 @@ void ComputeTile(const Image3F& xyb, const Rect& rect, float distance,
       mask_row[x] = ComputeMaskForAcStrategyUse(aq_map_row[x]);
     }
   }
+}
+
+void ComputeTile(const Image3F& xyb, const Rect& rect, float distance,
+                 float scale, ImageF* pre_erosion, float* diff_buffer,
+                 ImageF* aq_map, ImageF* mask) {
+  ComputeMaskingTile(xyb, rect, pre_erosion, diff_buffer, aq_map, mask);
   PerBlockModulations(distance, xyb.Plane(0), xyb.Plane(1), xyb.Plane(2), scale,
                       rect, aq_map);
 }
 
-void ComputeAdaptiveQuantField(const Image3F& opsin, const float distance,
+// Converts the quant field of the blocks in `rect` to the integer values of
+// the quantizer with the given global scale. This is done by the tile tasks,
+// while the quant field of the tile is still in the cache.
+void ComputeRawQuantTile(const ImageF& quant_field, const Rect& rect,
+                         const float inv_global_scale,
+                         ImageI* raw_quant_field) {
+  for (size_t y = rect.y0(); y < rect.y0() + rect.ysize(); ++y) {
+    const float* JXL_RESTRICT row_qf = quant_field.ConstRow(y);
+    int32_t* JXL_RESTRICT row_qi = raw_quant_field->Row(y);
+    for (size_t x = rect.x0(); x < rect.x0() + rect.xsize(); ++x) {
+      row_qi[x] =
+          Clamp1(static_cast<int>(row_qf[x] * inv_global_scale + 0.5f), 1, 256);
+    }
+  }
+}
+
+void ComputeAdaptiveQuantField(const Image3F& opsin, const Rect& block_rect,
+                               const float distance, const float global_scale,
                                ThreadPool* pool, ImageF* mask,
-                               ImageF* quant_field) {
+                               ImageF* quant_field, ImageI* raw_quant_field) {
   const size_t xsize_blocks = DivCeil(opsin.xsize(), kBlockDim);
   const size_t ysize_blocks = DivCeil(opsin.ysize(), kBlockDim);
-  const size_t xsize_tiles = DivCeil(xsize_blocks, kColorTileDimInBlocks);
-  const size_t ysize_tiles = DivCeil(ysize_blocks, kColorTileDimInBlocks);
+  JXL_ASSERT(block_rect.x1() <= xsize_blocks);
+  JXL_ASSERT(block_rect.y1() <= ysize_blocks);
+  const size_t xsize_tiles =
+      DivCeil(block_rect.xsize(), kColorTileDimInBlocks);
+  const size_t ysize_tiles =
+      DivCeil(block_rect.ysize(), kColorTileDimInBlocks);
   static const float kAcQuant = 0.8294f;
   const float scale = kAcQuant / distance;
   std::vector<ImageF> pre_erosion;
   ImageF diff_buffer;
-  *quant_field = ImageF(xsize_blocks, ysize_blocks);
-  *mask = ImageF(xsize_blocks, ysize_blocks);
+  if (quant_field->xsize() != xsize_blocks ||
+      quant_field->ysize() != ysize_blocks) {
+    *quant_field = ImageF(xsize_blocks, ysize_blocks);
+  }
+  if (mask->xsize() != xsize_blocks || mask->ysize() != ysize_blocks) {
+    *mask = ImageF(xsize_blocks, ysize_blocks);
+  }
+  if (!SameSize(*raw_quant_field, *quant_field)) {
+    *raw_quant_field = ImageI(xsize_blocks, ysize_blocks);
+  }
+  const float inv_global_scale = 1.0f / global_scale;
   JXL_CHECK(RunOnPool(
       pool, 0, xsize_tiles * ysize_tiles,
       [&](const size_t num_threads) {
@@ -532,17 +588,168 @@ void ComputeAdaptiveQuantField(const Image3F& opsin, const float distance,
       [&](const uint32_t tid, const size_t thread) {
         size_t tx = tid % xsize_tiles;
         size_t ty = tid / xsize_tiles;
-        size_t by0 = ty * kColorTileDimInBlocks;
-        size_t by1 = std::min((ty + 1) * kColorTileDimInBlocks, ysize_blocks);
-        size_t bx0 = tx * kColorTileDimInBlocks;
-        size_t bx1 = std::min((tx + 1) * kColorTileDimInBlocks, xsize_blocks);
-        Rect rect(bx0, by0, bx1 - bx0, by1 - by0);
+        Rect rect(block_rect.x0() + tx * kColorTileDimInBlocks,
+                  block_rect.y0() + ty * kColorTileDimInBlocks,
+                  kColorTileDimInBlocks, kColorTileDimInBlocks,
+                  block_rect.x1(), block_rect.y1());
         ComputeTile(opsin, rect, distance, scale, &pre_erosion[thread],
                     diff_buffer.Row(thread), quant_field, mask);
+        ComputeRawQuantTile(*quant_field, rect, inv_global_scale,
+                            raw_quant_field);
       },
       "AQ DiffPrecompute"));
 }
 
+void ComputeAdaptiveQuantMasking(const Image3F& opsin, ThreadPool* pool,
+                                 ImageF* mask, ImageF* eroded) {
+  const size_t xsize_blocks = DivCeil(opsin.xsize(), kBlockDim);
+  const size_t ysize_blocks = DivCeil(opsin.ysize(), kBlockDim);
+  const size_t xsize_tiles = DivCeil(xsize_blocks, kColorTileDimInBlocks);
+  const size_t ysize_tiles = DivCeil(ysize_blocks, kColorTileDimInBlocks);
+  std::vector<ImageF> pre_erosion;
+  ImageF diff_buffer;
+  *mask = ImageF(xsize_blocks, ysize_blocks);
+  *eroded = ImageF(xsize_blocks, ysize_blocks);
+  JXL_CHECK(RunOnPool(
+      pool, 0, xsize_tiles * ysize_tiles,
+      [&](const size_t num_threads) {
+        diff_buffer = ImageF(kColorTileDim + 8, num_threads);
+        for (size_t i = pre_erosion.size(); i < num_threads; i++) {
+          pre_erosion.emplace_back(kColorTileDimInBlocks * 2 + 2,
+                                   kColorTileDimInBlocks * 2 + 2);
+        }
+        return true;
+      },
+      [&](const uint32_t tid, const size_t thread) {
+        size_t tx = tid % xsize_tiles;
+        size_t ty = tid / xsize_tiles;
+        Rect rect(tx * kColorTileDimInBlocks, ty * kColorTileDimInBlocks,
+                  kColorTileDimInBlocks, kColorTileDimInBlocks, xsize_blocks,
+                  ysize_blocks);
+        ComputeMaskingTile(opsin, rect, &pre_erosion[thread],
+                           diff_buffer.Row(thread), eroded, mask);
+      },
+      "AQ Masking"));
+}
+
+void ComputeAdaptiveQuantFieldFromMasking(const Image3F& opsin,
+                                          const ImageF& eroded,
+                                          const float distance,
+                                          const float global_scale,
+                                          ThreadPool* pool,
+                                          ImageF* quant_field,
+                                          ImageI* raw_quant_field) {
+  const size_t xsize_blocks = eroded.xsize();
+  const size_t ysize_blocks = eroded.ysize();
+  const size_t xsize_tiles = DivCeil(xsize_blocks, kColorTileDimInBlocks);
+  const size_t ysize_tiles = DivCeil(ysize_blocks, kColorTileDimInBlocks);
+  static const float kAcQuant = 0.8294f;
+  const float scale = kAcQuant / distance;
+  *quant_field = ImageF(xsize_blocks, ysize_blocks);
+  *raw_quant_field = ImageI(xsize_blocks, ysize_blocks);
+  const float inv_global_scale = 1.0f / global_scale;
+  JXL_CHECK(RunOnPool(
+      pool, 0, xsize_tiles * ysize_tiles, ThreadPool::NoInit,
+      [&](const uint32_t tid, const size_t thread) {
+        size_t tx = tid % xsize_tiles;
+        size_t ty = tid / xsize_tiles;
+        Rect rect(tx * kColorTileDimInBlocks, ty * kColorTileDimInBlocks,
+                  kColorTileDimInBlocks, kColorTileDimInBlocks, xsize_blocks,
+                  ysize_blocks);
+        CopyImageTo(rect, eroded, rect, quant_field);
+        PerBlockModulations(distance, opsin.Plane(0), opsin.Plane(1),
+                            opsin.Plane(2), scale, rect, quant_field);
+        ComputeRawQuantTile(*quant_field, rect, inv_global_scale,
+                            raw_quant_field);
+      },
+      "AQ Modulations"));
+}
+
+// Cheaper variant of ComputeTile() for EncoderEffort::kLightning. The masking
+// of a block is estimated from the mean absolute difference of neighbouring Y
+// pixels inside the block instead of the eroded local differences of the X and
+// Y channels around it, and only the high frequency modulation is applied on
+// top of it.
+void ComputeTileFast(const Image3F& xyb, const Rect& rect, float distance,
+                     float scale, ImageF* aq_map, ImageF* mask) {
+  const float match_gamma_offset = 0.019;
+  // Relates the mean absolute difference of a block to the local pixel
+  // differences of ComputeTile(), which are summed over 4x4 pixels.
+  const float kGradientMul = 4.0f;
+  float mul, add;
+  QuantFieldScale(distance, scale, &mul, &add);
+  const HWY_CAPPED(float, kBlockDim) df;
+  const ImageF& xyb_y = xyb.Plane(1);
+  for (size_t iy = rect.y0(); iy < rect.y0() + rect.ysize(); iy++) {
+    const size_t y = iy * 8;
+    float* JXL_RESTRICT row_out = aq_map->Row(iy);
+    float* JXL_RESTRICT row_mask = mask->Row(iy);
+    for (size_t ix = rect.x0(); ix < rect.x0() + rect.xsize(); ix++) {
+      const size_t x = ix * 8;
+      auto sum = Zero(df);
+      for (size_t dy = 0; dy < 8; ++dy) {
+        const float* JXL_RESTRICT row_in = xyb_y.ConstRow(y + dy) + x;
+        for (size_t dx = 0; dx < 8; dx += Lanes(df)) {
+          sum = Add(sum, Load(df, row_in + dx));
+        }
+      }
+      const float mean = GetLane(SumOfLanes(df, sum)) * (1.0f / 64);
+      const auto gradient = BlockGradientSum(df, x, y, xyb_y);
+      const float gammac =
+          RatioOfDerivativesOfCubicRootToSimpleGamma(mean + match_gamma_offset);
+      const float diff = gammac * GetLane(gradient) * (1.0f / 112);
+      const float masking = kGradientMul * MaskingSqrt(diff * diff);
+      row_mask[ix] = ComputeMaskForAcStrategyUse(masking);
+      auto out_val = ComputeMask(df, Set(df, masking));
+      out_val = MulAdd(gradient, Set(df, -2.0052193233688884f / 112), out_val);
+      row_out[ix] = FastPow2f(GetLane(out_val) * 1.442695041f) * mul + add;
+    }
+  }
+}
+
+void ComputeFastAdaptiveQuantField(const Image3F& opsin,
+                                   const Rect& block_rect,
+                                   const float distance,
+                                   const float global_scale, ThreadPool* pool,
+                                   ImageF* mask, ImageF* quant_field,
+                                   ImageI* raw_quant_field) {
+  const size_t xsize_blocks = DivCeil(opsin.xsize(), kBlockDim);
+  const size_t ysize_blocks = DivCeil(opsin.ysize(), kBlockDim);
+  JXL_ASSERT(block_rect.x1() <= xsize_blocks);
+  JXL_ASSERT(block_rect.y1() <= ysize_blocks);
+  const size_t xsize_tiles =
+      DivCeil(block_rect.xsize(), kColorTileDimInBlocks);
+  const size_t ysize_tiles =
+      DivCeil(block_rect.ysize(), kColorTileDimInBlocks);
+  static const float kAcQuant = 0.8294f;
+  const float scale = kAcQuant / distance;
+  if (quant_field->xsize() != xsize_blocks ||
+      quant_field->ysize() != ysize_blocks) {
+    *quant_field = ImageF(xsize_blocks, ysize_blocks);
+  }
+  if (mask->xsize() != xsize_blocks || mask->ysize() != ysize_blocks) {
+    *mask = ImageF(xsize_blocks, ysize_blocks);
+  }
+  if (!SameSize(*raw_quant_field, *quant_field)) {
+    *raw_quant_field = ImageI(xsize_blocks, ysize_blocks);
+  }
+  const float inv_global_scale = 1.0f / global_scale;
+  JXL_CHECK(RunOnPool(
+      pool, 0, xsize_tiles * ysize_tiles, ThreadPool::NoInit,
+      [&](const uint32_t tid, const size_t thread) {
+        size_t tx = tid % xsize_tiles;
+        size_t ty = tid / xsize_tiles;
+        Rect rect(block_rect.x0() + tx * kColorTileDimInBlocks,
+                  block_rect.y0() + ty * kColorTileDimInBlocks,
+                  kColorTileDimInBlocks, kColorTileDimInBlocks,
+                  block_rect.x1(), block_rect.y1());
+        ComputeTileFast(opsin, rect, distance, scale, quant_field, mask);
+        ComputeRawQuantTile(*quant_field, rect, inv_global_scale,
+                            raw_quant_field);
+      },
+      "AQ Fast"));
+}
+
 }  // namespace
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -553,23 +760,54 @@ HWY_AFTER_NAMESPACE();
 #if HWY_ONCE
 namespace jxl {
 HWY_EXPORT(ComputeAdaptiveQuantField);
+HWY_EXPORT(ComputeFastAdaptiveQuantField);
+HWY_EXPORT(ComputeAdaptiveQuantMasking);
+HWY_EXPORT(ComputeAdaptiveQuantFieldFromMasking);
 
 void ComputeAdaptiveQuantField(const Image3F& opsin, const float distance,
                                const float scale, ThreadPool* pool,
                                ImageF* masking, ImageF* quant_field,
                                ImageI* raw_quant_field) {
+  const Rect block_rect(0, 0, DivCeil(opsin.xsize(), kBlockDim),
+                        DivCeil(opsin.ysize(), kBlockDim));
+  ComputeAdaptiveQuantField(opsin, block_rect, distance, scale, pool, masking,
+                            quant_field, raw_quant_field);
+}
+
+void ComputeAdaptiveQuantField(const Image3F& opsin, const Rect& block_rect,
+                               const float distance, const float scale,
+                               ThreadPool* pool, ImageF* masking,
+                               ImageF* quant_field, ImageI* raw_quant_field) {
   HWY_DYNAMIC_DISPATCH(ComputeAdaptiveQuantField)
-  (opsin, distance, pool, masking, quant_field);
-  *raw_quant_field = ImageI(quant_field->xsize(), quant_field->ysize());
-  const float inv_scale = 1.0f / scale;
-  for (size_t y = 0; y < quant_field->ysize(); ++y) {
-    const float* row_qf = quant_field->ConstRow(y);
-    int32_t* row_qi = raw_quant_field->Row(y);
-    for (size_t x = 0; x < quant_field->xsize(); ++x) {
-      int val = Clamp1(static_cast<int>(row_qf[x] * inv_scale + 0.5f), 1, 256);
-      row_qi[x] = val;
-    }
-  }
+  (opsin, block_rect, distance, scale, pool, masking, quant_field,
+   raw_quant_field);
+}
+
+void ComputeFastAdaptiveQuantField(const Image3F& opsin,
+                                   const Rect& block_rect,
+                                   const float distance, const float scale,
+                                   ThreadPool* pool, ImageF* masking,
+                                   ImageF* quant_field,
+                                   ImageI* raw_quant_field) {
+  HWY_DYNAMIC_DISPATCH(ComputeFastAdaptiveQuantField)
+  (opsin, block_rect, distance, scale, pool, masking, quant_field,
+   raw_quant_field);
+}
+
+void ComputeAdaptiveQuantMasking(const Image3F& opsin, ThreadPool* pool,
+                                 ImageF* masking, ImageF* eroded) {
+  HWY_DYNAMIC_DISPATCH(ComputeAdaptiveQuantMasking)
+  (opsin, pool, masking, eroded);
+}
+
+void ComputeAdaptiveQuantFieldFromMasking(const Image3F& opsin,
+                                          const ImageF& eroded,
+                                          const float distance,
+                                          const float scale, ThreadPool* pool,
+                                          ImageF* quant_field,
+                                          ImageI* raw_quant_field) {
+  HWY_DYNAMIC_DISPATCH(ComputeAdaptiveQuantFieldFromMasking)
+  (opsin, eroded, distance, scale, pool, quant_field, raw_quant_field);
 }
 
 }  // namespace jxl
@@ -23,6 +23,38 @@ void ComputeAdaptiveQuantField(const Image3F& opsin, const float distance,
                                ImageF* masking, ImageF* quant_field,
                                ImageI* raw_quant_field);
 
+// Same as above, but only computes the blocks of `block_rect`. The output
+// images always cover all blocks of `opsin` and are only reallocated if they
+// have a different size. Up to 8 pixel rows and columns of `opsin` around
+// `block_rect` are used as context.
+void ComputeAdaptiveQuantField(const Image3F& opsin, const Rect& block_rect,
+                               const float distance, const float scale,
+                               ThreadPool* pool, ImageF* masking,
+                               ImageF* quant_field, ImageI* raw_quant_field);
+
+// ComputeAdaptiveQuantField() on the whole image in two steps, for encoding
+// the same image at several distances: the first computes the mask and the
+// part of the quantization field that does not depend on the distance, the
+// eroded local pixel differences of every block, and the second computes the
+// quantization field for one distance from those. The result is the same.
+void ComputeAdaptiveQuantMasking(const Image3F& opsin, ThreadPool* pool,
+                                 ImageF* masking, ImageF* eroded);
+void ComputeAdaptiveQuantFieldFromMasking(const Image3F& opsin,
+                                          const ImageF& eroded,
+                                          const float distance,
+                                          const float scale, ThreadPool* pool,
+                                          ImageF* quant_field,
+                                          ImageI* raw_quant_field);
+
+// Faster and less accurate variant of the above, which only looks at the
+// pixels of each block itself (for EncoderEffort::kLightning).
+void ComputeFastAdaptiveQuantField(const Image3F& opsin,
+                                   const Rect& block_rect,
+                                   const float distance, const float scale,
+                                   ThreadPool* pool, ImageF* masking,
+                                   ImageF* quant_field,
+                                   ImageI* raw_quant_field);
+
 }  // namespace jxl
 
 #endif  // ENCODER_ENC_ADAPTIVE_QUANTIZATION_H_
@@ -593,6 +593,60 @@ class ANSCoder {
   uint32_t state_;
 };
 
+template <typename Visitor>
+void ForEachTokenReverse(const std::vector<Token>& tokens,
+                         const Visitor& visit) {
+  for (size_t i = tokens.size(); i > 0; --i) {
+    visit(tokens[i - 1]);
+  }
+}
+
+template <typename Visitor>
+void ForEachTokenReverse(const PackedTokens& tokens, const Visitor& visit) {
+  tokens.ForEachReverse(visit);
+}
+
+template <typename Tokens>
+void WriteTokensImpl(const Tokens& tokens, const EntropyEncodingData& codes,
+                     const std::vector<uint8_t>& context_map,
+                     BitWriter* writer) {
+  BitWriter::Allotment allotment(writer, 32 * tokens.size() + 32 * 1024 * 4);
+  {
+    // ANS encodes in reverse order, so the bit stream is produced back to
+    // front.
+    BitWriter::ReverseWriter reverse_writer(writer);
+    ANSCoder ans;
+    UintCoder uint_conder;
+    const auto encode_token = [&](const Token token, const size_t histo) {
+      uint32_t tok, nbits, bits;
+      uint_conder.Encode(token.value, &tok, &nbits, &bits);
+      const ANSEncSymbolInfo& info = codes.encoding_info[histo][tok];
+      uint8_t ans_nbits = 0;
+      uint32_t ans_bits = ans.PutSymbol(info, &ans_nbits);
+      // The ANS bits come before the extra bits in the stream, and both fit
+      // in one call unless the value is very large.
+      if (nbits + ans_nbits <= BitWriter::kMaxBitsPerCall) {
+        reverse_writer.Prepend(nbits + ans_nbits,
+                               (uint64_t{bits} << ans_nbits) | ans_bits);
+      } else {
+        reverse_writer.Prepend(nbits, bits);
+        reverse_writer.Prepend(ans_nbits, ans_bits);
+      }
+    };
+    if (context_map.size() > 1) {
+      ForEachTokenReverse(tokens, [&](const Token token) {
+        encode_token(token, context_map[token.context]);
+      });
+    } else {
+      ForEachTokenReverse(
+          tokens, [&](const Token token) { encode_token(token, 0); });
+    }
+    reverse_writer.Prepend(32, ans.GetState());
+    reverse_writer.Finish();
+  }
+  allotment.Reclaim(writer);
+}
+
 }  // namespace
 
 void WriteHistograms(const std::vector<Histogram>& histograms,
@@ -622,65 +676,46 @@ void WriteHistograms(const std::vector<Histogram>& histograms,
   }
 }
 
+void WriteContextMap(const std::vector<uint8_t>& context_map,
+                     BitWriter* writer, bool move_to_front) {
+  if (context_map.empty()) {
+    return;
+  }
+  if (*std::max_element(context_map.begin(), context_map.end()) == 0) {
+    writer->AllocateAndWrite(3, 1);  // simple code, 0 bits per entry
+    return;
+  }
+  // no simple code, MTF flag, no LZ77
+  writer->AllocateAndWrite(3, move_to_front ? 2 : 0);
+  std::vector<Token> tokens;
+  uint8_t mtf[256];
+  std::iota(mtf, mtf + 256, 0);
+  for (size_t i = 0; i < context_map.size(); i++) {
+    if (!move_to_front) {
+      tokens.emplace_back(0, context_map[i]);
+      continue;
+    }
+    const uint8_t value = context_map[i];
+    const size_t index = std::find(mtf, mtf + 256, value) - mtf;
+    tokens.emplace_back(0, index);
+    std::copy_backward(mtf, mtf + index, mtf + index + 1);
+    mtf[0] = value;
+  }
+  EntropyEncodingData codes;
+  std::vector<uint8_t> dummy_context_map(1);
+  WriteHistograms(BuildHistograms(1, tokens), &codes, writer);
+  WriteTokens(tokens, codes, dummy_context_map, writer);
+}
+
 void WriteTokens(const std::vector<Token>& tokens,
                  const EntropyEncodingData& codes,
                  const std::vector<uint8_t>& context_map, BitWriter* writer) {
-  BitWriter::Allotment allotment(writer, 32 * tokens.size() + 32 * 1024 * 4);
-  std::vector<uint64_t> out;
-  std::vector<uint8_t> out_nbits;
-  out.reserve(tokens.size());
-  out_nbits.reserve(tokens.size());
-  uint64_t allbits = 0;
-  size_t numallbits = 0;
-  // Writes in *reversed* order.
-  auto addbits = [&](size_t bits, size_t nbits) {
-    if (JXL_UNLIKELY(nbits)) {
-      JXL_DASSERT(bits >> nbits == 0);
-      if (JXL_UNLIKELY(numallbits + nbits > BitWriter::kMaxBitsPerCall)) {
-        out.push_back(allbits);
-        out_nbits.push_back(numallbits);
-        numallbits = allbits = 0;
-      }
-      allbits <<= nbits;
-      allbits |= bits;
-      numallbits += nbits;
-    }
-  };
-  const int end = tokens.size();
-  ANSCoder ans;
-  UintCoder uint_conder;
-  if (context_map.size() > 1) {
-    for (int i = end - 1; i >= 0; --i) {
-      const Token token = tokens[i];
-      const uint8_t histo = context_map[token.context];
-      uint32_t tok, nbits, bits;
-      uint_conder.Encode(tokens[i].value, &tok, &nbits, &bits);
-      const ANSEncSymbolInfo& info = codes.encoding_info[histo][tok];
-      // Extra bits first as this is reversed.
-      addbits(bits, nbits);
-      uint8_t ans_nbits = 0;
-      uint32_t ans_bits = ans.PutSymbol(info, &ans_nbits);
-      addbits(ans_bits, ans_nbits);
-    }
-  } else {
-    for (int i = end - 1; i >= 0; --i) {
-      uint32_t tok, nbits, bits;
-      uint_conder.Encode(tokens[i].value, &tok, &nbits, &bits);
-      const ANSEncSymbolInfo& info = codes.encoding_info[0][tok];
-      // Extra bits first as this is reversed.
-      addbits(bits, nbits);
-      uint8_t ans_nbits = 0;
-      uint32_t ans_bits = ans.PutSymbol(info, &ans_nbits);
-      addbits(ans_bits, ans_nbits);
-    }
-  }
-  const uint32_t state = ans.GetState();
-  writer->Write(32, state);
-  writer->Write(numallbits, allbits);
-  for (int i = out.size(); i > 0; --i) {
-    writer->Write(out_nbits[i - 1], out[i - 1]);
-  }
-  allotment.Reclaim(writer);
+  WriteTokensImpl(tokens, codes, context_map, writer);
+}
+
+void WriteTokens(const PackedTokens& tokens, const EntropyEncodingData& codes,
+                 const std::vector<uint8_t>& context_map, BitWriter* writer) {
+  WriteTokensImpl(tokens, codes, context_map, writer);
 }
 
 }  // namespace jxl
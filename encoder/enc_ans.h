@@ -36,9 +36,19 @@ struct EntropyEncodingData {
 void WriteHistograms(const std::vector<Histogram>& histograms,
                      EntropyEncodingData* codes, BitWriter* writer);
 
+// Writes the cluster of every context, as used by WriteTokens().
+// If `move_to_front` is true, the entries are coded as their index in a
+// move-to-front list of the clusters, which is much cheaper for maps where
+// long runs of contexts alternate between a few clusters.
+void WriteContextMap(const std::vector<uint8_t>& context_map,
+                     BitWriter* writer, bool move_to_front = false);
+
 void WriteTokens(const std::vector<Token>& tokens,
                  const EntropyEncodingData& codes,
                  const std::vector<uint8_t>& context_map, BitWriter* writer);
 
+void WriteTokens(const PackedTokens& tokens, const EntropyEncodingData& codes,
+                 const std::vector<uint8_t>& context_map, BitWriter* writer);
+
 }  // namespace jxl
 #endif  // ENCODER_ENC_ANS_H_
@@ -42,6 +42,9 @@ void BitWriter::Allotment::PrivateReclaim(BitWriter* JXL_RESTRICT writer,
   JXL_ASSERT(*used_bits <= max_bits_);
   *unused_bits = max_bits_ - *used_bits;
 
+  // Out of any allotment, callers may read the storage.
+  if (parent_ == nullptr) writer->Flush();
+
   // Reclaim unused bytes whole bytes from writer's allotment.
   const size_t unused_bytes = *unused_bits / kBitsPerByte;  // truncate
   JXL_ASSERT(writer->storage_.size() >= unused_bytes);
@@ -68,10 +71,11 @@ void BitWriter::AppendByteAligned(const std::vector<BitWriter>& others) {
     // images with no alpha. Do nothing.
     return;
   }
-  storage_.resize(storage_.size() + other_bytes + 1);  // extra zero padding
+  storage_.resize(storage_.size() + other_bytes);
 
   // Concatenate by copying bytes because both source and destination are bytes.
   JXL_ASSERT(BitsWritten() % kBitsPerByte == 0);
+  Flush();
   size_t pos = BitsWritten() / kBitsPerByte;
   for (const BitWriter& writer : others) {
     const Span<const uint8_t> span = writer.GetSpan();
@@ -80,43 +84,74 @@ void BitWriter::AppendByteAligned(const std::vector<BitWriter>& others) {
       pos += span.size();
     }
   }
-  storage_[pos++] = 0;  // for next Write
   JXL_ASSERT(pos <= storage_.size());
   bits_written_ += other_bytes * kBitsPerByte;
 }
 
-// Example: let's assume that 3 bits (Rs below) have been written already:
-// BYTE+0       BYTE+1       BYTE+2
-// 0000 0RRR    ???? ????    ???? ????
-//
-// Now, we could write up to 5 bits by just shifting them left by 3 bits and
-// OR'ing to BYTE-0.
-//
-// For n > 5 bits, we write the lowest 5 bits as above, then write the next
-// lowest bits into BYTE+1 starting from its lower bits and so on.
-void BitWriter::Write(size_t n_bits, uint64_t bits) {
-  JXL_DASSERT((bits >> n_bits) == 0);
-  JXL_DASSERT(n_bits <= kMaxBitsPerCall);
-  uint8_t* p = &storage_[bits_written_ / kBitsPerByte];
-  const size_t bits_in_first_byte = bits_written_ % kBitsPerByte;
-  bits <<= bits_in_first_byte;
+void BitWriter::AppendUnaligned(const BitWriter& other) {
+  // `other` is out of any allotment, so all its bits are in its storage.
+  JXL_ASSERT(other.buffer_bits_ < kBitsPerByte);
+  const uint8_t* JXL_RESTRICT bytes = other.storage_.data();
+  size_t num_bits = other.BitsWritten();
+  const size_t num_words = num_bits / 64;
+  WriteWords(bytes, num_words);
+  bytes += num_words * sizeof(uint64_t);
+  num_bits -= num_words * 64;
+  for (; num_bits >= 8; num_bits -= 8, ++bytes) Write(8, *bytes);
+  // The bits after the last written one are zero.
+  if (num_bits != 0) Write(num_bits, *bytes);
+}
+
+void BitWriter::ReverseWriter::Finish() {
+  const size_t words_end = writer_->storage_.size();
+  // The accumulator is stored a whole word at a time, which must not reach
+  // the next buffered word before it has been read.
+  JXL_ASSERT(writer_->bits_written_ + num_bits_ + 64 <=
+             words_begin_ * kBitsPerByte);
+  if (num_bits_ > 32) {
+    writer_->Write(32, acc_ & 0xFFFFFFFFu);
+    writer_->Write(num_bits_ - 32, acc_ >> 32);
+  } else {
+    writer_->Write(num_bits_, acc_);
+  }
+  // The words were stored in host byte order.
+#if JXL_BYTE_ORDER_LITTLE
+  writer_->WriteWords(&writer_->storage_[words_begin_],
+                      (words_end - words_begin_) / sizeof(uint64_t));
+#else
+  for (size_t pos = words_begin_; pos < words_end; pos += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, &writer_->storage_[pos], sizeof(word));
+    writer_->Write(32, word & 0xFFFFFFFFu);
+    writer_->Write(32, word >> 32);
+  }
+#endif
+}
+
+void BitWriter::WriteWords(const uint8_t* words, size_t num_words) {
 #if JXL_BYTE_ORDER_LITTLE
-  uint64_t v = *p;
-  // Last (partial) or next byte to write must be zero-initialized!
-  // PaddedBytes initializes the first, and Write/Append maintain this.
-  JXL_DASSERT(v >> bits_in_first_byte == 0);
-  v |= bits;
-  memcpy(p, &v, sizeof(v));  // Write bytes: possibly more than n_bits/8
+  // Each stored word is the accumulator followed by the start of the current
+  // word, whose rest then becomes the accumulator. The destination stays
+  // behind the source, so no word is overwritten before it is read.
+  for (size_t i = 0; i < num_words; ++i) {
+    uint64_t word;
+    memcpy(&word, words + i * sizeof(uint64_t), sizeof(word));
+    StoreWord(buffer_ | (word << buffer_bits_));
+    buffer_ = buffer_bits_ == 0 ? 0 : word >> (64 - buffer_bits_);
+    bits_written_ += 64;
+  }
 #else
-  *p++ |= static_cast<uint8_t>(bits & 0xFF);
-  for (size_t bits_left_to_write = n_bits + bits_in_first_byte;
-       bits_left_to_write >= 9; bits_left_to_write -= 8) {
-    bits >>= 8;
-    *p++ = static_cast<uint8_t>(bits & 0xFF);
+  for (size_t i = 0; i < num_words; ++i) {
+    const uint8_t* bytes = words + i * sizeof(uint64_t);
+    uint64_t lo = 0, hi = 0;
+    for (size_t j = 0; j < 4; ++j) {
+      lo |= uint64_t{bytes[j]} << (8 * j);
+      hi |= uint64_t{bytes[4 + j]} << (8 * j);
+    }
+    Write(32, lo);
+    Write(32, hi);
   }
-  *p = 0;
 #endif
-  bits_written_ += n_bits;
 }
 
 }  // namespace jxl
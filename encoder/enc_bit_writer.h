@@ -7,14 +7,17 @@
 #ifndef LIB_JXL_ENC_BIT_WRITER_H_
 #define LIB_JXL_ENC_BIT_WRITER_H_
 
-// BitWriter class: unbuffered writes using unaligned 64-bit stores.
+// BitWriter class: bits are collected in a 64-bit accumulator and stored a
+// whole word at a time.
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <utility>
 #include <vector>
 
+#include "encoder/base/byte_order.h"
 #include "encoder/base/compiler_specific.h"
 #include "encoder/base/padded_bytes.h"
 #include "encoder/base/span.h"
@@ -28,11 +31,8 @@ constexpr inline size_t RoundUpBitsToByteMultiple(size_t bits) {
 }
 
 struct BitWriter {
-  // Upper bound on `n_bits` in each call to Write. We shift a 64-bit word by
-  // 7 bits (max already valid bits in the last byte) and at least 1 bit is
-  // needed to zero-initialize the bit-stream ahead (i.e. if 7 bits are valid
-  // and we write 57 bits, then the next write will access a byte that was not
-  // yet zero-initialized).
+  // Upper bound on `n_bits` in each call to Write. The accumulator can take
+  // more, but ReverseWriter and the callers rely on this bound.
   static constexpr size_t kMaxBitsPerCall = 56;
 
   BitWriter() : bits_written_(0) {}
@@ -48,6 +48,8 @@ struct BitWriter {
   Span<const uint8_t> GetSpan() const {
     // Callers must ensure byte alignment to avoid uninitialized bits.
     JXL_ASSERT(bits_written_ % kBitsPerByte == 0);
+    // Out of any allotment, all bits are in the storage.
+    JXL_ASSERT(buffer_bits_ == 0);
     return Span<const uint8_t>(storage_.data(), bits_written_ / kBitsPerByte);
   }
 
@@ -57,6 +59,7 @@ struct BitWriter {
   PaddedBytes&& TakeBytes() && {
     // Callers must ensure byte alignment to avoid uninitialized bits.
     JXL_ASSERT(bits_written_ % kBitsPerByte == 0);
+    JXL_ASSERT(buffer_bits_ == 0);
     storage_.resize(bits_written_ / kBitsPerByte);
     return std::move(storage_);
   }
@@ -64,11 +67,16 @@ struct BitWriter {
  public:
   void AppendByteAligned(const std::vector<BitWriter>& others);
 
+  // Writes all bits of `other`, which need not end at a byte boundary. Like
+  // Write(), requires an allotment.
+  void AppendUnaligned(const BitWriter& other);
+
   class Allotment {
    public:
     // Expands a BitWriter's storage. Must happen before calling Write or
     // ZeroPadToByte. Must call ReclaimUnused after writing to reclaim the
     // unused storage so that BitWriter memory use remains tightly bounded.
+    // Reclaiming the outermost allotment also stores the accumulated bits.
     Allotment(BitWriter* JXL_RESTRICT writer, size_t max_bits);
     ~Allotment();
 
@@ -91,13 +99,77 @@ struct BitWriter {
   // Writes bits into bytes in increasing addresses, and within a byte
   // least-significant-bit first.
   //
-  // The function can write up to 56 bits in one go.
-  void Write(size_t n_bits, uint64_t bits);
+  // The function can write up to 56 bits in one go. The bits go to the
+  // accumulator, which is stored to the allotment when it holds 64 bits.
+  JXL_INLINE void Write(size_t n_bits, uint64_t bits) {
+    JXL_DASSERT((bits >> n_bits) == 0);
+    JXL_DASSERT(n_bits <= kMaxBitsPerCall);
+    buffer_ |= bits << buffer_bits_;
+    const size_t num_bits = buffer_bits_ + n_bits;
+    if (num_bits >= 64) {
+      StoreWord(buffer_);
+      // buffer_bits_ != 0 here, since n_bits < 64.
+      buffer_ = bits >> (64 - buffer_bits_);
+      buffer_bits_ = num_bits - 64;
+    } else {
+      buffer_bits_ = num_bits;
+    }
+    bits_written_ += n_bits;
+  }
 
+  // Writes a bit stream that is produced back to front, as by the ANS encoder:
+  // Prepend() is called with the chunks of the stream in reverse order, and
+  // Finish() writes the whole stream to `writer`. Full 64-bit words of the
+  // stream are buffered in the unused tail of the current allotment, which
+  // must have room for the stream plus 64 bits.
+  class ReverseWriter {
+   public:
+    explicit ReverseWriter(BitWriter* JXL_RESTRICT writer)
+        : writer_(writer), words_begin_(writer->storage_.size()) {}
+
+    // Adds `n_bits` <= kMaxBitsPerCall bits in front of the stream.
+    JXL_INLINE void Prepend(size_t n_bits, uint64_t bits) {
+      JXL_DASSERT((bits >> n_bits) == 0);
+      JXL_DASSERT(n_bits <= kMaxBitsPerCall);
+      if (num_bits_ + n_bits < 64) {
+        acc_ = (acc_ << n_bits) | bits;
+        num_bits_ += n_bits;
+        return;
+      }
+      const size_t rest = num_bits_ + n_bits - 64;
+      uint64_t word = bits >> rest;
+      if (num_bits_ != 0) word |= acc_ << (64 - num_bits_);
+      words_begin_ -= sizeof(word);
+      JXL_ASSERT(words_begin_ * kBitsPerByte >= writer_->bits_written_);
+      memcpy(&writer_->storage_[words_begin_], &word, sizeof(word));
+      acc_ = bits & ((uint64_t(1) << rest) - 1);
+      num_bits_ = rest;
+    }
+
+    void Finish();
+
+   private:
+    BitWriter* writer_;
+    size_t words_begin_;  // byte offset of the first buffered word
+    uint64_t acc_ = 0;    // first num_bits_ bits of the stream
+    size_t num_bits_ = 0;
+  };
+
+  // Writes a few bits without the caller having to create an allotment. Out
+  // of any allotment, the storage grows as needed, amortized by PaddedBytes.
   void AllocateAndWrite(size_t n_bits, uint64_t bits) {
-    Allotment allotment(this, n_bits);
+    if (current_allotment_ != nullptr) {
+      // Creating a nested allotment keeps the enclosing one from being
+      // charged for these bits.
+      Allotment allotment(this, n_bits);
+      Write(n_bits, bits);
+      allotment.Reclaim(this);
+      return;
+    }
+    const size_t num_bytes = DivCeil(bits_written_ + n_bits, kBitsPerByte);
+    if (storage_.size() < num_bytes) storage_.resize(num_bytes);
     Write(n_bits, bits);
-    allotment.Reclaim(this);
+    Flush();
   }
 
   // This should only rarely be used - e.g. when the current location will be
@@ -112,9 +184,44 @@ struct BitWriter {
   }
 
  private:
+  // Stores `word` at the first byte of the accumulator, which then holds no
+  // more than the bits of the next word.
+  JXL_INLINE void StoreWord(uint64_t word) {
+    const size_t pos = (bits_written_ - buffer_bits_) / kBitsPerByte;
+    uint8_t* p = storage_.data() + pos;
+#if JXL_BYTE_ORDER_LITTLE
+    memcpy(p, &word, sizeof(word));
+#else
+    for (size_t i = 0; i < sizeof(word); ++i) {
+      p[i] = static_cast<uint8_t>(word >> (i * kBitsPerByte));
+    }
+#endif
+  }
+
+  // Stores the accumulated bits, the last partial byte zero-padded. That byte
+  // stays in the accumulator, so that it starts at a byte boundary. Like the
+  // former unbuffered Write, may store zeros up to 7 bytes past the end.
+  JXL_INLINE void Flush() {
+    if (buffer_bits_ == 0) return;
+    StoreWord(buffer_);
+    // Less than 64, since the accumulator is never full.
+    const size_t stored_bits = buffer_bits_ & ~size_t(kBitsPerByte - 1);
+    buffer_ >>= stored_bits;
+    buffer_bits_ -= stored_bits;
+  }
+
+  // Writes the `num_words` 64-bit words at `words`, in the same byte order as
+  // the storage, through the accumulator. The words may be in the unused tail
+  // of the storage, at least 64 bits after the last written bit.
+  void WriteWords(const uint8_t* words, size_t num_words);
+
   size_t bits_written_;
   PaddedBytes storage_;
   Allotment* current_allotment_ = nullptr;
+  // The last buffer_bits_ < 64 bits written, which start at a byte boundary
+  // and are not yet (all) stored. The bits above them are zero.
+  uint64_t buffer_ = 0;
+  size_t buffer_bits_ = 0;
 };
 
 }  // namespace jxl
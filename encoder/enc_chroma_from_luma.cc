@@ -34,33 +34,49 @@ using hwy::HWY_NAMESPACE::Ge;
 using hwy::HWY_NAMESPACE::GetLane;
 using hwy::HWY_NAMESPACE::IfThenElse;
 using hwy::HWY_NAMESPACE::Lt;
+using hwy::HWY_NAMESPACE::Vec;
 
 static HWY_FULL(float) df;
 
-int32_t FindBestMultiplier(const float* values_m, const float* values_s,
-                           size_t num, float base, float distance_mul) {
-  if (num == 0) {
-    return 0;
-  }
-  float x;
-  auto ca = Zero(df);
-  auto cb = Zero(df);
+// Adds the terms of the least squares fit of FindBestMultiplier() for
+// values [begin, end) to the lanes of `ca` and `cb`.
+HWY_INLINE void AccumulateMultiplierTerms(const float* values_m,
+                                          const float* values_s, size_t begin,
+                                          size_t end, float base,
+                                          Vec<decltype(df)>* ca,
+                                          Vec<decltype(df)>* cb) {
   const auto inv_color_factor = Set(df, kInvColorFactor);
   const auto base_v = Set(df, base);
-  for (size_t i = 0; i < num; i += Lanes(df)) {
+  for (size_t i = begin; i < end; i += Lanes(df)) {
     // color residual = ax + b
     const auto a = Mul(inv_color_factor, Load(df, values_m + i));
     const auto b =
         Sub(Mul(base_v, Load(df, values_m + i)), Load(df, values_s + i));
-    ca = MulAdd(a, a, ca);
-    cb = MulAdd(a, b, cb);
+    *ca = MulAdd(a, a, *ca);
+    *cb = MulAdd(a, b, *cb);
   }
+}
+
+HWY_INLINE int32_t BestMultiplier(const Vec<decltype(df)> ca,
+                                  const Vec<decltype(df)> cb, size_t num,
+                                  float distance_mul) {
   // + distance_mul * x^2 * num
-  x = -GetLane(SumOfLanes(df, cb)) /
-      (GetLane(SumOfLanes(df, ca)) + num * distance_mul * 0.5f);
+  const float x = -GetLane(SumOfLanes(df, cb)) /
+                  (GetLane(SumOfLanes(df, ca)) + num * distance_mul * 0.5f);
   return std::max(-128.0f, std::min(127.0f, roundf(x)));
 }
 
+int32_t FindBestMultiplier(const float* values_m, const float* values_s,
+                           size_t num, float base, float distance_mul) {
+  if (num == 0) {
+    return 0;
+  }
+  auto ca = Zero(df);
+  auto cb = Zero(df);
+  AccumulateMultiplierTerms(values_m, values_s, 0, num, base, &ca, &cb);
+  return BestMultiplier(ca, cb, num, distance_mul);
+}
+
 void InitDCStorage(size_t num_blocks, ImageF* dc_values) {
   // First row: Y channel
   // Second row: X channel
@@ -78,22 +94,61 @@ void InitDCStorage(size_t num_blocks, ImageF* dc_values) {
   }
 }
 
-void ComputeDC(const ImageF& dc_values, int32_t* dc_x, int32_t* dc_b) {
+Status ComputeDC(const ImageF& dc_values, ThreadPool* pool, int32_t* dc_x,
+                 int32_t* dc_b) {
   constexpr float kDistanceMultiplierDC = 1e-5f;
+  // The sums of every chunk are added in chunk order, so the result does not
+  // depend on the number of threads. It is a multiple of all vector sizes.
+  constexpr size_t kChunkSize = 1 << 14;
   const float* JXL_RESTRICT dc_values_yx = dc_values.Row(0);
   const float* JXL_RESTRICT dc_values_x = dc_values.Row(1);
   const float* JXL_RESTRICT dc_values_yb = dc_values.Row(2);
   const float* JXL_RESTRICT dc_values_b = dc_values.Row(3);
-  *dc_x = FindBestMultiplier(dc_values_yx, dc_values_x, dc_values.xsize(), 0.0f,
-                             kDistanceMultiplierDC);
-  *dc_b = FindBestMultiplier(dc_values_yb, dc_values_b, dc_values.xsize(), 1.0f,
-                             kDistanceMultiplierDC);
+  const size_t num = dc_values.xsize();
+  const size_t num_chunks = DivCeil(num, kChunkSize);
+  const size_t N = Lanes(df);
+  // ca and cb vectors of X and B of every chunk.
+  auto sums = hwy::AllocateAligned<float>(num_chunks * 4 * N);
+  const auto accumulate_chunk = [&](const uint32_t chunk,
+                                    const size_t /*thread*/) {
+    const size_t begin = chunk * kChunkSize;
+    const size_t end = std::min(begin + kChunkSize, num);
+    auto ca_x = Zero(df);
+    auto cb_x = Zero(df);
+    auto ca_b = Zero(df);
+    auto cb_b = Zero(df);
+    AccumulateMultiplierTerms(dc_values_yx, dc_values_x, begin, end, 0.0f,
+                              &ca_x, &cb_x);
+    AccumulateMultiplierTerms(dc_values_yb, dc_values_b, begin, end, 1.0f,
+                              &ca_b, &cb_b);
+    float* JXL_RESTRICT chunk_sums = sums.get() + chunk * 4 * N;
+    Store(ca_x, df, chunk_sums);
+    Store(cb_x, df, chunk_sums + N);
+    Store(ca_b, df, chunk_sums + 2 * N);
+    Store(cb_b, df, chunk_sums + 3 * N);
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, num_chunks, ThreadPool::NoInit,
+                                accumulate_chunk, "Cfl DC"));
+  auto ca_x = Zero(df);
+  auto cb_x = Zero(df);
+  auto ca_b = Zero(df);
+  auto cb_b = Zero(df);
+  for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+    const float* JXL_RESTRICT chunk_sums = sums.get() + chunk * 4 * N;
+    ca_x = Add(ca_x, Load(df, chunk_sums));
+    cb_x = Add(cb_x, Load(df, chunk_sums + N));
+    ca_b = Add(ca_b, Load(df, chunk_sums + 2 * N));
+    cb_b = Add(cb_b, Load(df, chunk_sums + 3 * N));
+  }
+  *dc_x = num == 0 ? 0 : BestMultiplier(ca_x, cb_x, num, kDistanceMultiplierDC);
+  *dc_b = num == 0 ? 0 : BestMultiplier(ca_b, cb_b, num, kDistanceMultiplierDC);
+  return true;
 }
 
 void ComputeTile(const Image3F& opsin, const DequantMatrices& dequant,
                  const Rect& r, ImageSB* map_x, ImageSB* map_b,
-                 ImageF* dc_values, float* mem) {
-  size_t xsize_blocks = opsin.xsize() / kBlockDim;
+                 size_t dc_offset, size_t dc_stride, ImageF* dc_values,
+                 float* mem) {
   constexpr float kDistanceMultiplierAC = 1e-3f;
 
   const size_t y0 = r.y0();
@@ -107,10 +162,10 @@ void ComputeTile(const Image3F& opsin, const DequantMatrices& dequant,
   int8_t* JXL_RESTRICT row_out_x = map_x->Row(ty);
   int8_t* JXL_RESTRICT row_out_b = map_b->Row(ty);
 
-  float* JXL_RESTRICT dc_values_yx = dc_values->Row(0);
-  float* JXL_RESTRICT dc_values_x = dc_values->Row(1);
-  float* JXL_RESTRICT dc_values_yb = dc_values->Row(2);
-  float* JXL_RESTRICT dc_values_b = dc_values->Row(3);
+  float* JXL_RESTRICT dc_values_yx = dc_values->Row(0) + dc_offset;
+  float* JXL_RESTRICT dc_values_x = dc_values->Row(1) + dc_offset;
+  float* JXL_RESTRICT dc_values_yb = dc_values->Row(2) + dc_offset;
+  float* JXL_RESTRICT dc_values_b = dc_values->Row(3) + dc_offset;
 
   // All are aligned.
   float* HWY_RESTRICT block_y = mem;
@@ -154,10 +209,10 @@ void ComputeTile(const Image3F& opsin, const DequantMatrices& dequant,
           dequant.InvMatrix(acs.Strategy(), 2);
 
       // Copy DCs in dc_values.
-      dc_values_yx[y * xsize_blocks + x] = dc_y[0];
-      dc_values_x[y * xsize_blocks + x] = dc_x[0];
-      dc_values_yb[y * xsize_blocks + x] = dc_y[0];
-      dc_values_b[y * xsize_blocks + x] = dc_b[0];
+      dc_values_yx[y * dc_stride + x] = dc_y[0];
+      dc_values_x[y * dc_stride + x] = dc_x[0];
+      dc_values_yb[y * dc_stride + x] = dc_y[0];
+      dc_values_b[y * dc_stride + x] = dc_b[0];
 
       // Zero out DCs. This introduces terms in the optimization loop that
       // don't affect the result, as they are all 0, but allow for simpler
@@ -199,8 +254,6 @@ HWY_EXPORT(ComputeDC);
 HWY_EXPORT(ComputeTile);
 
 struct CfLHeuristics {
-  void Init(const Image3F& opsin);
-
   void PrepareForThreads(size_t num_threads) {
     mem = hwy::AllocateAligned<float>(num_threads * kItemsPerThread);
   }
@@ -209,9 +262,11 @@ struct CfLHeuristics {
                    const DequantMatrices& dequant, size_t thread,
                    ColorCorrelationMap* cmap);
 
-  void ComputeDC(ColorCorrelationMap* cmap);
-
-  ImageF dc_values;
+  // Per-block DC values of the whole image, the ones of `opsin` start at
+  // `dc_offset`, with `dc_stride` values per block row.
+  ImageF* dc_values;
+  size_t dc_offset;
+  size_t dc_stride;
   hwy::AlignedFreeUniquePtr<float[]> mem;
 
   // Working set is too large for stack; allocate dynamically.
@@ -221,38 +276,34 @@ struct CfLHeuristics {
       + AcStrategy::kMaxCoeffArea * 2;     // Scratch space
 };
 
-void CfLHeuristics::Init(const Image3F& opsin) {
-  size_t xsize_blocks = opsin.xsize() / kBlockDim;
-  size_t ysize_blocks = opsin.ysize() / kBlockDim;
-  HWY_DYNAMIC_DISPATCH(InitDCStorage)
-  (xsize_blocks * ysize_blocks, &dc_values);
-}
-
 void CfLHeuristics::ComputeTile(const Rect& r, const Image3F& opsin,
                                 const DequantMatrices& dequant, size_t thread,
                                 ColorCorrelationMap* cmap) {
   HWY_DYNAMIC_DISPATCH(ComputeTile)
-  (opsin, dequant, r, &cmap->ytox_map, &cmap->ytob_map, &dc_values,
-   mem.get() + thread * kItemsPerThread);
+  (opsin, dequant, r, &cmap->ytox_map, &cmap->ytob_map, dc_offset, dc_stride,
+   dc_values, mem.get() + thread * kItemsPerThread);
 }
 
-void CfLHeuristics::ComputeDC(ColorCorrelationMap* cmap) {
-  int32_t ytob_dc = 0;
-  int32_t ytox_dc = 0;
-  HWY_DYNAMIC_DISPATCH(ComputeDC)(dc_values, &ytox_dc, &ytob_dc);
-  cmap->SetYToBDC(ytob_dc);
-  cmap->SetYToXDC(ytox_dc);
+void InitColorCorrelationDCValues(size_t num_blocks, ImageF* dc_values) {
+  HWY_DYNAMIC_DISPATCH(InitDCStorage)(num_blocks, dc_values);
 }
 
-Status ComputeColorCorrelationMap(const Image3F& opsin,
-                                  const DequantMatrices& dequant,
-                                  ThreadPool* pool, ColorCorrelationMap* cmap) {
+Status ComputeColorCorrelationTiles(const Image3F& opsin,
+                                    const DequantMatrices& dequant,
+                                    size_t dc_offset, size_t dc_stride,
+                                    ThreadPool* pool, ColorCorrelationMap* cmap,
+                                    ImageF* dc_values) {
   size_t xsize_blocks = DivCeil(opsin.xsize(), kBlockDim);
   size_t ysize_blocks = DivCeil(opsin.ysize(), kBlockDim);
   size_t xsize_tiles = DivCeil(xsize_blocks, kColorTileDimInBlocks);
   size_t ysize_tiles = DivCeil(ysize_blocks, kColorTileDimInBlocks);
+  JXL_ASSERT(xsize_blocks <= dc_stride);
+  JXL_ASSERT(dc_offset + (ysize_blocks - 1) * dc_stride + xsize_blocks <=
+             dc_values->xsize());
   CfLHeuristics cfl_heuristics;
-  cfl_heuristics.Init(opsin);
+  cfl_heuristics.dc_values = dc_values;
+  cfl_heuristics.dc_offset = dc_offset;
+  cfl_heuristics.dc_stride = dc_stride;
   auto process_tile_cfl = [&](const uint32_t tid, const size_t thread) {
     size_t tx = tid % xsize_tiles;
     size_t ty = tid / xsize_tiles;
@@ -263,16 +314,37 @@ Status ComputeColorCorrelationMap(const Image3F& opsin,
     Rect r(bx0, by0, bx1 - bx0, by1 - by0);
     cfl_heuristics.ComputeTile(r, opsin, dequant, thread, cmap);
   };
-  JXL_RETURN_IF_ERROR(RunOnPool(
+  return RunOnPool(
       pool, 0, xsize_tiles * ysize_tiles,
       [&](const size_t num_threads) {
         cfl_heuristics.PrepareForThreads(num_threads);
         return true;
       },
-      process_tile_cfl, "Cfl Heuristics"));
-  cfl_heuristics.ComputeDC(cmap);
+      process_tile_cfl, "Cfl Heuristics");
+}
+
+Status ComputeColorCorrelationDC(const ImageF& dc_values, ThreadPool* pool,
+                                 ColorCorrelationMap* cmap) {
+  int32_t ytob_dc = 0;
+  int32_t ytox_dc = 0;
+  JXL_RETURN_IF_ERROR(
+      HWY_DYNAMIC_DISPATCH(ComputeDC)(dc_values, pool, &ytox_dc, &ytob_dc));
+  cmap->SetYToBDC(ytob_dc);
+  cmap->SetYToXDC(ytox_dc);
   return true;
 }
 
+Status ComputeColorCorrelationMap(const Image3F& opsin,
+                                  const DequantMatrices& dequant,
+                                  ThreadPool* pool, ColorCorrelationMap* cmap) {
+  ImageF dc_values;
+  InitColorCorrelationDCValues(
+      (opsin.xsize() / kBlockDim) * (opsin.ysize() / kBlockDim), &dc_values);
+  JXL_RETURN_IF_ERROR(
+      ComputeColorCorrelationTiles(opsin, dequant, 0, opsin.xsize() / kBlockDim,
+                                   pool, cmap, &dc_values));
+  return ComputeColorCorrelationDC(dc_values, pool, cmap);
+}
+
 }  // namespace jxl
 #endif  // HWY_ONCE
@@ -21,6 +21,28 @@ namespace jxl {
 Status ComputeColorCorrelationMap(const Image3F& opsin,
                                   const DequantMatrices& dequant,
                                   ThreadPool* pool, ColorCorrelationMap* cmap);
+
+// The functions below split ComputeColorCorrelationMap() into a per-tile and a
+// DC part, for images that are processed in bands or groups: the per-tile
+// factors only depend on the pixels of the band or group, but the DC factors
+// need the per-block DC values of the whole image.
+
+// Allocates storage for the DC values of `num_blocks` blocks.
+void InitColorCorrelationDCValues(size_t num_blocks, ImageF* dc_values);
+
+// Computes the per-tile factors of `opsin` and stores its per-block DC values
+// in `dc_values`, starting at block index `dc_offset` in raster order of an
+// image that is `dc_stride` blocks wide.
+Status ComputeColorCorrelationTiles(const Image3F& opsin,
+                                    const DequantMatrices& dequant,
+                                    size_t dc_offset, size_t dc_stride,
+                                    ThreadPool* pool, ColorCorrelationMap* cmap,
+                                    ImageF* dc_values);
+
+// Computes the DC factors from the DC values of all blocks.
+Status ComputeColorCorrelationDC(const ImageF& dc_values, ThreadPool* pool,
+                                 ColorCorrelationMap* cmap);
+
 }  // namespace jxl
 
 #endif  // ENCODER_ENC_CHROMA_FROM_LUMA_H_
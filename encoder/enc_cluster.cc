@@ -20,6 +20,8 @@
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
+#include "encoder/base/data_parallel.h"
+#include "encoder/base/status.h"
 #include "encoder/fast_math-inl.h"
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
@@ -81,39 +83,71 @@ float HistogramDistance(const Histogram& a, const Histogram& b) {
   return total_distance - a.entropy_ - b.entropy_;
 }
 
+// Number of histograms whose distances to the clusters are computed by one
+// task. The distances of a histogram cost about as much as its entropy, so
+// smaller tasks would mostly measure the dispatch.
+constexpr size_t kHistogramsPerTask = 64;
+
 // First step of a k-means clustering with a fancy distance metric.
-void FastClusterHistograms(const std::vector<Histogram>& in,
-                           size_t max_histograms, std::vector<Histogram>* out,
-                           std::vector<uint32_t>* histogram_symbols) {
+Status FastClusterHistograms(const std::vector<Histogram>& in,
+                             size_t max_histograms, ThreadPool* pool,
+                             std::vector<Histogram>* out,
+                             std::vector<uint32_t>* histogram_symbols) {
   out->clear();
   out->reserve(max_histograms);
   histogram_symbols->clear();
   histogram_symbols->resize(in.size(), max_histograms);
 
   std::vector<float> dists(in.size(), std::numeric_limits<float>::max());
+  const size_t num_tasks = DivCeil(in.size(), kHistogramsPerTask);
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, num_tasks, ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /*thread*/) {
+        const size_t begin = task * kHistogramsPerTask;
+        const size_t end = std::min(begin + kHistogramsPerTask, in.size());
+        for (size_t i = begin; i < end; i++) {
+          if (in[i].total_count_ == 0) {
+            (*histogram_symbols)[i] = 0;
+            dists[i] = 0.0f;
+            continue;
+          }
+          HistogramEntropy(in[i]);
+        }
+      },
+      "HistogramEntropy"));
   size_t largest_idx = 0;
   for (size_t i = 0; i < in.size(); i++) {
-    if (in[i].total_count_ == 0) {
-      (*histogram_symbols)[i] = 0;
-      dists[i] = 0.0f;
-      continue;
-    }
-    HistogramEntropy(in[i]);
     if (in[i].total_count_ > in[largest_idx].total_count_) {
       largest_idx = i;
     }
   }
 
+  // Index of the first of the largest distances of every task.
+  std::vector<size_t> task_largest(num_tasks);
   constexpr float kMinDistanceForDistinct = 64.0f;
   while (out->size() < max_histograms) {
     (*histogram_symbols)[largest_idx] = out->size();
     out->push_back(in[largest_idx]);
     dists[largest_idx] = 0.0f;
+    JXL_RETURN_IF_ERROR(RunOnPool(
+        pool, 0, num_tasks, ThreadPool::NoInit,
+        [&](const uint32_t task, size_t /*thread*/) {
+          const size_t begin = task * kHistogramsPerTask;
+          const size_t end = std::min(begin + kHistogramsPerTask, in.size());
+          size_t largest = begin;
+          for (size_t i = begin; i < end; i++) {
+            if (dists[i] == 0.0f) continue;
+            dists[i] =
+                std::min(HistogramDistance(in[i], out->back()), dists[i]);
+            if (dists[i] > dists[largest]) largest = i;
+          }
+          task_largest[task] = largest;
+        },
+        "HistogramDistances"));
+    // Same as a serial search for the first of the largest distances.
     largest_idx = 0;
-    for (size_t i = 0; i < in.size(); i++) {
-      if (dists[i] == 0.0f) continue;
-      dists[i] = std::min(HistogramDistance(in[i], out->back()), dists[i]);
-      if (dists[i] > dists[largest_idx]) largest_idx = i;
+    for (size_t largest : task_largest) {
+      if (dists[largest] > dists[largest_idx]) largest_idx = largest;
     }
     if (dists[largest_idx] < kMinDistanceForDistinct) break;
   }
@@ -133,6 +167,90 @@ void FastClusterHistograms(const std::vector<Histogram>& in,
     HistogramEntropy((*out)[best]);
     (*histogram_symbols)[i] = best;
   }
+  return true;
+}
+
+// Second step of a k-means clustering: moves every histogram to the closest
+// cluster and recomputes the clusters, up to `num_iterations` times.
+Status RefineClusters(const std::vector<Histogram>& in, size_t num_iterations,
+                      ThreadPool* pool, std::vector<Histogram>* out,
+                      std::vector<uint32_t>* histogram_symbols) {
+  const size_t num_tasks = DivCeil(in.size(), kHistogramsPerTask);
+  std::vector<char> task_changed(num_tasks);
+  for (size_t iter = 0; iter < num_iterations; ++iter) {
+    for (const Histogram& h : *out) HistogramEntropy(h);
+    // The clusters do not change while the closest one of every histogram is
+    // searched.
+    JXL_RETURN_IF_ERROR(RunOnPool(
+        pool, 0, num_tasks, ThreadPool::NoInit,
+        [&](const uint32_t task, size_t /*thread*/) {
+          const size_t begin = task * kHistogramsPerTask;
+          const size_t end = std::min(begin + kHistogramsPerTask, in.size());
+          bool changed = false;
+          for (size_t i = begin; i < end; i++) {
+            if (in[i].total_count_ == 0) continue;
+            uint32_t best = (*histogram_symbols)[i];
+            float best_dist = HistogramDistance(in[i], (*out)[best]);
+            for (size_t j = 0; j < out->size(); j++) {
+              if ((*out)[j].total_count_ == 0) continue;
+              float dist = HistogramDistance(in[i], (*out)[j]);
+              if (dist < best_dist) {
+                best = j;
+                best_dist = dist;
+              }
+            }
+            changed |= best != (*histogram_symbols)[i];
+            (*histogram_symbols)[i] = best;
+          }
+          task_changed[task] = changed;
+        },
+        "RefineClusters"));
+    if (std::find(task_changed.begin(), task_changed.end(), true) ==
+        task_changed.end()) {
+      break;
+    }
+    for (Histogram& h : *out) h.Clear();
+    for (size_t i = 0; i < in.size(); i++) {
+      (*out)[(*histogram_symbols)[i]].AddHistogram(in[i]);
+    }
+  }
+  // Contexts without tokens must not keep an empty cluster in use.
+  size_t used = 0;
+  while (used + 1 < out->size() && (*out)[used].total_count_ == 0) ++used;
+  for (size_t i = 0; i < in.size(); i++) {
+    if ((*out)[(*histogram_symbols)[i]].total_count_ == 0) {
+      (*histogram_symbols)[i] = used;
+    }
+  }
+  return true;
+}
+
+float EstimateTokenBits(const std::vector<Histogram>& histograms,
+                        ThreadPool* pool) {
+  const size_t num_tasks = DivCeil(histograms.size(), kHistogramsPerTask);
+  std::vector<double> task_bits(num_tasks);
+  JXL_CHECK(RunOnPool(
+      pool, 0, num_tasks, ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /*thread*/) {
+        const size_t begin = task * kHistogramsPerTask;
+        const size_t end =
+            std::min(begin + kHistogramsPerTask, histograms.size());
+        double bits = 0.0;
+        for (size_t i = begin; i < end; i++) {
+          const Histogram& h = histograms[i];
+          if (h.total_count_ == 0) continue;
+          HistogramEntropy(h);
+          bits += h.entropy_;
+          // Tokens from 16 on are followed by (token >> 2) - 2 raw bits, see
+          // UintCoder.
+          for (size_t token = 16; token < h.data_.size(); ++token) {
+            bits += static_cast<double>(h.data_[token]) * ((token >> 2) - 2);
+          }
+        }
+        task_bits[task] = bits;
+      },
+      "EstimateTokenBits"));
+  return std::accumulate(task_bits.begin(), task_bits.end(), 0.0);
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -143,6 +261,8 @@ HWY_AFTER_NAMESPACE();
 #if HWY_ONCE
 namespace jxl {
 HWY_EXPORT(FastClusterHistograms);  // Local function
+HWY_EXPORT(RefineClusters);         // Local function
+HWY_EXPORT(EstimateTokenBits);
 
 namespace {
 // -----------------------------------------------------------------------------
@@ -172,19 +292,56 @@ void HistogramReindex(const std::vector<uint32_t>& symbols,
 
 }  // namespace
 
-void ClusterHistograms(std::vector<Histogram>* histograms,
-                       std::vector<uint8_t>* context_map) {
-  if (histograms->size() <= 1) return;
+Status ClusterHistograms(std::vector<Histogram>* histograms,
+                         std::vector<uint8_t>* context_map, bool refine,
+                         ThreadPool* pool) {
+  if (histograms->size() <= 1) return true;
   static const size_t kClustersLimit = 128;
   size_t max_histograms = std::min(kClustersLimit, histograms->size());
 
   std::vector<Histogram> in(*histograms);
   std::vector<uint32_t> histogram_symbols;
-  HWY_DYNAMIC_DISPATCH(FastClusterHistograms)
-  (in, max_histograms, histograms, &histogram_symbols);
+  JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(FastClusterHistograms)(
+      in, max_histograms, pool, histograms, &histogram_symbols));
+  if (refine) {
+    static const size_t kRefineIterations = 4;
+    JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(RefineClusters)(
+        in, kRefineIterations, pool, histograms, &histogram_symbols));
+  }
 
   // Convert the context map to a canonical form.
   HistogramReindex(histogram_symbols, histograms, context_map);
+  return true;
+}
+
+void ClusterHistograms(const std::vector<uint8_t>& fixed_context_map,
+                       std::vector<Histogram>* histograms,
+                       std::vector<uint8_t>* context_map) {
+  JXL_ASSERT(fixed_context_map.size() == histograms->size());
+  if (histograms->size() <= 1) return;
+  const size_t num_clusters =
+      *std::max_element(fixed_context_map.begin(), fixed_context_map.end()) +
+      1;
+  std::vector<Histogram> clusters(num_clusters);
+  for (size_t i = 0; i < histograms->size(); ++i) {
+    clusters[fixed_context_map[i]].AddHistogram((*histograms)[i]);
+  }
+  // Contexts without tokens are moved to a used cluster, so that no empty
+  // histograms are written.
+  uint32_t used = 0;
+  while (used + 1 < num_clusters && clusters[used].total_count_ == 0) ++used;
+  std::vector<uint32_t> histogram_symbols(fixed_context_map.begin(),
+                                          fixed_context_map.end());
+  for (uint32_t& symbol : histogram_symbols) {
+    if (clusters[symbol].total_count_ == 0) symbol = used;
+  }
+  *histograms = std::move(clusters);
+  HistogramReindex(histogram_symbols, histograms, context_map);
+}
+
+float EstimateTokenBits(const std::vector<Histogram>& histograms,
+                        ThreadPool* pool) {
+  return HWY_DYNAMIC_DISPATCH(EstimateTokenBits)(histograms, pool);
 }
 
 }  // namespace jxl
@@ -14,12 +14,36 @@
 
 #include <vector>
 
+#include "encoder/base/data_parallel.h"
+#include "encoder/base/status.h"
 #include "encoder/histogram.h"
 
 namespace jxl {
 
-void ClusterHistograms(std::vector<Histogram>* histograms,
+// Replaces `histograms` by at most 128 clusters of similar ones and stores the
+// cluster of every context in `context_map`. If `refine` is true, the
+// assignment of the contexts to clusters is improved with a few more
+// iterations, which is slower. The distances between the histograms and the
+// clusters are computed on `pool`; the result does not depend on the number
+// of threads.
+Status ClusterHistograms(std::vector<Histogram>* histograms,
+                         std::vector<uint8_t>* context_map, bool refine = false,
+                         ThreadPool* pool = nullptr);
+
+// Same as above, but with the clusters given by `fixed_context_map`, which has
+// one entry per histogram, instead of searching for them.
+void ClusterHistograms(const std::vector<uint8_t>& fixed_context_map,
+                       std::vector<Histogram>* histograms,
                        std::vector<uint8_t>* context_map);
+
+// Returns an estimate of the number of bits of the tokens counted in
+// `histograms` if every context was coded with its own ideal entropy code,
+// including the raw bits of the tokens but not the cost of the histograms.
+// The clustered histograms of the frame code the tokens with a few percent
+// more bits, but the estimate is much quicker to compute.
+float EstimateTokenBits(const std::vector<Histogram>& histograms,
+                        ThreadPool* pool = nullptr);
+
 }  // namespace jxl
 
 #endif  // ENCODER_ENC_CLUSTER_H_
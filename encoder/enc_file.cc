@@ -8,18 +8,32 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <numeric>
 #include <vector>
 
 #include "encoder/base/data_parallel.h"
+#include "encoder/base/span.h"
+#include "encoder/base/stats.h"
 #include "encoder/enc_bit_writer.h"
 #include "encoder/enc_frame.h"
 #include "encoder/image.h"
+#include "encoder/quant_weights.h"
 
 namespace jxl {
 
 namespace {
 
+// Images of up to this many groups are encoded on a single thread by
+// Encoder::EncodeBatch(): splitting them across threads costs more in
+// synchronization than it saves, and other images of the batch keep the
+// other threads busy.
+constexpr size_t kMaxSerialBatchGroups = 4;
+
 // Reserved by ISO/IEC 10918-1. LF causes files opened in text mode to be
 // rejected because the marker changes to 0x0D instead. The 0xFF prefix also
 // ensures there were no 7-bit transmission limitations.
@@ -50,58 +64,519 @@ Status WriteSizeHeader(size_t xsize64, size_t ysize64, BitWriter* writer) {
   return true;
 }
 
-}  // namespace
-
-bool EncodeFile(const Image3F& input, float distance,
-                std::vector<uint8_t>* output) {
-  if (distance < 0.0) {
-    return JXL_FAILURE("Invalid butteraugli distance (%f)", distance);
-  } else if (distance == 0.0) {
-    return JXL_FAILURE("Lossless compression is not supported.");
-  } else if (distance <= 0.03) {
+Status CheckDistance(float* distance) {
+  if (*distance < 0.0) {
+    return JXL_FAILURE("Invalid butteraugli distance (%f)", *distance);
+  } else if (*distance == 0.0) {
+    return JXL_FAILURE("Lossless compression needs integer samples.");
+  } else if (*distance <= 0.03) {
     // Distance where the average BPP is still slightly smaller on photographs
     // than for lossless JPEG XL.
-    distance = 0.03;
+    *distance = 0.03;
   }
-  if (input.xsize() == 0 || input.ysize() == 0) {
+  return true;
+}
+
+// Writes the image header of an image with linear sRGB float samples if
+// `srgb_bits_per_sample` is zero, otherwise of one with integer samples of that
+// many bits in the sRGB transfer function. The frames of the image are coded in
+// XYB if `xyb_encoded`, otherwise in the color space of the samples.
+Status WriteImageHeader(size_t xsize, size_t ysize,
+                        size_t srgb_bits_per_sample, bool xyb_encoded,
+                        BitWriter* writer) {
+  if (xsize == 0 || ysize == 0) {
     return JXL_FAILURE("Empty image");
   }
+  BitWriter::Allotment allotment(writer, 1024);
+  writer->Write(8, 0xFF);
+  writer->Write(8, kCodestreamMarker);
+  JXL_RETURN_IF_ERROR(WriteSizeHeader(xsize, ysize, writer));
+  writer->Write(1, 0);  // not all default image metadata
+  writer->Write(1, 0);  // no extra fields in image metadata
+  if (srgb_bits_per_sample == 0) {
+    writer->Write(1, 1);  // floating point samples
+    writer->Write(2, 0);  // 32 bits per sample
+    writer->Write(4, 7);  // 8 exponent bits per sample
+    writer->Write(1, 0);  // modular 16 bit sufficient
+  } else {
+    writer->Write(1, 0);  // integer samples
+    if (srgb_bits_per_sample == 8) {
+      writer->Write(2, 0);  // 8 bits per sample
+    } else {
+      writer->Write(2, 3);  // bits per sample selector (1 .. 64)
+      writer->Write(6, srgb_bits_per_sample - 1);
+    }
+    // modular 16 bit sufficient
+    writer->Write(1, srgb_bits_per_sample <= 12 ? 1 : 0);
+  }
+  writer->Write(2, 0);  // no extra channels
+  writer->Write(1, xyb_encoded);
+  if (srgb_bits_per_sample == 0) {
+    writer->Write(1, 0);  // not all default color encoding
+    writer->Write(1, 0);  // no icc
+    writer->Write(2, 0);  // RGB color space
+    writer->Write(2, 1);  // D65 white point
+    writer->Write(2, 1);  // SRGB primaries
+    writer->Write(1, 0);  // no gamma
+    writer->Write(2, 2);  // transfer function selector bits (2 .. 17)
+    writer->Write(4, 6);  // linear transfer function (enum value 8)
+    writer->Write(2, 1);  // relative rendering intent
+  } else {
+    writer->Write(1, 1);  // all default color encoding (sRGB)
+  }
+  writer->Write(2, 0);  // no extensions
+  writer->Write(1, 1);  // all default transform data
+  writer->ZeroPadToByte();
+  allotment.Reclaim(writer);
+  return true;
+}
+
+// The encoded image in the order of the output: the headers and the TOC
+// followed by the sections of the frame.
+struct EncodedImage {
+  BitWriter header;
+  std::vector<BitWriter> sections;
+};
+
+// The sections are copied to their offsets in `output` by separate tasks of
+// `pool`.
+bool WriteOutput(const EncodedImage& image, ThreadPool* pool,
+                 std::vector<uint8_t>* output) {
+  const size_t num_sections = image.sections.size();
+  std::vector<size_t> offsets(num_sections + 1);
+  offsets[0] = image.header.BitsWritten() / kBitsPerByte;
+  for (size_t i = 0; i < num_sections; ++i) {
+    offsets[i + 1] =
+        offsets[i] + image.sections[i].BitsWritten() / kBitsPerByte;
+  }
+  output->resize(offsets[num_sections]);
+  const Span<const uint8_t> header = image.header.GetSpan();
+  if (!header.empty()) memcpy(output->data(), header.data(), header.size());
+  return RunOnPool(
+      pool, 0, num_sections, ThreadPool::NoInit,
+      [&](const uint32_t i, size_t /*thread*/) {
+        const Span<const uint8_t> span = image.sections[i].GetSpan();
+        if (!span.empty()) {
+          memcpy(output->data() + offsets[i], span.data(), span.size());
+        }
+      },
+      "WriteOutput");
+}
+
+bool WriteOutput(const EncodedImage& image, ThreadPool* /*pool*/,
+                 const OutputCallback& output) {
+  const auto write = [&output](const Span<const uint8_t> span) {
+    return span.empty() || output(span.data(), span.size());
+  };
+  if (!write(image.header.GetSpan())) {
+    return JXL_FAILURE("Output callback failed");
+  }
+  for (const BitWriter& section : image.sections) {
+    if (!write(section.GetSpan())) {
+      return JXL_FAILURE("Output callback failed");
+    }
+  }
+  return true;
+}
+
+Status CheckInput(const Image3F& linear, size_t* srgb_bits_per_sample) {
+  *srgb_bits_per_sample = 0;
+  return true;
+}
+
+Status CheckInput(const InterleavedImage& srgb, size_t* srgb_bits_per_sample) {
+  JXL_RETURN_IF_ERROR(srgb.Check());
+  *srgb_bits_per_sample = srgb.bits_per_sample();
+  return true;
+}
+
+template <class Output>
+bool EncodeImageNearLossless(const InterleavedImage& input, uint32_t max_error,
+                             ThreadPool* pool, const Output& output) {
+  ScopedStatsSpan span(pool ? pool->stats() : nullptr, "EncodeImage");
+  JXL_RETURN_IF_ERROR(input.Check());
+  EncodedImage image;
+  JXL_RETURN_IF_ERROR(WriteImageHeader(input.xsize(), input.ysize(),
+                                       input.bits_per_sample(),
+                                       /*xyb_encoded=*/false, &image.header));
+  JXL_RETURN_IF_ERROR(EncodeNearLosslessFrame(max_error, input, pool,
+                                              &image.header, &image.sections));
+  return WriteOutput(image, pool, output);
+}
+
+// Distance zero: the integer samples are coded losslessly, in the
+// near-lossless mode without error.
+template <class Output>
+bool EncodeImageLossless(const InterleavedImage& input, ThreadPool* pool,
+                         const Output& output) {
+  return EncodeImageNearLossless(input, /*max_error=*/0, pool, output);
+}
+
+template <class Output>
+bool EncodeImageLossless(const Image3F& /*input*/, ThreadPool* /*pool*/,
+                         const Output& /*output*/) {
+  return JXL_FAILURE("Lossless compression needs integer samples.");
+}
 
-  BitWriter writer;
-  BitWriter::Allotment allotment(&writer, 1024);
-  writer.Write(8, 0xFF);
-  writer.Write(8, kCodestreamMarker);
-  JXL_RETURN_IF_ERROR(WriteSizeHeader(input.xsize(), input.ysize(), &writer));
-  writer.Write(1, 0);  // not all default image metadata
-  writer.Write(1, 0);  // no extra fields in image metadata
-  writer.Write(1, 1);  // floating point samples
-  writer.Write(2, 0);  // 32 bits per sample
-  writer.Write(4, 7);  // 8 exponent bits per sample
-  writer.Write(1, 0);  // modular 16 bit sufficient
-  writer.Write(2, 0);  // no extra channels
-  writer.Write(1, 1);  // xyb encoded
-  writer.Write(1, 0);  // not all default color encoding
-  writer.Write(1, 0);  // no icc
-  writer.Write(2, 0);  // RGB color space
-  writer.Write(2, 1);  // D65 white point
-  writer.Write(2, 1);  // SRGB primaries
-  writer.Write(1, 0);  // no gamma
-  writer.Write(2, 2);  // transfer function selector bits (2 .. 17)
-  writer.Write(4, 6);  // linear transfer function (enum value 8)
-  writer.Write(2, 1);  // relative rendering intent
-  writer.Write(2, 0);  // no extensions
-  writer.Write(1, 1);  // all default transform data
-  writer.ZeroPadToByte();
-  allotment.Reclaim(&writer);
-
-  ThreadPool pool;
-  JXL_RETURN_IF_ERROR(EncodeFrame(distance, input, &pool, &writer));
-
-  PaddedBytes compressed;
-  compressed = std::move(writer).TakeBytes();
-  output->assign(compressed.data(), compressed.data() + compressed.size());
+template <class Input, class Output>
+bool EncodeImage(const Input& input, float distance, EncoderEffort effort,
+                 FramePipeline pipeline, const DequantMatrices& matrices,
+                 const EntropyPresetCodes* preset, const FrameLayout* layout,
+                 ThreadPool* pool, const Output& output,
+                 FramePreview* preview) {
+  if (distance == 0.0f) return EncodeImageLossless(input, pool, output);
+  ScopedStatsSpan span(pool ? pool->stats() : nullptr, "EncodeImage");
+  JXL_RETURN_IF_ERROR(CheckDistance(&distance));
+  size_t srgb_bits_per_sample;
+  JXL_RETURN_IF_ERROR(CheckInput(input, &srgb_bits_per_sample));
+  EncodedImage image;
+  JXL_RETURN_IF_ERROR(WriteImageHeader(input.xsize(), input.ysize(),
+                                       srgb_bits_per_sample,
+                                       /*xyb_encoded=*/true, &image.header));
+  JXL_RETURN_IF_ERROR(EncodeFrame(distance, effort, input, pipeline, matrices,
+                                  preset, layout, pool, &image.header,
+                                  &image.sections, preview));
+  return WriteOutput(image, pool, output);
+}
 
+template <class Input>
+bool EncodeImageMultiDistance(const Input& input, Span<const float> distances,
+                              EncoderEffort effort,
+                              const DequantMatrices& matrices,
+                              const EntropyPresetCodes* preset,
+                              const FrameLayout* layout, ThreadPool* pool,
+                              std::vector<std::vector<uint8_t>>* outputs,
+                              FramePreview* preview) {
+  ScopedStatsSpan span(pool ? pool->stats() : nullptr, "EncodeImage");
+  size_t srgb_bits_per_sample;
+  JXL_RETURN_IF_ERROR(CheckInput(input, &srgb_bits_per_sample));
+  outputs->resize(distances.size());
+  // Lossless images share nothing with the others, they are encoded first.
+  std::vector<float> lossy_distances;
+  std::vector<size_t> lossy_outputs;
+  for (size_t i = 0; i < distances.size(); ++i) {
+    float distance = distances[i];
+    if (distance == 0.0f) {
+      JXL_RETURN_IF_ERROR(EncodeImageLossless(input, pool, &(*outputs)[i]));
+      continue;
+    }
+    JXL_RETURN_IF_ERROR(CheckDistance(&distance));
+    lossy_distances.push_back(distance);
+    lossy_outputs.push_back(i);
+  }
+  if (lossy_distances.empty()) return true;
+  std::vector<EncodedImage> images(lossy_distances.size());
+  std::vector<BitWriter*> writers;
+  std::vector<std::vector<BitWriter>*> sections;
+  for (EncodedImage& image : images) {
+    JXL_RETURN_IF_ERROR(WriteImageHeader(input.xsize(), input.ysize(),
+                                         srgb_bits_per_sample,
+                                         /*xyb_encoded=*/true, &image.header));
+    writers.push_back(&image.header);
+    sections.push_back(&image.sections);
+  }
+  JXL_RETURN_IF_ERROR(EncodeFrames(
+      Span<const float>(lossy_distances.data(), lossy_distances.size()),
+      effort, input, matrices, preset, layout, pool, writers, sections,
+      preview));
+  for (size_t i = 0; i < images.size(); ++i) {
+    JXL_RETURN_IF_ERROR(
+        WriteOutput(images[i], pool, &(*outputs)[lossy_outputs[i]]));
+  }
   return true;
 }
 
+template <class Input, class Output>
+bool EncodeImageTargetSize(const Input& input, size_t target_size,
+                           EncoderEffort effort,
+                           const DequantMatrices& matrices,
+                           const EntropyPresetCodes* preset,
+                           const FrameLayout* layout, ThreadPool* pool,
+                           const Output& output, float* distance,
+                           FramePreview* preview) {
+  ScopedStatsSpan span(pool ? pool->stats() : nullptr, "EncodeImage");
+  size_t srgb_bits_per_sample;
+  JXL_RETURN_IF_ERROR(CheckInput(input, &srgb_bits_per_sample));
+  EncodedImage image;
+  JXL_RETURN_IF_ERROR(WriteImageHeader(input.xsize(), input.ysize(),
+                                       srgb_bits_per_sample,
+                                       /*xyb_encoded=*/true, &image.header));
+  JXL_RETURN_IF_ERROR(EncodeFrameTargetSize(target_size, effort, input,
+                                            matrices, preset, layout, pool,
+                                            &image.header, &image.sections,
+                                            distance, preview));
+  return WriteOutput(image, pool, output);
+}
+
+template <class Output>
+bool EncodeImageStreaming(size_t xsize, size_t ysize,
+                          const ImageRowsCallback& get_rows, float distance,
+                          EncoderEffort effort,
+                          const DequantMatrices& matrices,
+                          const EntropyPresetCodes* preset,
+                          const FrameLayout* layout, ThreadPool* pool,
+                          const Output& output, FramePreview* preview) {
+  ScopedStatsSpan span(pool ? pool->stats() : nullptr, "EncodeImage");
+  JXL_RETURN_IF_ERROR(CheckDistance(&distance));
+  EncodedImage image;
+  JXL_RETURN_IF_ERROR(
+      WriteImageHeader(xsize, ysize, 0, /*xyb_encoded=*/true, &image.header));
+  JXL_RETURN_IF_ERROR(EncodeFrame(distance, effort, xsize, ysize, get_rows,
+                                  matrices, preset, layout, pool, &image.header,
+                                  &image.sections, preview));
+  return WriteOutput(image, pool, output);
+}
+
+// The quantization tables of the free functions, built on the first call and
+// shared by all of them. Encoder keeps its own.
+const DequantMatrices& SharedDequantMatrices() {
+  static const DequantMatrices* matrices = new DequantMatrices();
+  return *matrices;
+}
+
+}  // namespace
+
+bool EncodeFile(const Image3F& input, float distance,
+                std::vector<uint8_t>* output) {
+  Encoder encoder;
+  return encoder.Encode(input, distance, output);
+}
+
+bool EncodeFile(const Image3F& input, float distance, ThreadPool* pool,
+                std::vector<uint8_t>* output, EncoderEffort effort) {
+  const DequantMatrices& matrices = SharedDequantMatrices();
+  return EncodeImage(input, distance, effort, FramePipeline::kFused, matrices,
+                     /*preset=*/nullptr, /*layout=*/nullptr, pool, output,
+                     /*preview=*/nullptr);
+}
+
+bool EncodeFile(const Image3F& input, float distance, ThreadPool* pool,
+                const OutputCallback& output, EncoderEffort effort) {
+  const DequantMatrices& matrices = SharedDequantMatrices();
+  return EncodeImage(input, distance, effort, FramePipeline::kFused, matrices,
+                     /*preset=*/nullptr, /*layout=*/nullptr, pool, output,
+                     /*preview=*/nullptr);
+}
+
+bool EncodeFile(const InterleavedImage& input, float distance,
+                ThreadPool* pool, std::vector<uint8_t>* output,
+                EncoderEffort effort) {
+  const DequantMatrices& matrices = SharedDequantMatrices();
+  return EncodeImage(input, distance, effort, FramePipeline::kFused, matrices,
+                     /*preset=*/nullptr, /*layout=*/nullptr, pool, output,
+                     /*preview=*/nullptr);
+}
+
+bool EncodeFile(const InterleavedImage& input, float distance,
+                ThreadPool* pool, const OutputCallback& output,
+                EncoderEffort effort) {
+  const DequantMatrices& matrices = SharedDequantMatrices();
+  return EncodeImage(input, distance, effort, FramePipeline::kFused, matrices,
+                     /*preset=*/nullptr, /*layout=*/nullptr, pool, output,
+                     /*preview=*/nullptr);
+}
+
+bool EncodeFileMultiDistance(const Image3F& input,
+                             Span<const float> distances, ThreadPool* pool,
+                             std::vector<std::vector<uint8_t>>* outputs,
+                             EncoderEffort effort) {
+  const DequantMatrices& matrices = SharedDequantMatrices();
+  return EncodeImageMultiDistance(input, distances, effort, matrices,
+                                  /*preset=*/nullptr, /*layout=*/nullptr,
+                                  pool, outputs, /*preview=*/nullptr);
+}
+
+bool EncodeFileMultiDistance(const InterleavedImage& input,
+                             Span<const float> distances, ThreadPool* pool,
+                             std::vector<std::vector<uint8_t>>* outputs,
+                             EncoderEffort effort) {
+  const DequantMatrices& matrices = SharedDequantMatrices();
+  return EncodeImageMultiDistance(input, distances, effort, matrices,
+                                  /*preset=*/nullptr, /*layout=*/nullptr,
+                                  pool, outputs, /*preview=*/nullptr);
+}
+
+bool EncodeFileTargetSize(const Image3F& input, size_t target_size,
+                          ThreadPool* pool, std::vector<uint8_t>* output,
+                          EncoderEffort effort, float* distance) {
+  const DequantMatrices& matrices = SharedDequantMatrices();
+  return EncodeImageTargetSize(input, target_size, effort, matrices,
+                               /*preset=*/nullptr, /*layout=*/nullptr, pool,
+                               output, distance, /*preview=*/nullptr);
+}
+
+bool EncodeFileTargetSize(const InterleavedImage& input, size_t target_size,
+                          ThreadPool* pool, std::vector<uint8_t>* output,
+                          EncoderEffort effort, float* distance) {
+  const DequantMatrices& matrices = SharedDequantMatrices();
+  return EncodeImageTargetSize(input, target_size, effort, matrices,
+                               /*preset=*/nullptr, /*layout=*/nullptr, pool,
+                               output, distance, /*preview=*/nullptr);
+}
+
+bool EncodeFileStreaming(size_t xsize, size_t ysize,
+                         const ImageRowsCallback& get_rows, float distance,
+                         ThreadPool* pool, std::vector<uint8_t>* output,
+                         EncoderEffort effort) {
+  const DequantMatrices& matrices = SharedDequantMatrices();
+  return EncodeImageStreaming(xsize, ysize, get_rows, distance, effort,
+                              matrices, /*preset=*/nullptr,
+                              /*layout=*/nullptr, pool, output,
+                              /*preview=*/nullptr);
+}
+
+bool EncodeFileStreaming(size_t xsize, size_t ysize,
+                         const ImageRowsCallback& get_rows, float distance,
+                         ThreadPool* pool, const OutputCallback& output,
+                         EncoderEffort effort) {
+  const DequantMatrices& matrices = SharedDequantMatrices();
+  return EncodeImageStreaming(xsize, ysize, get_rows, distance, effort,
+                              matrices, /*preset=*/nullptr,
+                              /*layout=*/nullptr, pool, output,
+                              /*preview=*/nullptr);
+}
+
+bool EncodeFileNearLossless(const InterleavedImage& input, uint32_t max_error,
+                            ThreadPool* pool, std::vector<uint8_t>* output) {
+  return EncodeImageNearLossless(input, max_error, pool, output);
+}
+
+bool EncodeFileNearLossless(const InterleavedImage& input, uint32_t max_error,
+                            ThreadPool* pool, const OutputCallback& output) {
+  return EncodeImageNearLossless(input, max_error, pool, output);
+}
+
+Encoder::Encoder(int num_worker_threads) : pool_(num_worker_threads) {}
+
+void Encoder::SetEntropyPreset(const EntropyPreset* preset) {
+  preset_.reset(preset ? new EntropyPresetCodes(*preset) : nullptr);
+}
+
+bool Encoder::Encode(const Image3F& input, float distance,
+                     std::vector<uint8_t>* output) {
+  return EncodeImage(input, distance, effort_, pipeline_, matrices_,
+                     preset_.get(), &layout_, &pool_, output, preview_);
+}
+
+bool Encoder::Encode(const Image3F& input, float distance,
+                     const OutputCallback& output) {
+  return EncodeImage(input, distance, effort_, pipeline_, matrices_,
+                     preset_.get(), &layout_, &pool_, output, preview_);
+}
+
+bool Encoder::Encode(const InterleavedImage& input, float distance,
+                     std::vector<uint8_t>* output) {
+  return EncodeImage(input, distance, effort_, pipeline_, matrices_,
+                     preset_.get(), &layout_, &pool_, output, preview_);
+}
+
+bool Encoder::Encode(const InterleavedImage& input, float distance,
+                     const OutputCallback& output) {
+  return EncodeImage(input, distance, effort_, pipeline_, matrices_,
+                     preset_.get(), &layout_, &pool_, output, preview_);
+}
+
+bool Encoder::EncodeMultiDistance(const Image3F& input,
+                                  Span<const float> distances,
+                                  std::vector<std::vector<uint8_t>>* outputs) {
+  return EncodeImageMultiDistance(input, distances, effort_, matrices_,
+                                  preset_.get(), &layout_, &pool_, outputs,
+                                  preview_);
+}
+
+bool Encoder::EncodeMultiDistance(const InterleavedImage& input,
+                                  Span<const float> distances,
+                                  std::vector<std::vector<uint8_t>>* outputs) {
+  return EncodeImageMultiDistance(input, distances, effort_, matrices_,
+                                  preset_.get(), &layout_, &pool_, outputs,
+                                  preview_);
+}
+
+bool Encoder::EncodeTargetSize(const Image3F& input, size_t target_size,
+                               std::vector<uint8_t>* output, float* distance) {
+  return EncodeImageTargetSize(input, target_size, effort_, matrices_,
+                               preset_.get(), &layout_, &pool_, output,
+                               distance, preview_);
+}
+
+bool Encoder::EncodeTargetSize(const InterleavedImage& input,
+                               size_t target_size,
+                               std::vector<uint8_t>* output, float* distance) {
+  return EncodeImageTargetSize(input, target_size, effort_, matrices_,
+                               preset_.get(), &layout_, &pool_, output,
+                               distance, preview_);
+}
+
+bool Encoder::EncodeBatch(Span<const Image3F> inputs, float distance,
+                          std::vector<std::vector<uint8_t>>* outputs) {
+  outputs->resize(inputs.size());
+  const auto num_groups = [&inputs](const uint32_t i) {
+    return DivCeil(inputs[i].xsize(), kGroupDim) *
+           DivCeil(inputs[i].ysize(), kGroupDim);
+  };
+  // The largest images first, so that the small ones at the end of the batch
+  // keep the threads busy while the last large ones are finished.
+  std::vector<uint32_t> order(inputs.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&num_groups](const uint32_t a, const uint32_t b) {
+                     return num_groups(a) > num_groups(b);
+                   });
+  // Every thread encodes its small images with a pool without worker threads,
+  // which reports to the same stats as pool_.
+  std::vector<std::unique_ptr<ThreadPool>> serial_pools;
+  const auto init = [&serial_pools](const size_t num_threads) {
+    serial_pools.resize(num_threads);
+    return true;
+  };
+  std::atomic<bool> ok{true};
+  const auto encode = [&](const uint32_t task, const size_t thread) {
+    const uint32_t i = order[task];
+    ThreadPool* pool = &pool_;
+    if (num_groups(i) <= kMaxSerialBatchGroups) {
+      if (serial_pools[thread] == nullptr) {
+        serial_pools[thread].reset(new ThreadPool(0));
+        serial_pools[thread]->SetStats(pool_.stats());
+      }
+      pool = serial_pools[thread].get();
+    }
+    if (!EncodeImage(inputs[i], distance, effort_, pipeline_, matrices_,
+                     preset_.get(), &layout_, pool, &(*outputs)[i],
+                     /*preview=*/nullptr)) {
+      ok = false;
+    }
+  };
+  JXL_RETURN_IF_ERROR(
+      RunOnPool(&pool_, 0, inputs.size(), init, encode, "EncodeBatch"));
+  return ok.load();
+}
+
+bool Encoder::EncodeStreaming(size_t xsize, size_t ysize,
+                              const ImageRowsCallback& get_rows,
+                              float distance, std::vector<uint8_t>* output) {
+  return EncodeImageStreaming(xsize, ysize, get_rows, distance, effort_,
+                              matrices_, preset_.get(), &layout_, &pool_,
+                              output, preview_);
+}
+
+bool Encoder::EncodeStreaming(size_t xsize, size_t ysize,
+                              const ImageRowsCallback& get_rows,
+                              float distance, const OutputCallback& output) {
+  return EncodeImageStreaming(xsize, ysize, get_rows, distance, effort_,
+                              matrices_, preset_.get(), &layout_, &pool_,
+                              output, preview_);
+}
+
+bool Encoder::EncodeNearLossless(const InterleavedImage& input,
+                                 uint32_t max_error,
+                                 std::vector<uint8_t>* output) {
+  return EncodeImageNearLossless(input, max_error, &pool_, output);
+}
+
+bool Encoder::EncodeNearLossless(const InterleavedImage& input,
+                                 uint32_t max_error,
+                                 const OutputCallback& output) {
+  return EncodeImageNearLossless(input, max_error, &pool_, output);
+}
+
 }  // namespace jxl
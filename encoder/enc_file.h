@@ -7,19 +7,232 @@
 #ifndef ENCODER_ENC_FILE_H_
 #define ENCODER_ENC_FILE_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <functional>
+#include <memory>
+#include <thread>  //NOLINT
 #include <vector>
 
+#include "encoder/base/data_parallel.h"
+#include "encoder/base/span.h"
+#include "encoder/base/stats.h"
+#include "encoder/enc_frame.h"
+#include "encoder/entropy_preset.h"
 #include "encoder/image.h"
+#include "encoder/quant_weights.h"
 
 namespace jxl {
 
+// Receives the encoded image: called with consecutive chunks of the output
+// in order, each of which is only valid during the call. The encoder hands
+// out its internal buffers, so nothing is copied on the way. Returns false on
+// error, which stops the output and makes the encoding fail.
+typedef std::function<bool(const uint8_t* data, size_t size)> OutputCallback;
+
 // Input is in linear sRGB colorspace, individual sample values can be outside
 // the [0.0, 1.0] range for out-of-gammut colors.
 bool EncodeFile(const Image3F& input, float distance,
                 std::vector<uint8_t>* output);
 
+// Same as above, but runs on the given thread pool instead of starting a new
+// one for this call. `pool` may be null, in which case all work is done on the
+// calling thread. If the pool has an EncodeStats attached, the timings and
+// section sizes of the call are added to it. See EncoderEffort for the
+// speed/size trade-off of `effort`. The quantization tables are built by the
+// first call of any of the functions below that take a pool, and shared by
+// all later ones.
+bool EncodeFile(const Image3F& input, float distance, ThreadPool* pool,
+                std::vector<uint8_t>* output,
+                EncoderEffort effort = EncoderEffort::kDefault);
+
+// Same as above, but passes the output to `output` instead of a vector.
+bool EncodeFile(const Image3F& input, float distance, ThreadPool* pool,
+                const OutputCallback& output,
+                EncoderEffort effort = EncoderEffort::kDefault);
+
+// Encodes 8 or 16 bit RGB or RGBA samples in the sRGB transfer function (e.g.
+// straight from a PNG or JPEG decoder) without converting them to a float
+// image first; the samples are linearized on the fly while they are converted
+// to XYB, and the image header declares sRGB as the color encoding of the
+// image. The alpha channel, if any, is ignored. `pool` may be null.
+//
+// A distance of zero encodes the samples losslessly, the same as
+// EncodeFileNearLossless() with a maximum error of zero; the effort is then
+// ignored. Float input cannot be encoded losslessly.
+bool EncodeFile(const InterleavedImage& input, float distance,
+                ThreadPool* pool, std::vector<uint8_t>* output,
+                EncoderEffort effort = EncoderEffort::kDefault);
+bool EncodeFile(const InterleavedImage& input, float distance,
+                ThreadPool* pool, const OutputCallback& output,
+                EncoderEffort effort = EncoderEffort::kDefault);
+
+// Encodes 8 or 16 bit RGB or RGBA samples (see above) such that every sample
+// of the decoded image, at the bit depth of the input, differs by at most
+// `max_error` from the input sample, or losslessly if `max_error` is zero. The
+// image is coded in modular mode instead of VarDCT, which is much faster but
+// usually only gives smaller files than VarDCT at small distances. The alpha
+// channel, if any, is ignored. `pool` may be null.
+bool EncodeFileNearLossless(const InterleavedImage& input, uint32_t max_error,
+                            ThreadPool* pool, std::vector<uint8_t>* output);
+bool EncodeFileNearLossless(const InterleavedImage& input, uint32_t max_error,
+                            ThreadPool* pool, const OutputCallback& output);
+
+// Encodes `input` at each of `distances` into the output of the same index,
+// with the same result as an EncodeFile() call for each distance, but the work
+// that does not depend on the distance (see EncodeFrames()) is done only once.
+// This is considerably faster than separate calls when several qualities of
+// the same image are needed, e.g. to choose one by its file size. A distance
+// of zero is encoded losslessly on its own. `pool` may be null.
+bool EncodeFileMultiDistance(const Image3F& input,
+                             Span<const float> distances, ThreadPool* pool,
+                             std::vector<std::vector<uint8_t>>* outputs,
+                             EncoderEffort effort = EncoderEffort::kDefault);
+bool EncodeFileMultiDistance(const InterleavedImage& input,
+                             Span<const float> distances, ThreadPool* pool,
+                             std::vector<std::vector<uint8_t>>* outputs,
+                             EncoderEffort effort = EncoderEffort::kDefault);
+
+// Encodes `input` at the distance that gives the largest output of at most
+// `target_size` bytes (see EncodeFrameTargetSize() for how closely and in
+// which range of distances), and stores the distance in `distance` if it is
+// not null. This takes about as long as two or three EncodeFile() calls,
+// instead of the five to eight of a binary search of the distance with them.
+// The output may exceed `target_size` if the image does not fit at any
+// distance. `pool` may be null.
+bool EncodeFileTargetSize(const Image3F& input, size_t target_size,
+                          ThreadPool* pool, std::vector<uint8_t>* output,
+                          EncoderEffort effort = EncoderEffort::kDefault,
+                          float* distance = nullptr);
+bool EncodeFileTargetSize(const InterleavedImage& input, size_t target_size,
+                          ThreadPool* pool, std::vector<uint8_t>* output,
+                          EncoderEffort effort = EncoderEffort::kDefault,
+                          float* distance = nullptr);
+
+// Encodes an image of the given dimensions whose rows are pulled from
+// `get_rows` (see ImageRowsCallback) a band at a time, instead of having the
+// whole image in memory. The rows are pulled twice, unless the encoder has an
+// entropy preset. The per-block data and the output of the whole image are
+// still kept in memory, see the streaming EncodeFrame(). The output is the
+// same as EncodeFile() on the full image. `pool` may be null.
+bool EncodeFileStreaming(size_t xsize, size_t ysize,
+                         const ImageRowsCallback& get_rows, float distance,
+                         ThreadPool* pool, std::vector<uint8_t>* output,
+                         EncoderEffort effort = EncoderEffort::kDefault);
+bool EncodeFileStreaming(size_t xsize, size_t ysize,
+                         const ImageRowsCallback& get_rows, float distance,
+                         ThreadPool* pool, const OutputCallback& output,
+                         EncoderEffort effort = EncoderEffort::kDefault);
+
+// Long-lived encoder context for encoding many images in a row. The worker
+// threads and the quantization tables are set up once in the constructor and
+// reused by every Encode call, which makes a big difference for small images
+// where this setup would otherwise dominate the encoding time.
+//
+// Not thread-safe: no two calls to Encode on the same object may overlap.
+class Encoder {
+ public:
+  // "num_worker_threads" defaults to one per hyperthread. If zero, all tasks
+  // run on the calling thread.
+  explicit Encoder(
+      int num_worker_threads = std::thread::hardware_concurrency());
+
+  Encoder(const Encoder&) = delete;
+  Encoder& operator=(const Encoder&) = delete;
+
+  // See EncodeFile() for the input format.
+  bool Encode(const Image3F& input, float distance,
+              std::vector<uint8_t>* output);
+  bool Encode(const Image3F& input, float distance,
+              const OutputCallback& output);
+  bool Encode(const InterleavedImage& input, float distance,
+              std::vector<uint8_t>* output);
+  bool Encode(const InterleavedImage& input, float distance,
+              const OutputCallback& output);
+
+  // See EncodeFileNearLossless(). Ignores the effort and the pipeline.
+  bool EncodeNearLossless(const InterleavedImage& input, uint32_t max_error,
+                          std::vector<uint8_t>* output);
+  bool EncodeNearLossless(const InterleavedImage& input, uint32_t max_error,
+                          const OutputCallback& output);
+
+  // See EncodeFileStreaming().
+  bool EncodeStreaming(size_t xsize, size_t ysize,
+                       const ImageRowsCallback& get_rows, float distance,
+                       std::vector<uint8_t>* output);
+  bool EncodeStreaming(size_t xsize, size_t ysize,
+                       const ImageRowsCallback& get_rows, float distance,
+                       const OutputCallback& output);
+
+  // See EncodeFileMultiDistance(). The stages always run phase by phase.
+  bool EncodeMultiDistance(const Image3F& input, Span<const float> distances,
+                           std::vector<std::vector<uint8_t>>* outputs);
+  bool EncodeMultiDistance(const InterleavedImage& input,
+                           Span<const float> distances,
+                           std::vector<std::vector<uint8_t>>* outputs);
+
+  // See EncodeFileTargetSize(). Ignores the pipeline.
+  bool EncodeTargetSize(const Image3F& input, size_t target_size,
+                        std::vector<uint8_t>* output,
+                        float* distance = nullptr);
+  bool EncodeTargetSize(const InterleavedImage& input, size_t target_size,
+                        std::vector<uint8_t>* output,
+                        float* distance = nullptr);
+
+  // Encodes every image of `inputs` as by Encode(), into the output of the
+  // same index, several images at a time. Small images, which cannot keep
+  // many threads busy, are each encoded on a single thread, while large ones
+  // are split across the threads that are idle. This gives a much higher
+  // throughput than encoding the images one after another when most of them
+  // are small. Returns false if any of them failed.
+  bool EncodeBatch(Span<const Image3F> inputs, float distance,
+                   std::vector<std::vector<uint8_t>>* outputs);
+
+  // Selects how Encode() schedules the stages of the encoder, the default is
+  // FramePipeline::kFused. Only useful to compare their performance, the
+  // output is the same.
+  void SetFramePipeline(FramePipeline pipeline) { pipeline_ = pipeline; }
+
+  // Selects the speed/size trade-off of the following Encode calls, the
+  // default is EncoderEffort::kDefault.
+  void SetEffort(EncoderEffort effort) { effort_ = effort; }
+
+  // Codes the DC and AC tokens of the following Encode calls with the entropy
+  // codes of `preset`, or with codes computed for every image if null. This
+  // saves the time of building and clustering their histograms, which is
+  // significant for small images, but the codes are not adapted to the image.
+  // The preset is copied, its tables are prepared here once.
+  void SetEntropyPreset(const EntropyPreset* preset);
+
+  // Selects the order of the groups and the number of passes of the
+  // following Encode calls, see FrameLayout. The default is all groups in
+  // raster order in a single pass. Ignored by EncodeNearLossless().
+  void SetFrameLayout(const FrameLayout& layout) { layout_ = layout; }
+
+  // Stores the 1:8 preview of the images of the following Encode calls in
+  // `preview`, in the format it selects, or stops it if null. `preview` must
+  // outlive the Encode calls. It is not filled by EncodeBatch(),
+  // EncodeNearLossless() and lossless encodes at distance 0.
+  void SetPreview(FramePreview* preview) { preview_ = preview; }
+
+  // Starts reporting the time spent in each stage of the encoder and the size
+  // of each output section to `stats`, or stops it if null. `stats` must
+  // outlive the Encode calls.
+  void SetStats(EncodeStats* stats) { pool_.SetStats(stats); }
+
+  ThreadPool* pool() { return &pool_; }
+
+ private:
+  ThreadPool pool_;
+  DequantMatrices matrices_;
+  FramePipeline pipeline_ = FramePipeline::kFused;
+  EncoderEffort effort_ = EncoderEffort::kDefault;
+  std::unique_ptr<EntropyPresetCodes> preset_;
+  FrameLayout layout_;
+  FramePreview* preview_ = nullptr;
+};
+
 }  // namespace jxl
 
 #endif  // ENCODER_ENC_FILE_H_
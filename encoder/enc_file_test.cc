@@ -0,0 +1,197 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/enc_file.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "encoder/base/data_parallel.h"
+#include "encoder/base/span.h"
+#include "encoder/enc_frame.h"
+#include "encoder/entropy_preset.h"
+#include "encoder/image.h"
+#include "encoder/test_utils.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+struct Size {
+  size_t xsize;
+  size_t ysize;
+};
+
+// Sizes of one group, of several and of partial blocks, groups and bands of
+// the streaming encoder.
+const Size kSizes[] = {{17, 9}, {256, 256}, {259, 263}, {300, 521}};
+
+// Returns the rows of `image` for the streaming encoder.
+ImageRowsCallback RowsOf(const Image3F& image) {
+  return [&image](size_t y0, Image3F* rows) {
+    EXPECT_LE(y0 + rows->ysize(), image.ysize());
+    for (size_t c = 0; c < 3; ++c) {
+      for (size_t y = 0; y < rows->ysize(); ++y) {
+        memcpy(rows->PlaneRow(c, y), image.ConstPlaneRow(c, y0 + y),
+               image.xsize() * sizeof(float));
+      }
+    }
+    return true;
+  };
+}
+
+TEST(EncFileTest, PhaseByPhaseMatchesFused) {
+  const EncoderEffort kEfforts[] = {EncoderEffort::kLightning,
+                                    EncoderEffort::kDefault,
+                                    EncoderEffort::kSlower};
+  Encoder encoder(4);
+  for (const Size& size : kSizes) {
+    const Image3F image = test::TestImage(size.xsize, size.ysize);
+    for (EncoderEffort effort : kEfforts) {
+      encoder.SetEffort(effort);
+      encoder.SetFramePipeline(FramePipeline::kFused);
+      std::vector<uint8_t> fused;
+      ASSERT_TRUE(encoder.Encode(image, 1.0f, &fused));
+      encoder.SetFramePipeline(FramePipeline::kPhaseByPhase);
+      std::vector<uint8_t> phase_by_phase;
+      ASSERT_TRUE(encoder.Encode(image, 1.0f, &phase_by_phase));
+      EXPECT_TRUE(test::SameBytes(fused, phase_by_phase))
+          << size.xsize << "x" << size.ysize << " effort "
+          << static_cast<int>(effort);
+    }
+  }
+}
+
+TEST(EncFileTest, MultiDistanceMatchesEncodeFile) {
+  ThreadPool pool(4);
+  const float kDistances[] = {1.0f, 0.5f, 3.0f, 1.0f};
+  const float kDistancesWithLossless[] = {2.0f, 0.0f, 0.7f};
+  for (EncoderEffort effort :
+       {EncoderEffort::kLightning, EncoderEffort::kDefault,
+        EncoderEffort::kSlower}) {
+    for (const Size& size : kSizes) {
+      const Image3F image = test::TestImage(size.xsize, size.ysize);
+      std::vector<std::vector<uint8_t>> outputs;
+      ASSERT_TRUE(EncodeFileMultiDistance(image, Span<const float>(kDistances),
+                                          &pool, &outputs, effort));
+      ASSERT_EQ(4u, outputs.size());
+      for (size_t i = 0; i < outputs.size(); ++i) {
+        std::vector<uint8_t> expected;
+        ASSERT_TRUE(EncodeFile(image, kDistances[i], &pool, &expected, effort));
+        EXPECT_TRUE(test::SameBytes(expected, outputs[i]))
+            << size.xsize << "x" << size.ysize << " distance "
+            << kDistances[i] << " effort " << static_cast<int>(effort);
+      }
+      // Only interleaved samples can be coded losslessly.
+      for (size_t bits : {8, 16}) {
+        const std::vector<uint8_t> pixels =
+            test::TestPixels(size.xsize, size.ysize, bits);
+        const InterleavedImage srgb(pixels.data(), size.xsize, size.ysize, 3,
+                                    bits);
+        ASSERT_TRUE(EncodeFileMultiDistance(
+            srgb, Span<const float>(kDistancesWithLossless), &pool, &outputs,
+            effort));
+        ASSERT_EQ(3u, outputs.size());
+        for (size_t i = 0; i < outputs.size(); ++i) {
+          std::vector<uint8_t> expected;
+          ASSERT_TRUE(EncodeFile(srgb, kDistancesWithLossless[i], &pool,
+                                 &expected, effort));
+          EXPECT_TRUE(test::SameBytes(expected, outputs[i]))
+              << size.xsize << "x" << size.ysize << " " << bits
+              << " bits distance " << kDistancesWithLossless[i] << " effort "
+              << static_cast<int>(effort);
+        }
+      }
+    }
+  }
+}
+
+// Encodes an image of several groups in every mode that splits work across
+// threads: the group strips, the histogram clustering and the work stealing
+// of the pool must not change the output.
+std::vector<std::vector<uint8_t>> EncodeAllModes(int num_threads) {
+  const size_t xsize = 600;
+  const size_t ysize = 520;
+  const Image3F image = test::TestImage(xsize, ysize);
+  const std::vector<uint8_t> pixels = test::TestPixels(xsize, ysize, 16);
+  const InterleavedImage srgb(pixels.data(), xsize, ysize, 3, 16);
+  Encoder encoder(num_threads);
+  std::vector<std::vector<uint8_t>> outputs;
+  std::vector<uint8_t> output;
+  for (EncoderEffort effort :
+       {EncoderEffort::kLightning, EncoderEffort::kDefault,
+        EncoderEffort::kSlower}) {
+    encoder.SetEffort(effort);
+    for (FramePipeline pipeline :
+         {FramePipeline::kFused, FramePipeline::kPhaseByPhase}) {
+      encoder.SetFramePipeline(pipeline);
+      EXPECT_TRUE(encoder.Encode(image, 1.0f, &output));
+      outputs.push_back(output);
+    }
+  }
+  encoder.SetEffort(EncoderEffort::kDefault);
+  FrameLayout layout;
+  layout.group_order = GroupOrder::kCenterFirst;
+  layout.two_passes = true;
+  encoder.SetFrameLayout(layout);
+  EXPECT_TRUE(encoder.Encode(image, 2.0f, &output));
+  outputs.push_back(output);
+  EXPECT_TRUE(encoder.Encode(srgb, 0.0f, &output));
+  outputs.push_back(output);
+  EXPECT_TRUE(encoder.EncodeNearLossless(srgb, 2, &output));
+  outputs.push_back(output);
+  return outputs;
+}
+
+TEST(EncFileTest, SameOutputForAnyNumberOfThreads) {
+  const std::vector<std::vector<uint8_t>> expected = EncodeAllModes(0);
+  for (int num_threads : {1, 3, 8}) {
+    const std::vector<std::vector<uint8_t>> outputs =
+        EncodeAllModes(num_threads);
+    ASSERT_EQ(expected.size(), outputs.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+      EXPECT_TRUE(test::SameBytes(expected[i], outputs[i]))
+          << num_threads << " threads, mode " << i;
+    }
+  }
+}
+
+TEST(EncFileTest, StreamingMatchesEncodeFile) {
+  ThreadPool pool(4);
+  for (const Size& size : kSizes) {
+    const Image3F image = test::TestImage(size.xsize, size.ysize);
+    std::vector<uint8_t> expected;
+    ASSERT_TRUE(EncodeFile(image, 1.0f, &pool, &expected));
+    std::vector<uint8_t> streamed;
+    ASSERT_TRUE(EncodeFileStreaming(size.xsize, size.ysize, RowsOf(image),
+                                    1.0f, &pool, &streamed));
+    EXPECT_TRUE(test::SameBytes(expected, streamed))
+        << size.xsize << "x" << size.ysize;
+  }
+}
+
+TEST(EncFileTest, StreamingWithPresetMatchesEncode) {
+  Encoder encoder(4);
+  const EntropyPreset preset =
+      test::TrainPreset(test::TestImage(300, 200, 1), encoder.pool());
+  encoder.SetEntropyPreset(&preset);
+  for (const Size& size : kSizes) {
+    const Image3F image = test::TestImage(size.xsize, size.ysize);
+    std::vector<uint8_t> expected;
+    ASSERT_TRUE(encoder.Encode(image, 1.0f, &expected));
+    std::vector<uint8_t> streamed;
+    ASSERT_TRUE(encoder.EncodeStreaming(size.xsize, size.ysize, RowsOf(image),
+                                        1.0f, &streamed));
+    EXPECT_TRUE(test::SameBytes(expected, streamed))
+        << size.xsize << "x" << size.ysize;
+  }
+}
+
+}  // namespace
+}  // namespace jxl
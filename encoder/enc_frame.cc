@@ -8,14 +8,17 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <algorithm>
 #include <array>
 #include <atomic>
 #include <cmath>
 #include <limits>
+#include <memory>
 #include <numeric>
 #include <queue>
+#include <utility>
 #include <vector>
 
 #include "encoder/ac_context.h"
@@ -24,6 +27,8 @@
 #include "encoder/base/compiler_specific.h"
 #include "encoder/base/data_parallel.h"
 #include "encoder/base/padded_bytes.h"
+#include "encoder/base/printf_macros.h"
+#include "encoder/base/stats.h"
 #include "encoder/base/status.h"
 #include "encoder/chroma_from_luma.h"
 #include "encoder/common.h"
@@ -33,8 +38,10 @@
 #include "encoder/enc_bit_writer.h"
 #include "encoder/enc_chroma_from_luma.h"
 #include "encoder/enc_cluster.h"
+#include "encoder/enc_gradient.h"
 #include "encoder/enc_group.h"
 #include "encoder/enc_xyb.h"
+#include "encoder/entropy_preset.h"
 #include "encoder/gaborish.h"
 #include "encoder/image.h"
 #include "encoder/quant_weights.h"
@@ -78,6 +85,15 @@ float QuantDC(float distance) {
   return std::min(kDcQuant / effective_dist, 50.f);
 }
 
+constexpr float kGaborishMul = 0.9908511000000001f;
+
+// The first of two AC passes codes every coefficient rounded towards zero to a
+// multiple of 2^kCoarsePassShift.
+constexpr uint32_t kCoarsePassShift = 1;
+
+// Number of contexts of the entropy code of the TOC permutation.
+constexpr size_t kPermutationContexts = 8;
+
 struct ImageDim {
   ImageDim(size_t xs, size_t ys)
       : xsize(xs),
@@ -97,6 +113,12 @@ struct ImageDim {
                 xsize_blocks, ysize_blocks);
   }
 
+  Rect GroupRect(size_t idx) const {
+    return Rect((idx % xsize_groups) * kGroupDim,
+                (idx / xsize_groups) * kGroupDim, kGroupDim, kGroupDim, xsize,
+                ysize);
+  }
+
   Rect BlockRect(size_t idx) const {
     return Rect((idx % xsize_groups) * kGroupDimInBlocks,
                 (idx / xsize_groups) * kGroupDimInBlocks, kGroupDimInBlocks,
@@ -268,7 +290,6 @@ static constexpr uint8_t kGradientContextLut[1024] = {
 static constexpr int64_t kGradRangeMin = 0;
 static constexpr int64_t kGradRangeMid = 512;
 static constexpr int64_t kGradRangeMax = 1023;
-static constexpr size_t kNumDCContexts = 45;
 
 Status ComputeDCTokens(const Image3F& dc, const ColorCorrelationMap& cmap,
                        const ImageDim& dim, const float scale_dc,
@@ -379,7 +400,7 @@ Status ComputeACMetadataTokens(const ColorCorrelationMap& cmap,
 }
 
 void WriteFrameHeader(uint32_t x_qm_scale, uint32_t epf_iters, bool gaborish,
-                      BitWriter* writer) {
+                      size_t num_passes, BitWriter* writer) {
   BitWriter::Allotment allotment(writer, 1024);
   writer->Write(1, 0);    // not all default
   writer->Write(2, 0);    // regular frame
@@ -389,7 +410,15 @@ void WriteFrameHeader(uint32_t x_qm_scale, uint32_t epf_iters, bool gaborish,
   writer->Write(2, 0);    // no upsampling
   writer->Write(3, x_qm_scale);
   writer->Write(3, 2);  // b_qm_scale
-  writer->Write(2, 0);  // one pass
+  if (num_passes == 1) {
+    writer->Write(2, 0);  // one pass
+  } else {
+    writer->Write(2, num_passes - 1);
+    writer->Write(2, 0);  // no downsampled passes
+    for (size_t i = 0; i + 1 < num_passes; ++i) {
+      writer->Write(2, kCoarsePassShift);
+    }
+  }
   writer->Write(1, 0);  // no custom frame size or origin
   writer->Write(2, 0);  // replace blend mode
   writer->Write(1, 1);  // last frame
@@ -440,48 +469,89 @@ void WriteQuantScales(int global_scale, int quant_dc, BitWriter* writer) {
   }
 }
 
-void WriteContextMap(const std::vector<uint8_t>& context_map,
-                     BitWriter* writer) {
-  if (context_map.empty()) {
-    return;
-  }
-  if (*std::max_element(context_map.begin(), context_map.end()) == 0) {
-    writer->AllocateAndWrite(3, 1);  // simple code, 0 bits per entry
-    return;
+// Writes `tokens` preceded by an entropy code of their own.
+void WriteTokensWithCode(size_t num_contexts, const std::vector<Token>& tokens,
+                         BitWriter* writer) {
+  EntropyEncodingData codes;
+  std::vector<uint8_t> context_map;
+  auto histograms = BuildHistograms(num_contexts, tokens);
+  JXL_CHECK(ClusterHistograms(&histograms, &context_map));
+  writer->AllocateAndWrite(1, 0);  // no lz77
+  WriteContextMap(context_map, writer);
+  WriteHistograms(histograms, &codes, writer);
+  WriteTokens(tokens, codes, context_map, writer);
+}
+
+// Writes the modular context tree given by its `tokens`.
+void WriteTree(const std::vector<Token>& tokens, BitWriter* writer) {
+  writer->AllocateAndWrite(1, 1);  // not an empty tree
+  WriteTokensWithCode(kNumTreeContexts, tokens, writer);
+}
+
+// Context of a value of the Lehmer code of a permutation that follows `prev`.
+uint32_t PermutationContext(uint32_t prev) {
+  return prev == 0 ? 0
+                   : std::min<uint32_t>(1 + FloorLog2Nonzero(prev),
+                                        kPermutationContexts - 1);
+}
+
+// Writes the permutation that moves the element at index i to
+// `permutation[i]`: the length of its Lehmer code without the trailing zeros,
+// then the values of that code, each in the context of the previous one.
+void WritePermutation(const std::vector<uint32_t>& permutation,
+                      BitWriter* writer) {
+  const size_t size = permutation.size();
+  // The code of an element is the number of smaller ones after it, which are
+  // counted with a Fenwick tree of the elements before it.
+  std::vector<uint32_t> lehmer(size);
+  std::vector<uint32_t> tree(size + 1);
+  for (size_t i = 0; i < size; ++i) {
+    const uint32_t value = permutation[i];
+    uint32_t num_smaller_before = 0;
+    for (uint32_t j = value + 1; j != 0; j &= j - 1) {
+      num_smaller_before += tree[j];
+    }
+    lehmer[i] = value - num_smaller_before;
+    for (uint32_t j = value + 1; j <= size; j += j & (~j + 1)) ++tree[j];
   }
-  writer->AllocateAndWrite(3, 0);  // no simple code, no MTF, no LZ77
+  size_t end = size;
+  while (end > 0 && lehmer[end - 1] == 0) --end;
   std::vector<Token> tokens;
-  for (size_t i = 0; i < context_map.size(); i++) {
-    tokens.emplace_back(0, context_map[i]);
+  tokens.emplace_back(PermutationContext(size), end);
+  uint32_t prev = 0;
+  for (size_t i = 0; i < end; ++i) {
+    tokens.emplace_back(PermutationContext(prev), lehmer[i]);
+    prev = lehmer[i];
   }
-  EntropyEncodingData codes;
-  std::vector<uint8_t> dummy_context_map(1);
-  WriteHistograms(BuildHistograms(1, tokens), &codes, writer);
-  WriteTokens(tokens, codes, dummy_context_map, writer);
+  WriteTokensWithCode(kPermutationContexts, tokens, writer);
 }
 
 void WriteContextTree(size_t num_dc_groups, BitWriter* writer) {
   std::vector<Token> tokens(kContextTreeTokens,
                             kContextTreeTokens + kNumContextTreeTokens);
   tokens[1].value = PackSigned(1 + num_dc_groups);
-  EntropyEncodingData codes;
-  std::vector<uint8_t> context_map;
-  auto histograms = BuildHistograms(kNumTreeContexts, tokens);
-  ClusterHistograms(&histograms, &context_map);
-  writer->AllocateAndWrite(1, 1);  // not an empty tree
-  writer->AllocateAndWrite(1, 0);  // no lz77
-  WriteContextMap(context_map, writer);
-  WriteHistograms(histograms, &codes, writer);
-  WriteTokens(tokens, codes, context_map, writer);
+  WriteTree(tokens, writer);
+}
+
+// Writes the context map and histograms of a preset code.
+void WritePresetCode(const EntropyPresetCodes::Code& code, BitWriter* writer) {
+  BitWriter::Allotment allotment(writer, code.bits.BitsWritten());
+  writer->AppendUnaligned(code.bits);
+  allotment.Reclaim(writer);
 }
 
-void WriteDCGlobal(const QuantScales& qscales, const ColorCorrelationMap& cmap,
-                   const size_t num_dc_groups,
-                   const std::vector<std::vector<Token>>& dc_tokens,
-                   const std::vector<std::vector<Token>>& ac_meta_tokens,
-                   EntropyEncodingData* dc_code,
-                   std::vector<uint8_t>* dc_context_map,
-                   BitWriter* group_writer) {
+// Writes the DC global section up to the entropy code of the DC tokens, which
+// is stored in `dc_code` and `dc_context_map` unless it is that of `preset`.
+// The histograms of the DC groups are built by separate tasks of `pool`.
+Status WriteDCGlobal(const QuantScales& qscales,
+                     const ColorCorrelationMap& cmap,
+                     const size_t num_dc_groups,
+                     const std::vector<std::vector<Token>>& dc_tokens,
+                     const std::vector<std::vector<Token>>& ac_meta_tokens,
+                     const EntropyPresetCodes* preset, ThreadPool* pool,
+                     EntropyEncodingData* dc_code,
+                     std::vector<uint8_t>* dc_context_map,
+                     BitWriter* group_writer) {
   BitWriter::Allotment allotment(group_writer, 1024);
   group_writer->Write(1, 1);  // default dequant dc
   WriteQuantScales(qscales.global_scale, qscales.quant_dc, group_writer);
@@ -500,94 +570,401 @@ void WriteDCGlobal(const QuantScales& qscales, const ColorCorrelationMap& cmap,
   }
   allotment.Reclaim(group_writer);
   WriteContextTree(num_dc_groups, group_writer);
-  HistogramBuilder builder(kNumDCContexts);
-  builder.Add(dc_tokens);
-  builder.Add(ac_meta_tokens);
   group_writer->AllocateAndWrite(1, 0);  // no lz77
-  ClusterHistograms(&builder.histograms, dc_context_map);
+  if (preset != nullptr) {
+    WritePresetCode(preset->dc(), group_writer);
+    return true;
+  }
+  HistogramBuilder builder(kNumDCContexts);
+  if (num_dc_groups == 1) {
+    builder.Add(dc_tokens[0]);
+    builder.Add(ac_meta_tokens[0]);
+  } else {
+    std::vector<HistogramBuilder> group_histograms(
+        num_dc_groups, HistogramBuilder(kNumDCContexts));
+    JXL_RETURN_IF_ERROR(RunOnPool(
+        pool, 0, num_dc_groups, ThreadPool::NoInit,
+        [&](const uint32_t group_index, size_t /*thread*/) {
+          group_histograms[group_index].Add(dc_tokens[group_index]);
+          group_histograms[group_index].Add(ac_meta_tokens[group_index]);
+        },
+        "BuildDCHistograms"));
+    std::vector<const HistogramBuilder*> histograms;
+    for (const HistogramBuilder& group : group_histograms) {
+      histograms.push_back(&group);
+    }
+    JXL_RETURN_IF_ERROR(MergeHistograms(histograms, pool, &builder));
+  }
+  JXL_RETURN_IF_ERROR(ClusterHistograms(&builder.histograms, dc_context_map,
+                                        /*refine=*/false, pool));
   WriteContextMap(*dc_context_map, group_writer);
   WriteHistograms(builder.histograms, dc_code, group_writer);
+  return true;
 }
 
-}  // namespace
+// Returns the order of the sections of a frame with `num_passes` AC passes in
+// the output, as the index of the section at every position, for the AC
+// groups of every pass in the order given by `layout`. The sections before
+// the AC groups keep their order. Returns an empty order if all of them do.
+Status ComputeSectionOrder(const ImageDim& dim, size_t num_passes,
+                           const FrameLayout* layout,
+                           std::vector<uint32_t>* order) {
+  order->clear();
+  const GroupOrder group_order =
+      layout != nullptr ? layout->group_order : GroupOrder::kRaster;
+  if (group_order == GroupOrder::kRaster || dim.num_groups == 1) return true;
+  std::vector<float> priority(dim.num_groups);
+  if (group_order == GroupOrder::kCenterFirst) {
+    // Squared distance of the center of the group from that of the image.
+    for (size_t i = 0; i < dim.num_groups; ++i) {
+      const Rect rect = dim.GroupRect(i);
+      const float dx = rect.x0() + 0.5f * rect.xsize() - 0.5f * dim.xsize;
+      const float dy = rect.y0() + 0.5f * rect.ysize() - 0.5f * dim.ysize;
+      priority[i] = -(dx * dx + dy * dy);
+    }
+  } else {
+    if (layout->group_priority.size() != dim.num_groups) {
+      return JXL_FAILURE("%" PRIuS " group priorities for %" PRIuS " groups",
+                         layout->group_priority.size(), dim.num_groups);
+    }
+    priority = layout->group_priority;
+  }
+  std::vector<uint32_t> groups(dim.num_groups);
+  std::iota(groups.begin(), groups.end(), 0);
+  std::stable_sort(groups.begin(), groups.end(),
+                   [&priority](uint32_t a, uint32_t b) {
+                     return priority[a] > priority[b];
+                   });
+  const uint32_t first_ac_group = 2 + dim.num_dc_groups;
+  order->resize(first_ac_group);
+  std::iota(order->begin(), order->end(), 0);
+  for (size_t pass = 0; pass < num_passes; ++pass) {
+    for (const uint32_t group : groups) {
+      order->push_back(first_ac_group + pass * dim.num_groups + group);
+    }
+  }
+  return true;
+}
 
-Status EncodeFrame(const float distance, const Image3F& linear,
-                   ThreadPool* pool, BitWriter* writer) {
-  // Pre-compute image dimension-derived values.
-  ImageDim dim(linear.xsize(), linear.ysize());
+// Pads all `sections` of the frame to whole bytes, brings them into `order`
+// (see ComputeSectionOrder()) and writes the TOC to `writer`. Also reports the
+// size of the headers already in `writer` and of every section, in the order
+// of the output, to `stats`, unless it is null.
+Status WriteTOC(const ImageDim& dim, const std::vector<uint32_t>& order,
+                EncodeStats* stats, std::vector<BitWriter>* sections,
+                BitWriter* writer) {
+  std::vector<BitWriter>& group_codes = *sections;
+  const size_t global_ac_index = dim.num_dc_groups + 1;
+  const bool is_small_image = group_codes.size() == 1;
 
-  // Write frame header.
-  uint32_t x_qm_scale = ComputeXQuantScale(distance);
-  uint32_t epf_iters = ComputeNumEpfIters(distance);
-  bool gaborish = distance >= 0.1;
-  WriteFrameHeader(x_qm_scale, epf_iters, gaborish, writer);
+  // Zero pad all sections.
+  for (BitWriter& bw : group_codes) {
+    BitWriter::Allotment allotment(&bw, 8);
+    bw.ZeroPadToByte();  // end of group.
+    allotment.Reclaim(&bw);
+  }
 
-  // Transform image to XYB colorspace.
-  Image3F opsin(dim.xsize_blocks * kBlockDim, dim.ysize_blocks * kBlockDim);
-  opsin.ShrinkTo(dim.xsize, dim.ysize);
-  ToXYB(linear, pool, &opsin);
-  PadImageToBlockMultipleInPlace(&opsin);
+  // Write TOC and assemble bit stream.
+  const size_t header_bytes = writer->BitsWritten() / kBitsPerByte;
+  if (order.empty()) {
+    writer->AllocateAndWrite(1, 0);  // no permutation
+  } else {
+    // The permutation gives the position of every section in the output.
+    writer->AllocateAndWrite(1, 1);
+    std::vector<uint32_t> permutation(order.size());
+    std::vector<BitWriter> ordered(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      permutation[order[i]] = i;
+      ordered[i] = std::move(group_codes[order[i]]);
+    }
+    WritePermutation(permutation, writer);
+    group_codes.swap(ordered);
+  }
+  {
+    size_t num_sizes = group_codes.size();
+    BitWriter::Allotment allotment(writer, 1024 + 30 * num_sizes);
+    writer->ZeroPadToByte();  // before TOC entries
+    for (size_t i = 0; i < group_codes.size(); i++) {
+      JXL_ASSERT(group_codes[i].BitsWritten() % kBitsPerByte == 0);
+      const size_t group_size = group_codes[i].BitsWritten() / kBitsPerByte;
+      size_t offset = 0;
+      bool success = false;
+      static const size_t kBits[4] = {10, 14, 22, 30};
+      for (size_t i = 0; i < 4; ++i) {
+        if (group_size < offset + (1u << kBits[i])) {
+          writer->Write(2, i);
+          writer->Write(kBits[i], group_size - offset);
+          success = true;
+          break;
+        }
+        offset += (1u << kBits[i]);
+      }
+      JXL_RETURN_IF_ERROR(success);
+    }
+    writer->ZeroPadToByte();
+    allotment.Reclaim(writer);
+  }
+  if (stats) {
+    stats->AddSection("Headers", 0, header_bytes);
+    stats->AddSection("TOC", 0,
+                      writer->BitsWritten() / kBitsPerByte - header_bytes);
+    for (size_t pos = 0; pos < group_codes.size(); ++pos) {
+      const size_t bytes = group_codes[pos].BitsWritten() / kBitsPerByte;
+      const size_t i = order.empty() ? pos : order[pos];
+      if (is_small_image) {
+        stats->AddSection("All groups", 0, bytes);
+      } else if (i == 0) {
+        stats->AddSection("DC global", 0, bytes);
+      } else if (i < global_ac_index) {
+        stats->AddSection("DC group", i - 1, bytes);
+      } else if (i == global_ac_index) {
+        stats->AddSection("AC global", 0, bytes);
+      } else {
+        // The AC groups of the second pass, if any, follow those of the
+        // first one.
+        const size_t group = i - global_ac_index - 1;
+        stats->AddSection(group < dim.num_groups ? "AC group" : "AC refinement",
+                          group % dim.num_groups, bytes);
+      }
+    }
+  }
 
-  // Compute adaptive quantization field (relies on pre-gaborish values).
-  QuantScales qscales = ComputeQuantScales(distance);
-  ImageF quant_field, masking;
-  ImageI raw_quant_field;
-  ComputeAdaptiveQuantField(opsin, distance, qscales.scale, pool, &masking,
-                            &quant_field, &raw_quant_field);
+  return true;
+}
 
-  // Initialize quant weights and compute X quant matrix scale.
-  DequantMatrices matrices;
-  float x_qm_mul = std::pow(1.25f, x_qm_scale - 2.0f);
+// Encoding parameters of a frame, most of which only depend on the distance
+// and the effort.
+struct FrameParams {
+  FrameParams(float distance, EncoderEffort effort,
+              const EntropyPresetCodes* preset = nullptr,
+              const FrameLayout* layout = nullptr,
+              FramePreview* preview = nullptr,
+              FrameHistograms* histograms = nullptr)
+      : distance(distance),
+        effort(effort),
+        x_qm_scale(ComputeXQuantScale(distance)),
+        epf_iters(ComputeNumEpfIters(distance)),
+        gaborish(distance >= 0.1),
+        qscales(ComputeQuantScales(distance)),
+        x_qm_mul(std::pow(1.25f, x_qm_scale - 2.0f)),
+        preset(preset),
+        layout(layout),
+        num_passes(layout != nullptr && layout->two_passes ? 2 : 1),
+        preview(preview),
+        histograms(histograms) {}
 
-  if (gaborish) {
-    // Apply inverse-gaborish.
-    GaborishInverse(&opsin, 0.9908511000000001f, pool);
+  const float distance;
+  const EncoderEffort effort;
+  const uint32_t x_qm_scale;
+  const uint32_t epf_iters;
+  const bool gaborish;
+  const QuantScales qscales;
+  // X quant matrix scale.
+  const float x_qm_mul;
+  // If not null, the entropy codes of the DC and AC tokens, which are then
+  // not computed from the histograms of the frame.
+  const EntropyPresetCodes* const preset;
+  // If not null, the order of the AC groups and the number of passes.
+  const FrameLayout* const layout;
+  const size_t num_passes;
+  // If not null, the preview of the frame is stored in it.
+  FramePreview* const preview;
+  // If not null, the histograms of the tokens are added to it and no
+  // sections are written.
+  FrameHistograms* const histograms;
+};
+
+// Chooses the transform of every block of `opsin` for the distance and the
+// effort of `params`, or uses the one forced by its layout.
+Status ChooseAcStrategy(const Image3F& opsin, const FrameParams& params,
+                        const ColorCorrelationMap& cmap,
+                        const ImageF& quant_field, const ImageF& masking,
+                        ThreadPool* pool, const DequantMatrices& matrices,
+                        AcStrategyImage* ac_strategy) {
+  if (params.layout != nullptr && params.layout->force_ac_strategy) {
+    FillAcStrategy(params.layout->ac_strategy, ac_strategy);
+    return true;
   }
+  return ComputeAcStrategyImage(
+      opsin, params.distance, cmap, quant_field, masking,
+      /*try_4x4=*/params.effort == EncoderEffort::kSlower, pool, matrices,
+      ac_strategy);
+}
 
-  // Compute per-tile color correlation values.
-  ColorCorrelationMap cmap(dim.xsize, dim.ysize);
-  JXL_RETURN_IF_ERROR(ComputeColorCorrelationMap(opsin, matrices, pool, &cmap));
+// Converts the DC image `dc` of a frame, the average XYB values of its blocks
+// before the chroma from luma prediction, to its preview.
+void ComputePreview(const Image3F& dc, ThreadPool* pool,
+                    FramePreview* preview) {
+  preview->xsize = dc.xsize();
+  preview->ysize = dc.ysize();
+  if (preview->format == FramePreview::Format::kLinear) {
+    preview->linear = Image3F(dc.xsize(), dc.ysize());
+    XYBToLinear(dc, pool, &preview->linear);
+  } else {
+    XYBToSRGB8(dc, pool, &preview->srgb);
+  }
+}
 
-  // Compute block sizes.
-  AcStrategyImage ac_strategy(dim.xsize_blocks, dim.ysize_blocks);
-  JXL_RETURN_IF_ERROR(ComputeAcStrategyImage(opsin, distance, cmap, quant_field,
-                                             masking, pool, matrices,
-                                             &ac_strategy));
-  AdjustQuantField(ac_strategy, &raw_quant_field);
+// Entropy codes of the AC tokens of every pass of a frame without a preset.
+struct ACCodes {
+  std::vector<uint8_t> context_maps[2];
+  EntropyEncodingData codes[2];
+};
 
-  // Compute DC image and AC coefficient tokens.
-  Image3F dc(dim.xsize_blocks, dim.ysize_blocks);
-  std::vector<std::vector<Token>> ac_tokens(dim.num_groups);
-  JXL_RETURN_IF_ERROR(ComputeCoefficients(opsin, raw_quant_field, matrices,
-                                          qscales.scale, cmap, ac_strategy,
-                                          x_qm_mul, pool, &dc, &ac_tokens));
+// Writes the AC global section of the frame to `writer`. The entropy code of
+// every pass is that of the preset of the frame, or is clustered from the
+// histograms of the pass in `histograms` and stored in `codes`.
+Status WriteACGlobal(const ImageDim& dim, const FrameParams& params,
+                     HistogramBuilder* const histograms[2], ThreadPool* pool,
+                     ACCodes* codes, BitWriter* writer) {
+  EncodeStats* stats = pool != nullptr ? pool->stats() : nullptr;
+  {
+    BitWriter::Allotment allotment(writer, 1024);
+    writer->Write(1, 1);  // all default quant matrices
+    size_t num_histo_bits = CeilLog2Nonzero(dim.num_groups);
+    if (num_histo_bits != 0) writer->Write(num_histo_bits, 0);
+    allotment.Reclaim(writer);
+  }
+  for (size_t pass = 0; pass < params.num_passes; ++pass) {
+    BitWriter::Allotment allotment(writer, 1024);
+    writer->Write(2, 3);
+    writer->Write(13, 0);  // all default coeff order
+    allotment.Reclaim(writer);
+    writer->AllocateAndWrite(1, 0);  // no lz77
+    if (params.preset != nullptr) {
+      WritePresetCode(params.preset->ac(), writer);
+      continue;
+    }
+    ScopedStatsSpan span(stats, "ClusterAndWriteACHistograms");
+    std::vector<Histogram>& counts = histograms[pass]->histograms;
+    // The fixed context map has too many clusters to be written without
+    // move-to-front coding.
+    const bool fixed_map = params.effort == EncoderEffort::kLightning;
+    if (fixed_map) {
+      ClusterHistograms(FixedACContextMap(), &counts,
+                        &codes->context_maps[pass]);
+    } else {
+      JXL_RETURN_IF_ERROR(ClusterHistograms(
+          &counts, &codes->context_maps[pass],
+          /*refine=*/params.effort == EncoderEffort::kSlower, pool));
+    }
+    WriteContextMap(codes->context_maps[pass], writer, fixed_map);
+    WriteHistograms(counts, &codes->codes[pass], writer);
+  }
+  return true;
+}
 
-  // Compute DC tokens.
-  std::vector<std::vector<Token>> dc_tokens(dim.num_dc_groups);
-  JXL_RETURN_IF_ERROR(
-      ComputeDCTokens(dc, cmap, dim, qscales.scale_dc, pool, &dc_tokens));
+// Writes the AC groups from index `first_group` on to their sections, with
+// the codes written by WriteACGlobal(). The tokens of every pass are in
+// `tokens`, at the index of the pass times the number of these groups plus
+// that of the group from `first_group`.
+Status WriteACGroups(const ImageDim& dim, const FrameParams& params,
+                     const ACCodes& codes,
+                     const std::vector<PackedTokens>& tokens,
+                     size_t first_group, ThreadPool* pool,
+                     std::vector<BitWriter>* sections) {
+  const size_t num_groups = tokens.size() / params.num_passes;
+  const auto process_group = [&](const uint32_t task, const size_t thread) {
+    const size_t pass = task / num_groups;
+    const size_t group = first_group + task % num_groups;
+    const std::vector<uint8_t>& context_map =
+        params.preset ? params.preset->ac().context_map
+                      : codes.context_maps[pass];
+    const EntropyEncodingData& pass_codes =
+        params.preset ? params.preset->ac().codes : codes.codes[pass];
+    BitWriter* writer =
+        &(*sections)[2 + dim.num_dc_groups + pass * dim.num_groups + group];
+    WriteTokens(tokens[task], pass_codes, context_map, writer);
+  };
+  return RunOnPool(pool, 0, tokens.size(), ThreadPool::NoInit, process_group,
+                   "EncodeGroupCoefficients");
+}
+
+// Writes all sections of the frame to `sections` and the TOC to `writer`,
+// given the block-level data of the whole frame, the AC tokens of each group
+// and their histograms. If `ac_tokens` is null, the AC global and AC group
+// sections are already in `sections`, which then has all the sections of the
+// frame. Also stores the preview of the frame if it has one.
+Status WriteFrameSections(const ImageDim& dim, const FrameParams& params,
+                          const ColorCorrelationMap& cmap,
+                          const AcStrategyImage& ac_strategy,
+                          const ImageI& raw_quant_field, const Image3F& dc,
+                          const std::vector<PackedTokens>* ac_tokens,
+                          HistogramBuilder* ac_histograms, ThreadPool* pool,
+                          BitWriter* writer, std::vector<BitWriter>* sections) {
+  EncodeStats* stats = pool != nullptr ? pool->stats() : nullptr;
+  const QuantScales& qscales = params.qscales;
 
-  // Compute control fields tokens.
+  // Compute DC tokens and control fields tokens.
+  std::vector<std::vector<Token>> dc_tokens(dim.num_dc_groups);
   std::vector<std::vector<Token>> ac_meta_tokens(dim.num_dc_groups);
   std::vector<size_t> num_ac_blocks(dim.num_dc_groups);
-  JXL_RETURN_IF_ERROR(ComputeACMetadataTokens(cmap, ac_strategy,
-                                              raw_quant_field, dim, pool,
-                                              &ac_meta_tokens, &num_ac_blocks));
+  JXL_RETURN_IF_ERROR(RunConcurrently(
+      pool,
+      [&]() {
+        return ComputeDCTokens(dc, cmap, dim, qscales.scale_dc, pool,
+                               &dc_tokens);
+      },
+      [&]() {
+        return ComputeACMetadataTokens(cmap, ac_strategy, raw_quant_field, dim,
+                                       pool, &ac_meta_tokens, &num_ac_blocks);
+      },
+      "Compute DC and AC metadata tokens"));
+
+  if (params.histograms != nullptr) {
+    params.histograms->dc.Add(dc_tokens);
+    params.histograms->dc.Add(ac_meta_tokens);
+    return MergeHistograms({ac_histograms}, pool, &params.histograms->ac);
+  }
+  if (params.preview != nullptr) ComputePreview(dc, pool, params.preview);
+
+  const size_t num_passes = params.num_passes;
+  std::vector<uint32_t> order;
+  JXL_RETURN_IF_ERROR(
+      ComputeSectionOrder(dim, num_passes, params.layout, &order));
+
+  // With two passes, the AC tokens are split into those of each pass, with
+  // histograms of their own.
+  std::vector<PackedTokens> pass_tokens;
+  std::vector<HistogramBuilder> pass_histograms;
+  const std::vector<PackedTokens>* tokens = ac_tokens;
+  HistogramBuilder* histograms[2] = {ac_histograms, nullptr};
+  if (ac_tokens != nullptr && num_passes == 2) {
+    if (params.preset == nullptr) {
+      pass_histograms.resize(2, HistogramBuilder(kNumACContexts));
+    }
+    JXL_RETURN_IF_ERROR(SplitACPasses(ac_strategy, *ac_tokens,
+                                      kCoarsePassShift, pool, &pass_tokens,
+                                      &pass_histograms));
+    tokens = &pass_tokens;
+    if (params.preset == nullptr) {
+      histograms[0] = &pass_histograms[0];
+      histograms[1] = &pass_histograms[1];
+    }
+  }
 
   // Allocate bit writers for all sections.
-  size_t num_toc_entries = 2 + dim.num_dc_groups + dim.num_groups;
-  std::vector<BitWriter> group_codes(num_toc_entries);
+  size_t num_toc_entries = 2 + dim.num_dc_groups + num_passes * dim.num_groups;
+  std::vector<BitWriter>& group_codes = *sections;
+  if (ac_tokens != nullptr) {
+    group_codes.clear();
+    group_codes.resize(num_toc_entries);
+  }
+  JXL_ASSERT(group_codes.size() == num_toc_entries);
   const size_t global_ac_index = dim.num_dc_groups + 1;
-  const bool is_small_image = dim.num_groups == 1;
+  const bool is_small_image = dim.num_groups == 1 && num_passes == 1;
   const auto get_output = [&](const size_t index) {
-    return &group_codes[is_small_image ? 0 : index];
+    return &group_codes[index];
   };
 
-  // Write DC global and compute DC and control fields histograms.
-  EntropyEncodingData dc_code;
-  std::vector<uint8_t> dc_context_map;
-  WriteDCGlobal(qscales, cmap, dim.num_dc_groups, dc_tokens, ac_meta_tokens,
-                &dc_code, &dc_context_map, get_output(0));
+  // DC global with the DC and control fields histograms, written before the
+  // DC groups.
+  EntropyEncodingData own_dc_code;
+  std::vector<uint8_t> own_dc_context_map;
+  const EntropyEncodingData& dc_code =
+      params.preset ? params.preset->dc().codes : own_dc_code;
+  const std::vector<uint8_t>& dc_context_map =
+      params.preset ? params.preset->dc().context_map : own_dc_context_map;
 
   // Write DC groups and control fields.
   const auto process_dc_group = [&](const uint32_t group_index,
@@ -610,73 +987,1412 @@ Status EncodeFrame(const float distance, const Image3F& linear,
       WriteTokens(ac_meta_tokens[group_index], dc_code, dc_context_map, writer);
     }
   };
-  JXL_CHECK(RunOnPool(pool, 0, dim.num_dc_groups, ThreadPool::NoInit,
-                      process_dc_group, "EncodeDCGroup"));
+  const auto write_dc_sections = [&]() {
+    JXL_RETURN_IF_ERROR(WriteDCGlobal(
+        qscales, cmap, dim.num_dc_groups, dc_tokens, ac_meta_tokens,
+        params.preset, pool, &own_dc_code, &own_dc_context_map,
+        get_output(0)));
+    return RunOnPool(pool, 0, dim.num_dc_groups, ThreadPool::NoInit,
+                     process_dc_group, "EncodeDCGroup");
+  };
 
-  // Write AC global and compute AC histograms.
-  std::vector<uint8_t> context_map;
-  EntropyEncodingData codes;
-  {
-    BitWriter* group_writer = get_output(global_ac_index);
-    BitWriter::Allotment allotment(group_writer, 1024);
-    group_writer->Write(1, 1);  // all default quant matrices
-    size_t num_histo_bits = CeilLog2Nonzero(dim.num_groups);
-    if (num_histo_bits != 0) group_writer->Write(num_histo_bits, 0);
-    group_writer->Write(2, 3);
-    group_writer->Write(13, 0);  // all default coeff order
-    allotment.Reclaim(group_writer);
-    auto histograms = BuildHistograms(kNumACContexts, ac_tokens);
-    group_writer->AllocateAndWrite(1, 0);  // no lz77
-    ClusterHistograms(&histograms, &context_map);
-    WriteContextMap(context_map, group_writer);
-    WriteHistograms(histograms, &codes, group_writer);
-  }
-
-  // Write AC groups.
-  const auto process_group = [&](const uint32_t group_index,
-                                 const size_t thread) {
-    BitWriter* writer = get_output(2 + dim.num_dc_groups + group_index);
-    WriteTokens(ac_tokens[group_index], codes, context_map, writer);
+  // Write AC global and compute AC histograms, then write AC groups, those
+  // of every pass after those of the previous one.
+  ACCodes ac_codes;
+  const auto write_ac_sections = [&]() -> Status {
+    if (ac_tokens == nullptr) return true;
+    JXL_RETURN_IF_ERROR(WriteACGlobal(dim, params, histograms, pool,
+                                      &ac_codes, get_output(global_ac_index)));
+    return WriteACGroups(dim, params, ac_codes, *tokens, /*first_group=*/0,
+                         pool, sections);
   };
-  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, dim.num_groups, ThreadPool::NoInit,
-                                process_group, "EncodeGroupCoefficients"));
 
-  // Zero pad all sections.
-  for (BitWriter& bw : group_codes) {
-    BitWriter::Allotment allotment(&bw, 8);
-    bw.ZeroPadToByte();  // end of group.
-    allotment.Reclaim(&bw);
+  // The DC sections and the AC sections are independent, so the DC and the AC
+  // histograms are also clustered concurrently.
+  JXL_RETURN_IF_ERROR(RunConcurrently(pool, write_dc_sections,
+                                      write_ac_sections, "EncodeSections"));
+  // All sections of a small image form a single one, without padding between
+  // them, so they are written separately and then concatenated.
+  if (is_small_image) {
+    BitWriter* JXL_RESTRICT out = &group_codes[0];
+    for (size_t i = 1; i < group_codes.size(); ++i) {
+      BitWriter::Allotment allotment(out, group_codes[i].BitsWritten());
+      out->AppendUnaligned(group_codes[i]);
+      allotment.Reclaim(out);
+    }
+    group_codes.resize(1);
   }
 
-  // Write TOC and assemble bit stream.
+  return WriteTOC(dim, order, stats, sections, writer);
+}
+
+// Block-level data and AC tokens of the whole frame, for the encoders that
+// process the frame in parts.
+struct FrameData {
+  explicit FrameData(const ImageDim& dim)
+      : dim(dim),
+        cmap(dim.xsize, dim.ysize),
+        ac_strategy(dim.xsize_blocks, dim.ysize_blocks),
+        raw_quant_field(dim.xsize_blocks, dim.ysize_blocks),
+        dc(dim.xsize_blocks, dim.ysize_blocks),
+        ac_tokens(dim.num_groups) {
+    InitColorCorrelationDCValues(dim.xsize_blocks * dim.ysize_blocks,
+                                 &cfl_dc_values);
+  }
+
+  const ImageDim dim;
+  ColorCorrelationMap cmap;
+  ImageF cfl_dc_values;
+  AcStrategyImage ac_strategy;
+  ImageI raw_quant_field;
+  Image3F dc;
+  std::vector<PackedTokens> ac_tokens;
+};
+
+// Number of pixels of pre-gaborish context that EncodeRegion() needs around
+// its rect: the adaptive quantization reads 5 and the inverse gaborish 2
+// pixels outside of it. Two blocks keep the rect aligned to the vector size.
+constexpr size_t kRegionBorder = 2 * kBlockDim;
+
+// Scratch images of EncodeRegion(), reused from one region to the next.
+struct RegionBuffers {
+  RegionBuffers(size_t xsize, size_t ysize) : opsin(xsize, ysize) {}
+
+  Image3F opsin;
+  ImageF quant_field;
+  ImageF masking;
+  ImageI raw_quant_field;
+};
+
+// Runs the stages from the adaptive quantization up to the AC tokens on
+// `rect`, a rectangle of whole groups in frame pixel coordinates, and stores
+// the results in its part of `frame`. `xyb` holds the pre-gaborish XYB pixels
+// of the frame starting at (xyb_x0, xyb_y0), including kRegionBorder pixels
+// around `rect` where it is not at the edge of the frame. The histograms of
+// the AC tokens are added to `ac_histograms`, unless the frame has a preset.
+// Regions that do not overlap may be encoded concurrently with different
+// `buffers` and `ac_histograms`.
+Status EncodeRegion(const FrameParams& params, const DequantMatrices& matrices,
+                    const Image3F& xyb, size_t xyb_x0, size_t xyb_y0,
+                    const Rect& rect, ThreadPool* pool, RegionBuffers* buffers,
+                    HistogramBuilder* ac_histograms, FrameData* frame) {
+  const ImageDim& dim = frame->dim;
+  const size_t xsize_blocks = rect.xsize() / kBlockDim;
+  const size_t ysize_blocks = rect.ysize() / kBlockDim;
+  const Rect block_rect(rect.x0() / kBlockDim, rect.y0() / kBlockDim,
+                        xsize_blocks, ysize_blocks);
+  // Position of the region in `xyb`.
+  const Rect xyb_rect(rect.x0() - xyb_x0, rect.y0() - xyb_y0, rect.xsize(),
+                      rect.ysize());
+  const Rect xyb_block_rect(xyb_rect.x0() / kBlockDim,
+                            xyb_rect.y0() / kBlockDim, xsize_blocks,
+                            ysize_blocks);
+
+  const bool lightning = params.effort == EncoderEffort::kLightning;
+
+  // Compute adaptive quantization field (relies on pre-gaborish values).
+  if (lightning) {
+    ComputeFastAdaptiveQuantField(
+        xyb, xyb_block_rect, params.distance, params.qscales.scale, pool,
+        &buffers->masking, &buffers->quant_field, &buffers->raw_quant_field);
+  } else {
+    ComputeAdaptiveQuantField(xyb, xyb_block_rect, params.distance,
+                              params.qscales.scale, pool, &buffers->masking,
+                              &buffers->quant_field,
+                              &buffers->raw_quant_field);
+  }
+  ImageF quant_field(xsize_blocks, ysize_blocks);
+  ImageF masking(xsize_blocks, ysize_blocks);
+  ImageI raw_quant_field(xsize_blocks, ysize_blocks);
+  CopyImageTo(xyb_block_rect, buffers->quant_field, Rect(quant_field),
+              &quant_field);
+  CopyImageTo(xyb_block_rect, buffers->masking, Rect(masking), &masking);
+  CopyImageTo(xyb_block_rect, buffers->raw_quant_field, Rect(raw_quant_field),
+              &raw_quant_field);
+
+  Image3F& opsin = buffers->opsin;
+  opsin.ShrinkTo(rect.xsize(), rect.ysize());
+  if (params.gaborish) {
+    // Apply inverse-gaborish.
+    GaborishInverse(xyb, xyb_rect, kGaborishMul, pool, &opsin);
+  } else {
+    CopyImageTo(xyb_rect, xyb, Rect(opsin), &opsin);
+  }
+
+  // Compute per-tile color correlation values of the region.
+  ColorCorrelationMap cmap(rect.xsize(), rect.ysize());
+  JXL_RETURN_IF_ERROR(ComputeColorCorrelationTiles(
+      opsin, matrices, block_rect.y0() * dim.xsize_blocks + block_rect.x0(),
+      dim.xsize_blocks, pool, &cmap, &frame->cfl_dc_values));
+  const Rect tile_rect(rect.x0() / kColorTileDim, rect.y0() / kColorTileDim,
+                       cmap.ytox_map.xsize(), cmap.ytox_map.ysize());
+  CopyImageTo(Rect(cmap.ytox_map), cmap.ytox_map, tile_rect,
+              &frame->cmap.ytox_map);
+  CopyImageTo(Rect(cmap.ytob_map), cmap.ytob_map, tile_rect,
+              &frame->cmap.ytob_map);
+
+  // Compute block sizes.
+  AcStrategyImage ac_strategy(xsize_blocks, ysize_blocks);
+  if (lightning) {
+    ac_strategy.FillDCT8();
+  } else {
+    JXL_RETURN_IF_ERROR(ChooseAcStrategy(opsin, params, cmap, quant_field,
+                                         masking, pool, matrices,
+                                         &ac_strategy));
+    JXL_RETURN_IF_ERROR(
+        AdjustQuantField(ac_strategy, pool, &raw_quant_field));
+  }
+  frame->ac_strategy.CopyFrom(Rect(ac_strategy), ac_strategy, block_rect);
+  CopyImageTo(Rect(raw_quant_field), raw_quant_field, block_rect,
+              &frame->raw_quant_field);
+
+  // Compute DC image and AC coefficient tokens of the region.
+  const size_t xsize_groups = DivCeil(rect.xsize(), kGroupDim);
+  const size_t ysize_groups = DivCeil(rect.ysize(), kGroupDim);
+  Image3F dc(xsize_blocks, ysize_blocks);
+  std::vector<PackedTokens> ac_tokens(xsize_groups * ysize_groups);
+  JXL_RETURN_IF_ERROR(ComputeCoefficients(
+      opsin, raw_quant_field, matrices, params.qscales.scale, cmap,
+      ac_strategy, params.x_qm_mul, pool, &dc, &ac_tokens,
+      params.preset ? nullptr : ac_histograms));
+  CopyImageTo(Rect(dc), dc, block_rect, &frame->dc);
+  const size_t gx0 = rect.x0() / kGroupDim;
+  const size_t gy0 = rect.y0() / kGroupDim;
+  for (size_t i = 0; i < ac_tokens.size(); ++i) {
+    const size_t gx = gx0 + i % xsize_groups;
+    const size_t gy = gy0 + i / xsize_groups;
+    frame->ac_tokens[gy * dim.xsize_groups + gx].swap(ac_tokens[i]);
+  }
+  return true;
+}
+
+// Pads the XYB pixels of `xyb`, which starts at frame pixel (xyb_x0, xyb_y0),
+// beyond the size of the image to a multiple of the block size, the same way
+// as PadImageToBlockMultipleInPlace() does for the whole image.
+void PadRegionToBlockMultiple(const ImageDim& dim, size_t xyb_x0,
+                              size_t xyb_y0, Image3F* xyb) {
+  const size_t xyb_x1 = xyb_x0 + xyb->xsize();
+  const size_t xyb_y1 = xyb_y0 + xyb->ysize();
+  const size_t last_y = std::min(xyb_y1, dim.ysize);
+  for (size_t c = 0; c < 3; ++c) {
+    if (xyb_x1 > dim.xsize) {
+      for (size_t y = xyb_y0; y < last_y; ++y) {
+        float* JXL_RESTRICT row = xyb->PlaneRow(c, y - xyb_y0);
+        for (size_t x = dim.xsize; x < xyb_x1; ++x) {
+          row[x - xyb_x0] = row[dim.xsize - 1 - xyb_x0];
+        }
+      }
+    }
+    for (size_t y = std::max(dim.ysize, xyb_y0); y < xyb_y1; ++y) {
+      memcpy(xyb->PlaneRow(c, y - xyb_y0),
+             xyb->ConstPlaneRow(c, dim.ysize - 1 - xyb_y0),
+             xyb->xsize() * sizeof(float));
+    }
+  }
+}
+
+template <class Input>
+Status EncodeFramePhaseByPhase(const FrameParams& params, const ImageDim& dim,
+                               const Input& input,
+                               const DequantMatrices& matrices,
+                               ThreadPool* pool, BitWriter* writer,
+                               std::vector<BitWriter>* sections) {
+  // Transform image to XYB colorspace.
+  Image3F opsin(dim.xsize_blocks * kBlockDim, dim.ysize_blocks * kBlockDim);
+  opsin.ShrinkTo(dim.xsize, dim.ysize);
+  ToXYB(input, pool, &opsin);
+  PadImageToBlockMultipleInPlace(&opsin, pool);
+
+  const bool lightning = params.effort == EncoderEffort::kLightning;
+
+  // Compute adaptive quantization field (relies on pre-gaborish values).
+  const QuantScales& qscales = params.qscales;
+  ImageF quant_field, masking;
+  ImageI raw_quant_field;
+  if (lightning) {
+    ComputeFastAdaptiveQuantField(
+        opsin, Rect(0, 0, dim.xsize_blocks, dim.ysize_blocks), params.distance,
+        qscales.scale, pool, &masking, &quant_field, &raw_quant_field);
+  } else {
+    ComputeAdaptiveQuantField(opsin, params.distance, qscales.scale, pool,
+                              &masking, &quant_field, &raw_quant_field);
+  }
+
+  if (params.gaborish) {
+    // Apply inverse-gaborish.
+    GaborishInverse(&opsin, kGaborishMul, pool);
+  }
+
+  // Compute per-tile color correlation values.
+  ColorCorrelationMap cmap(dim.xsize, dim.ysize);
+  JXL_RETURN_IF_ERROR(ComputeColorCorrelationMap(opsin, matrices, pool, &cmap));
+
+  // Compute block sizes.
+  AcStrategyImage ac_strategy(dim.xsize_blocks, dim.ysize_blocks);
+  if (lightning) {
+    ac_strategy.FillDCT8();
+  } else {
+    JXL_RETURN_IF_ERROR(ChooseAcStrategy(opsin, params, cmap, quant_field,
+                                         masking, pool, matrices,
+                                         &ac_strategy));
+    JXL_RETURN_IF_ERROR(
+        AdjustQuantField(ac_strategy, pool, &raw_quant_field));
+  }
+
+  // Compute DC image and AC coefficient tokens.
+  Image3F dc(dim.xsize_blocks, dim.ysize_blocks);
+  std::vector<PackedTokens> ac_tokens(dim.num_groups);
+  HistogramBuilder ac_histograms(kNumACContexts);
+  JXL_RETURN_IF_ERROR(ComputeCoefficients(
+      opsin, raw_quant_field, matrices, qscales.scale, cmap, ac_strategy,
+      params.x_qm_mul, pool, &dc, &ac_tokens,
+      params.preset ? nullptr : &ac_histograms));
+
+  return WriteFrameSections(dim, params, cmap, ac_strategy, raw_quant_field,
+                            dc, &ac_tokens, &ac_histograms, pool, writer,
+                            sections);
+}
+
+// Per-thread state of EncodeFrameFused().
+struct FusedGroupState {
+  FusedGroupState()
+      : pool(0),
+        xyb(kGroupDim + 2 * kRegionBorder, kGroupDim + 2 * kRegionBorder),
+        buffers(kGroupDim, kGroupDim),
+        ac_histograms(kNumACContexts) {}
+
+  // Runs the stages of a group on the thread that owns the group, so that
+  // its pixels stay in the cache of that core, unless there are fewer groups
+  // than threads.
+  ThreadPool pool;
+  Image3F xyb;
+  RegionBuffers buffers;
+  HistogramBuilder ac_histograms;
+};
+
+template <class Input>
+Status EncodeFrameFused(const FrameParams& params, const ImageDim& dim,
+                        const Input& input, const DequantMatrices& matrices,
+                        ThreadPool* pool, BitWriter* writer,
+                        std::vector<BitWriter>* sections) {
+  const size_t xsize_padded = dim.xsize_blocks * kBlockDim;
+  const size_t ysize_padded = dim.ysize_blocks * kBlockDim;
+  EncodeStats* stats = pool != nullptr ? pool->stats() : nullptr;
+  FrameData frame(dim);
+  std::vector<std::unique_ptr<FusedGroupState>> states;
+  // With fewer groups than threads, the stages of every group are split
+  // across the threads of `pool` instead, so that small images do not leave
+  // most threads idle.
+  const bool split_groups =
+      pool != nullptr && dim.num_groups < pool->num_threads();
+  std::atomic<bool> ok{true};
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, dim.num_groups,
+      [&](const size_t num_threads) {
+        states.resize(num_threads);
+        return true;
+      },
+      [&](const uint32_t group_index, const size_t thread) {
+        if (!states[thread]) {
+          states[thread].reset(new FusedGroupState());
+          states[thread]->pool.SetStats(stats);
+        }
+        FusedGroupState* state = states[thread].get();
+        ThreadPool* group_pool = split_groups ? pool : &state->pool;
+        const Rect block_rect = dim.BlockRect(group_index);
+        const Rect rect(block_rect.x0() * kBlockDim,
+                        block_rect.y0() * kBlockDim,
+                        block_rect.xsize() * kBlockDim,
+                        block_rect.ysize() * kBlockDim);
+        // The group plus its border, clamped to the padded image.
+        const size_t ext_x0 =
+            rect.x0() < kRegionBorder ? 0 : rect.x0() - kRegionBorder;
+        const size_t ext_y0 =
+            rect.y0() < kRegionBorder ? 0 : rect.y0() - kRegionBorder;
+        const size_t ext_x1 = std::min(rect.x1() + kRegionBorder, xsize_padded);
+        const size_t ext_y1 = std::min(rect.y1() + kRegionBorder, ysize_padded);
+
+        // Transform the input pixels of the group to XYB colorspace.
+        Image3F& xyb = state->xyb;
+        xyb.ShrinkTo(ext_x1 - ext_x0, ext_y1 - ext_y0);
+        const Rect rect_in(ext_x0, ext_y0, ext_x1 - ext_x0, ext_y1 - ext_y0,
+                           dim.xsize, dim.ysize);
+        ToXYB(input, rect_in, group_pool,
+              Rect(0, 0, rect_in.xsize(), rect_in.ysize()), &xyb);
+        PadRegionToBlockMultiple(dim, ext_x0, ext_y0, &xyb);
+
+        if (!EncodeRegion(params, matrices, xyb, ext_x0, ext_y0, rect,
+                          group_pool, &state->buffers,
+                          &state->ac_histograms, &frame)) {
+          ok = false;
+        }
+      },
+      "EncodeGroupFused"));
+  JXL_RETURN_IF_ERROR(ok.load());
+
+  HistogramBuilder ac_histograms(kNumACContexts);
+  std::vector<const HistogramBuilder*> state_histograms;
+  for (const auto& state : states) {
+    if (state && !params.preset) {
+      state_histograms.push_back(&state->ac_histograms);
+    }
+  }
+  JXL_RETURN_IF_ERROR(MergeHistograms(state_histograms, pool, &ac_histograms));
+  JXL_RETURN_IF_ERROR(
+      ComputeColorCorrelationDC(frame.cfl_dc_values, pool, &frame.cmap));
+
+  return WriteFrameSections(dim, params, frame.cmap, frame.ac_strategy,
+                            frame.raw_quant_field, frame.dc, &frame.ac_tokens,
+                            &ac_histograms, pool, writer, sections);
+}
+
+template <class Input>
+Status EncodeFrameImpl(const FrameParams& params, const Input& input,
+                       const FramePipeline pipeline,
+                       const DequantMatrices& matrices, ThreadPool* pool,
+                       BitWriter* writer, std::vector<BitWriter>* sections) {
+  // Pre-compute image dimension-derived values.
+  ImageDim dim(input.xsize(), input.ysize());
+
+  // Write frame header.
+  WriteFrameHeader(params.x_qm_scale, params.epf_iters, params.gaborish,
+                   params.num_passes, writer);
+
+  if (pipeline == FramePipeline::kFused) {
+    return EncodeFrameFused(params, dim, input, matrices, pool, writer,
+                            sections);
+  }
+  return EncodeFramePhaseByPhase(params, dim, input, matrices, pool, writer,
+                                 sections);
+}
+
+// EncodeFramePhaseByPhase() for each of `params`, which only differ in the
+// distance, with the stages that do not depend on the distance run once: the
+// color conversion, the masking of the adaptive quantization, and the inverse
+// gaborish and the chroma from luma statistics, which are computed once for
+// the distances with and once for those without gaborish.
+template <class Input>
+Status EncodeFramesMultiDistance(const std::vector<FrameParams>& params,
+                                 const Input& input,
+                                 const DequantMatrices& matrices,
+                                 ThreadPool* pool,
+                                 const std::vector<BitWriter*>& writers,
+                                 const std::vector<std::vector<BitWriter>*>&
+                                     sections) {
+  ImageDim dim(input.xsize(), input.ysize());
+  const size_t num_frames = params.size();
+  const bool lightning = params[0].effort == EncoderEffort::kLightning;
+
+  // Transform image to XYB colorspace.
+  Image3F opsin(dim.xsize_blocks * kBlockDim, dim.ysize_blocks * kBlockDim);
+  opsin.ShrinkTo(dim.xsize, dim.ysize);
+  ToXYB(input, pool, &opsin);
+  PadImageToBlockMultipleInPlace(&opsin, pool);
+
+  // Compute the adaptive quantization fields of all distances while the
+  // pre-gaborish values are still there.
+  const Rect all_blocks(0, 0, dim.xsize_blocks, dim.ysize_blocks);
+  ImageF masking, eroded;
+  std::vector<ImageF> quant_fields(num_frames);
+  std::vector<ImageI> raw_quant_fields(num_frames);
+  if (!lightning) ComputeAdaptiveQuantMasking(opsin, pool, &masking, &eroded);
+  for (size_t i = 0; i < num_frames; ++i) {
+    if (lightning) {
+      // The fast field is cheap enough to recompute for every distance.
+      ComputeFastAdaptiveQuantField(opsin, all_blocks, params[i].distance,
+                                    params[i].qscales.scale, pool, &masking,
+                                    &quant_fields[i], &raw_quant_fields[i]);
+    } else {
+      ComputeAdaptiveQuantFieldFromMasking(
+          opsin, eroded, params[i].distance, params[i].qscales.scale, pool,
+          &quant_fields[i], &raw_quant_fields[i]);
+    }
+  }
+
+  // Apply inverse-gaborish, keeping a copy of the input of it if some of the
+  // distances are too small for gaborish.
+  bool any_gaborish = false;
+  bool all_gaborish = true;
+  for (const FrameParams& p : params) {
+    any_gaborish |= p.gaborish;
+    all_gaborish &= p.gaborish;
+  }
+  Image3F plain_opsin;
+  if (any_gaborish) {
+    if (!all_gaborish) {
+      plain_opsin = Image3F(opsin.xsize(), opsin.ysize());
+      CopyImageTo(Rect(opsin), opsin, Rect(opsin), &plain_opsin);
+    }
+    GaborishInverse(&opsin, kGaborishMul, pool);
+  }
+  const Image3F& gaborish_opsin = opsin;
+  const Image3F& no_gaborish_opsin = all_gaborish || !any_gaborish
+                                         ? opsin
+                                         : plain_opsin;
+
+  // Compute per-tile color correlation values.
+  ColorCorrelationMap gaborish_cmap, no_gaborish_cmap;
+  if (any_gaborish) {
+    gaborish_cmap = ColorCorrelationMap(dim.xsize, dim.ysize);
+    JXL_RETURN_IF_ERROR(ComputeColorCorrelationMap(gaborish_opsin, matrices,
+                                                   pool, &gaborish_cmap));
+  }
+  if (!all_gaborish) {
+    no_gaborish_cmap = ColorCorrelationMap(dim.xsize, dim.ysize);
+    JXL_RETURN_IF_ERROR(ComputeColorCorrelationMap(
+        no_gaborish_opsin, matrices, pool, &no_gaborish_cmap));
+  }
+
+  for (size_t i = 0; i < num_frames; ++i) {
+    const FrameParams& p = params[i];
+    const Image3F& frame_opsin = p.gaborish ? gaborish_opsin
+                                            : no_gaborish_opsin;
+    const ColorCorrelationMap& cmap =
+        p.gaborish ? gaborish_cmap : no_gaborish_cmap;
+    WriteFrameHeader(p.x_qm_scale, p.epf_iters, p.gaborish, p.num_passes,
+                     writers[i]);
+
+    // Compute block sizes.
+    AcStrategyImage ac_strategy(dim.xsize_blocks, dim.ysize_blocks);
+    if (lightning) {
+      ac_strategy.FillDCT8();
+    } else {
+      JXL_RETURN_IF_ERROR(ChooseAcStrategy(frame_opsin, p, cmap,
+                                           quant_fields[i], masking, pool,
+                                           matrices, &ac_strategy));
+      JXL_RETURN_IF_ERROR(
+          AdjustQuantField(ac_strategy, pool, &raw_quant_fields[i]));
+    }
+
+    // Compute DC image and AC coefficient tokens.
+    Image3F dc(dim.xsize_blocks, dim.ysize_blocks);
+    std::vector<PackedTokens> ac_tokens(dim.num_groups);
+    HistogramBuilder ac_histograms(kNumACContexts);
+    JXL_RETURN_IF_ERROR(ComputeCoefficients(
+        frame_opsin, raw_quant_fields[i], matrices, p.qscales.scale, cmap,
+        ac_strategy, p.x_qm_mul, pool, &dc, &ac_tokens,
+        p.preset ? nullptr : &ac_histograms));
+
+    JXL_RETURN_IF_ERROR(WriteFrameSections(
+        dim, p, cmap, ac_strategy, raw_quant_fields[i], dc, &ac_tokens,
+        &ac_histograms, pool, writers[i], sections[i]));
+  }
+  return true;
+}
+
+// Range of the distances that EncodeFrameTargetSize() searches, all of them
+// with gaborish.
+constexpr float kMinTargetDistance = 0.1f;
+constexpr float kMaxTargetDistance = 25.0f;
+// The search starts at this distance, with the block sizes chosen for it.
+constexpr float kInitialTargetDistance = 1.0f;
+// Initial guess of d log(size) / d log(distance) for the search.
+constexpr double kInitialTargetSizeSlope = -1.0;
+// The search ends at a size between (1 - kTargetSizeTolerance) * target and
+// the target.
+constexpr double kTargetSizeTolerance = 0.02;
+// Limits of the number of sizes estimated for each written frame and of the
+// number of frames written, of which the last one is used in any case.
+constexpr size_t kMaxTargetSizeEstimates = 10;
+constexpr size_t kMaxTargetSizeWrites = 8;
+// After the first write, the model is only trusted up to this factor away from
+// the distance of the last frame written.
+constexpr double kMaxTargetDistanceStep = 2.0;
+
+// The distance-dependent part of a frame quantized by EncodeFrameTargetSize().
+struct QuantizedFrame {
+  QuantizedFrame(const ImageDim& dim, float distance, EncoderEffort effort,
+                 const EntropyPresetCodes* preset, const FrameLayout* layout)
+      : params(distance, effort, preset, layout),
+        dc(dim.xsize_blocks, dim.ysize_blocks),
+        ac_tokens(dim.num_groups),
+        ac_histograms(kNumACContexts) {}
+
+  const FrameParams params;
+  ImageF quant_field;
+  ImageI raw_quant_field;
+  Image3F dc;
+  std::vector<PackedTokens> ac_tokens;
+  HistogramBuilder ac_histograms;
+  // Estimated size of the tokens of the frame in bytes.
+  double estimated_size;
+};
+
+// Estimates the size of the DC, AC metadata and AC tokens of `frame` from
+// their histograms.
+Status EstimateFrameSize(const ImageDim& dim, const ColorCorrelationMap& cmap,
+                         const AcStrategyImage& ac_strategy, ThreadPool* pool,
+                         QuantizedFrame* frame) {
+  std::vector<std::vector<Token>> dc_tokens(dim.num_dc_groups);
+  std::vector<std::vector<Token>> ac_meta_tokens(dim.num_dc_groups);
+  std::vector<size_t> num_ac_blocks(dim.num_dc_groups);
+  JXL_RETURN_IF_ERROR(ComputeDCTokens(frame->dc, cmap, dim,
+                                      frame->params.qscales.scale_dc, pool,
+                                      &dc_tokens));
+  JXL_RETURN_IF_ERROR(ComputeACMetadataTokens(
+      cmap, ac_strategy, frame->raw_quant_field, dim, pool, &ac_meta_tokens,
+      &num_ac_blocks));
+  HistogramBuilder dc_histograms(kNumDCContexts);
+  dc_histograms.Add(dc_tokens);
+  dc_histograms.Add(ac_meta_tokens);
+  const double bits =
+      EstimateTokenBits(dc_histograms.histograms, pool) +
+      EstimateTokenBits(frame->ac_histograms.histograms, pool);
+  frame->estimated_size = bits / kBitsPerByte;
+  return true;
+}
+
+// Encodes the frame at the distance for which the size of the image, the
+// bytes of `writer` so far plus those of the frame, is closest to
+// `target_size` without exceeding it. The color conversion, the masking, the
+// inverse gaborish, the chroma from luma map, the block sizes and their DCT
+// are computed only once, for kInitialTargetDistance; then the size of the
+// frame is estimated from the histograms of its tokens at the distances of a
+// secant search on the logarithms of distance and size, which only repeats
+// the quantization and the tokenization. The frame is written at the distance
+// found, and the difference of its actual and its estimated size corrects the
+// estimates of the next search if it is too large.
+template <class Input>
+Status EncodeFrameTargetSizeImpl(size_t target_size,
+                                 const EncoderEffort effort,
+                                 const Input& input,
+                                 const DequantMatrices& matrices,
+                                 const EntropyPresetCodes* preset,
+                                 const FrameLayout* layout, ThreadPool* pool,
+                                 BitWriter* writer,
+                                 std::vector<BitWriter>* sections,
+                                 float* distance, FramePreview* preview) {
+  ImageDim dim(input.xsize(), input.ysize());
+  const bool lightning = effort == EncoderEffort::kLightning;
+  const double header_size =
+      static_cast<double>(writer->BitsWritten()) / kBitsPerByte;
+  const double target = target_size;
+
+  // Transform image to XYB colorspace.
+  Image3F opsin(dim.xsize_blocks * kBlockDim, dim.ysize_blocks * kBlockDim);
+  opsin.ShrinkTo(dim.xsize, dim.ysize);
+  ToXYB(input, pool, &opsin);
+  PadImageToBlockMultipleInPlace(&opsin, pool);
+
+  // The quantization fields are computed from the pre-gaborish values, which
+  // are kept for that.
+  const Rect all_blocks(0, 0, dim.xsize_blocks, dim.ysize_blocks);
+  ImageF masking, eroded;
+  if (!lightning) ComputeAdaptiveQuantMasking(opsin, pool, &masking, &eroded);
+  const auto compute_quant_field = [&](QuantizedFrame* frame) {
+    const FrameParams& p = frame->params;
+    if (lightning) {
+      ImageF unused_masking;
+      ComputeFastAdaptiveQuantField(opsin, all_blocks, p.distance,
+                                    p.qscales.scale, pool, &unused_masking,
+                                    &frame->quant_field,
+                                    &frame->raw_quant_field);
+    } else {
+      ComputeAdaptiveQuantFieldFromMasking(
+          opsin, eroded, p.distance, p.qscales.scale, pool, &frame->quant_field,
+          &frame->raw_quant_field);
+    }
+  };
+
+  // Color correlation, block sizes and their DCT coefficients, from the
+  // inverse-gaborish image, which is not needed any more afterwards.
+  ColorCorrelationMap cmap(dim.xsize, dim.ysize);
+  AcStrategyImage ac_strategy(dim.xsize_blocks, dim.ysize_blocks);
+  ImageTransforms transforms;
   {
-    size_t num_sizes = group_codes.size();
-    BitWriter::Allotment allotment(writer, 1024 + 30 * num_sizes);
-    writer->Write(1, 0);      // no permutation
-    writer->ZeroPadToByte();  // before TOC entries
-    for (size_t i = 0; i < group_codes.size(); i++) {
-      JXL_ASSERT(group_codes[i].BitsWritten() % kBitsPerByte == 0);
-      const size_t group_size = group_codes[i].BitsWritten() / kBitsPerByte;
-      size_t offset = 0;
-      bool success = false;
-      static const size_t kBits[4] = {10, 14, 22, 30};
-      for (size_t i = 0; i < 4; ++i) {
-        if (group_size < offset + (1u << kBits[i])) {
-          writer->Write(2, i);
-          writer->Write(kBits[i], group_size - offset);
-          success = true;
-          break;
+    Image3F gaborish_opsin(opsin.xsize(), opsin.ysize());
+    GaborishInverse(opsin, Rect(opsin), kGaborishMul, pool, &gaborish_opsin);
+    JXL_RETURN_IF_ERROR(
+        ComputeColorCorrelationMap(gaborish_opsin, matrices, pool, &cmap));
+    if (lightning) {
+      ac_strategy.FillDCT8();
+    } else {
+      QuantizedFrame initial(dim, kInitialTargetDistance, effort, preset,
+                             layout);
+      compute_quant_field(&initial);
+      JXL_RETURN_IF_ERROR(ChooseAcStrategy(
+          gaborish_opsin, initial.params, cmap, initial.quant_field, masking,
+          pool, matrices, &ac_strategy));
+    }
+    JXL_RETURN_IF_ERROR(
+        ComputeTransforms(gaborish_opsin, ac_strategy, pool, &transforms));
+  }
+
+  // Quantizes the frame at `d` and estimates its size.
+  const auto quantize = [&](const float d,
+                            std::unique_ptr<QuantizedFrame>* frame) {
+    frame->reset(new QuantizedFrame(dim, d, effort, preset, layout));
+    QuantizedFrame* f = frame->get();
+    compute_quant_field(f);
+    if (!lightning) {
+      JXL_RETURN_IF_ERROR(
+          AdjustQuantField(ac_strategy, pool, &f->raw_quant_field));
+    }
+    JXL_RETURN_IF_ERROR(ComputeCoefficients(
+        opsin, f->raw_quant_field, matrices, f->params.qscales.scale, cmap,
+        ac_strategy, f->params.x_qm_mul, pool, &f->dc, &f->ac_tokens,
+        &f->ac_histograms, &transforms));
+    return EstimateFrameSize(dim, cmap, ac_strategy, pool, f);
+  };
+
+  // The actual size of a frame is modeled as mul * estimate + add, with the
+  // line through the last two frames written, or through the origin and the
+  // last one while there is only one. Most of the difference is the cost of
+  // the histograms, which is significant for small images.
+  double mul = 1.0;
+  double add = 0.0;
+  double written_estimate = 0.0;
+  double written_size = 0.0;
+  double written_distance = 0.0;
+  // The distances of the frames written that were too large (lo) and that fit
+  // (hi) bound all later searches, zero and infinity if there are none yet.
+  double written_lo = 0.0;
+  double written_hi = std::numeric_limits<double>::infinity();
+  float d = kInitialTargetDistance;
+  // The frame written last, and the largest one written so far that fits.
+  BitWriter frame_writer, best_writer;
+  std::vector<BitWriter> frame_sections, best_sections;
+  float best_distance = 0.0f;
+  double best_size = 0.0;
+  std::unique_ptr<QuantizedFrame> frame;
+  for (size_t write = 0; write < kMaxTargetSizeWrites; ++write) {
+    // Distances estimated to give a too large (lo) and a small enough (hi)
+    // size with the current model.
+    double lo = written_lo;
+    double hi = written_hi;
+    double slope = kInitialTargetSizeSlope;
+    double prev_d = 0.0;
+    double prev_size = 0.0;
+    for (size_t i = 0;; ++i) {
+      // After a write, the search continues from its distance with the
+      // corrected model.
+      if (!frame || frame->params.distance != d) {
+        JXL_RETURN_IF_ERROR(quantize(d, &frame));
+      }
+      const double size = header_size + mul * frame->estimated_size + add;
+      if (size > target) {
+        lo = d;
+      } else {
+        hi = d;
+      }
+      if ((size <= target && size >= (1.0 - kTargetSizeTolerance) * target) ||
+          i + 1 == kMaxTargetSizeEstimates ||
+          (size > target && d >= kMaxTargetDistance) ||
+          (size < target && d <= kMinTargetDistance)) {
+        break;
+      }
+      if (prev_d != 0.0) {
+        const double s = (std::log(size) - std::log(prev_size)) /
+                         (std::log(d) - std::log(prev_d));
+        // Keeps the previous slope if the sizes are too noisy for a new one.
+        if (std::isfinite(s) && s < 0.0) slope = s;
+      }
+      const double goal = (1.0 - 0.5 * kTargetSizeTolerance) * target;
+      double next = d * std::exp((std::log(goal) - std::log(size)) / slope);
+      if (next <= lo || next >= hi) {
+        next = lo == 0.0 ? hi * 0.5
+                         : std::isinf(hi) ? lo * 2.0 : std::sqrt(lo * hi);
+      }
+      if (written_distance != 0.0) {
+        next = std::max(next, written_distance / kMaxTargetDistanceStep);
+        next = std::min(next, written_distance * kMaxTargetDistanceStep);
+      }
+      prev_d = d;
+      prev_size = size;
+      d = std::min(std::max(static_cast<float>(next), kMinTargetDistance),
+                   kMaxTargetDistance);
+      if (d == prev_d) break;
+    }
+    // If no frame fits yet, the last one is written at the largest distance.
+    if (write + 1 == kMaxTargetSizeWrites && best_size == 0.0 &&
+        d != kMaxTargetDistance) {
+      d = kMaxTargetDistance;
+      JXL_RETURN_IF_ERROR(quantize(d, &frame));
+    }
+    // No distance between two frames written is left to try.
+    if (d == written_lo || d == written_hi) break;
+
+    frame_writer = BitWriter();
+    const FrameParams& p = frame->params;
+    WriteFrameHeader(p.x_qm_scale, p.epf_iters, p.gaborish, p.num_passes,
+                     &frame_writer);
+    JXL_RETURN_IF_ERROR(WriteFrameSections(
+        dim, p, cmap, ac_strategy, frame->raw_quant_field, frame->dc,
+        &frame->ac_tokens, &frame->ac_histograms, pool, &frame_writer,
+        &frame_sections));
+    double frame_size =
+        static_cast<double>(frame_writer.BitsWritten()) / kBitsPerByte;
+    for (const BitWriter& section : frame_sections) {
+      frame_size += static_cast<double>(section.BitsWritten()) / kBitsPerByte;
+    }
+    const double size = header_size + frame_size;
+    if (size > target) {
+      written_lo = std::max<double>(written_lo, d);
+    } else {
+      written_hi = std::min<double>(written_hi, d);
+    }
+    if (size <= target && size > best_size) {
+      std::swap(frame_writer, best_writer);
+      std::swap(frame_sections, best_sections);
+      best_distance = d;
+      best_size = size;
+    }
+    if (best_size >= (1.0 - 2 * kTargetSizeTolerance) * target ||
+        (size <= target && d <= kMinTargetDistance) ||
+        (size > target && d >= kMaxTargetDistance)) {
+      break;
+    }
+    const double estimate = frame->estimated_size;
+    mul = frame_size / estimate;
+    add = 0.0;
+    if (write != 0 && estimate != written_estimate) {
+      const double line_mul =
+          (frame_size - written_size) / (estimate - written_estimate);
+      if (line_mul > 0.0) {
+        mul = line_mul;
+        add = frame_size - mul * estimate;
+      }
+    }
+    written_estimate = estimate;
+    written_size = frame_size;
+    written_distance = d;
+  }
+
+  // If no frame fits, the last one is used, which was written at the largest
+  // distance.
+  if (best_distance == 0.0f) {
+    std::swap(frame_writer, best_writer);
+    std::swap(frame_sections, best_sections);
+    best_distance = d;
+  }
+  BitWriter::Allotment allotment(writer, best_writer.BitsWritten());
+  writer->AppendUnaligned(best_writer);
+  allotment.Reclaim(writer);
+  sections->swap(best_sections);
+  if (distance != nullptr) *distance = best_distance;
+  // The DC does not depend on the distance.
+  if (preview != nullptr) ComputePreview(frame->dc, pool, preview);
+  return true;
+}
+
+template <class Input>
+Status EncodeFramesImpl(Span<const float> distances,
+                        const EncoderEffort effort, const Input& input,
+                        const DequantMatrices& matrices,
+                        const EntropyPresetCodes* preset,
+                        const FrameLayout* layout, ThreadPool* pool,
+                        const std::vector<BitWriter*>& writers,
+                        const std::vector<std::vector<BitWriter>*>& sections,
+                        FramePreview* preview) {
+  JXL_ASSERT(writers.size() == distances.size());
+  JXL_ASSERT(sections.size() == distances.size());
+  if (distances.size() == 0) return true;
+  std::vector<FrameParams> params;
+  params.reserve(distances.size());
+  for (size_t i = 0; i < distances.size(); ++i) {
+    // The DC does not depend on the distance, so one preview is enough.
+    params.emplace_back(distances[i], effort, preset, layout,
+                        i == 0 ? preview : nullptr);
+  }
+  return EncodeFramesMultiDistance(params, input, matrices, pool, writers,
+                                   sections);
+}
+
+// Contexts of the modular context tree tokens.
+constexpr uint32_t kSplitValContext = 0;
+constexpr uint32_t kPropertyContext = 1;
+constexpr uint32_t kPredictorContext = 2;
+constexpr uint32_t kOffsetContext = 3;
+constexpr uint32_t kMultiplierLogContext = 4;
+constexpr uint32_t kMultiplierBitsContext = 5;
+
+constexpr uint32_t kGradientPredictor = 5;
+
+// Modular context tree of the near-lossless frames. Every leaf uses the
+// gradient predictor; the context is given by the channel and by the local
+// gradients W - NW and NW - N (modular properties 10 and 11), each of which
+// falls into one of kNumBuckets buckets.
+class NearLosslessTree {
+ public:
+  static constexpr size_t kNumBuckets = 5;
+  static constexpr size_t kNumContexts = 3 * kNumBuckets * kNumBuckets;
+
+  NearLosslessTree(const ResidualQuantizer& quantizer, size_t bits_per_sample) {
+    // The thresholds grow with the sample range and with the quantization
+    // step, since the gradients of the decoded samples are (mostly) multiples
+    // of it.
+    const int32_t scale = 1 << (bits_per_sample - 8);
+    t1_ = 2 * scale + quantizer.step() / 2;
+    t2_ = 12 * scale + 2 * quantizer.step();
+    bucket_.resize(2 * t2_ + 3);
+    for (int32_t d = -t2_ - 1; d <= t2_ + 1; ++d) {
+      bucket_[d + t2_ + 1] = d > t2_ ? 4 : d > t1_ ? 3 : d >= -t1_ ? 2
+                                                   : d >= -t2_ ? 1 : 0;
+    }
+    BuildTokens(quantizer.step());
+  }
+
+  JXL_INLINE uint32_t Context(size_t c, int32_t w_nw, int32_t nw_n) const {
+    return (c * kNumBuckets + Bucket(w_nw)) * kNumBuckets + Bucket(nw_n);
+  }
+
+  // Thresholds of the buckets, see Bucket().
+  int32_t t1() const { return t1_; }
+  int32_t t2() const { return t2_; }
+
+  const std::vector<Token>& tokens() const { return tokens_; }
+
+  // Context of each leaf, in the order in which the decoder numbers them.
+  const std::vector<uint32_t>& leaf_contexts() const { return leaf_contexts_; }
+
+ private:
+  struct Node {
+    int32_t property;  // -1 for leaves
+    int32_t splitval;
+    // Taken if the property is greater than `splitval`, resp. otherwise.
+    size_t lchild;
+    size_t rchild;
+    uint32_t context;
+  };
+
+  JXL_INLINE uint32_t Bucket(int32_t d) const {
+    return bucket_[Clamp1(d, -t2_ - 1, t2_ + 1) + t2_ + 1];
+  }
+
+  size_t AddNode(int32_t property, int32_t splitval, size_t lchild,
+                 size_t rchild, uint32_t context) {
+    nodes_.push_back(Node{property, splitval, lchild, rchild, context});
+    return nodes_.size() - 1;
+  }
+
+  // Adds the nodes that split the `property` into the buckets, whose subtrees
+  // are given by `bucket_node`.
+  template <typename BucketNode>
+  size_t AddBuckets(int32_t property, const BucketNode& bucket_node) {
+    const size_t high = AddNode(property, t2_, bucket_node(4), bucket_node(3),
+                                0);
+    const size_t low = AddNode(property, -t2_ - 1, bucket_node(1),
+                               bucket_node(0), 0);
+    const size_t middle = AddNode(property, -t1_ - 1, bucket_node(2), low, 0);
+    return AddNode(property, t1_, high, middle, 0);
+  }
+
+  void BuildTokens(uint32_t step) {
+    size_t channel_root[3];
+    for (uint32_t c = 0; c < 3; ++c) {
+      channel_root[c] = AddBuckets(10, [&](uint32_t b10) {
+        return AddBuckets(11, [&](uint32_t b11) {
+          return AddNode(-1, 0, 0, 0, (c * kNumBuckets + b10) * kNumBuckets +
+                                          b11);
+        });
+      });
+    }
+    const size_t c01 = AddNode(0, 0, channel_root[1], channel_root[0], 0);
+    const size_t root = AddNode(0, 1, channel_root[2], c01, 0);
+    // The decoder reads the nodes in breadth-first order.
+    std::queue<size_t> queue;
+    queue.push(root);
+    while (!queue.empty()) {
+      const Node& node = nodes_[queue.front()];
+      queue.pop();
+      tokens_.emplace_back(kPropertyContext, node.property + 1);
+      if (node.property < 0) {
+        tokens_.emplace_back(kPredictorContext, kGradientPredictor);
+        tokens_.emplace_back(kOffsetContext, PackSigned(0));
+        tokens_.emplace_back(kMultiplierLogContext, 0);
+        tokens_.emplace_back(kMultiplierBitsContext, step - 1);
+        leaf_contexts_.push_back(node.context);
+        continue;
+      }
+      tokens_.emplace_back(kSplitValContext, PackSigned(node.splitval));
+      queue.push(node.lchild);
+      queue.push(node.rchild);
+    }
+  }
+
+  int32_t t1_;
+  int32_t t2_;
+  std::vector<uint8_t> bucket_;
+  std::vector<Node> nodes_;
+  std::vector<Token> tokens_;
+  std::vector<uint32_t> leaf_contexts_;
+};
+
+// Per-thread buffers of ComputeNearLosslessTokens() and
+// ComputeLosslessTokens().
+struct ModularRows {
+  std::vector<int32_t> samples;
+  std::vector<uint32_t> residuals;
+  std::vector<uint32_t> contexts;
+  // Token counts of every context, kMaxModularTokens per context.
+  std::vector<int32_t> counts;
+};
+
+// Upper bound of the tokens of the residuals of samples with up to 16 bits.
+// Their PackSigned() values are below 2^17, whose UintCoder tokens are at most
+// 4 * 16 + 3.
+constexpr size_t kMaxModularTokens = 72;
+
+// Computes the tokens of the samples in `rect` of `srgb`, which are coded as
+// the three channels of one modular image. The samples are predicted from the
+// decoded values of their neighbours, which are kept in `rows`.
+template <typename T>
+void ComputeNearLosslessTokens(const InterleavedImage& srgb, const Rect& rect,
+                               const ResidualQuantizer& quantizer,
+                               const NearLosslessTree& tree, ModularRows* rows,
+                               PackedTokens* tokens,
+                               HistogramBuilder* histograms) {
+  const size_t xsize = rect.xsize();
+  const size_t num_channels = srgb.num_channels();
+  const int32_t step = quantizer.step();
+  rows->samples.resize(2 * xsize);
+  tokens->reserve(3 * xsize * rect.ysize());
+  for (size_t c = 0; c < 3; ++c) {
+    int32_t* JXL_RESTRICT prev = rows->samples.data();
+    int32_t* JXL_RESTRICT cur = rows->samples.data() + xsize;
+    for (size_t y = 0; y < rect.ysize(); ++y) {
+      const T* JXL_RESTRICT row_in =
+          reinterpret_cast<const T*>(srgb.ConstRow(rect.y0() + y)) +
+          rect.x0() * num_channels + c;
+      for (size_t x = 0; x < xsize; ++x) {
+        const int32_t left = x ? cur[x - 1] : y ? prev[x] : 0;
+        const int32_t top = y ? prev[x] : left;
+        const int32_t topleft = x && y ? prev[x - 1] : left;
+        const int32_t guess = ClampedGradient(top, left, topleft);
+        const int32_t k =
+            quantizer.Quantize(row_in[x * num_channels] - guess);
+        cur[x] = guess + k * step;
+        const Token token(tree.Context(c, left - topleft, topleft - top),
+                          PackSigned(k));
+        tokens->emplace_back(token.context, token.value);
+        histograms->Add(token);
+      }
+      std::swap(prev, cur);
+    }
+  }
+}
+
+// Same as ComputeNearLosslessTokens() with a maximum error of zero, where the
+// decoded samples are those of the input, so that a whole row can be
+// predicted at once.
+template <typename T>
+void ComputeLosslessTokens(const InterleavedImage& srgb, const Rect& rect,
+                           const NearLosslessTree& tree, ModularRows* rows,
+                           PackedTokens* tokens,
+                           HistogramBuilder* histograms) {
+  const size_t xsize = rect.xsize();
+  const size_t num_channels = srgb.num_channels();
+  // Every row starts with the W neighbour of its first sample.
+  rows->samples.resize(2 * (xsize + 1));
+  rows->residuals.resize(xsize);
+  rows->contexts.resize(xsize);
+  tokens->reserve(3 * xsize * rect.ysize());
+  rows->counts.assign(NearLosslessTree::kNumContexts * kMaxModularTokens, 0);
+  int32_t* JXL_RESTRICT counts = rows->counts.data();
+  const UintCoder uint_coder;
+  // PredictGradientRow() computes the contexts of the tree.
+  static_assert(NearLosslessTree::kNumBuckets == 5, "Bucket mismatch");
+  for (size_t c = 0; c < 3; ++c) {
+    const uint32_t context_base = c * NearLosslessTree::kNumBuckets *
+                                  NearLosslessTree::kNumBuckets;
+    int32_t* JXL_RESTRICT prev = rows->samples.data() + 1;
+    int32_t* JXL_RESTRICT cur = rows->samples.data() + xsize + 2;
+    for (size_t y = 0; y < rect.ysize(); ++y) {
+      const T* JXL_RESTRICT row_in =
+          reinterpret_cast<const T*>(srgb.ConstRow(rect.y0() + y)) +
+          rect.x0() * num_channels + c;
+      for (size_t x = 0; x < xsize; ++x) {
+        cur[x] = row_in[x * num_channels];
+      }
+      // The first sample of a row is predicted from the one above it, those
+      // of the first row from the one to the left.
+      if (y == 0) {
+        cur[-1] = 0;
+        PredictGradientRow(cur - 1, cur - 1, cur - 1, cur, xsize, tree.t1(),
+                           tree.t2(), context_base,
+                           rows->residuals.data(), rows->contexts.data());
+      } else {
+        cur[-1] = prev[0];
+        prev[-1] = prev[0];
+        PredictGradientRow(cur - 1, prev, prev - 1, cur, xsize, tree.t1(),
+                           tree.t2(), context_base,
+                           rows->residuals.data(), rows->contexts.data());
+      }
+      for (size_t x = 0; x < xsize; ++x) {
+        const uint32_t context = rows->contexts[x];
+        const uint32_t residual = rows->residuals[x];
+        uint32_t tok, nbits, bits;
+        uint_coder.Encode(residual, &tok, &nbits, &bits);
+        JXL_DASSERT(tok < kMaxModularTokens);
+        tokens->emplace_back(context, residual);
+        ++counts[context * kMaxModularTokens + tok];
+      }
+      std::swap(prev, cur);
+    }
+  }
+  // Same histograms as adding the tokens one by one.
+  for (size_t context = 0; context < NearLosslessTree::kNumContexts;
+       ++context) {
+    histograms->histograms[context].AddCounts(
+        counts + context * kMaxModularTokens, kMaxModularTokens);
+  }
+}
+
+}  // namespace
+
+Status ComputeSectionOrder(size_t xsize, size_t ysize,
+                           const FrameLayout* layout,
+                           std::vector<uint32_t>* order) {
+  const size_t num_passes = layout != nullptr && layout->two_passes ? 2 : 1;
+  return ComputeSectionOrder(ImageDim(xsize, ysize), num_passes, layout, order);
+}
+
+Status EncodeFrame(const float distance, const EncoderEffort effort,
+                   const Image3F& linear, const FramePipeline pipeline,
+                   const DequantMatrices& matrices,
+                   const EntropyPresetCodes* preset,
+                   const FrameLayout* layout, ThreadPool* pool,
+                   BitWriter* writer, std::vector<BitWriter>* sections,
+                   FramePreview* preview) {
+  const FrameParams params(distance, effort, preset, layout, preview);
+  return EncodeFrameImpl(params, linear, pipeline, matrices, pool, writer,
+                         sections);
+}
+
+Status EncodeFrame(const float distance, const EncoderEffort effort,
+                   const InterleavedImage& srgb, const FramePipeline pipeline,
+                   const DequantMatrices& matrices,
+                   const EntropyPresetCodes* preset,
+                   const FrameLayout* layout, ThreadPool* pool,
+                   BitWriter* writer, std::vector<BitWriter>* sections,
+                   FramePreview* preview) {
+  const FrameParams params(distance, effort, preset, layout, preview);
+  return EncodeFrameImpl(params, srgb, pipeline, matrices, pool, writer,
+                         sections);
+}
+
+Status EncodeFrame(const float distance, const EncoderEffort effort,
+                   const size_t xsize, const size_t ysize,
+                   const ImageRowsCallback& get_rows,
+                   const DequantMatrices& matrices,
+                   const EntropyPresetCodes* preset,
+                   const FrameLayout* layout, ThreadPool* pool,
+                   BitWriter* writer, std::vector<BitWriter>* sections,
+                   FramePreview* preview) {
+  // Pre-compute image dimension-derived values.
+  ImageDim dim(xsize, ysize);
+  const size_t xsize_padded = dim.xsize_blocks * kBlockDim;
+  const size_t ysize_padded = dim.ysize_blocks * kBlockDim;
+
+  // Write frame header.
+  const FrameParams params(distance, effort, preset, layout, preview);
+  WriteFrameHeader(params.x_qm_scale, params.epf_iters, params.gaborish,
+                   params.num_passes, writer);
+
+  FrameData frame(dim);
+  const size_t num_passes = params.num_passes;
+  sections->clear();
+  sections->resize(2 + dim.num_dc_groups + num_passes * dim.num_groups);
+
+  // The AC groups of every band are written as soon as its tokens are
+  // computed, so that the tokens of only one band are kept. Without a preset,
+  // this needs the entropy codes of the whole frame, so the image is encoded
+  // twice: the first run only adds up the histograms of the tokens of every
+  // band, and the second one writes them.
+  HistogramBuilder ac_histograms(kNumACContexts);
+  std::vector<HistogramBuilder> pass_histograms;
+  HistogramBuilder* histograms[2] = {&ac_histograms, nullptr};
+  if (num_passes == 2 && params.preset == nullptr) {
+    pass_histograms.resize(2, HistogramBuilder(kNumACContexts));
+    histograms[0] = &pass_histograms[0];
+    histograms[1] = &pass_histograms[1];
+  }
+  ACCodes ac_codes;
+  BitWriter* ac_global = &(*sections)[dim.num_dc_groups + 1];
+  const size_t first_run = params.preset == nullptr ? 0 : 1;
+  if (first_run == 1) {
+    JXL_RETURN_IF_ERROR(
+        WriteACGlobal(dim, params, histograms, pool, &ac_codes, ac_global));
+  }
+
+  // The image is processed in bands of one group row. `xyb` holds the band
+  // plus kRegionBorder rows above and below it, starting at image row
+  // `xyb_y0`. The border rows are carried over to the next band, so every
+  // input row is converted once per run.
+  Image3F linear(dim.xsize, kGroupDim + kRegionBorder);
+  Image3F xyb(xsize_padded, kGroupDim + 2 * kRegionBorder);
+  RegionBuffers buffers(xsize_padded, kGroupDim);
+
+  for (size_t run = first_run; run < 2; ++run) {
+    const bool write = run == 1;
+    size_t xyb_y0 = 0;
+    size_t xyb_y1 = 0;
+    for (size_t gy = 0; gy < dim.ysize_groups; ++gy) {
+      const size_t y0 = gy * kGroupDim;
+      const size_t y1 = std::min(y0 + kGroupDim, ysize_padded);
+      const size_t ext_y0 = y0 < kRegionBorder ? 0 : y0 - kRegionBorder;
+      const size_t ext_y1 = std::min(y1 + kRegionBorder, ysize_padded);
+
+      // Move the rows shared with the previous band to the top.
+      const size_t num_kept = xyb_y1 > ext_y0 ? xyb_y1 - ext_y0 : 0;
+      for (size_t c = 0; c < 3; ++c) {
+        for (size_t y = 0; y < num_kept; ++y) {
+          memcpy(xyb.PlaneRow(c, y), xyb.ConstPlaneRow(c, ext_y0 - xyb_y0 + y),
+                 xsize_padded * sizeof(float));
         }
-        offset += (1u << kBits[i]);
       }
-      JXL_RETURN_IF_ERROR(success);
+      xyb.ShrinkTo(xsize_padded, ext_y1 - ext_y0);
+
+      // Read and transform the new input rows to XYB colorspace, then pad
+      // them to a multiple of the block size.
+      const size_t read_y0 = ext_y0 + num_kept;
+      const size_t read_y1 = std::min(ext_y1, dim.ysize);
+      if (read_y1 > read_y0) {
+        linear.ShrinkTo(dim.xsize, read_y1 - read_y0);
+        if (!get_rows(read_y0, &linear)) {
+          return JXL_FAILURE("Failed to get input rows %" PRIuS "..%" PRIuS,
+                             read_y0, read_y1);
+        }
+        ToXYB(linear, pool,
+              Rect(0, read_y0 - ext_y0, linear.xsize(), linear.ysize()), &xyb);
+      }
+      PadRegionToBlockMultiple(dim, 0, ext_y0, &xyb);
+      xyb_y0 = ext_y0;
+      xyb_y1 = ext_y1;
+
+      // With two passes, the histograms are those of the split tokens.
+      HistogramBuilder* band_histograms =
+          write || num_passes == 2 ? nullptr : &ac_histograms;
+      JXL_RETURN_IF_ERROR(EncodeRegion(
+          params, matrices, xyb, 0, xyb_y0, Rect(0, y0, xsize_padded, y1 - y0),
+          pool, &buffers, band_histograms, &frame));
+
+      // Take the tokens of the band out of the frame.
+      const size_t first_group = gy * dim.xsize_groups;
+      std::vector<PackedTokens> tokens(dim.xsize_groups);
+      for (size_t gx = 0; gx < dim.xsize_groups; ++gx) {
+        tokens[gx].swap(frame.ac_tokens[first_group + gx]);
+      }
+      if (num_passes == 2) {
+        const size_t ysize_blocks = (y1 - y0) / kBlockDim;
+        AcStrategyImage ac_strategy(dim.xsize_blocks, ysize_blocks);
+        ac_strategy.CopyFrom(
+            Rect(0, y0 / kBlockDim, dim.xsize_blocks, ysize_blocks),
+            frame.ac_strategy, Rect(0, 0, dim.xsize_blocks, ysize_blocks));
+        std::vector<HistogramBuilder> no_histograms;
+        std::vector<PackedTokens> pass_tokens;
+        JXL_RETURN_IF_ERROR(SplitACPasses(
+            ac_strategy, tokens, kCoarsePassShift, pool, &pass_tokens,
+            write ? &no_histograms : &pass_histograms));
+        tokens.swap(pass_tokens);
+      }
+      if (write) {
+        JXL_RETURN_IF_ERROR(WriteACGroups(dim, params, ac_codes, tokens,
+                                          first_group, pool, sections));
+      }
     }
-    writer->ZeroPadToByte();
+    if (!write) {
+      JXL_RETURN_IF_ERROR(
+          WriteACGlobal(dim, params, histograms, pool, &ac_codes, ac_global));
+    }
+  }
+
+  JXL_RETURN_IF_ERROR(
+      ComputeColorCorrelationDC(frame.cfl_dc_values, pool, &frame.cmap));
+
+  return WriteFrameSections(dim, params, frame.cmap, frame.ac_strategy,
+                            frame.raw_quant_field, frame.dc,
+                            /*ac_tokens=*/nullptr, /*ac_histograms=*/nullptr,
+                            pool, writer, sections);
+}
+
+Status EncodeFrames(Span<const float> distances, const EncoderEffort effort,
+                    const Image3F& linear, const DequantMatrices& matrices,
+                    const EntropyPresetCodes* preset,
+                    const FrameLayout* layout, ThreadPool* pool,
+                    const std::vector<BitWriter*>& writers,
+                    const std::vector<std::vector<BitWriter>*>& sections,
+                    FramePreview* preview) {
+  return EncodeFramesImpl(distances, effort, linear, matrices, preset, layout,
+                          pool, writers, sections, preview);
+}
+
+Status EncodeFrames(Span<const float> distances, const EncoderEffort effort,
+                    const InterleavedImage& srgb,
+                    const DequantMatrices& matrices,
+                    const EntropyPresetCodes* preset,
+                    const FrameLayout* layout, ThreadPool* pool,
+                    const std::vector<BitWriter*>& writers,
+                    const std::vector<std::vector<BitWriter>*>& sections,
+                    FramePreview* preview) {
+  return EncodeFramesImpl(distances, effort, srgb, matrices, preset, layout,
+                          pool, writers, sections, preview);
+}
+
+Status EncodeFrameTargetSize(size_t target_size, const EncoderEffort effort,
+                             const Image3F& linear,
+                             const DequantMatrices& matrices,
+                             const EntropyPresetCodes* preset,
+                             const FrameLayout* layout, ThreadPool* pool,
+                             BitWriter* writer,
+                             std::vector<BitWriter>* sections,
+                             float* distance, FramePreview* preview) {
+  return EncodeFrameTargetSizeImpl(target_size, effort, linear, matrices,
+                                   preset, layout, pool, writer, sections,
+                                   distance, preview);
+}
+
+Status EncodeFrameTargetSize(size_t target_size, const EncoderEffort effort,
+                             const InterleavedImage& srgb,
+                             const DequantMatrices& matrices,
+                             const EntropyPresetCodes* preset,
+                             const FrameLayout* layout, ThreadPool* pool,
+                             BitWriter* writer,
+                             std::vector<BitWriter>* sections,
+                             float* distance, FramePreview* preview) {
+  return EncodeFrameTargetSizeImpl(target_size, effort, srgb, matrices,
+                                   preset, layout, pool, writer, sections,
+                                   distance, preview);
+}
+
+Status AddFrameHistograms(const float distance, const EncoderEffort effort,
+                          const Image3F& linear,
+                          const DequantMatrices& matrices, ThreadPool* pool,
+                          FrameHistograms* histograms) {
+  const FrameParams params(distance, effort, /*preset=*/nullptr,
+                           /*layout=*/nullptr, /*preview=*/nullptr,
+                           histograms);
+  BitWriter writer;
+  std::vector<BitWriter> sections;
+  return EncodeFrameImpl(params, linear, FramePipeline::kFused, matrices, pool,
+                         &writer, &sections);
+}
+
+Status EncodeNearLosslessFrame(const uint32_t max_error,
+                               const InterleavedImage& srgb, ThreadPool* pool,
+                               BitWriter* writer,
+                               std::vector<BitWriter>* sections) {
+  JXL_RETURN_IF_ERROR(srgb.Check());
+  const size_t bits_per_sample = srgb.bits_per_sample();
+  if (max_error >= (1u << bits_per_sample)) {
+    return JXL_FAILURE("Maximum error %u too large for %" PRIuS "-bit samples",
+                       max_error, bits_per_sample);
+  }
+  const ImageDim dim(srgb.xsize(), srgb.ysize());
+  const ResidualQuantizer quantizer(max_error);
+  const NearLosslessTree tree(quantizer, bits_per_sample);
+  constexpr size_t kNumContexts = NearLosslessTree::kNumContexts;
+  EncodeStats* stats = pool != nullptr ? pool->stats() : nullptr;
+
+  // Frame header: modular, no color transform, no loop filters.
+  {
+    BitWriter::Allotment allotment(writer, 1024);
+    writer->Write(1, 0);  // not all default
+    writer->Write(2, 0);  // regular frame
+    writer->Write(1, 1);  // modular
+    writer->Write(2, 0);  // no flags
+    writer->Write(1, 0);  // no YCbCr
+    writer->Write(2, 0);  // no upsampling
+    writer->Write(2, 1);  // group size 256
+    writer->Write(2, 0);  // one pass
+    writer->Write(1, 0);  // no custom frame size or origin
+    writer->Write(2, 0);  // replace blend mode
+    writer->Write(1, 1);  // last frame
+    writer->Write(2, 0);  // no name
+    writer->Write(1, 0);  // not default loop filter
+    writer->Write(1, 0);  // no gaborish
+    writer->Write(2, 0);  // no epf
+    writer->Write(2, 0);  // no loop filter extensions
+    writer->Write(2, 0);  // no frame header extensions
     allotment.Reclaim(writer);
   }
-  writer->AppendByteAligned(group_codes);
 
-  return true;
+  // Every group is a modular image of its own, with its own tokens.
+  std::vector<PackedTokens> tokens(dim.num_groups);
+  std::vector<HistogramBuilder> group_histograms(
+      dim.num_groups, HistogramBuilder(kNumContexts));
+  std::vector<ModularRows> rows;
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, dim.num_groups,
+      [&](const size_t num_threads) {
+        rows.resize(num_threads);
+        return true;
+      },
+      [&](const uint32_t group_index, const size_t thread) {
+        const Rect rect = dim.GroupRect(group_index);
+        if (max_error == 0 && bits_per_sample == 8) {
+          ComputeLosslessTokens<uint8_t>(srgb, rect, tree, &rows[thread],
+                                         &tokens[group_index],
+                                         &group_histograms[group_index]);
+        } else if (max_error == 0) {
+          ComputeLosslessTokens<uint16_t>(srgb, rect, tree, &rows[thread],
+                                          &tokens[group_index],
+                                          &group_histograms[group_index]);
+        } else if (bits_per_sample == 8) {
+          ComputeNearLosslessTokens<uint8_t>(
+              srgb, rect, quantizer, tree, &rows[thread], &tokens[group_index],
+              &group_histograms[group_index]);
+        } else {
+          ComputeNearLosslessTokens<uint16_t>(
+              srgb, rect, quantizer, tree, &rows[thread], &tokens[group_index],
+              &group_histograms[group_index]);
+        }
+      },
+      "ComputeNearLosslessTokens"));
+
+  // A small image has a single section, in which its channels are coded as
+  // part of the global modular image. Otherwise the DC groups and the AC
+  // global section are empty.
+  const bool is_small_image = dim.num_groups == 1;
+  sections->clear();
+  sections->resize(is_small_image ? 1 : 2 + dim.num_dc_groups + dim.num_groups);
+  BitWriter* global_writer = &(*sections)[0];
+
+  EntropyEncodingData codes;
+  std::vector<uint8_t> context_map;
+  {
+    ScopedStatsSpan span(stats, "ClusterAndWriteModularHistograms");
+    BitWriter::Allotment allotment(global_writer, 1024);
+    global_writer->Write(1, 1);  // default dequant dc
+    allotment.Reclaim(global_writer);
+    WriteTree(tree.tokens(), global_writer);
+    HistogramBuilder builder(kNumContexts);
+    std::vector<const HistogramBuilder*> histograms;
+    for (const HistogramBuilder& group : group_histograms) {
+      histograms.push_back(&group);
+    }
+    JXL_RETURN_IF_ERROR(MergeHistograms(histograms, pool, &builder));
+    JXL_RETURN_IF_ERROR(ClusterHistograms(&builder.histograms, &context_map,
+                                          /*refine=*/false, pool));
+    // The decoder looks up the clusters by leaf.
+    std::vector<uint8_t> leaf_context_map;
+    for (const uint32_t context : tree.leaf_contexts()) {
+      leaf_context_map.push_back(context_map[context]);
+    }
+    global_writer->AllocateAndWrite(1, 0);  // no lz77
+    WriteContextMap(leaf_context_map, global_writer);
+    WriteHistograms(builder.histograms, &codes, global_writer);
+  }
+
+  const auto write_group = [&](const uint32_t group_index,
+                               const size_t thread) {
+    BitWriter* group_writer =
+        &(*sections)[is_small_image ? 0 : 2 + dim.num_dc_groups + group_index];
+    group_writer->AllocateAndWrite(4, 3);  // use global tree, default wp,
+                                           // no transforms
+    WriteTokens(tokens[group_index], codes, context_map, group_writer);
+  };
+  if (is_small_image) {
+    write_group(0, 0);
+  } else {
+    // Header of the global modular image, all of whose channels are coded in
+    // the groups.
+    global_writer->AllocateAndWrite(4, 3);
+    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, dim.num_groups, ThreadPool::NoInit,
+                                  write_group, "EncodeNearLosslessGroup"));
+  }
+
+  return WriteTOC(dim, /*order=*/{}, stats, sections, writer);
 }
 
 }  // namespace jxl
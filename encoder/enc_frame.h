@@ -7,17 +7,251 @@
 #ifndef ENCODER_ENC_FRAME_H_
 #define ENCODER_ENC_FRAME_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+#include "encoder/ac_context.h"
+#include "encoder/ac_strategy.h"
 #include "encoder/base/data_parallel.h"
+#include "encoder/base/span.h"
 #include "encoder/base/status.h"
 #include "encoder/enc_bit_writer.h"
+#include "encoder/entropy_preset.h"
+#include "encoder/histogram.h"
 #include "encoder/image.h"
+#include "encoder/quant_weights.h"
 
 namespace jxl {
 
-// Encodes a single frame (including its header) into a byte stream.
-// Groups may be processed in parallel by `pool`.
-Status EncodeFrame(const float distance, const Image3F& linear,
-                   ThreadPool* pool, BitWriter* writer);
+// Provides the input of the streaming variant of EncodeFrame: `rows` has the
+// width of the image and must be filled with the linear sRGB samples of the
+// image rows [y0, y0 + rows->ysize()). The rows are requested in top to bottom
+// order, once per run over the image (see EncodeFrame()), so the same rows may
+// be requested again after the last one. Returns false on error.
+typedef std::function<bool(size_t y0, Image3F* rows)> ImageRowsCallback;
+
+// Order in which EncodeFrame() runs its stages (color conversion, adaptive
+// quantization, inverse gaborish, chroma from luma, block sizes, coefficients
+// and tokens) on the image. The result is the same for all of them.
+enum class FramePipeline {
+  // Every stage processes the whole image before the next one starts, each of
+  // them split into tasks for the pool. Every stage reads and writes
+  // whole-image buffers, which no longer fit in the caches for large images.
+  kPhaseByPhase,
+  // All stages run on one group (plus a border of a few pixels) before the
+  // next group is started, with one task per group. The intermediate images
+  // of a group are small enough to stay in the cache of the core.
+  kFused,
+};
+
+// How much time the encoder spends on finding a compact encoding of the image.
+// The distance, i.e. the visual quality, is the target at every effort.
+enum class EncoderEffort {
+  // Skips the searches of the encoder: every block is an 8x8 DCT, the
+  // quantization field is estimated from the gradients inside each block
+  // alone and the AC histograms are merged by a fixed context map instead of
+  // being clustered. About 2.5 times as fast as kDefault, for larger files
+  // (5% on textured images, much more on smooth ones).
+  kLightning,
+  kDefault,
+  // Also tries the 4x4 transforms for every 8x8 block, and refines the
+  // clustering of the AC histograms further.
+  kSlower,
+};
+
+// Order of the AC groups of a frame in the output, see FrameLayout.
+enum class GroupOrder {
+  // Rows of groups from top to bottom, each from left to right.
+  kRaster,
+  // By increasing distance of the center of the group from the center of the
+  // image, where the viewer is most likely to look first.
+  kCenterFirst,
+  // By decreasing FrameLayout::group_priority.
+  kPriority,
+};
+
+// Layout of the sections of a frame for progressive decoding. The DC of the
+// whole image always comes first, so a decoder can show all of it at 1:8
+// before the first AC group arrives; the layout decides in which order the AC
+// groups follow, written as a permutation in the TOC, and whether the AC
+// coefficients are split into two passes.
+struct FrameLayout {
+  GroupOrder group_order = GroupOrder::kRaster;
+  // For kPriority, the priority of every group in raster order. Groups with
+  // the same priority keep their raster order.
+  std::vector<float> group_priority;
+  // Codes every AC coefficient rounded towards zero to an even number in a
+  // first pass over all groups, and the rest in a second one. The first pass
+  // alone decodes to the whole image with half the AC precision, in about 40%
+  // of the AC bytes, at the cost of files 3% to 7% larger.
+  bool two_passes = false;
+  // Codes every block with the transform `ac_strategy` where it fits, aligned
+  // to its size, and the rest with 8x8 DCTs, instead of choosing the
+  // transform of each block. Only meant for testing decoders on every
+  // transform. Ignored at EncoderEffort::kLightning.
+  bool force_ac_strategy = false;
+  AcStrategy::Type ac_strategy = AcStrategy::DCT;
+};
+
+// The frame at 1:8, one pixel per 8x8 block, converted from the DC of the
+// blocks, which the encoder computes anyway: a thumbnail that costs almost
+// nothing. The DC is the average of the pixels of a block after the inverse
+// gaborish, so the preview is slightly sharper than a box-filtered downscale,
+// and the last row and column average the edge pixels repeated.
+struct FramePreview {
+  enum class Format {
+    // Planar linear SRGB samples in `linear`.
+    kLinear,
+    // Interleaved 8-bit sRGB samples in `srgb`, see XYBToSRGB8().
+    kSRGB8,
+  };
+  Format format = Format::kSRGB8;
+  size_t xsize = 0;
+  size_t ysize = 0;
+  Image3F linear;
+  std::vector<uint8_t> srgb;
+};
+
+// Encodes a single frame: its header and TOC are written to `writer`, which
+// is byte-aligned afterwards, and its sections to `sections`. The frame is the
+// bytes of `writer` followed by those of each of the `sections`; they are
+// kept apart so that the caller can pass them on to the output without
+// concatenating them first.
+// Groups may be processed in parallel by `pool`. The `matrices` only hold the
+// default quantization tables, so they can be shared by multiple frames, and
+// so can `preset`: if it is not null, the DC and AC tokens are coded with its
+// entropy codes instead of ones computed from their histograms. The sections
+// are laid out as given by `layout`, or in raster order in a single pass if it
+// is null. If `preview` is not null, it receives the preview of the frame in
+// its format.
+Status EncodeFrame(const float distance, const EncoderEffort effort,
+                   const Image3F& linear, const FramePipeline pipeline,
+                   const DequantMatrices& matrices,
+                   const EntropyPresetCodes* preset,
+                   const FrameLayout* layout, ThreadPool* pool,
+                   BitWriter* writer, std::vector<BitWriter>* sections,
+                   FramePreview* preview);
+
+// Same as above, but for 8 or 16 bit samples in the sRGB transfer function,
+// which are linearized while they are converted to XYB.
+Status EncodeFrame(const float distance, const EncoderEffort effort,
+                   const InterleavedImage& srgb, const FramePipeline pipeline,
+                   const DequantMatrices& matrices,
+                   const EntropyPresetCodes* preset,
+                   const FrameLayout* layout, ThreadPool* pool,
+                   BitWriter* writer, std::vector<BitWriter>* sections,
+                   FramePreview* preview);
+
+// Streaming variant of the above for images that are too large to be kept in
+// memory. The input is requested from `get_rows` and processed in bands of
+// one group row, and the AC groups of every band are written as soon as its
+// tokens are computed, so the memory used for pixels and tokens is
+// proportional to the image width. Without a `preset`, this takes two runs
+// over the input, the first one to compute the entropy codes of the AC tokens
+// of the whole frame. Memory still grows with the image area: the
+// per-block data of the frame, about 33 bytes per 8x8 block, its DC tokens
+// and `sections` are kept until the end. The result is identical to the
+// above.
+Status EncodeFrame(const float distance, const EncoderEffort effort,
+                   const size_t xsize, const size_t ysize,
+                   const ImageRowsCallback& get_rows,
+                   const DequantMatrices& matrices,
+                   const EntropyPresetCodes* preset,
+                   const FrameLayout* layout, ThreadPool* pool,
+                   BitWriter* writer, std::vector<BitWriter>* sections,
+                   FramePreview* preview);
+
+// Encodes the frame of the same image at each of `distances`, with the header
+// and TOC written to the writer and the sections to the vector of the same
+// index; the result is the same as that of separate EncodeFrame() calls. The
+// color conversion, the distance-independent part of the adaptive
+// quantization, the inverse gaborish and the chroma from luma statistics are
+// computed only once, and only the later stages, from the quantization field
+// on, run for every distance. The stages run phase by phase, so the whole XYB
+// image is kept in memory, plus the per-block data of every distance. The
+// preview is the same at all distances.
+Status EncodeFrames(Span<const float> distances, const EncoderEffort effort,
+                    const Image3F& linear, const DequantMatrices& matrices,
+                    const EntropyPresetCodes* preset,
+                    const FrameLayout* layout, ThreadPool* pool,
+                    const std::vector<BitWriter*>& writers,
+                    const std::vector<std::vector<BitWriter>*>& sections,
+                    FramePreview* preview);
+Status EncodeFrames(Span<const float> distances, const EncoderEffort effort,
+                    const InterleavedImage& srgb,
+                    const DequantMatrices& matrices,
+                    const EntropyPresetCodes* preset,
+                    const FrameLayout* layout, ThreadPool* pool,
+                    const std::vector<BitWriter*>& writers,
+                    const std::vector<std::vector<BitWriter>*>& sections,
+                    FramePreview* preview);
+
+// Encodes the frame at the distance for which the size of the whole image, the
+// bytes already in `writer` plus those of the frame, is as large as possible
+// without exceeding `target_size` bytes, up to a tolerance of a few percent,
+// and stores that distance in `distance` if it is not null. The distance is
+// searched from 0.1 to 25; if the image does not fit even at 25, it is encoded
+// at that distance anyway. Instead of encoding the frame at every distance of
+// the search, everything up to the block sizes and their DCT is computed once,
+// and the size at a distance is estimated from the histograms of the tokens,
+// so only the quantization and the tokens are computed again. The block sizes
+// are chosen for a distance of 1, so the output differs from that of
+// EncodeFrame() at the same distance.
+Status EncodeFrameTargetSize(size_t target_size, const EncoderEffort effort,
+                             const Image3F& linear,
+                             const DequantMatrices& matrices,
+                             const EntropyPresetCodes* preset,
+                             const FrameLayout* layout, ThreadPool* pool,
+                             BitWriter* writer,
+                             std::vector<BitWriter>* sections,
+                             float* distance, FramePreview* preview);
+Status EncodeFrameTargetSize(size_t target_size, const EncoderEffort effort,
+                             const InterleavedImage& srgb,
+                             const DequantMatrices& matrices,
+                             const EntropyPresetCodes* preset,
+                             const FrameLayout* layout, ThreadPool* pool,
+                             BitWriter* writer,
+                             std::vector<BitWriter>* sections,
+                             float* distance, FramePreview* preview);
+
+// Stores in `order` the permutation of the sections of a frame of `xsize` x
+// `ysize` pixels coded with `layout` that is written to its TOC: the index of
+// the section at every position of the output, or nothing if the sections
+// keep their order. Fails if the group priorities do not match the groups.
+Status ComputeSectionOrder(size_t xsize, size_t ysize,
+                           const FrameLayout* layout,
+                           std::vector<uint32_t>* order);
+
+// Histograms of the DC and AC tokens of frames before clustering, from which
+// TrainPresetCode() trains the codes of an EntropyPreset.
+struct FrameHistograms {
+  FrameHistograms() : dc(kNumDCContexts), ac(kNumACContexts) {}
+
+  HistogramBuilder dc;
+  HistogramBuilder ac;
+};
+
+// Adds the histograms of the tokens that EncodeFrame() would code for the
+// image to `histograms`, without writing the frame.
+Status AddFrameHistograms(const float distance, const EncoderEffort effort,
+                          const Image3F& linear,
+                          const DequantMatrices& matrices, ThreadPool* pool,
+                          FrameHistograms* histograms);
+
+// Encodes the 8 or 16 bit samples of `srgb` as a modular frame in which no
+// decoded sample differs from the input by more than `max_error`, or that is
+// lossless if it is zero. Each sample is predicted from the decoded values of
+// its neighbours and the residual is quantized to a multiple of
+// 2 * max_error + 1, independently for every group, which may be processed in
+// parallel by `pool`. There is no color transform, so the image header must
+// declare the samples as not XYB encoded. The alpha channel, if any, is
+// ignored.
+Status EncodeNearLosslessFrame(uint32_t max_error, const InterleavedImage& srgb,
+                               ThreadPool* pool, BitWriter* writer,
+                               std::vector<BitWriter>* sections);
 
 }  // namespace jxl
 
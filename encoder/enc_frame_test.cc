@@ -0,0 +1,134 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/enc_frame.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "encoder/common.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+// Sections of a frame of less than 2048x2048 pixels: the DC global section,
+// one DC group, the AC global section, then the AC groups of every pass.
+constexpr uint32_t kFirstACGroup = 3;
+
+// Checks that `order` is a permutation of the sections of a frame with
+// `num_groups` groups and `num_passes` passes that keeps the sections before
+// the AC groups in place and the AC groups of each pass together, in the same
+// order in every pass, and returns that order of the groups.
+std::vector<uint32_t> OrderOfGroups(const std::vector<uint32_t>& order,
+                                   size_t num_groups, size_t num_passes) {
+  EXPECT_EQ(kFirstACGroup + num_passes * num_groups, order.size());
+  std::vector<uint32_t> sorted = order;
+  std::sort(sorted.begin(), sorted.end());
+  for (size_t i = 0; i < sorted.size(); ++i) EXPECT_EQ(i, sorted[i]);
+  for (uint32_t i = 0; i < kFirstACGroup; ++i) EXPECT_EQ(i, order[i]);
+  std::vector<uint32_t> groups;
+  for (size_t pass = 0; pass < num_passes; ++pass) {
+    for (size_t i = 0; i < num_groups; ++i) {
+      const uint32_t section = order[kFirstACGroup + pass * num_groups + i];
+      const uint32_t first = kFirstACGroup + pass * num_groups;
+      EXPECT_GE(section, first);
+      if (pass == 0) {
+        groups.push_back(section - first);
+      } else {
+        EXPECT_EQ(groups[i], section - first) << "pass " << pass;
+      }
+    }
+  }
+  return groups;
+}
+
+TEST(EncFrameTest, RasterOrderIsNotPermuted) {
+  std::vector<uint32_t> order;
+  ASSERT_TRUE(ComputeSectionOrder(1000, 600, nullptr, &order));
+  EXPECT_TRUE(order.empty());
+  FrameLayout layout;
+  layout.two_passes = true;
+  ASSERT_TRUE(ComputeSectionOrder(1000, 600, &layout, &order));
+  EXPECT_TRUE(order.empty());
+  // A single group has no other order.
+  layout.group_order = GroupOrder::kCenterFirst;
+  ASSERT_TRUE(ComputeSectionOrder(256, 100, &layout, &order));
+  EXPECT_TRUE(order.empty());
+}
+
+TEST(EncFrameTest, CenterFirstOrder) {
+  struct Case {
+    size_t xsize;
+    size_t ysize;
+    std::vector<uint32_t> groups;
+  };
+  // Grids of 5x2, 1x3 and 3x3 groups, the first two with partial groups in
+  // the last column or row. In the last one, the groups next to the center
+  // one, and the corners, are equally far from the center of the image and
+  // keep their raster order.
+  const Case kCases[] = {
+      {1200, 300, {2, 7, 1, 6, 3, 8, 0, 5, 4, 9}},
+      {200, 700, {1, 0, 2}},
+      {768, 768, {4, 1, 3, 5, 7, 0, 2, 6, 8}},
+  };
+  for (const Case& c : kCases) {
+    const size_t num_groups =
+        DivCeil(c.xsize, kGroupDim) * DivCeil(c.ysize, kGroupDim);
+    for (bool two_passes : {false, true}) {
+      FrameLayout layout;
+      layout.group_order = GroupOrder::kCenterFirst;
+      layout.two_passes = two_passes;
+      std::vector<uint32_t> order;
+      ASSERT_TRUE(ComputeSectionOrder(c.xsize, c.ysize, &layout, &order));
+      EXPECT_EQ(c.groups, OrderOfGroups(order, num_groups, two_passes ? 2 : 1))
+          << c.xsize << "x" << c.ysize;
+    }
+  }
+}
+
+TEST(EncFrameTest, PriorityOrderIsStable) {
+  FrameLayout layout;
+  layout.group_order = GroupOrder::kPriority;
+  // 5x2 groups. Equal priorities keep the raster order.
+  layout.group_priority = {1, 3, 3, 0, 1, 3, 2, 2, 0, 1};
+  const std::vector<uint32_t> expected = {1, 2, 5, 6, 7, 0, 4, 9, 3, 8};
+  for (bool two_passes : {false, true}) {
+    layout.two_passes = two_passes;
+    std::vector<uint32_t> order;
+    ASSERT_TRUE(ComputeSectionOrder(1200, 300, &layout, &order));
+    EXPECT_EQ(expected, OrderOfGroups(order, 10, two_passes ? 2 : 1));
+  }
+  // 8x5 groups, enough for std::sort not to keep ties in order by chance.
+  layout.group_priority.resize(40);
+  std::vector<uint32_t> expected40;
+  for (uint32_t priority : {2, 1, 0}) {
+    for (uint32_t i = 0; i < 40; ++i) {
+      layout.group_priority[i] = i % 3;
+      if (i % 3 == priority) expected40.push_back(i);
+    }
+  }
+  std::vector<uint32_t> order;
+  ASSERT_TRUE(ComputeSectionOrder(2000, 1200, &layout, &order));
+  EXPECT_EQ(expected40, OrderOfGroups(order, 40, 2));
+}
+
+TEST(EncFrameTest, PriorityCountMustMatchGroups) {
+  FrameLayout layout;
+  layout.group_order = GroupOrder::kPriority;
+  layout.group_priority = {1, 2, 3};
+  std::vector<uint32_t> order;
+  EXPECT_FALSE(ComputeSectionOrder(1200, 300, &layout, &order));
+  EXPECT_FALSE(ComputeSectionOrder(200, 900, &layout, &order));
+  ASSERT_TRUE(ComputeSectionOrder(200, 700, &layout, &order));
+  EXPECT_EQ(std::vector<uint32_t>({2, 1, 0}), OrderOfGroups(order, 3, 1));
+}
+
+}  // namespace
+}  // namespace jxl
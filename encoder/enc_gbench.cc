@@ -0,0 +1,818 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+// Microbenchmarks of the encoder stages, each of them run on the output of the
+// previous stages of the same input. The inputs are a synthetic image and,
+// if the JXL_TINY_BENCHMARK_IMAGE environment variable names a PFM file, a
+// photo, both at several sizes. Every benchmark reports the megapixels of the
+// input image processed per second ("MP/s") and the bytes per second of the
+// data the stage reads, or writes for the entropy coding stages.
+//
+// Example: jxl_tiny_benchmark --benchmark_filter='ToXYB/input:0/size:1024'
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>  //NOLINT
+#include <cmath>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>  //NOLINT
+#include <utility>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "encoder/ac_context.h"
+#include "encoder/ac_strategy.h"
+#include "encoder/base/byte_order.h"
+#include "encoder/base/data_parallel.h"
+#include "encoder/base/span.h"
+#include "encoder/base/stats.h"
+#include "encoder/chroma_from_luma.h"
+#include "encoder/enc_ac_strategy.h"
+#include "encoder/enc_adaptive_quantization.h"
+#include "encoder/enc_ans.h"
+#include "encoder/enc_bit_writer.h"
+#include "encoder/enc_chroma_from_luma.h"
+#include "encoder/enc_cluster.h"
+#include "encoder/enc_file.h"
+#include "encoder/enc_group.h"
+#include "encoder/enc_xyb.h"
+#include "encoder/gaborish.h"
+#include "encoder/histogram.h"
+#include "encoder/image.h"
+#include "encoder/quant_weights.h"
+#include "encoder/read_pfm.h"
+#include "encoder/token.h"
+
+namespace jxl {
+namespace {
+
+// Parameters of the encoder at distance 1.
+constexpr float kDistance = 1.0f;
+constexpr float kQuantScale = 7340.0f / 65536.0f;
+constexpr float kGaborishMul = 0.9908511000000001f;
+constexpr float kXQuantMatrixMul = 1.0f;
+
+enum InputKind : int64_t { kSynthetic = 0, kPhoto = 1 };
+
+// Smooth gradients with some texture, noise and sharp edges, in linear sRGB.
+Image3F SyntheticImage(size_t xsize, size_t ysize) {
+  Image3F image(xsize, ysize);
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> noise(-0.02f, 0.02f);
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < ysize; ++y) {
+      float* JXL_RESTRICT row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < xsize; ++x) {
+        const float gradient = (x + y + 64.0f * c) / (xsize + ysize + 128.0f);
+        const float texture =
+            0.1f * std::sin(x * 0.3f + c) * std::sin(y * 0.2f);
+        const float edge = ((x / 96 + y / 64) % 3 == 0) ? 0.3f : 0.0f;
+        const float v = gradient + texture + edge + noise(rng);
+        row[x] = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+      }
+    }
+  }
+  return image;
+}
+
+// The photo of JXL_TINY_BENCHMARK_IMAGE, repeated or cropped to the given
+// size. Returns false if there is none.
+bool PhotoImage(size_t xsize, size_t ysize, Image3F* image) {
+  static const Image3F* photo = []() -> const Image3F* {
+    const char* path = getenv("JXL_TINY_BENCHMARK_IMAGE");
+    Image3F* image = new Image3F();
+    if (path == nullptr || !ReadPFM(path, image)) {
+      delete image;
+      return nullptr;
+    }
+    return image;
+  }();
+  if (photo == nullptr) return false;
+  *image = Image3F(xsize, ysize);
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < ysize; ++y) {
+      const float* JXL_RESTRICT row_in =
+          photo->ConstPlaneRow(c, y % photo->ysize());
+      float* JXL_RESTRICT row_out = image->PlaneRow(c, y);
+      for (size_t x = 0; x < xsize; ++x) {
+        row_out[x] = row_in[x % photo->xsize()];
+      }
+    }
+  }
+  return true;
+}
+
+const DequantMatrices& Matrices() {
+  static const DequantMatrices* matrices = new DequantMatrices();
+  return *matrices;
+}
+
+// The input of every stage for one image, computed the same way as
+// EncodeFrame() with the phase-by-phase pipeline does.
+struct StageInputs {
+  Image3F linear;
+  // Padded to whole blocks, before and after the inverse gaborish.
+  Image3F xyb;
+  Image3F opsin;
+  ImageF quant_field;
+  ImageF masking;
+  // Adjusted to the block sizes.
+  ImageI raw_quant_field;
+  ColorCorrelationMap cmap;
+  AcStrategyImage ac_strategy;
+  std::vector<PackedTokens> ac_tokens;
+  std::vector<Histogram> histograms;
+  // After clustering.
+  std::vector<Histogram> clustered_histograms;
+  std::vector<uint8_t> context_map;
+  EntropyEncodingData codes;
+};
+
+// Returns the inputs of the given kind and size, or null if there is no photo.
+// They are computed once and kept for all benchmarks.
+const StageInputs* GetInputs(int64_t kind, size_t size) {
+  static std::map<std::pair<int64_t, size_t>, std::unique_ptr<StageInputs>>
+      cache;
+  std::unique_ptr<StageInputs>& inputs = cache[std::make_pair(kind, size)];
+  if (inputs) return inputs.get();
+
+  std::unique_ptr<StageInputs> in(new StageInputs());
+  if (kind == kSynthetic) {
+    in->linear = SyntheticImage(size, size);
+  } else if (!PhotoImage(size, size, &in->linear)) {
+    return nullptr;
+  }
+  ThreadPool pool;
+  const size_t xsize_blocks = DivCeil(size, kBlockDim);
+  const size_t ysize_blocks = DivCeil(size, kBlockDim);
+  in->xyb = Image3F(xsize_blocks * kBlockDim, ysize_blocks * kBlockDim);
+  in->xyb.ShrinkTo(size, size);
+  ToXYB(in->linear, &pool, &in->xyb);
+  PadImageToBlockMultipleInPlace(&in->xyb, &pool);
+  ComputeAdaptiveQuantField(in->xyb, kDistance, kQuantScale, &pool,
+                            &in->masking, &in->quant_field,
+                            &in->raw_quant_field);
+  in->opsin = Image3F(in->xyb.xsize(), in->xyb.ysize());
+  GaborishInverse(in->xyb, Rect(in->xyb), kGaborishMul, &pool, &in->opsin);
+  in->cmap = ColorCorrelationMap(size, size);
+  JXL_CHECK(
+      ComputeColorCorrelationMap(in->opsin, Matrices(), &pool, &in->cmap));
+  in->ac_strategy = AcStrategyImage(xsize_blocks, ysize_blocks);
+  JXL_CHECK(ComputeAcStrategyImage(in->opsin, kDistance, in->cmap,
+                                   in->quant_field, in->masking,
+                                   /*try_4x4=*/false, &pool, Matrices(),
+                                   &in->ac_strategy));
+  JXL_CHECK(
+      AdjustQuantField(in->ac_strategy, &pool, &in->raw_quant_field));
+  Image3F dc(xsize_blocks, ysize_blocks);
+  in->ac_tokens.resize(DivCeil(size, kGroupDim) * DivCeil(size, kGroupDim));
+  HistogramBuilder builder(kNumACContexts);
+  JXL_CHECK(ComputeCoefficients(in->opsin, in->raw_quant_field, Matrices(),
+                                kQuantScale, in->cmap, in->ac_strategy,
+                                kXQuantMatrixMul, &pool, &dc, &in->ac_tokens,
+                                &builder));
+  in->histograms = builder.histograms;
+  in->clustered_histograms = in->histograms;
+  JXL_CHECK(ClusterHistograms(&in->clustered_histograms, &in->context_map));
+  BitWriter writer;
+  WriteHistograms(in->clustered_histograms, &in->codes, &writer);
+
+  inputs = std::move(in);
+  return inputs.get();
+}
+
+size_t HistogramBytes(const std::vector<Histogram>& histograms) {
+  size_t bytes = 0;
+  for (const Histogram& h : histograms) {
+    bytes += h.data_.size() * sizeof(h.data_[0]);
+  }
+  return bytes;
+}
+
+// Reports the throughput of a stage that processed `num_pixels` pixels and
+// `num_bytes` bytes per iteration.
+void SetThroughput(benchmark::State& state, size_t num_pixels,
+                   size_t num_bytes) {
+  state.counters["MP/s"] = benchmark::Counter(
+      num_pixels * 1e-6, benchmark::Counter::kIsIterationInvariantRate);
+  state.SetBytesProcessed(state.iterations() * num_bytes);
+}
+
+// Returns the inputs selected by the first two arguments of the benchmark,
+// which are the input kind and the image size.
+const StageInputs* GetInputs(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state.range(0), state.range(1));
+  if (in == nullptr) state.SkipWithError("JXL_TINY_BENCHMARK_IMAGE not set");
+  return in;
+}
+
+// Reading the input from a PFM file in the byte order of the system (0) or
+// the other one (1), with the pixels at a float-aligned (0) or unaligned (1)
+// offset in the file. The rows read are first checked against the input, so
+// that every SIMD target also tests the conversion of its lanes.
+void BM_ReadPFM(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t xsize = in->linear.xsize();
+  const size_t ysize = in->linear.ysize();
+  const bool swap = state.range(3) != 0;
+  const bool big_endian = IsLittleEndian() == swap;
+  // The scale is padded with zeros to move the pixels.
+  std::string header = "PF\n" + std::to_string(xsize) + " " +
+                       std::to_string(ysize) + "\n" +
+                       (big_endian ? "1.0" : "-1.0");
+  while ((header.size() + 1) % sizeof(float) != (state.range(4) ? 1 : 0)) {
+    header += '0';
+  }
+  header += '\n';
+  std::vector<uint8_t> file(header.begin(), header.end());
+  for (size_t y = ysize; y-- > 0;) {
+    for (size_t x = 0; x < xsize; ++x) {
+      for (size_t c = 0; c < 3; ++c) {
+        float v = in->linear.ConstPlaneRow(c, y)[x];
+        if (swap) v = BSwapFloat(v);
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&v);
+        file.insert(file.end(), bytes, bytes + sizeof(v));
+      }
+    }
+  }
+  const char* tmpdir = getenv("TMPDIR");
+  std::string path = std::string(tmpdir ? tmpdir : "/tmp") +
+                     "/jxl_tiny_benchmark_XXXXXX";
+  const int fd = mkstemp(&path[0]);
+  FILE* f = fd < 0 ? nullptr : fdopen(fd, "wb");
+  if (f == nullptr || fwrite(file.data(), 1, file.size(), f) != file.size() ||
+      fclose(f) != 0) {
+    state.SkipWithError("Could not write the PFM file");
+    return;
+  }
+  ThreadPool pool(state.range(2));
+  Image3F image;
+  bool same = ReadPFM(path.c_str(), &pool, &image);
+  for (size_t c = 0; c < 3 && same; ++c) {
+    for (size_t y = 0; y < ysize && same; ++y) {
+      same = memcmp(image.ConstPlaneRow(c, y), in->linear.ConstPlaneRow(c, y),
+                    xsize * sizeof(float)) == 0;
+    }
+  }
+  if (!same) {
+    unlink(path.c_str());
+    state.SkipWithError("The rows read differ from the input");
+    return;
+  }
+  for (auto _ : state) {
+    JXL_CHECK(ReadPFM(path.c_str(), &pool, &image));
+  }
+  unlink(path.c_str());
+  SetThroughput(state, xsize * ysize, file.size());
+}
+
+void BM_ToXYB(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t num_pixels = in->linear.xsize() * in->linear.ysize();
+  ThreadPool pool(state.range(2));
+  Image3F xyb(in->linear.xsize(), in->linear.ysize());
+  for (auto _ : state) {
+    ToXYB(in->linear, &pool, &xyb);
+  }
+  SetThroughput(state, num_pixels, num_pixels * 3 * sizeof(float));
+}
+
+void BM_GaborishInverse(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t num_pixels = in->linear.xsize() * in->linear.ysize();
+  ThreadPool pool(state.range(2));
+  Image3F opsin(in->xyb.xsize(), in->xyb.ysize());
+  for (auto _ : state) {
+    GaborishInverse(in->xyb, Rect(in->xyb), kGaborishMul, &pool, &opsin);
+  }
+  SetThroughput(state, num_pixels, num_pixels * 3 * sizeof(float));
+}
+
+void BM_ComputeAdaptiveQuantField(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t num_pixels = in->linear.xsize() * in->linear.ysize();
+  ThreadPool pool(state.range(2));
+  ImageF quant_field, masking;
+  ImageI raw_quant_field;
+  for (auto _ : state) {
+    ComputeAdaptiveQuantField(in->xyb, kDistance, kQuantScale, &pool,
+                              &masking, &quant_field, &raw_quant_field);
+  }
+  SetThroughput(state, num_pixels, num_pixels * 3 * sizeof(float));
+}
+
+void BM_ComputeColorCorrelationMap(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t num_pixels = in->linear.xsize() * in->linear.ysize();
+  ThreadPool pool(state.range(2));
+  ColorCorrelationMap cmap(in->linear.xsize(), in->linear.ysize());
+  for (auto _ : state) {
+    JXL_CHECK(ComputeColorCorrelationMap(in->opsin, Matrices(), &pool, &cmap));
+  }
+  SetThroughput(state, num_pixels, num_pixels * 3 * sizeof(float));
+}
+
+void BM_ComputeAcStrategyImage(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t num_pixels = in->linear.xsize() * in->linear.ysize();
+  ThreadPool pool(state.range(2));
+  AcStrategyImage ac_strategy(in->ac_strategy.xsize(),
+                              in->ac_strategy.ysize());
+  for (auto _ : state) {
+    JXL_CHECK(ComputeAcStrategyImage(in->opsin, kDistance, in->cmap,
+                                     in->quant_field, in->masking,
+                                     /*try_4x4=*/false, &pool, Matrices(),
+                                     &ac_strategy));
+  }
+  SetThroughput(state, num_pixels, num_pixels * 3 * sizeof(float));
+}
+
+void BM_ComputeCoefficients(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t num_pixels = in->linear.xsize() * in->linear.ysize();
+  ThreadPool pool(state.range(2));
+  Image3F dc(in->ac_strategy.xsize(), in->ac_strategy.ysize());
+  for (auto _ : state) {
+    std::vector<PackedTokens> ac_tokens(in->ac_tokens.size());
+    HistogramBuilder histograms(kNumACContexts);
+    JXL_CHECK(ComputeCoefficients(in->opsin, in->raw_quant_field, Matrices(),
+                                  kQuantScale, in->cmap, in->ac_strategy,
+                                  kXQuantMatrixMul, &pool, &dc, &ac_tokens,
+                                  &histograms));
+  }
+  SetThroughput(state, num_pixels, num_pixels * 3 * sizeof(float));
+}
+
+// The clustering modifies the histograms, so every iteration also includes a
+// copy of them, which is negligible in comparison.
+void BM_ClusterHistograms(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t num_pixels = in->linear.xsize() * in->linear.ysize();
+  ThreadPool pool(state.range(2));
+  for (auto _ : state) {
+    std::vector<Histogram> histograms = in->histograms;
+    std::vector<uint8_t> context_map;
+    JXL_CHECK(ClusterHistograms(&histograms, &context_map, /*refine=*/false,
+                                &pool));
+  }
+  SetThroughput(state, num_pixels, HistogramBytes(in->histograms));
+}
+
+void BM_WriteHistograms(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t num_pixels = in->linear.xsize() * in->linear.ysize();
+  size_t num_bytes = 0;
+  for (auto _ : state) {
+    EntropyEncodingData codes;
+    BitWriter writer;
+    WriteHistograms(in->clustered_histograms, &codes, &writer);
+    num_bytes = writer.BitsWritten() / kBitsPerByte;
+  }
+  SetThroughput(state, num_pixels, num_bytes);
+}
+
+void BM_WriteTokens(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t num_pixels = in->linear.xsize() * in->linear.ysize();
+  size_t num_bytes = 0;
+  for (auto _ : state) {
+    num_bytes = 0;
+    for (const PackedTokens& tokens : in->ac_tokens) {
+      BitWriter writer;
+      WriteTokens(tokens, in->codes, in->context_map, &writer);
+      num_bytes += writer.BitsWritten() / kBitsPerByte;
+    }
+  }
+  SetThroughput(state, num_pixels, num_bytes);
+}
+
+// The whole encoder with a new thread pool for every image, as EncodeFile()
+// without a pool does.
+void BM_EncodeFile(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t num_pixels = in->linear.xsize() * in->linear.ysize();
+  std::vector<uint8_t> output;
+  for (auto _ : state) {
+    ThreadPool pool(state.range(2));
+    JXL_CHECK(EncodeFile(in->linear, kDistance, &pool, &output));
+  }
+  SetThroughput(state, num_pixels, output.size());
+}
+
+// The whole encoder with a reused context, with the phase-by-phase (0) or the
+// fused (1) pipeline.
+void BM_EncoderEncode(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t num_pixels = in->linear.xsize() * in->linear.ysize();
+  Encoder encoder(state.range(2));
+  encoder.SetFramePipeline(state.range(3) == 0 ? FramePipeline::kPhaseByPhase
+                                               : FramePipeline::kFused);
+  std::vector<uint8_t> output;
+  for (auto _ : state) {
+    JXL_CHECK(encoder.Encode(in->linear, kDistance, &output));
+  }
+  SetThroughput(state, num_pixels, output.size());
+}
+
+// The whole encoder with a reused context and 1 to N threads, where N is the
+// number of hardware threads; besides the throughput, reports the speedup
+// over the single thread run of the same input ("speedup"), which is run
+// first.
+void BM_EncoderScaling(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t num_pixels = in->linear.xsize() * in->linear.ysize();
+  const size_t num_threads = state.range(2);
+  Encoder encoder(num_threads);
+  std::vector<uint8_t> output;
+  const auto start = std::chrono::steady_clock::now();
+  for (auto _ : state) {
+    JXL_CHECK(encoder.Encode(in->linear, kDistance, &output));
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  const double seconds = elapsed.count() / state.iterations();
+  static std::map<std::pair<int64_t, int64_t>, double> single_thread_seconds;
+  const auto key = std::make_pair(state.range(0), state.range(1));
+  if (num_threads == 1) single_thread_seconds[key] = seconds;
+  const auto single = single_thread_seconds.find(key);
+  if (single != single_thread_seconds.end()) {
+    state.counters["speedup"] = single->second / seconds;
+  }
+  SetThroughput(state, num_pixels, output.size());
+}
+
+// The whole encoder with a reused context at the lightning (0), default (1)
+// or slower (2) effort; besides the throughput, reports the size of the output
+// in bits per pixel ("bpp").
+void BM_EncoderEffort(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t num_pixels = in->linear.xsize() * in->linear.ysize();
+  static const EncoderEffort kEfforts[] = {EncoderEffort::kLightning,
+                                           EncoderEffort::kDefault,
+                                           EncoderEffort::kSlower};
+  Encoder encoder(state.range(2));
+  encoder.SetEffort(kEfforts[state.range(3)]);
+  std::vector<uint8_t> output;
+  for (auto _ : state) {
+    JXL_CHECK(encoder.Encode(in->linear, kDistance, &output));
+  }
+  SetThroughput(state, num_pixels, output.size());
+  state.counters["bpp"] = output.size() * 8.0 / num_pixels;
+}
+
+// The input in 8-bit sRGB, as taken by the near-lossless encoder.
+std::vector<uint8_t> ToSRGB8(const Image3F& linear) {
+  std::vector<uint8_t> srgb(linear.xsize() * linear.ysize() * 3);
+  for (size_t y = 0; y < linear.ysize(); ++y) {
+    for (size_t c = 0; c < 3; ++c) {
+      const float* JXL_RESTRICT row = linear.ConstPlaneRow(c, y);
+      uint8_t* JXL_RESTRICT row_out = &srgb[y * linear.xsize() * 3 + c];
+      for (size_t x = 0; x < linear.xsize(); ++x) {
+        const float v = row[x] < 0.0f ? 0.0f : (row[x] > 1.0f ? 1.0f : row[x]);
+        const float encoded = v <= 0.0031308f
+                                  ? 12.92f * v
+                                  : 1.055f * std::pow(v, 1 / 2.4f) - 0.055f;
+        row_out[3 * x] = static_cast<uint8_t>(encoded * 255.0f + 0.5f);
+      }
+    }
+  }
+  return srgb;
+}
+
+// The near-lossless encoder with a reused context at the maximum error given
+// by the last argument; reports the size of the output in bits per pixel
+// ("bpp") too.
+void BM_EncoderNearLossless(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t xsize = in->linear.xsize();
+  const size_t ysize = in->linear.ysize();
+  const std::vector<uint8_t> srgb = ToSRGB8(in->linear);
+  const InterleavedImage image(srgb.data(), xsize, ysize, 3, 8);
+  Encoder encoder(state.range(2));
+  std::vector<uint8_t> output;
+  for (auto _ : state) {
+    JXL_CHECK(encoder.EncodeNearLossless(image, state.range(3), &output));
+  }
+  SetThroughput(state, xsize * ysize, output.size());
+  state.counters["bpp"] = output.size() * 8.0 / (xsize * ysize);
+}
+
+// A corpus of mostly small images of the given kind, as in a photo gallery
+// with thumbnails: 48 images of 1 to 4 groups and 4 images of 12 to 48 groups.
+// Returns false if there is no photo.
+bool MixedSizeCorpus(int64_t kind, std::vector<Image3F>* images) {
+  static const size_t kSizes[][2] = {{64, 64},   {160, 120},  {256, 256},
+                                     {320, 240}, {400, 300},  {512, 384},
+                                     {512, 512}, {300, 200},  {1024, 768},
+                                     {2048, 1536}};
+  images->clear();
+  for (size_t i = 0; i < 52; ++i) {
+    const size_t* size = i < 48 ? kSizes[i % 8] : kSizes[8 + i % 2];
+    Image3F image;
+    if (kind == kSynthetic) {
+      image = SyntheticImage(size[0], size[1]);
+    } else if (!PhotoImage(size[0], size[1], &image)) {
+      return false;
+    }
+    images->push_back(std::move(image));
+  }
+  return true;
+}
+
+// The whole encoder on a corpus of mixed sizes (see MixedSizeCorpus()), with
+// one Encode call per image (0) or with EncodeBatch (1); reports the number of
+// images encoded per second ("images/s").
+void BM_EncoderBatch(benchmark::State& state) {
+  std::vector<Image3F> images;
+  if (!MixedSizeCorpus(state.range(0), &images)) {
+    state.SkipWithError("JXL_TINY_BENCHMARK_IMAGE not set");
+    return;
+  }
+  size_t num_pixels = 0;
+  for (const Image3F& image : images) {
+    num_pixels += image.xsize() * image.ysize();
+  }
+  Encoder encoder(state.range(1));
+  std::vector<std::vector<uint8_t>> outputs(images.size());
+  for (auto _ : state) {
+    if (state.range(2) == 0) {
+      for (size_t i = 0; i < images.size(); ++i) {
+        JXL_CHECK(encoder.Encode(images[i], kDistance, &outputs[i]));
+      }
+    } else {
+      JXL_CHECK(encoder.EncodeBatch(Span<const Image3F>(images), kDistance,
+                                    &outputs));
+    }
+  }
+  size_t num_bytes = 0;
+  for (const std::vector<uint8_t>& output : outputs) {
+    num_bytes += output.size();
+  }
+  SetThroughput(state, num_pixels, num_bytes);
+  state.counters["images/s"] = benchmark::Counter(
+      images.size(), benchmark::Counter::kIsIterationInvariantRate);
+}
+
+// The whole encoder at the distances of kMultiDistances, with one Encode call
+// per distance (0) or with a single EncodeMultiDistance call (1).
+const float kMultiDistances[] = {0.5f, 1.0f, 2.0f, 4.0f};
+
+void BM_EncoderMultiDistance(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const Span<const float> distances(kMultiDistances);
+  const size_t num_pixels =
+      in->linear.xsize() * in->linear.ysize() * distances.size();
+  Encoder encoder(state.range(2));
+  std::vector<std::vector<uint8_t>> outputs(distances.size());
+  for (auto _ : state) {
+    if (state.range(3) == 0) {
+      for (size_t i = 0; i < distances.size(); ++i) {
+        JXL_CHECK(encoder.Encode(in->linear, distances[i], &outputs[i]));
+      }
+    } else {
+      JXL_CHECK(encoder.EncodeMultiDistance(in->linear, distances, &outputs));
+    }
+  }
+  size_t num_bytes = 0;
+  for (const std::vector<uint8_t>& output : outputs) {
+    num_bytes += output.size();
+  }
+  SetThroughput(state, num_pixels, num_bytes);
+}
+
+// The whole encoder at a size of kTargetBitsPerPixel, with a bisection of the
+// distance over Encode calls (0) or with EncodeTargetSize (1). The size
+// reached is reported as a fraction of the target.
+constexpr double kTargetBitsPerPixel = 1.0;
+constexpr size_t kTargetSizeBisections = 8;
+
+void BM_EncoderTargetSize(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  const size_t num_pixels = in->linear.xsize() * in->linear.ysize();
+  const size_t target_size =
+      static_cast<size_t>(num_pixels * kTargetBitsPerPixel / kBitsPerByte);
+  Encoder encoder(state.range(2));
+  std::vector<uint8_t> output, best;
+  for (auto _ : state) {
+    if (state.range(3) == 0) {
+      float lo = 0.1f;
+      float hi = 25.0f;
+      best.clear();
+      for (size_t i = 0; i < kTargetSizeBisections; ++i) {
+        const float distance = std::sqrt(lo * hi);
+        JXL_CHECK(encoder.Encode(in->linear, distance, &output));
+        if (output.size() > target_size) {
+          lo = distance;
+        } else {
+          hi = distance;
+          best.swap(output);
+        }
+      }
+    } else {
+      JXL_CHECK(encoder.EncodeTargetSize(in->linear, target_size, &best));
+    }
+  }
+  SetThroughput(state, num_pixels, best.size());
+  state.counters["size_ratio"] =
+      static_cast<double>(best.size()) / target_size;
+}
+
+// The whole encoder with the AC groups in raster order (0), center first (1),
+// or in two passes in raster order (2) or center first (3). Reports the bytes
+// needed for the 1:8 preview ("preview_bytes") and for the whole image at the
+// precision of the first pass ("first_pass_bytes").
+void BM_EncoderLayout(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  FrameLayout layout;
+  if (state.range(3) & 1) layout.group_order = GroupOrder::kCenterFirst;
+  layout.two_passes = (state.range(3) & 2) != 0;
+  Encoder encoder(state.range(2));
+  encoder.SetFrameLayout(layout);
+  std::vector<uint8_t> output;
+  for (auto _ : state) {
+    JXL_CHECK(encoder.Encode(in->linear, kDistance, &output));
+  }
+  SetThroughput(state, in->linear.xsize() * in->linear.ysize(), output.size());
+  // The sizes of the sections, in the order of the output, of one more frame.
+  EncodeStats stats;
+  encoder.SetStats(&stats);
+  JXL_CHECK(encoder.Encode(in->linear, kDistance, &output));
+  encoder.SetStats(nullptr);
+  size_t bytes = 0;
+  size_t preview_bytes = 0;
+  size_t first_pass_bytes = 0;
+  for (const EncodeStats::Section& section : stats.GetSections()) {
+    bytes += section.bytes;
+    if (section.name == "DC group") preview_bytes = bytes;
+    if (section.name == "AC group" || section.name == "All groups") {
+      first_pass_bytes = bytes;
+    }
+  }
+  state.counters["preview_bytes"] = preview_bytes;
+  state.counters["first_pass_bytes"] = first_pass_bytes;
+}
+
+// The preview is 0: none, 1: linear or 2: 8-bit sRGB.
+void BM_EncoderPreview(benchmark::State& state) {
+  const StageInputs* in = GetInputs(state);
+  if (in == nullptr) return;
+  Encoder encoder(state.range(2));
+  FramePreview preview;
+  if (state.range(3) == 1) preview.format = FramePreview::Format::kLinear;
+  if (state.range(3) != 0) encoder.SetPreview(&preview);
+  std::vector<uint8_t> output;
+  for (auto _ : state) {
+    JXL_CHECK(encoder.Encode(in->linear, kDistance, &output));
+  }
+  SetThroughput(state, in->linear.xsize() * in->linear.ysize(), output.size());
+}
+
+// Arguments of the benchmarks: input kind, image size, number of worker
+// threads and, for the whole encoder, the pipeline, the effort, the maximum
+// error, whether the distances are encoded together, how the target size is
+// searched, the layout of the frame or the format of the preview.
+const std::vector<int64_t> kInputs = {kSynthetic, kPhoto};
+const std::vector<int64_t> kSizes = {256, 1024, 2048};
+const std::vector<int64_t> kThreads = {0, 1, 3, 7};
+
+void ParallelStageArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"input", "size", "threads"});
+  b->ArgsProduct({kInputs, kSizes, kThreads});
+  b->UseRealTime();
+  b->Unit(benchmark::kMillisecond);
+}
+
+void SerialStageArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"input", "size", "threads"});
+  b->ArgsProduct({kInputs, kSizes, {0}});
+  b->Unit(benchmark::kMillisecond);
+}
+
+void ReadPFMArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"input", "size", "threads", "swap", "unaligned"});
+  b->ArgsProduct({kInputs, kSizes, kThreads, {0, 1}, {0, 1}});
+  b->UseRealTime();
+  b->Unit(benchmark::kMillisecond);
+}
+
+void EncoderArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"input", "size", "threads", "fused"});
+  b->ArgsProduct({kInputs, kSizes, kThreads, {0, 1}});
+  b->UseRealTime();
+  b->Unit(benchmark::kMillisecond);
+}
+
+void EffortArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"input", "size", "threads", "effort"});
+  b->ArgsProduct({kInputs, kSizes, kThreads, {0, 1, 2}});
+  b->UseRealTime();
+  b->Unit(benchmark::kMillisecond);
+}
+
+void NearLosslessArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"input", "size", "threads", "max_error"});
+  b->ArgsProduct({kInputs, kSizes, kThreads, {0, 2, 8}});
+  b->UseRealTime();
+  b->Unit(benchmark::kMillisecond);
+}
+
+void ScalingArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"input", "size", "threads"});
+  const int64_t max_threads =
+      std::max<int64_t>(1, std::thread::hardware_concurrency());
+  std::vector<int64_t> threads;
+  for (int64_t n = 1; n < max_threads; n *= 2) threads.push_back(n);
+  threads.push_back(max_threads);
+  b->ArgsProduct({kInputs, kSizes, threads});
+  b->UseRealTime();
+  b->Unit(benchmark::kMillisecond);
+}
+
+void MultiDistanceArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"input", "size", "threads", "multi"});
+  b->ArgsProduct({kInputs, kSizes, kThreads, {0, 1}});
+  b->UseRealTime();
+  b->Unit(benchmark::kMillisecond);
+}
+
+void TargetSizeArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"input", "size", "threads", "search"});
+  b->ArgsProduct({kInputs, kSizes, kThreads, {0, 1}});
+  b->UseRealTime();
+  b->Unit(benchmark::kMillisecond);
+}
+
+void LayoutArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"input", "size", "threads", "layout"});
+  b->ArgsProduct({kInputs, kSizes, kThreads, {0, 1, 2, 3}});
+  b->UseRealTime();
+  b->Unit(benchmark::kMillisecond);
+}
+
+void PreviewArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"input", "size", "threads", "preview"});
+  b->ArgsProduct({kInputs, kSizes, kThreads, {0, 1, 2}});
+  b->UseRealTime();
+  b->Unit(benchmark::kMillisecond);
+}
+
+void BatchArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"input", "threads", "batch"});
+  b->ArgsProduct({kInputs, kThreads, {0, 1}});
+  b->UseRealTime();
+  b->Unit(benchmark::kMillisecond);
+}
+
+BENCHMARK(BM_ReadPFM)->Apply(ReadPFMArgs);
+BENCHMARK(BM_ToXYB)->Apply(ParallelStageArgs);
+BENCHMARK(BM_GaborishInverse)->Apply(ParallelStageArgs);
+BENCHMARK(BM_ComputeAdaptiveQuantField)->Apply(ParallelStageArgs);
+BENCHMARK(BM_ComputeColorCorrelationMap)->Apply(ParallelStageArgs);
+BENCHMARK(BM_ComputeAcStrategyImage)->Apply(ParallelStageArgs);
+BENCHMARK(BM_ComputeCoefficients)->Apply(ParallelStageArgs);
+BENCHMARK(BM_ClusterHistograms)->Apply(ParallelStageArgs);
+BENCHMARK(BM_WriteHistograms)->Apply(SerialStageArgs);
+BENCHMARK(BM_WriteTokens)->Apply(SerialStageArgs);
+BENCHMARK(BM_EncodeFile)->Apply(ParallelStageArgs);
+BENCHMARK(BM_EncoderEncode)->Apply(EncoderArgs);
+BENCHMARK(BM_EncoderEffort)->Apply(EffortArgs);
+BENCHMARK(BM_EncoderScaling)->Apply(ScalingArgs);
+BENCHMARK(BM_EncoderNearLossless)->Apply(NearLosslessArgs);
+BENCHMARK(BM_EncoderBatch)->Apply(BatchArgs);
+BENCHMARK(BM_EncoderMultiDistance)->Apply(MultiDistanceArgs);
+BENCHMARK(BM_EncoderTargetSize)->Apply(TargetSizeArgs);
+BENCHMARK(BM_EncoderLayout)->Apply(LayoutArgs);
+BENCHMARK(BM_EncoderPreview)->Apply(PreviewArgs);
+
+}  // namespace
+}  // namespace jxl
@@ -0,0 +1,114 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/enc_gradient.h"
+
+#include <algorithm>
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "encoder/enc_gradient.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "encoder/base/compiler_specific.h"
+#include "encoder/common.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::BitCast;
+using hwy::HWY_NAMESPACE::Ge;
+using hwy::HWY_NAMESPACE::Gt;
+using hwy::HWY_NAMESPACE::IfThenElse;
+using hwy::HWY_NAMESPACE::Lt;
+using hwy::HWY_NAMESPACE::Max;
+using hwy::HWY_NAMESPACE::Min;
+using hwy::HWY_NAMESPACE::ShiftLeft;
+using hwy::HWY_NAMESPACE::ShiftRight;
+using hwy::HWY_NAMESPACE::Sub;
+using hwy::HWY_NAMESPACE::VecFromMask;
+using hwy::HWY_NAMESPACE::Xor;
+
+JXL_INLINE int32_t Bucket(int32_t d, int32_t t1, int32_t t2) {
+  return (d >= -t2) + (d >= -t1) + (d > t1) + (d > t2);
+}
+
+// The masks are all ones where true, so subtracting them counts them.
+template <class D, class V>
+JXL_INLINE V Bucket(D d, V diff, V t1, V t2) {
+  V bucket = Zero(d);
+  bucket = Sub(bucket, VecFromMask(d, Ge(diff, Neg(t2))));
+  bucket = Sub(bucket, VecFromMask(d, Ge(diff, Neg(t1))));
+  bucket = Sub(bucket, VecFromMask(d, Gt(diff, t1)));
+  return Sub(bucket, VecFromMask(d, Gt(diff, t2)));
+}
+
+void PredictGradientRow(const int32_t* JXL_RESTRICT w,
+                        const int32_t* JXL_RESTRICT n,
+                        const int32_t* JXL_RESTRICT nw,
+                        const int32_t* JXL_RESTRICT value, size_t num,
+                        int32_t t1, int32_t t2, uint32_t context_base,
+                        uint32_t* JXL_RESTRICT residuals,
+                        uint32_t* JXL_RESTRICT contexts) {
+  const HWY_FULL(int32_t) di;
+  const HWY_FULL(uint32_t) du;
+  const auto t1_v = Set(di, t1);
+  const auto t2_v = Set(di, t2);
+  const auto base_v = Set(di, context_base);
+  size_t x = 0;
+  for (; x + Lanes(di) <= num; x += Lanes(di)) {
+    const auto w_v = LoadU(di, w + x);
+    const auto n_v = LoadU(di, n + x);
+    const auto nw_v = LoadU(di, nw + x);
+    // The samples have at most 16 bits, so the gradient does not overflow.
+    const auto m = Min(n_v, w_v);
+    const auto M = Max(n_v, w_v);
+    const auto grad = Sub(Add(n_v, w_v), nw_v);
+    const auto guess =
+        IfThenElse(Lt(nw_v, m), M, IfThenElse(Gt(nw_v, M), m, grad));
+    const auto residual = Sub(LoadU(di, value + x), guess);
+    const auto packed =
+        Xor(ShiftLeft<1>(residual), ShiftRight<31>(residual));
+    StoreU(BitCast(du, packed), du, residuals + x);
+    const auto b10 = Bucket(di, Sub(w_v, nw_v), t1_v, t2_v);
+    const auto b11 = Bucket(di, Sub(nw_v, n_v), t1_v, t2_v);
+    const auto context =
+        Add(base_v, Add(Add(ShiftLeft<2>(b10), b10), b11));
+    StoreU(BitCast(du, context), du, contexts + x);
+  }
+  for (; x < num; ++x) {
+    const int32_t m = std::min(n[x], w[x]);
+    const int32_t M = std::max(n[x], w[x]);
+    const int32_t guess = nw[x] < m ? M : nw[x] > M ? m : n[x] + w[x] - nw[x];
+    residuals[x] = PackSigned(value[x] - guess);
+    contexts[x] = context_base + 5 * Bucket(w[x] - nw[x], t1, t2) +
+                  Bucket(nw[x] - n[x], t1, t2);
+  }
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+
+HWY_EXPORT(PredictGradientRow);
+
+void PredictGradientRow(const int32_t* w, const int32_t* n, const int32_t* nw,
+                        const int32_t* value, size_t num, int32_t t1,
+                        int32_t t2, uint32_t context_base, uint32_t* residuals,
+                        uint32_t* contexts) {
+  HWY_DYNAMIC_DISPATCH(PredictGradientRow)
+  (w, n, nw, value, num, t1, t2, context_base, residuals, contexts);
+}
+
+}  // namespace jxl
+#endif  // HWY_ONCE
@@ -0,0 +1,61 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef ENCODER_ENC_GRADIENT_H_
+#define ENCODER_ENC_GRADIENT_H_
+
+// Lossless prediction of modular channels with the clamped gradient
+// predictor, vectorized across a row, and quantization of its residuals for
+// near-lossless coding.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "encoder/base/compiler_specific.h"
+
+namespace jxl {
+
+// For the `num` samples at `value`, whose W, N and NW neighbours are at `w`,
+// `n` and `nw`, stores the PackSigned() residual of the clamped gradient
+// prediction in `residuals` and the context
+//   context_base + 5 * Bucket(W - NW) + Bucket(NW - N)
+// in `contexts`, where Bucket(d) counts which of -t2 <= d, -t1 <= d, t1 < d
+// and t2 < d hold (0 <= t1 < t2). The neighbour arrays may overlap `value`.
+void PredictGradientRow(const int32_t* w, const int32_t* n, const int32_t* nw,
+                        const int32_t* value, size_t num, int32_t t1,
+                        int32_t t2, uint32_t context_base, uint32_t* residuals,
+                        uint32_t* contexts);
+
+// Quantizes the prediction residuals of the near-lossless frames to multiples
+// of 2 * max_error + 1, the multiplier of the leaves of their context tree.
+class ResidualQuantizer {
+ public:
+  explicit ResidualQuantizer(uint32_t max_error)
+      : max_error_(max_error),
+        step_(2 * max_error + 1),
+        inv_step_(((uint64_t{1} << kShift) + step_ - 1) / step_) {}
+
+  uint32_t step() const { return step_; }
+
+  // Returns the k for which k * step() is nearest to `residual`. The division
+  // is a multiplication by the rounded-up reciprocal, which is exact because
+  // the residuals have at most 18 bits.
+  JXL_INLINE int32_t Quantize(int32_t residual) const {
+    const uint64_t abs_residual = residual < 0 ? -residual : residual;
+    const int32_t k = ((abs_residual + max_error_) * inv_step_) >> kShift;
+    return residual < 0 ? -k : k;
+  }
+
+ private:
+  static constexpr uint64_t kShift = 40;
+  const uint32_t max_error_;
+  const uint32_t step_;
+  const uint64_t inv_step_;
+};
+
+}  // namespace jxl
+
+#endif  // ENCODER_ENC_GRADIENT_H_
@@ -0,0 +1,81 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/enc_gradient.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "encoder/common.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+int32_t Bucket(int32_t d, int32_t t1, int32_t t2) {
+  return (d >= -t2) + (d >= -t1) + (d > t1) + (d > t2);
+}
+
+// Rows of every length up to a few vectors, so that both the vector loop and
+// the remainder of every target run, with samples of up to 16 bits.
+TEST(EncGradientTest, PredictGradientRowIsLossless) {
+  std::mt19937 rng(1);
+  const int32_t kThresholds[][2] = {{0, 1}, {3, 12}, {100, 5000}};
+  for (uint32_t bits : {8, 16}) {
+    std::uniform_int_distribution<int32_t> sample(0, (1 << bits) - 1);
+    for (size_t num = 1; num <= 70; ++num) {
+      std::vector<int32_t> w(num), n(num), nw(num), value(num);
+      for (size_t x = 0; x < num; ++x) {
+        w[x] = sample(rng);
+        n[x] = sample(rng);
+        // Also smooth areas, where the gradient is not clamped.
+        nw[x] = x % 3 ? sample(rng) : (w[x] + n[x]) / 2;
+        value[x] = x % 5 ? sample(rng) : n[x];
+      }
+      for (const auto& t : kThresholds) {
+        std::vector<uint32_t> residuals(num), contexts(num);
+        PredictGradientRow(w.data(), n.data(), nw.data(), value.data(), num,
+                           t[0], t[1], 50, residuals.data(), contexts.data());
+        for (size_t x = 0; x < num; ++x) {
+          const int32_t m = std::min(n[x], w[x]);
+          const int32_t M = std::max(n[x], w[x]);
+          const int32_t guess = std::min(M, std::max(m, n[x] + w[x] - nw[x]));
+          // What a decoder reconstructs from the residual.
+          ASSERT_EQ(value[x], guess + UnpackSigned(residuals[x]))
+              << "num " << num << " x " << x;
+          ASSERT_EQ(50 + 5 * Bucket(w[x] - nw[x], t[0], t[1]) +
+                        Bucket(nw[x] - n[x], t[0], t[1]),
+                    contexts[x])
+              << "num " << num << " x " << x;
+        }
+      }
+    }
+  }
+}
+
+// Every residual of 18 bits is quantized to the nearest multiple of the step,
+// so the near-lossless samples are within max_error of the input.
+TEST(EncGradientTest, QuantizedResidualsWithinMaxError) {
+  for (uint32_t max_error : {0u, 1u, 2u, 3u, 7u, 100u, 4095u, 65535u}) {
+    const ResidualQuantizer quantizer(max_error);
+    const int32_t step = quantizer.step();
+    for (int32_t residual = -(1 << 18) + 1; residual < (1 << 18);
+         ++residual) {
+      const int32_t k = quantizer.Quantize(residual);
+      const int32_t error = std::abs(residual - k * step);
+      ASSERT_LE(error, static_cast<int32_t>(max_error))
+          << "max_error " << max_error << " residual " << residual;
+    }
+  }
+}
+
+}  // namespace
+}  // namespace jxl
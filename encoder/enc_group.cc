@@ -6,7 +6,11 @@
 
 #include "encoder/enc_group.h"
 
+#include <string.h>
+
+#include <algorithm>
 #include <utility>
+#include <vector>
 
 #include "hwy/aligned_allocator.h"
 
@@ -19,9 +23,35 @@
 #include "encoder/ac_strategy.h"
 #include "encoder/base/bits.h"
 #include "encoder/base/compiler_specific.h"
+#include "encoder/coeff_order.h"
 #include "encoder/common.h"
 #include "encoder/enc_transforms-inl.h"
 #include "encoder/image.h"
+
+#ifndef ENCODER_ENC_GROUP_STRIP_
+#define ENCODER_ENC_GROUP_STRIP_
+namespace jxl {
+
+// Groups of images with fewer groups than threads are split into strips of
+// this many block rows, which are computed as separate tasks. The transforms
+// are at most 32x32 and aligned, so none of them crosses a strip boundary.
+constexpr size_t kStripDimInBlocks = 4;
+
+// The non-zeros token of a block in the first block row of a strip, whose
+// context is predicted from the block above. That block belongs to the
+// previous strip, which may not be computed yet when the token is produced,
+// so its context is fixed up afterwards.
+struct NonZerosFixup {
+  uint32_t token;  // index in the tokens of the strip
+  uint32_t c;
+  uint32_t bx;
+  uint32_t block_ctx;
+  uint32_t nzeros;
+};
+
+}  // namespace jxl
+#endif  // ENCODER_ENC_GROUP_STRIP_
+
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
@@ -158,29 +188,6 @@ JXL_INLINE int32_t PredictFromTopAndLeft(
   return (row_top[x] + row[x - 1] + 1) / 2;
 }
 
-// Needs at least 16 bits. A 32-bit type speeds up DecodeAC by 2% at the cost of
-// more memory.
-using coeff_order_t = uint32_t;
-
-constexpr coeff_order_t kCoeffOrders[] = {
-    0,   1,   8,   16, 9,   2,   3,   10,  17,  24,  32,  25,  18,  11,  4,
-    5,   12,  19,  26, 33,  40,  48,  41,  34,  27,  20,  13,  6,   7,   14,
-    21,  28,  35,  42, 49,  56,  57,  50,  43,  36,  29,  22,  15,  23,  30,
-    37,  44,  51,  58, 59,  52,  45,  38,  31,  39,  46,  53,  60,  61,  54,
-    47,  55,  62,  63, 0,   1,   16,  2,   3,   17,  32,  18,  4,   5,   19,
-    33,  48,  34,  20, 6,   7,   21,  35,  49,  64,  50,  36,  22,  8,   9,
-    23,  37,  51,  65, 80,  66,  52,  38,  24,  10,  11,  25,  39,  53,  67,
-    81,  96,  82,  68, 54,  40,  26,  12,  13,  27,  41,  55,  69,  83,  97,
-    112, 98,  84,  70, 56,  42,  28,  14,  15,  29,  43,  57,  71,  85,  99,
-    113, 114, 100, 86, 72,  58,  44,  30,  31,  45,  59,  73,  87,  101, 115,
-    116, 102, 88,  74, 60,  46,  47,  61,  75,  89,  103, 117, 118, 104, 90,
-    76,  62,  63,  77, 91,  105, 119, 120, 106, 92,  78,  79,  93,  107, 121,
-    122, 108, 94,  95, 109, 123, 124, 110, 111, 125, 126, 127,
-};
-
-// Maps from ac strategy to offset in kCoeffOrders[]
-static constexpr size_t kCoeffOrderOffset[] = {0, kDCTBlockSize, kDCTBlockSize};
-
 template <class DI>
 HWY_INLINE HWY_MAYBE_UNUSED Vec<Rebind<float, DI>> AdjustQuantBias(
     DI di, const size_t c, const Vec<DI> quant_i,
@@ -300,13 +307,21 @@ void QuantizeRoundtripYBlockAC(const float* JXL_RESTRICT qm,
   }
 }
 
-void ComputeCoefficients(size_t group_idx, const Image3F& opsin,
-                         const ImageI& raw_quant_field,
+// Computes the DC and the AC tokens of the block rows [by0, by1) of a group,
+// and the number of non-zeros of their blocks in `tmp_num_nzeroes`. If
+// `fixups` is not null, the row above by0 is not available yet and the
+// non-zeros tokens of row by0 are added to `fixups` instead of `histograms`.
+void ComputeCoefficients(size_t group_idx, size_t by0, size_t by1,
+                         const Image3F& opsin, const ImageI& raw_quant_field,
                          const DequantMatrices& matrices, const float scale,
                          const ColorCorrelationMap& cmap,
                          const AcStrategyImage& ac_strategy,
                          const float x_qm_mul, Image3I* tmp_num_nzeroes,
-                         Image3F* dc, std::vector<Token>* output) {
+                         int32_t* JXL_RESTRICT mem, float* JXL_RESTRICT fmem,
+                         Image3F* dc, PackedTokens* output,
+                         std::vector<NonZerosFixup>* fixups,
+                         HistogramBuilder* histograms,
+                         const ImageTransforms* transforms) {
   const size_t xsize_groups = DivCeil(opsin.xsize(), kGroupDim);
   const size_t gx = group_idx % xsize_groups;
   const size_t gy = group_idx / xsize_groups;
@@ -323,26 +338,32 @@ void ComputeCoefficients(size_t group_idx, const Image3F& opsin,
       DivCeil(block_group_rect.ysize(), kColorTileDimInBlocks));
 
   const size_t xsize_blocks = block_group_rect.xsize();
-  const size_t ysize_blocks = block_group_rect.ysize();
+  by1 = std::min(by1, block_group_rect.ysize());
+  if (by0 >= by1) return;
 
   const size_t dc_stride = static_cast<size_t>(dc->PixelsPerRow());
   const size_t opsin_stride = static_cast<size_t>(opsin.PixelsPerRow());
 
-  // TODO(veluca): consider strategies to reduce this memory.
-  auto mem = hwy::AllocateAligned<int32_t>(3 * AcStrategy::kMaxCoeffArea);
-  auto fmem = hwy::AllocateAligned<float>(5 * AcStrategy::kMaxCoeffArea);
-  float* JXL_RESTRICT scratch_space =
-      fmem.get() + 3 * AcStrategy::kMaxCoeffArea;
+  // Per-thread scratch space of 3 * kMaxCoeffArea integers in `mem` and
+  // 5 * kMaxCoeffArea floats in `fmem`.
+  float* JXL_RESTRICT scratch_space = fmem + 3 * AcStrategy::kMaxCoeffArea;
   constexpr HWY_CAPPED(float, kDCTBlockSize) d;
-  HWY_ALIGN float* coeffs_in = fmem.get();
-  HWY_ALIGN int32_t* quantized = mem.get();
+  HWY_ALIGN float* coeffs_in = fmem;
+  HWY_ALIGN int32_t* quantized = mem;
 
   output->reserve(output->size() +
-                  3 * xsize_blocks * ysize_blocks * kDCTBlockSize);
+                  3 * xsize_blocks * (by1 - by0) * kDCTBlockSize);
 
   const size_t nzeros_stride = tmp_num_nzeroes->PixelsPerRow();
 
-  for (size_t by = 0; by < ysize_blocks; ++by) {
+  // The precomputed coefficients of the next transform, if any.
+  const float* JXL_RESTRICT transformed =
+      transforms != nullptr
+          ? transforms->coefficients[group_idx].get() +
+                transforms->row_offsets[group_idx][by0]
+          : nullptr;
+
+  for (size_t by = by0; by < by1; ++by) {
     const int32_t* JXL_RESTRICT row_quant_ac =
         block_group_rect.ConstRow(raw_quant_field, by);
     size_t ty = by / kColorTileDimInBlocks;
@@ -367,11 +388,13 @@ void ComputeCoefficients(size_t group_idx, const Image3F& opsin,
         tmp_num_nzeroes->PlaneRow(1, by),
         tmp_num_nzeroes->PlaneRow(2, by),
     };
+    const bool has_top = by != 0 && !(by == by0 && fixups != nullptr);
     const int32_t* JXL_RESTRICT row_nzeros_top[3] = {
-        by == 0 ? nullptr : tmp_num_nzeroes->ConstPlaneRow(0, by - 1),
-        by == 0 ? nullptr : tmp_num_nzeroes->ConstPlaneRow(1, by - 1),
-        by == 0 ? nullptr : tmp_num_nzeroes->ConstPlaneRow(2, by - 1),
+        has_top ? tmp_num_nzeroes->ConstPlaneRow(0, by - 1) : nullptr,
+        has_top ? tmp_num_nzeroes->ConstPlaneRow(1, by - 1) : nullptr,
+        has_top ? tmp_num_nzeroes->ConstPlaneRow(2, by - 1) : nullptr,
     };
+    const bool fix_up_row = by != 0 && !has_top;
     for (size_t bx = 0; bx < xsize_blocks; ++bx) {
       size_t tx = bx / kColorTileDimInBlocks;
       const auto x_factor = Set(d, cmap.YtoXRatio(row_cmap[0][tx]));
@@ -387,8 +410,13 @@ void ComputeCoefficients(size_t group_idx, const Image3F& opsin,
 
       // DCT Y channel, roundtrip-quantize it and set DC.
       const int32_t quant_ac = row_quant_ac[bx];
-      TransformFromPixels(acs.Strategy(), opsin_rows[1] + bx * kBlockDim,
-                          opsin_stride, coeffs_in + size, scratch_space);
+      if (transformed != nullptr) {
+        memcpy(coeffs_in, transformed, 3 * size * sizeof(float));
+        transformed += 3 * size;
+      } else {
+        TransformFromPixels(acs.Strategy(), opsin_rows[1] + bx * kBlockDim,
+                            opsin_stride, coeffs_in + size, scratch_space);
+      }
       DCFromLowestFrequencies(acs.Strategy(), coeffs_in + size, dc_rows[1] + bx,
                               dc_stride);
       int kind = acs.RawStrategy();
@@ -398,9 +426,12 @@ void ComputeCoefficients(size_t group_idx, const Image3F& opsin,
                                 coeffs_in + size, quantized + size);
 
       // DCT X and B channels
-      for (size_t c : {0, 2}) {
-        TransformFromPixels(acs.Strategy(), opsin_rows[c] + bx * kBlockDim,
-                            opsin_stride, coeffs_in + c * size, scratch_space);
+      if (transformed == nullptr) {
+        for (size_t c : {0, 2}) {
+          TransformFromPixels(acs.Strategy(), opsin_rows[c] + bx * kBlockDim,
+                              opsin_stride, coeffs_in + c * size,
+                              scratch_space);
+        }
       }
 
       // Unapply color correlation
@@ -426,6 +457,7 @@ void ComputeCoefficients(size_t group_idx, const Image3F& opsin,
       // Tokenize coefficients
       const size_t log2_covered_blocks =
           Num0BitsBelowLS1Bit_Nonzero(covered_blocks);
+      const coeff_order_t* JXL_RESTRICT order = NaturalCoeffOrder(acs);
       for (int c : {1, 0, 2}) {
         const int32_t* JXL_RESTRICT block = quantized + c * size;
 
@@ -436,16 +468,26 @@ void ComputeCoefficients(size_t group_idx, const Image3F& opsin,
                                       log2_covered_blocks, block, nzeros_stride,
                                       row_nzeros[c] + bx);
 
-        const coeff_order_t* JXL_RESTRICT order =
-            &kCoeffOrders[kCoeffOrderOffset[acs.RawStrategy()]];
-
         int32_t predicted_nzeros =
             PredictFromTopAndLeft(row_nzeros_top[c], row_nzeros[c], bx, 32);
         const size_t block_ctx = BlockContext(c, acs.StrategyCode());
         const size_t nzero_ctx = NonZeroContext(predicted_nzeros, block_ctx);
         const size_t histo_offset = ZeroDensityContextsOffset(block_ctx);
 
-        output->emplace_back(nzero_ctx, nzeros);
+        const auto add_token = [&](size_t ctx, uint32_t value) {
+          output->emplace_back(ctx, value);
+          if (histograms != nullptr) histograms->Add(Token(ctx, value));
+        };
+        if (fix_up_row) {
+          fixups->push_back({static_cast<uint32_t>(output->size()),
+                             static_cast<uint32_t>(c),
+                             static_cast<uint32_t>(bx),
+                             static_cast<uint32_t>(block_ctx),
+                             static_cast<uint32_t>(nzeros)});
+          output->emplace_back(nzero_ctx, nzeros);
+        } else {
+          add_token(nzero_ctx, nzeros);
+        }
         // Skip LLF.
         size_t prev = (nzeros > static_cast<ssize_t>(size / 16) ? 0 : 1);
         for (size_t k = covered_blocks; k < size && nzeros != 0; ++k) {
@@ -454,7 +496,7 @@ void ComputeCoefficients(size_t group_idx, const Image3F& opsin,
               histo_offset + ZeroDensityContext(nzeros, k, covered_blocks,
                                                 log2_covered_blocks, prev);
           uint32_t u_coeff = PackSigned(coeff);
-          output->emplace_back(ctx, u_coeff);
+          add_token(ctx, u_coeff);
           prev = coeff != 0;
           nzeros -= prev;
         }
@@ -464,6 +506,161 @@ void ComputeCoefficients(size_t group_idx, const Image3F& opsin,
   }
 }
 
+// Computes the coefficients of the transforms of a group, see ImageTransforms.
+void ComputeGroupTransforms(size_t group_idx, const Image3F& opsin,
+                            const AcStrategyImage& ac_strategy,
+                            float* JXL_RESTRICT scratch_space,
+                            hwy::AlignedFreeUniquePtr<float[]>* coefficients,
+                            std::vector<size_t>* row_offsets) {
+  const size_t xsize_groups = DivCeil(opsin.xsize(), kGroupDim);
+  const size_t gx = group_idx % xsize_groups;
+  const size_t gy = group_idx / xsize_groups;
+  const Rect block_group_rect(gx * kGroupDimInBlocks, gy * kGroupDimInBlocks,
+                              kGroupDimInBlocks, kGroupDimInBlocks,
+                              DivCeil(opsin.xsize(), kBlockDim),
+                              DivCeil(opsin.ysize(), kBlockDim));
+  const Rect group_rect(gx * kGroupDim, gy * kGroupDim, kGroupDim, kGroupDim,
+                        opsin.xsize(), opsin.ysize());
+  const size_t opsin_stride = static_cast<size_t>(opsin.PixelsPerRow());
+  // The transforms cover every block of the group exactly once.
+  *coefficients = hwy::AllocateAligned<float>(
+      3 * kDCTBlockSize * block_group_rect.xsize() * block_group_rect.ysize());
+  row_offsets->resize(block_group_rect.ysize());
+  size_t pos = 0;
+  for (size_t by = 0; by < block_group_rect.ysize(); ++by) {
+    (*row_offsets)[by] = pos;
+    AcStrategyRow ac_strategy_row = ac_strategy.ConstRow(block_group_rect, by);
+    for (size_t bx = 0; bx < block_group_rect.xsize(); ++bx) {
+      const AcStrategy acs = ac_strategy_row[bx];
+      if (!acs.IsFirstBlock()) continue;
+      const size_t size = kDCTBlockSize * acs.covered_blocks_x() *
+                          acs.covered_blocks_y();
+      for (size_t c = 0; c < 3; ++c) {
+        TransformFromPixels(
+            acs.Strategy(),
+            group_rect.ConstPlaneRow(opsin, c, by * kBlockDim) + bx * kBlockDim,
+            opsin_stride, coefficients->get() + pos + c * size,
+            scratch_space);
+      }
+      pos += 3 * size;
+    }
+  }
+}
+
+// Sets the contexts of the non-zeros tokens of block row `by` of a group, the
+// first row of a strip, now that the row above is known.
+void FixUpNonZerosContexts(const Image3I& num_nzeroes, size_t by,
+                           const std::vector<NonZerosFixup>& fixups,
+                           PackedTokens* tokens, HistogramBuilder* histograms) {
+  for (const NonZerosFixup& fixup : fixups) {
+    const int32_t predicted_nzeros = PredictFromTopAndLeft(
+        num_nzeroes.ConstPlaneRow(fixup.c, by - 1),
+        num_nzeroes.ConstPlaneRow(fixup.c, by), fixup.bx, 32);
+    const size_t nzero_ctx = NonZeroContext(predicted_nzeros, fixup.block_ctx);
+    tokens->SetContext(fixup.token, nzero_ctx);
+    if (histograms != nullptr) {
+      histograms->Add(Token(nzero_ctx, fixup.nzeros));
+    }
+  }
+}
+
+// Splits the AC tokens of a group into the tokens of two passes, see
+// SplitACPasses(). `num_nzeroes` are the non-zeros images of the passes and
+// `coeffs` holds the coefficients of the largest transform.
+void SplitGroupPasses(size_t group_idx, const AcStrategyImage& ac_strategy,
+                      const PackedTokens& tokens, uint32_t shift,
+                      Image3I* num_nzeroes, int32_t* JXL_RESTRICT coeffs,
+                      PackedTokens* JXL_RESTRICT output[2],
+                      HistogramBuilder* histograms[2]) {
+  const size_t xsize_groups =
+      DivCeil(ac_strategy.xsize(), kGroupDimInBlocks);
+  const size_t gx = group_idx % xsize_groups;
+  const size_t gy = group_idx / xsize_groups;
+  const Rect block_group_rect(gx * kGroupDimInBlocks, gy * kGroupDimInBlocks,
+                              kGroupDimInBlocks, kGroupDimInBlocks,
+                              ac_strategy.xsize(), ac_strategy.ysize());
+  std::vector<uint32_t> values;
+  values.reserve(tokens.size());
+  tokens.ForEach([&values](const Token& token) {
+    values.push_back(token.value);
+  });
+  const uint32_t* JXL_RESTRICT value = values.data();
+  for (size_t pass = 0; pass < 2; ++pass) {
+    output[pass]->reserve(values.size());
+  }
+  int32_t* JXL_RESTRICT pass_coeffs[2] = {coeffs,
+                                          coeffs + AcStrategy::kMaxCoeffArea};
+
+  // Visits the blocks in the order of ComputeCoefficients().
+  for (size_t by = 0; by < block_group_rect.ysize(); ++by) {
+    AcStrategyRow ac_strategy_row = ac_strategy.ConstRow(block_group_rect, by);
+    for (size_t bx = 0; bx < block_group_rect.xsize(); ++bx) {
+      const AcStrategy acs = ac_strategy_row[bx];
+      if (!acs.IsFirstBlock()) continue;
+      const size_t covered_blocks = acs.covered_blocks_x() *
+                                    acs.covered_blocks_y();
+      const size_t size = kDCTBlockSize * covered_blocks;
+      const size_t log2_covered_blocks =
+          Num0BitsBelowLS1Bit_Nonzero(covered_blocks);
+      for (int c : {1, 0, 2}) {
+        // The coefficients in coefficient order, split into the passes.
+        int32_t nzeros = *value++;
+        std::fill(coeffs, coeffs + size, 0);
+        std::fill(pass_coeffs[1], pass_coeffs[1] + size, 0);
+        for (size_t k = covered_blocks; k < size && nzeros != 0; ++k) {
+          const int32_t coeff = UnpackSigned(*value++);
+          const int32_t coarse =
+              coeff < 0 ? -(-coeff >> shift) : coeff >> shift;
+          pass_coeffs[0][k] = coarse;
+          pass_coeffs[1][k] = coeff - coarse * (1 << shift);
+          nzeros -= coeff != 0;
+        }
+        JXL_DASSERT(nzeros == 0);
+
+        const size_t block_ctx = BlockContext(c, acs.StrategyCode());
+        const size_t histo_offset = ZeroDensityContextsOffset(block_ctx);
+        for (size_t pass = 0; pass < 2; ++pass) {
+          const int32_t* JXL_RESTRICT block = pass_coeffs[pass];
+          Image3I& nzeros_image = num_nzeroes[pass];
+          int32_t pass_nzeros = 0;
+          for (size_t k = covered_blocks; k < size; ++k) {
+            pass_nzeros += block[k] != 0;
+          }
+          const int32_t shifted_nzeros = static_cast<int32_t>(
+              (pass_nzeros + covered_blocks - 1) >> log2_covered_blocks);
+          for (size_t y = 0; y < acs.covered_blocks_y(); y++) {
+            int32_t* JXL_RESTRICT row = nzeros_image.PlaneRow(c, by + y);
+            for (size_t x = 0; x < acs.covered_blocks_x(); x++) {
+              row[bx + x] = shifted_nzeros;
+            }
+          }
+          const int32_t predicted_nzeros = PredictFromTopAndLeft(
+              by == 0 ? nullptr : nzeros_image.ConstPlaneRow(c, by - 1),
+              nzeros_image.ConstPlaneRow(c, by), bx, 32);
+          const auto add_token = [&](size_t ctx, uint32_t token_value) {
+            output[pass]->emplace_back(ctx, token_value);
+            if (histograms[pass] != nullptr) {
+              histograms[pass]->Add(Token(ctx, token_value));
+            }
+          };
+          add_token(NonZeroContext(predicted_nzeros, block_ctx), pass_nzeros);
+          size_t prev =
+              (pass_nzeros > static_cast<ssize_t>(size / 16) ? 0 : 1);
+          for (size_t k = covered_blocks; k < size && pass_nzeros != 0; ++k) {
+            const size_t ctx =
+                histo_offset + ZeroDensityContext(pass_nzeros, k,
+                                                  covered_blocks,
+                                                  log2_covered_blocks, prev);
+            add_token(ctx, PackSigned(block[k]));
+            prev = block[k] != 0;
+            pass_nzeros -= prev;
+          }
+        }
+      }
+    }
+  }
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -471,31 +668,197 @@ HWY_AFTER_NAMESPACE();
 
 #if HWY_ONCE
 namespace jxl {
+static_assert(kNumACContexts <= (1u << PackedTokens::kContextBits),
+              "AC contexts do not fit in PackedTokens");
+
 HWY_EXPORT(ComputeCoefficients);
+HWY_EXPORT(ComputeGroupTransforms);
+HWY_EXPORT(FixUpNonZerosContexts);
+HWY_EXPORT(SplitGroupPasses);
+
+Status ComputeTransforms(const Image3F& opsin,
+                         const AcStrategyImage& ac_strategy, ThreadPool* pool,
+                         ImageTransforms* transforms) {
+  const size_t num_groups = DivCeil(opsin.xsize(), kGroupDim) *
+                            DivCeil(opsin.ysize(), kGroupDim);
+  transforms->coefficients.resize(num_groups);
+  transforms->row_offsets.resize(num_groups);
+  std::vector<hwy::AlignedFreeUniquePtr<float[]>> scratch_space;
+  return RunOnPool(
+      pool, 0, num_groups,
+      [&](const size_t num_threads) {
+        scratch_space.resize(num_threads);
+        for (size_t t = 0; t < num_threads; ++t) {
+          scratch_space[t] =
+              hwy::AllocateAligned<float>(2 * AcStrategy::kMaxCoeffArea);
+        }
+        return true;
+      },
+      [&](size_t group_idx, size_t thread) {
+        HWY_DYNAMIC_DISPATCH(ComputeGroupTransforms)
+        (group_idx, opsin, ac_strategy, scratch_space[thread].get(),
+         &transforms->coefficients[group_idx],
+         &transforms->row_offsets[group_idx]);
+      },
+      "ComputeTransforms");
+}
+
 Status ComputeCoefficients(const Image3F& opsin, const ImageI& raw_quant_field,
                            const DequantMatrices& matrices, const float scale,
                            const ColorCorrelationMap& cmap,
                            const AcStrategyImage& ac_strategy,
                            const float x_qm_mul, ThreadPool* pool, Image3F* dc,
-                           std::vector<std::vector<Token>>* ac_tokens) {
+                           std::vector<PackedTokens>* ac_tokens,
+                           HistogramBuilder* ac_histograms,
+                           const ImageTransforms* transforms) {
   const size_t xsize_groups = DivCeil(opsin.xsize(), kGroupDim);
   const size_t ysize_groups = DivCeil(opsin.ysize(), kGroupDim);
+  const size_t num_groups = xsize_groups * ysize_groups;
+  // With fewer groups than threads, every group is split into strips so that
+  // all threads have work. The strips of a group share its non-zeros image,
+  // and all but the first produce their tokens separately, to be appended to
+  // those of the group after their first row is fixed up.
+  const bool split = pool != nullptr && num_groups < pool->num_threads();
+  const size_t num_strips =
+      split ? kGroupDimInBlocks / kStripDimInBlocks : 1;
+  const size_t strip_rows = kGroupDimInBlocks / num_strips;
+  std::vector<Image3I> group_nzeroes;
+  std::vector<PackedTokens> strip_tokens;
+  std::vector<std::vector<NonZerosFixup>> fixups;
+  if (split) {
+    for (size_t i = 0; i < num_groups; ++i) {
+      group_nzeroes.emplace_back(kGroupDimInBlocks, kGroupDimInBlocks);
+    }
+    strip_tokens.resize(num_groups * num_strips);
+    fixups.resize(num_groups * num_strips);
+  }
+  // The scratch memory only depends on the thread, so allocate it once per
+  // thread instead of once per group.
+  constexpr size_t kMemSize = 3 * AcStrategy::kMaxCoeffArea;
+  constexpr size_t kFMemSize = 5 * AcStrategy::kMaxCoeffArea;
   std::vector<Image3I> num_nzeroes;
+  std::vector<hwy::AlignedFreeUniquePtr<int32_t[]>> mem;
+  std::vector<hwy::AlignedFreeUniquePtr<float[]>> fmem;
+  // The histograms of the AC tokens are accumulated per thread while the
+  // tokens are produced, instead of in a separate pass over all tokens. The
+  // first thread adds to `ac_histograms` directly, so a single-threaded pool
+  // needs neither temporary histograms nor a merge.
+  std::vector<HistogramBuilder> histograms;
+  if (ac_histograms != nullptr) {
+    ac_histograms->histograms.resize(kNumACContexts);
+  }
   const auto tokenize_group_init = [&](const size_t num_threads) {
-    num_nzeroes.resize(num_threads);
+    if (!split) num_nzeroes.resize(num_threads);
+    if (ac_histograms != nullptr) {
+      histograms.resize(num_threads - 1, HistogramBuilder(kNumACContexts));
+    }
+    mem.resize(num_threads);
+    fmem.resize(num_threads);
     for (size_t t = 0; t < num_threads; ++t) {
-      num_nzeroes[t] = Image3I(kGroupDimInBlocks, kGroupDimInBlocks);
+      if (!split) {
+        num_nzeroes[t] = Image3I(kGroupDimInBlocks, kGroupDimInBlocks);
+      }
+      mem[t] = hwy::AllocateAligned<int32_t>(kMemSize);
+      fmem[t] = hwy::AllocateAligned<float>(kFMemSize);
     }
     return true;
   };
-  return RunOnPool(
-      pool, 0, xsize_groups * ysize_groups, tokenize_group_init,
-      [&](size_t group_idx, size_t thread) {
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, num_groups * num_strips, tokenize_group_init,
+      [&](size_t task, size_t thread) {
+        const size_t group_idx = task / num_strips;
+        const size_t strip = task % num_strips;
         HWY_DYNAMIC_DISPATCH(ComputeCoefficients)
-        (group_idx, opsin, raw_quant_field, matrices, scale, cmap, ac_strategy,
-         x_qm_mul, &num_nzeroes[thread], dc, &(*ac_tokens)[group_idx]);
+        (group_idx, strip * strip_rows, (strip + 1) * strip_rows, opsin,
+         raw_quant_field, matrices, scale, cmap, ac_strategy, x_qm_mul,
+         split ? &group_nzeroes[group_idx] : &num_nzeroes[thread],
+         mem[thread].get(), fmem[thread].get(), dc,
+         strip == 0 ? &(*ac_tokens)[group_idx] : &strip_tokens[task],
+         strip == 0 ? nullptr : &fixups[task],
+         thread == 0 || ac_histograms == nullptr ? ac_histograms
+                                                 : &histograms[thread - 1],
+         transforms);
+      },
+      "Compute coeffs"));
+  for (size_t task = 0; task < strip_tokens.size(); ++task) {
+    const size_t strip = task % num_strips;
+    if (strip == 0 || strip_tokens[task].empty()) continue;
+    const size_t group_idx = task / num_strips;
+    HWY_DYNAMIC_DISPATCH(FixUpNonZerosContexts)
+    (group_nzeroes[group_idx], strip * strip_rows, fixups[task],
+     &strip_tokens[task], ac_histograms);
+    (*ac_tokens)[group_idx].Append(strip_tokens[task]);
+  }
+  if (ac_histograms == nullptr) return true;
+  std::vector<const HistogramBuilder*> thread_histograms;
+  for (const HistogramBuilder& builder : histograms) {
+    thread_histograms.push_back(&builder);
+  }
+  JXL_RETURN_IF_ERROR(
+      MergeHistograms(thread_histograms, pool, ac_histograms));
+  return true;
+}
+
+Status SplitACPasses(const AcStrategyImage& ac_strategy,
+                     const std::vector<PackedTokens>& ac_tokens,
+                     uint32_t shift, ThreadPool* pool,
+                     std::vector<PackedTokens>* passes,
+                     std::vector<HistogramBuilder>* histograms) {
+  const size_t num_groups = ac_tokens.size();
+  passes->clear();
+  passes->resize(2 * num_groups);
+  // As in ComputeCoefficients(), the first thread adds to `histograms`
+  // directly and the others to their own histograms, merged at the end.
+  const bool has_histograms = !histograms->empty();
+  for (HistogramBuilder& builder : *histograms) {
+    builder.histograms.resize(kNumACContexts);
+  }
+  std::vector<HistogramBuilder> thread_histograms;
+  std::vector<Image3I> num_nzeroes;
+  std::vector<hwy::AlignedFreeUniquePtr<int32_t[]>> coeffs;
+  const auto init = [&](const size_t num_threads) {
+    if (has_histograms) {
+      thread_histograms.resize(2 * (num_threads - 1),
+                               HistogramBuilder(kNumACContexts));
+    }
+    num_nzeroes.clear();
+    for (size_t i = 0; i < 2 * num_threads; ++i) {
+      num_nzeroes.emplace_back(kGroupDimInBlocks, kGroupDimInBlocks);
+    }
+    coeffs.resize(num_threads);
+    for (size_t t = 0; t < num_threads; ++t) {
+      coeffs[t] = hwy::AllocateAligned<int32_t>(2 * AcStrategy::kMaxCoeffArea);
+    }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, num_groups, init,
+      [&](size_t group_idx, size_t thread) {
+        PackedTokens* output[2] = {&(*passes)[group_idx],
+                                   &(*passes)[num_groups + group_idx]};
+        HistogramBuilder* group_histograms[2] = {nullptr, nullptr};
+        if (has_histograms) {
+          for (size_t pass = 0; pass < 2; ++pass) {
+            group_histograms[pass] =
+                thread == 0 ? &(*histograms)[pass]
+                            : &thread_histograms[2 * (thread - 1) + pass];
+          }
+        }
+        HWY_DYNAMIC_DISPATCH(SplitGroupPasses)
+        (group_idx, ac_strategy, ac_tokens[group_idx], shift,
+         &num_nzeroes[2 * thread], coeffs[thread].get(), output,
+         group_histograms);
       },
-      "Compute coeffs");
+      "SplitACPasses"));
+  if (!has_histograms) return true;
+  for (size_t pass = 0; pass < 2; ++pass) {
+    std::vector<const HistogramBuilder*> in;
+    for (size_t i = pass; i < thread_histograms.size(); i += 2) {
+      in.push_back(&thread_histograms[i]);
+    }
+    JXL_RETURN_IF_ERROR(MergeHistograms(in, pool, &(*histograms)[pass]));
+  }
+  return true;
 }
 
 }  // namespace jxl
@@ -8,23 +8,63 @@
 #define ENCODER_ENC_GROUP_H_
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include <hwy/aligned_allocator.h>
+#include <vector>
 
 #include "encoder/ac_strategy.h"
 #include "encoder/base/data_parallel.h"
 #include "encoder/base/status.h"
 #include "encoder/chroma_from_luma.h"
+#include "encoder/histogram.h"
 #include "encoder/image.h"
 #include "encoder/quant_weights.h"
 #include "encoder/token.h"
 
 namespace jxl {
 
+// The DCT coefficients of every transform of an image, which only depend on
+// the pixels and the block sizes, for quantizing the image more than once.
+struct ImageTransforms {
+  // For every group, the coefficients of its transforms in the order of their
+  // first blocks, for each of them those of X, then Y, then B.
+  std::vector<hwy::AlignedFreeUniquePtr<float[]>> coefficients;
+  // For every group, the index in its `coefficients` of the first transform
+  // of each block row.
+  std::vector<std::vector<size_t>> row_offsets;
+};
+
+// Computes the transforms of all blocks of `opsin` with the given sizes.
+Status ComputeTransforms(const Image3F& opsin,
+                         const AcStrategyImage& ac_strategy, ThreadPool* pool,
+                         ImageTransforms* transforms);
+
+// Computes the DC image and the AC tokens of every group. The histograms of the
+// AC tokens are added to `ac_histograms`, unless it is null. If `transforms` is
+// not null, it holds the coefficients of `opsin` and `ac_strategy`, which are
+// then not computed again.
 Status ComputeCoefficients(const Image3F& opsin, const ImageI& raw_quant_field,
                            const DequantMatrices& matrices, const float scale,
                            const ColorCorrelationMap& cmap,
                            const AcStrategyImage& ac_strategy,
                            const float x_qm_mul, ThreadPool* pool, Image3F* dc,
-                           std::vector<std::vector<Token>>* ac_tokens);
+                           std::vector<PackedTokens>* ac_tokens,
+                           HistogramBuilder* ac_histograms,
+                           const ImageTransforms* transforms = nullptr);
+
+// Splits the AC tokens of every group, as computed by ComputeCoefficients()
+// for `ac_strategy`, into those of two passes, stored in `passes` at the index
+// of the pass times the number of groups plus that of the group. The first
+// pass codes every coefficient rounded towards zero to a multiple of
+// 2^`shift`, the second one the rest. The histograms of the tokens of each
+// pass are added to the builder of the same index in `histograms`, unless it
+// is empty.
+Status SplitACPasses(const AcStrategyImage& ac_strategy,
+                     const std::vector<PackedTokens>& ac_tokens,
+                     uint32_t shift, ThreadPool* pool,
+                     std::vector<PackedTokens>* passes,
+                     std::vector<HistogramBuilder>* histograms);
 
 }  // namespace jxl
 
@@ -599,6 +599,19 @@ HWY_INLINE void ReinterpretingIDCT(const float* input,
                                   scratch_space);
 }
 
+// Replaces the DCs of the four quarters of a DCT4X4 or IDENTITY block, which
+// are at the top-left 2x2 coefficients, with their 2x2 Hadamard transform.
+HWY_INLINE void DC2x2(float* JXL_RESTRICT coefficients) {
+  const float block00 = coefficients[0];
+  const float block01 = coefficients[1];
+  const float block10 = coefficients[kBlockDim];
+  const float block11 = coefficients[kBlockDim + 1];
+  coefficients[0] = (block00 + block01 + block10 + block11) * 0.25f;
+  coefficients[1] = (block00 + block01 - block10 - block11) * 0.25f;
+  coefficients[kBlockDim] = (block00 - block01 + block10 - block11) * 0.25f;
+  coefficients[kBlockDim + 1] = (block00 - block01 - block10 + block11) * 0.25f;
+}
+
 HWY_MAYBE_UNUSED void TransformFromPixels(const AcStrategy::Type strategy,
                                           const float* JXL_RESTRICT pixels,
                                           size_t pixels_stride,
@@ -616,11 +629,77 @@ HWY_MAYBE_UNUSED void TransformFromPixels(const AcStrategy::Type strategy,
                                 scratch_space);
       break;
     }
+    case Type::DCT16X16: {
+      ComputeScaledDCT<16, 16>()(DCTFrom(pixels, pixels_stride), coefficients,
+                                 scratch_space);
+      break;
+    }
+    case Type::DCT32X16: {
+      ComputeScaledDCT<32, 16>()(DCTFrom(pixels, pixels_stride), coefficients,
+                                 scratch_space);
+      break;
+    }
+    case Type::DCT16X32: {
+      ComputeScaledDCT<16, 32>()(DCTFrom(pixels, pixels_stride), coefficients,
+                                 scratch_space);
+      break;
+    }
+    case Type::DCT32X32: {
+      ComputeScaledDCT<32, 32>()(DCTFrom(pixels, pixels_stride), coefficients,
+                                 scratch_space);
+      break;
+    }
     case Type::DCT: {
       ComputeScaledDCT<8, 8>()(DCTFrom(pixels, pixels_stride), coefficients,
                                scratch_space);
       break;
     }
+    case Type::DCT4X4: {
+      HWY_ALIGN float block[4 * 4];
+      for (size_t y = 0; y < 2; y++) {
+        for (size_t x = 0; x < 2; x++) {
+          ComputeScaledDCT<4, 4>()(
+              DCTFrom(pixels + y * 4 * pixels_stride + x * 4, pixels_stride),
+              block, scratch_space);
+          for (size_t iy = 0; iy < 4; iy++) {
+            for (size_t ix = 0; ix < 4; ix++) {
+              coefficients[(y + iy * 2) * 8 + x + ix * 2] = block[iy * 4 + ix];
+            }
+          }
+        }
+      }
+      DC2x2(coefficients);
+      break;
+    }
+    case Type::IDENTITY: {
+      for (size_t y = 0; y < 2; y++) {
+        for (size_t x = 0; x < 2; x++) {
+          const float* JXL_RESTRICT quarter =
+              pixels + y * 4 * pixels_stride + x * 4;
+          float block_dc = 0;
+          for (size_t iy = 0; iy < 4; iy++) {
+            for (size_t ix = 0; ix < 4; ix++) {
+              block_dc += quarter[iy * pixels_stride + ix];
+            }
+          }
+          block_dc *= 1.0f / 16;
+          // Differences to the pixel at (1, 1); the difference of the pixel
+          // at (0, 0) is moved to its place to make room for the mean.
+          const float ref = quarter[pixels_stride + 1];
+          for (size_t iy = 0; iy < 4; iy++) {
+            for (size_t ix = 0; ix < 4; ix++) {
+              if (ix == 1 && iy == 1) continue;
+              coefficients[(y + iy * 2) * 8 + x + ix * 2] =
+                  quarter[iy * pixels_stride + ix] - ref;
+            }
+          }
+          coefficients[(y + 2) * 8 + x + 2] = coefficients[y * 8 + x];
+          coefficients[y * 8 + x] = block_dc;
+        }
+      }
+      DC2x2(coefficients);
+      break;
+    }
     case Type::kNumValidStrategies:
       JXL_ABORT("Invalid strategy");
   }
@@ -643,7 +722,33 @@ HWY_MAYBE_UNUSED void DCFromLowestFrequencies(const AcStrategy::Type strategy,
                          /*COLS=*/2>(block, 2 * kBlockDim, dc, dc_stride);
       break;
     }
+    case Type::DCT16X16: {
+      ReinterpretingIDCT</*DCT_ROWS=*/2 * kBlockDim, /*DCT_COLS=*/2 * kBlockDim,
+                         /*LF_ROWS=*/2, /*LF_COLS=*/2, /*ROWS=*/2,
+                         /*COLS=*/2>(block, 2 * kBlockDim, dc, dc_stride);
+      break;
+    }
+    case Type::DCT32X16: {
+      ReinterpretingIDCT</*DCT_ROWS=*/4 * kBlockDim, /*DCT_COLS=*/2 * kBlockDim,
+                         /*LF_ROWS=*/4, /*LF_COLS=*/2, /*ROWS=*/4,
+                         /*COLS=*/2>(block, 4 * kBlockDim, dc, dc_stride);
+      break;
+    }
+    case Type::DCT16X32: {
+      ReinterpretingIDCT</*DCT_ROWS=*/2 * kBlockDim, /*DCT_COLS=*/4 * kBlockDim,
+                         /*LF_ROWS=*/2, /*LF_COLS=*/4, /*ROWS=*/2,
+                         /*COLS=*/4>(block, 4 * kBlockDim, dc, dc_stride);
+      break;
+    }
+    case Type::DCT32X32: {
+      ReinterpretingIDCT</*DCT_ROWS=*/4 * kBlockDim, /*DCT_COLS=*/4 * kBlockDim,
+                         /*LF_ROWS=*/4, /*LF_COLS=*/4, /*ROWS=*/4,
+                         /*COLS=*/4>(block, 4 * kBlockDim, dc, dc_stride);
+      break;
+    }
     case Type::DCT:
+    case Type::DCT4X4:
+    case Type::IDENTITY:
       dc[0] = block[0];
       break;
     case Type::kNumValidStrategies:
@@ -6,6 +6,9 @@
 
 #include "encoder/enc_xyb.h"
 
+#include <cmath>
+#include <vector>
+
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "encoder/enc_xyb.cc"
 #include <hwy/foreach_target.h>
@@ -13,6 +16,7 @@
 
 #include "encoder/base/data_parallel.h"
 #include "encoder/base/status.h"
+#include "encoder/common.h"
 #include "encoder/fast_math-inl.h"
 #include "encoder/image.h"
 
@@ -22,8 +26,13 @@ namespace HWY_NAMESPACE {
 
 // These templates are not found via ADL.
 using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::Gt;
+using hwy::HWY_NAMESPACE::IfThenElse;
+using hwy::HWY_NAMESPACE::Max;
+using hwy::HWY_NAMESPACE::Min;
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::Sqrt;
 using hwy::HWY_NAMESPACE::Sub;
 using hwy::HWY_NAMESPACE::ZeroIfNegative;
 
@@ -94,14 +103,9 @@ void LinearRGBToXYB(const V r, const V g, const V b,
   Store(mixed2, d, valz);
 }
 
-// This is different from Butteraugli's OpsinDynamicsImage() in the sense that
-// it does not contain a sensitivity multiplier based on the blurred image.
-void ToXYB(const Image3F& linear, ThreadPool* pool, Image3F* JXL_RESTRICT xyb) {
-  JXL_ASSERT(SameSize(linear, *xyb));
-
+// Stores the pre-broadcasted constants of LinearRGBToXYB.
+void InitPremulAbsorb(float* JXL_RESTRICT premul_absorb) {
   const HWY_FULL(float) d;
-  // Pre-broadcasted constants
-  HWY_ALIGN float premul_absorb[MaxLanes(d) * 12];
   const size_t N = Lanes(d);
   for (size_t i = 0; i < 9; ++i) {
     const auto absorb = Set(d, kOpsinAbsorbanceMatrix[i]);
@@ -111,18 +115,31 @@ void ToXYB(const Image3F& linear, ThreadPool* pool, Image3F* JXL_RESTRICT xyb) {
     const auto neg_bias_cbrt = Set(d, -cbrtf(kOpsinAbsorbanceBias));
     Store(neg_bias_cbrt, d, premul_absorb + (9 + i) * N);
   }
+}
 
-  const size_t xsize = linear.xsize();
+// This is different from Butteraugli's OpsinDynamicsImage() in the sense that
+// it does not contain a sensitivity multiplier based on the blurred image.
+void ToXYB(const Image3F& linear, const Rect& rect_in, ThreadPool* pool,
+           const Rect& rect, Image3F* JXL_RESTRICT xyb) {
+  JXL_ASSERT(SameSize(rect_in, rect));
+  JXL_ASSERT(rect_in.x1() <= linear.xsize() && rect_in.y1() <= linear.ysize());
+  JXL_ASSERT(rect.x1() <= xyb->xsize() && rect.y1() <= xyb->ysize());
+
+  const HWY_FULL(float) d;
+  HWY_ALIGN float premul_absorb[MaxLanes(d) * 12];
+  InitPremulAbsorb(premul_absorb);
+
+  const size_t xsize = rect_in.xsize();
   JXL_CHECK(RunOnPool(
-      pool, 0, static_cast<uint32_t>(linear.ysize()), ThreadPool::NoInit,
+      pool, 0, static_cast<uint32_t>(rect_in.ysize()), ThreadPool::NoInit,
       [&](const uint32_t task, size_t /*thread*/) {
         const size_t y = static_cast<size_t>(task);
-        const float* JXL_RESTRICT row_in0 = linear.ConstPlaneRow(0, y);
-        const float* JXL_RESTRICT row_in1 = linear.ConstPlaneRow(1, y);
-        const float* JXL_RESTRICT row_in2 = linear.ConstPlaneRow(2, y);
-        float* JXL_RESTRICT row_xyb0 = xyb->PlaneRow(0, y);
-        float* JXL_RESTRICT row_xyb1 = xyb->PlaneRow(1, y);
-        float* JXL_RESTRICT row_xyb2 = xyb->PlaneRow(2, y);
+        const float* JXL_RESTRICT row_in0 = rect_in.ConstPlaneRow(linear, 0, y);
+        const float* JXL_RESTRICT row_in1 = rect_in.ConstPlaneRow(linear, 1, y);
+        const float* JXL_RESTRICT row_in2 = rect_in.ConstPlaneRow(linear, 2, y);
+        float* JXL_RESTRICT row_xyb0 = rect.PlaneRow(xyb, 0, y);
+        float* JXL_RESTRICT row_xyb1 = rect.PlaneRow(xyb, 1, y);
+        float* JXL_RESTRICT row_xyb2 = rect.PlaneRow(xyb, 2, y);
 
         for (size_t x = 0; x < xsize; x += Lanes(d)) {
           const auto in_r = Load(d, row_in0 + x);
@@ -135,6 +152,261 @@ void ToXYB(const Image3F& linear, ThreadPool* pool, Image3F* JXL_RESTRICT xyb) {
       "LinearToXYB"));
 }
 
+// Inverse of the sRGB transfer function for x in [0, 1], max error 3e-8.
+template <class D, class V>
+V SRGBToLinear(const D d, const V x) {
+  // 4,4 rational polynomial approximation above the linear segment.
+  HWY_ALIGN const float p[4 * (4 + 1)] = {
+      HWY_REP4(2.200248328e-04f), HWY_REP4(1.043637593e-02f),
+      HWY_REP4(1.624820318e-01f), HWY_REP4(7.961564959e-01f),
+      HWY_REP4(8.210152774e-01f)};
+  HWY_ALIGN const float q[4 * (4 + 1)] = {
+      HWY_REP4(2.631846970e-01f), HWY_REP4(1.076976492e+00f),
+      HWY_REP4(4.987528350e-01f), HWY_REP4(-5.512498495e-02f),
+      HWY_REP4(6.521209011e-03f)};
+  const V linear = Mul(x, Set(d, 1.0f / 12.92f));
+  const V poly = EvalRationalPolynomial(d, x, p, q);
+  return IfThenElse(Gt(x, Set(d, 0.04045f)), poly, linear);
+}
+
+// Linear value of each 8-bit sRGB sample.
+struct SRGB8ToLinearTable {
+  SRGB8ToLinearTable() {
+    for (size_t i = 0; i < 256; ++i) {
+      const double x = i / 255.0;
+      values[i] = x <= 0.04045 ? x / 12.92 : std::pow((x + 0.055) / 1.055, 2.4);
+    }
+  }
+  float values[256];
+};
+
+// Converts `rect_in` of the interleaved sRGB samples of `srgb` to XYB. Each
+// row is first deinterleaved into per-thread buffers (linearized by a table
+// lookup for 8-bit samples), which stay in the L1 cache while they are
+// linearized (for 16-bit samples) and converted to XYB.
+void InterleavedToXYB(const InterleavedImage& srgb, const Rect& rect_in,
+                      ThreadPool* pool, const Rect& rect,
+                      Image3F* JXL_RESTRICT xyb) {
+  JXL_ASSERT(SameSize(rect_in, rect));
+  JXL_ASSERT(rect_in.x1() <= srgb.xsize() && rect_in.y1() <= srgb.ysize());
+  JXL_ASSERT(rect.x1() <= xyb->xsize() && rect.y1() <= xyb->ysize());
+
+  const HWY_FULL(float) d;
+  HWY_ALIGN float premul_absorb[MaxLanes(d) * 12];
+  InitPremulAbsorb(premul_absorb);
+  static const SRGB8ToLinearTable kTable;
+
+  const size_t xsize = rect_in.xsize();
+  const size_t N = Lanes(d);
+  const size_t xsize_padded = DivCeil(xsize, N) * N;
+  const size_t nc = srgb.num_channels();
+  std::vector<Image3F> buffers;
+  const auto init = [&](const size_t num_threads) {
+    for (size_t i = 0; i < num_threads; ++i) {
+      buffers.emplace_back(xsize_padded, 1);
+      // The lanes past xsize are converted as well.
+      ZeroFillImage(&buffers.back());
+    }
+    return true;
+  };
+  const auto process_row = [&](const uint32_t task, size_t thread) {
+    const size_t y = static_cast<size_t>(task);
+    float* JXL_RESTRICT row0 = buffers[thread].PlaneRow(0, 0);
+    float* JXL_RESTRICT row1 = buffers[thread].PlaneRow(1, 0);
+    float* JXL_RESTRICT row2 = buffers[thread].PlaneRow(2, 0);
+    const uint8_t* row_in = srgb.ConstRow(rect_in.y0() + y);
+    if (srgb.bits_per_sample() == 8) {
+      const float* JXL_RESTRICT table = kTable.values;
+      const uint8_t* JXL_RESTRICT pixels = row_in + rect_in.x0() * nc;
+      for (size_t x = 0; x < xsize; ++x) {
+        row0[x] = table[pixels[x * nc + 0]];
+        row1[x] = table[pixels[x * nc + 1]];
+        row2[x] = table[pixels[x * nc + 2]];
+      }
+    } else {
+      const uint16_t* JXL_RESTRICT pixels =
+          reinterpret_cast<const uint16_t*>(row_in) + rect_in.x0() * nc;
+      const float mul = 1.0f / 65535;
+      for (size_t x = 0; x < xsize; ++x) {
+        row0[x] = pixels[x * nc + 0] * mul;
+        row1[x] = pixels[x * nc + 1] * mul;
+        row2[x] = pixels[x * nc + 2] * mul;
+      }
+    }
+    const bool linearize = srgb.bits_per_sample() != 8;
+    float* JXL_RESTRICT row_xyb0 = rect.PlaneRow(xyb, 0, y);
+    float* JXL_RESTRICT row_xyb1 = rect.PlaneRow(xyb, 1, y);
+    float* JXL_RESTRICT row_xyb2 = rect.PlaneRow(xyb, 2, y);
+    for (size_t x = 0; x < xsize; x += N) {
+      auto in_r = Load(d, row0 + x);
+      auto in_g = Load(d, row1 + x);
+      auto in_b = Load(d, row2 + x);
+      if (linearize) {
+        in_r = SRGBToLinear(d, in_r);
+        in_g = SRGBToLinear(d, in_g);
+        in_b = SRGBToLinear(d, in_b);
+      }
+      LinearRGBToXYB(in_r, in_g, in_b, premul_absorb, row_xyb0 + x,
+                     row_xyb1 + x, row_xyb2 + x);
+    }
+  };
+  JXL_CHECK(RunOnPool(pool, 0, static_cast<uint32_t>(rect_in.ysize()), init,
+                      process_row, "SRGBToXYB"));
+}
+
+// Stores the pre-broadcasted constants of XYBToLinearRGB(): the inverse of the
+// opsin absorbance matrix, the bias and its cube root.
+void InitPremulInverseAbsorb(float* JXL_RESTRICT premul_inverse) {
+  const float* m = kOpsinAbsorbanceMatrix;
+  const double cofactors[9] = {
+      m[4] * m[8] - m[5] * m[7], m[2] * m[7] - m[1] * m[8],
+      m[1] * m[5] - m[2] * m[4], m[5] * m[6] - m[3] * m[8],
+      m[0] * m[8] - m[2] * m[6], m[2] * m[3] - m[0] * m[5],
+      m[3] * m[7] - m[4] * m[6], m[1] * m[6] - m[0] * m[7],
+      m[0] * m[4] - m[1] * m[3]};
+  const double det =
+      m[0] * cofactors[0] + m[1] * cofactors[3] + m[2] * cofactors[6];
+  const HWY_FULL(float) d;
+  const size_t N = Lanes(d);
+  for (size_t i = 0; i < 9; ++i) {
+    Store(Set(d, cofactors[i] / det), d, premul_inverse + i * N);
+  }
+  Store(Set(d, -kOpsinAbsorbanceBias), d, premul_inverse + 9 * N);
+  Store(Set(d, cbrtf(kOpsinAbsorbanceBias)), d, premul_inverse + 10 * N);
+}
+
+// Converts one XYB vector to linear RGB, the inverse of LinearRGBToXYB() for
+// the colors it does not clamp.
+template <class V>
+void XYBToLinearRGB(const V valx, const V valy, const V valz,
+                    const float* JXL_RESTRICT premul_inverse,
+                    V* JXL_RESTRICT r, V* JXL_RESTRICT g, V* JXL_RESTRICT b) {
+  const HWY_FULL(float) d;
+  const size_t N = Lanes(d);
+  const auto neg_bias = Load(d, premul_inverse + 9 * N);
+  const auto bias_cbrt = Load(d, premul_inverse + 10 * N);
+  const auto gamma0 = Add(Add(valy, valx), bias_cbrt);
+  const auto gamma1 = Add(Sub(valy, valx), bias_cbrt);
+  const auto gamma2 = Add(valz, bias_cbrt);
+  const auto mixed0 = MulAdd(Mul(gamma0, gamma0), gamma0, neg_bias);
+  const auto mixed1 = MulAdd(Mul(gamma1, gamma1), gamma1, neg_bias);
+  const auto mixed2 = MulAdd(Mul(gamma2, gamma2), gamma2, neg_bias);
+  const auto m0 = Load(d, premul_inverse + 0 * N);
+  const auto m1 = Load(d, premul_inverse + 1 * N);
+  const auto m2 = Load(d, premul_inverse + 2 * N);
+  const auto m3 = Load(d, premul_inverse + 3 * N);
+  const auto m4 = Load(d, premul_inverse + 4 * N);
+  const auto m5 = Load(d, premul_inverse + 5 * N);
+  const auto m6 = Load(d, premul_inverse + 6 * N);
+  const auto m7 = Load(d, premul_inverse + 7 * N);
+  const auto m8 = Load(d, premul_inverse + 8 * N);
+  *r = MulAdd(m0, mixed0, MulAdd(m1, mixed1, Mul(m2, mixed2)));
+  *g = MulAdd(m3, mixed0, MulAdd(m4, mixed1, Mul(m5, mixed2)));
+  *b = MulAdd(m6, mixed0, MulAdd(m7, mixed1, Mul(m8, mixed2)));
+}
+
+// The sRGB transfer function for x in [0, 1], max error 1e-7.
+template <class D, class V>
+V LinearToSRGB(const D d, const V x) {
+  // 4,4 rational polynomial of sqrt(x) above the linear segment.
+  HWY_ALIGN const float p[4 * (4 + 1)] = {
+      HWY_REP4(-5.135152395e-04f), HWY_REP4(5.287254571e-03f),
+      HWY_REP4(3.903842876e-01f), HWY_REP4(1.474205315e+00f),
+      HWY_REP4(7.352629620e-01f)};
+  HWY_ALIGN const float q[4 * (4 + 1)] = {
+      HWY_REP4(1.004519624e-02f), HWY_REP4(3.036675394e-01f),
+      HWY_REP4(1.340816930e+00f), HWY_REP4(9.258482155e-01f),
+      HWY_REP4(2.424867759e-02f)};
+  const V linear = Mul(x, Set(d, 12.92f));
+  const V poly = EvalRationalPolynomial(d, Sqrt(x), p, q);
+  return IfThenElse(Gt(x, Set(d, 0.0031308f)), poly, linear);
+}
+
+void XYBToLinear(const Image3F& xyb, ThreadPool* pool,
+                 Image3F* JXL_RESTRICT linear) {
+  JXL_ASSERT(SameSize(xyb, *linear));
+
+  const HWY_FULL(float) d;
+  HWY_ALIGN float premul_inverse[MaxLanes(d) * 11];
+  InitPremulInverseAbsorb(premul_inverse);
+
+  const size_t xsize = xyb.xsize();
+  JXL_CHECK(RunOnPool(
+      pool, 0, static_cast<uint32_t>(xyb.ysize()), ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /*thread*/) {
+        const size_t y = static_cast<size_t>(task);
+        const float* JXL_RESTRICT row_xyb0 = xyb.ConstPlaneRow(0, y);
+        const float* JXL_RESTRICT row_xyb1 = xyb.ConstPlaneRow(1, y);
+        const float* JXL_RESTRICT row_xyb2 = xyb.ConstPlaneRow(2, y);
+        float* JXL_RESTRICT row_out0 = linear->PlaneRow(0, y);
+        float* JXL_RESTRICT row_out1 = linear->PlaneRow(1, y);
+        float* JXL_RESTRICT row_out2 = linear->PlaneRow(2, y);
+        for (size_t x = 0; x < xsize; x += Lanes(d)) {
+          auto r = Zero(d), g = Zero(d), b = Zero(d);
+          XYBToLinearRGB(Load(d, row_xyb0 + x), Load(d, row_xyb1 + x),
+                         Load(d, row_xyb2 + x), premul_inverse, &r, &g, &b);
+          Store(r, d, row_out0 + x);
+          Store(g, d, row_out1 + x);
+          Store(b, d, row_out2 + x);
+        }
+      },
+      "XYBToLinear"));
+}
+
+// Like XYBToLinear(), but the samples are clamped to [0, 1], converted with
+// the sRGB transfer function and scaled to 8 bits in per-thread buffers, which
+// are then interleaved into `srgb`.
+void XYBToSRGB8(const Image3F& xyb, ThreadPool* pool,
+                uint8_t* JXL_RESTRICT srgb) {
+  const HWY_FULL(float) d;
+  HWY_ALIGN float premul_inverse[MaxLanes(d) * 11];
+  InitPremulInverseAbsorb(premul_inverse);
+
+  const size_t xsize = xyb.xsize();
+  const size_t N = Lanes(d);
+  const size_t xsize_padded = DivCeil(xsize, N) * N;
+  std::vector<Image3F> buffers;
+  const auto init = [&](const size_t num_threads) {
+    for (size_t i = 0; i < num_threads; ++i) {
+      buffers.emplace_back(xsize_padded, 1);
+    }
+    return true;
+  };
+  const auto process_row = [&](const uint32_t task, size_t thread) {
+    const size_t y = static_cast<size_t>(task);
+    const float* JXL_RESTRICT row_xyb0 = xyb.ConstPlaneRow(0, y);
+    const float* JXL_RESTRICT row_xyb1 = xyb.ConstPlaneRow(1, y);
+    const float* JXL_RESTRICT row_xyb2 = xyb.ConstPlaneRow(2, y);
+    float* JXL_RESTRICT rows[3] = {buffers[thread].PlaneRow(0, 0),
+                                   buffers[thread].PlaneRow(1, 0),
+                                   buffers[thread].PlaneRow(2, 0)};
+    const auto zero = Zero(d);
+    const auto one = Set(d, 1.0f);
+    // Rounds to nearest when truncated below.
+    const auto mul = Set(d, 255.0f);
+    const auto half = Set(d, 0.5f);
+    for (size_t x = 0; x < xsize; x += N) {
+      auto r = zero, g = zero, b = zero;
+      XYBToLinearRGB(Load(d, row_xyb0 + x), Load(d, row_xyb1 + x),
+                     Load(d, row_xyb2 + x), premul_inverse, &r, &g, &b);
+      r = LinearToSRGB(d, Min(Max(r, zero), one));
+      g = LinearToSRGB(d, Min(Max(g, zero), one));
+      b = LinearToSRGB(d, Min(Max(b, zero), one));
+      Store(MulAdd(r, mul, half), d, rows[0] + x);
+      Store(MulAdd(g, mul, half), d, rows[1] + x);
+      Store(MulAdd(b, mul, half), d, rows[2] + x);
+    }
+    uint8_t* JXL_RESTRICT pixels = srgb + y * xsize * 3;
+    for (size_t x = 0; x < xsize; ++x) {
+      pixels[x * 3 + 0] = static_cast<uint8_t>(rows[0][x]);
+      pixels[x * 3 + 1] = static_cast<uint8_t>(rows[1][x]);
+      pixels[x * 3 + 2] = static_cast<uint8_t>(rows[2][x]);
+    }
+  };
+  JXL_CHECK(RunOnPool(pool, 0, static_cast<uint32_t>(xyb.ysize()), init,
+                      process_row, "XYBToSRGB8"));
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -144,7 +416,43 @@ HWY_AFTER_NAMESPACE();
 namespace jxl {
 HWY_EXPORT(ToXYB);
 void ToXYB(const Image3F& linear, ThreadPool* pool, Image3F* JXL_RESTRICT xyb) {
-  return HWY_DYNAMIC_DISPATCH(ToXYB)(linear, pool, xyb);
+  JXL_ASSERT(SameSize(linear, *xyb));
+  return HWY_DYNAMIC_DISPATCH(ToXYB)(linear, Rect(linear), pool, Rect(linear),
+                                     xyb);
+}
+void ToXYB(const Image3F& linear, ThreadPool* pool, const Rect& rect,
+           Image3F* JXL_RESTRICT xyb) {
+  return HWY_DYNAMIC_DISPATCH(ToXYB)(linear, Rect(linear), pool, rect, xyb);
+}
+void ToXYB(const Image3F& linear, const Rect& rect_in, ThreadPool* pool,
+           const Rect& rect, Image3F* JXL_RESTRICT xyb) {
+  return HWY_DYNAMIC_DISPATCH(ToXYB)(linear, rect_in, pool, rect, xyb);
+}
+
+HWY_EXPORT(InterleavedToXYB);
+void ToXYB(const InterleavedImage& srgb, ThreadPool* pool,
+           Image3F* JXL_RESTRICT xyb) {
+  JXL_ASSERT(srgb.xsize() == xyb->xsize() && srgb.ysize() == xyb->ysize());
+  return HWY_DYNAMIC_DISPATCH(InterleavedToXYB)(
+      srgb, Rect(0, 0, srgb.xsize(), srgb.ysize()), pool, Rect(*xyb), xyb);
+}
+void ToXYB(const InterleavedImage& srgb, const Rect& rect_in,
+           ThreadPool* pool, const Rect& rect, Image3F* JXL_RESTRICT xyb) {
+  return HWY_DYNAMIC_DISPATCH(InterleavedToXYB)(srgb, rect_in, pool, rect,
+                                                xyb);
+}
+
+HWY_EXPORT(XYBToLinear);
+void XYBToLinear(const Image3F& xyb, ThreadPool* pool,
+                 Image3F* JXL_RESTRICT linear) {
+  return HWY_DYNAMIC_DISPATCH(XYBToLinear)(xyb, pool, linear);
+}
+
+HWY_EXPORT(XYBToSRGB8);
+void XYBToSRGB8(const Image3F& xyb, ThreadPool* pool,
+                std::vector<uint8_t>* srgb) {
+  srgb->resize(xyb.xsize() * xyb.ysize() * 3);
+  return HWY_DYNAMIC_DISPATCH(XYBToSRGB8)(xyb, pool, srgb->data());
 }
 }  // namespace jxl
 #endif  // HWY_ONCE
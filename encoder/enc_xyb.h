@@ -7,6 +7,10 @@
 #ifndef ENCODER_ENC_XYB_H_
 #define ENCODER_ENC_XYB_H_
 
+#include <stdint.h>
+
+#include <vector>
+
 #include "encoder/base/data_parallel.h"
 #include "encoder/image.h"
 
@@ -15,6 +19,36 @@ namespace jxl {
 // Converts linear SRGB to XYB.
 void ToXYB(const Image3F& linear, ThreadPool* pool, Image3F* JXL_RESTRICT xyb);
 
+// Same as above, but stores the result in `rect` of `xyb`, which must have the
+// same size as `linear`.
+void ToXYB(const Image3F& linear, ThreadPool* pool, const Rect& rect,
+           Image3F* JXL_RESTRICT xyb);
+
+// Same as above, but only converts `rect_in` of `linear`. `rect_in.x0()` must
+// be a multiple of the vector size (16 is enough for all targets).
+void ToXYB(const Image3F& linear, const Rect& rect_in, ThreadPool* pool,
+           const Rect& rect, Image3F* JXL_RESTRICT xyb);
+
+// Converts interleaved sRGB samples to XYB, linearizing them on the fly.
+// `xyb` must have the same size as `srgb`.
+void ToXYB(const InterleavedImage& srgb, ThreadPool* pool,
+           Image3F* JXL_RESTRICT xyb);
+
+// Same as above, but only converts `rect_in` of `srgb` to `rect` of `xyb`.
+// Unlike for planar input, `rect_in.x0()` may be any value.
+void ToXYB(const InterleavedImage& srgb, const Rect& rect_in,
+           ThreadPool* pool, const Rect& rect, Image3F* JXL_RESTRICT xyb);
+
+// Converts XYB back to linear SRGB, the inverse of ToXYB() for the colors it
+// does not clamp. `linear` must have the same size as `xyb`.
+void XYBToLinear(const Image3F& xyb, ThreadPool* pool,
+                 Image3F* JXL_RESTRICT linear);
+
+// Same as above, but stores 8-bit sRGB samples, clamped to the sRGB gamut, in
+// `srgb`: three interleaved samples per pixel, with the rows one after another.
+void XYBToSRGB8(const Image3F& xyb, ThreadPool* pool,
+                std::vector<uint8_t>* srgb);
+
 }  // namespace jxl
 
 #endif  // ENCODER_ENC_XYB_H_
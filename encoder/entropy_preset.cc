@@ -0,0 +1,185 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/entropy_preset.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "encoder/ac_context.h"
+#include "encoder/enc_cluster.h"
+
+namespace jxl {
+
+namespace {
+
+constexpr uint8_t kPresetSignature[4] = {'J', 'X', 'L', 'P'};
+
+// Total count of the histograms of a trained preset.
+constexpr double kPresetTotalCount = 1 << 16;
+
+void AppendVarint(uint64_t value, std::vector<uint8_t>* out) {
+  while (value >= 0x80) {
+    out->push_back((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  out->push_back(value);
+}
+
+// Reads LEB128 varints, failing at the end of the data.
+class VarintReader {
+ public:
+  VarintReader(const uint8_t* data, size_t size)
+      : pos_(data), end_(data + size) {}
+
+  Status Read(uint64_t max_value, uint64_t* value) {
+    *value = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+      if (pos_ == end_) return JXL_FAILURE("Truncated entropy preset");
+      const uint8_t byte = *pos_++;
+      *value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0) {
+        if (*value > max_value) return JXL_FAILURE("Invalid entropy preset");
+        return true;
+      }
+    }
+    return JXL_FAILURE("Invalid varint in entropy preset");
+  }
+
+  bool AtEnd() const { return pos_ == end_; }
+
+ private:
+  const uint8_t* pos_;
+  const uint8_t* end_;
+};
+
+void SerializeCode(const PresetCode& code, std::vector<uint8_t>* out) {
+  AppendVarint(code.context_map.size(), out);
+  out->insert(out->end(), code.context_map.begin(), code.context_map.end());
+  AppendVarint(code.histograms.size(), out);
+  for (const Histogram& histogram : code.histograms) {
+    for (size_t i = 0; i < kPresetAlphabetSize; ++i) {
+      AppendVarint(histogram.data_[i], out);
+    }
+  }
+}
+
+Status ParseCode(size_t num_contexts, VarintReader* reader, PresetCode* code) {
+  uint64_t value;
+  JXL_RETURN_IF_ERROR(reader->Read(num_contexts, &value));
+  if (value != num_contexts) {
+    return JXL_FAILURE("Entropy preset has %d contexts instead of %d",
+                       static_cast<int>(value), static_cast<int>(num_contexts));
+  }
+  code->context_map.resize(num_contexts);
+  for (uint8_t& cluster : code->context_map) {
+    JXL_RETURN_IF_ERROR(reader->Read(255, &value));
+    cluster = value;
+  }
+  // The decoder derives the number of histograms from the context map.
+  const size_t num_clusters =
+      *std::max_element(code->context_map.begin(), code->context_map.end()) +
+      1;
+  JXL_RETURN_IF_ERROR(reader->Read(256, &value));
+  if (value != num_clusters) {
+    return JXL_FAILURE("Entropy preset has unused clusters");
+  }
+  code->histograms.resize(num_clusters);
+  for (Histogram& histogram : code->histograms) {
+    histogram.Clear();
+    histogram.data_.resize(kPresetAlphabetSize);
+    for (int32_t& count : histogram.data_) {
+      JXL_RETURN_IF_ERROR(reader->Read(1 << 24, &value));
+      if (value == 0) return JXL_FAILURE("Entropy preset has a zero count");
+      count = value;
+      histogram.total_count_ += value;
+    }
+  }
+  return true;
+}
+
+void PrepareCode(const PresetCode& preset, EntropyPresetCodes::Code* code) {
+  code->context_map = preset.context_map;
+  // This is only done once, so both ways of writing the context map are
+  // tried.
+  BitWriter plain;
+  BitWriter move_to_front;
+  WriteContextMap(code->context_map, &plain);
+  WriteContextMap(code->context_map, &move_to_front, /*move_to_front=*/true);
+  code->bits = move_to_front.BitsWritten() < plain.BitsWritten()
+                   ? std::move(move_to_front)
+                   : std::move(plain);
+  WriteHistograms(preset.histograms, &code->codes, &code->bits);
+}
+
+}  // namespace
+
+PresetCode TrainPresetCode(const std::vector<Histogram>& histograms) {
+  PresetCode code;
+  code.histograms = histograms;
+  JXL_CHECK(
+      ClusterHistograms(&code.histograms, &code.context_map, /*refine=*/true));
+  if (code.context_map.empty()) {
+    code.context_map.resize(histograms.size());
+  }
+  for (Histogram& histogram : code.histograms) {
+    const double scale = histogram.total_count_ == 0
+                             ? 0.0
+                             : kPresetTotalCount / histogram.total_count_;
+    Histogram scaled;
+    scaled.data_.resize(kPresetAlphabetSize);
+    for (size_t i = 0; i < kPresetAlphabetSize; ++i) {
+      const int32_t count = i < histogram.data_.size() ? histogram.data_[i] : 0;
+      scaled.data_[i] = 1 + static_cast<int32_t>(count * scale);
+      scaled.total_count_ += scaled.data_[i];
+    }
+    histogram = std::move(scaled);
+  }
+  return code;
+}
+
+std::vector<uint8_t> SerializeEntropyPreset(const EntropyPreset& preset) {
+  std::vector<uint8_t> out(kPresetSignature, kPresetSignature + 4);
+  SerializeCode(preset.dc, &out);
+  SerializeCode(preset.ac, &out);
+  return out;
+}
+
+Status ParseEntropyPreset(const uint8_t* data, size_t size,
+                          EntropyPreset* preset) {
+  if (size < 4 || memcmp(data, kPresetSignature, 4) != 0) {
+    return JXL_FAILURE("Not an entropy preset");
+  }
+  VarintReader reader(data + 4, size - 4);
+  JXL_RETURN_IF_ERROR(ParseCode(kNumDCContexts, &reader, &preset->dc));
+  JXL_RETURN_IF_ERROR(ParseCode(kNumACContexts, &reader, &preset->ac));
+  if (!reader.AtEnd()) return JXL_FAILURE("Trailing data in entropy preset");
+  return true;
+}
+
+bool ReadEntropyPreset(const char* filename, EntropyPreset* preset) {
+  FILE* file = fopen(filename, "rb");
+  if (file == nullptr) return false;
+  std::vector<uint8_t> data;
+  uint8_t buffer[4096];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), file)) != 0) {
+    data.insert(data.end(), buffer, buffer + size);
+  }
+  const bool ok = !ferror(file);
+  fclose(file);
+  return ok && ParseEntropyPreset(data.data(), data.size(), preset);
+}
+
+EntropyPresetCodes::EntropyPresetCodes(const EntropyPreset& preset) {
+  PrepareCode(preset.dc, &dc_);
+  PrepareCode(preset.ac, &ac_);
+}
+
+}  // namespace jxl
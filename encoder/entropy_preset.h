@@ -0,0 +1,82 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef ENCODER_ENTROPY_PRESET_H_
+#define ENCODER_ENTROPY_PRESET_H_
+
+// Entropy codes trained on a corpus of images, which frames can use instead of
+// computing their own. The codes are still written to every frame, but the
+// histograms of the tokens are not built and not clustered.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "encoder/base/status.h"
+#include "encoder/enc_ans.h"
+#include "encoder/enc_bit_writer.h"
+#include "encoder/histogram.h"
+
+namespace jxl {
+
+// The tokens of all 32-bit values: every histogram of a preset has a nonzero
+// count for each of them, so that any token can be coded.
+constexpr size_t kPresetAlphabetSize = 128;
+
+// Entropy code of one kind of tokens: the cluster of every context and the
+// histogram of every cluster.
+struct PresetCode {
+  std::vector<uint8_t> context_map;
+  std::vector<Histogram> histograms;
+};
+
+struct EntropyPreset {
+  // Codes of the DC and AC metadata tokens (kNumDCContexts contexts) and of
+  // the AC tokens (kNumACContexts contexts).
+  PresetCode dc;
+  PresetCode ac;
+};
+
+// Clusters the histograms of all contexts, summed over the training images,
+// and rescales the counts of every cluster to a total of about 2^16, with a
+// count of at least one for every token.
+PresetCode TrainPresetCode(const std::vector<Histogram>& histograms);
+
+// File format of the presets: "JXLP", then for the DC and for the AC code the
+// number of contexts, the context map, the number of clusters and the
+// kPresetAlphabetSize counts of every cluster, all numbers as LEB128 varints.
+std::vector<uint8_t> SerializeEntropyPreset(const EntropyPreset& preset);
+Status ParseEntropyPreset(const uint8_t* data, size_t size,
+                          EntropyPreset* preset);
+
+bool ReadEntropyPreset(const char* filename, EntropyPreset* preset);
+
+// An EntropyPreset in the form used by the encoder: the bits of the context
+// maps and histograms, and the ANS tables of the histograms, are computed
+// once for all frames.
+class EntropyPresetCodes {
+ public:
+  struct Code {
+    std::vector<uint8_t> context_map;
+    EntropyEncodingData codes;
+    // Context map and histograms as written to the frame.
+    BitWriter bits;
+  };
+
+  explicit EntropyPresetCodes(const EntropyPreset& preset);
+
+  const Code& dc() const { return dc_; }
+  const Code& ac() const { return ac_; }
+
+ private:
+  Code dc_;
+  Code ac_;
+};
+
+}  // namespace jxl
+
+#endif  // ENCODER_ENTROPY_PRESET_H_
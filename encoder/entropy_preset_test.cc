@@ -0,0 +1,157 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/entropy_preset.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "encoder/base/data_parallel.h"
+#include "encoder/enc_ans.h"
+#include "encoder/enc_file.h"
+#include "encoder/test_utils.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+class EntropyPresetTest : public ::testing::Test {
+ protected:
+  static void SetUpTestCase() {
+    ThreadPool pool(4);
+    preset_ = new EntropyPreset(
+        test::TrainPreset(test::TestImage(300, 200, 1), &pool));
+  }
+  static void TearDownTestCase() { delete preset_; }
+
+  static EntropyPreset* preset_;
+};
+
+EntropyPreset* EntropyPresetTest::preset_ = nullptr;
+
+void ExpectSameCode(const PresetCode& expected, const PresetCode& actual) {
+  EXPECT_EQ(expected.context_map, actual.context_map);
+  ASSERT_EQ(expected.histograms.size(), actual.histograms.size());
+  for (size_t i = 0; i < expected.histograms.size(); ++i) {
+    EXPECT_EQ(expected.histograms[i].data_, actual.histograms[i].data_);
+    EXPECT_EQ(expected.histograms[i].total_count_,
+              actual.histograms[i].total_count_);
+  }
+}
+
+TEST_F(EntropyPresetTest, TrainedPresetIsValid) {
+  ASSERT_EQ(kNumDCContexts, preset_->dc.context_map.size());
+  ASSERT_EQ(kNumACContexts, preset_->ac.context_map.size());
+  for (const PresetCode* code : {&preset_->dc, &preset_->ac}) {
+    for (uint8_t cluster : code->context_map) {
+      EXPECT_LT(cluster, code->histograms.size());
+    }
+    for (const Histogram& histogram : code->histograms) {
+      ASSERT_EQ(kPresetAlphabetSize, histogram.data_.size());
+      for (int32_t count : histogram.data_) EXPECT_GT(count, 0);
+    }
+  }
+}
+
+TEST_F(EntropyPresetTest, SerializeParseRoundTrip) {
+  const std::vector<uint8_t> data = SerializeEntropyPreset(*preset_);
+  EntropyPreset parsed;
+  ASSERT_TRUE(ParseEntropyPreset(data.data(), data.size(), &parsed));
+  ExpectSameCode(preset_->dc, parsed.dc);
+  ExpectSameCode(preset_->ac, parsed.ac);
+  EXPECT_TRUE(test::SameBytes(data, SerializeEntropyPreset(parsed)));
+}
+
+TEST_F(EntropyPresetTest, RejectsTruncatedData) {
+  const std::vector<uint8_t> data = SerializeEntropyPreset(*preset_);
+  EntropyPreset parsed;
+  for (size_t size = 0; size < data.size(); ++size) {
+    EXPECT_FALSE(ParseEntropyPreset(data.data(), size, &parsed)) << size;
+  }
+}
+
+TEST_F(EntropyPresetTest, RejectsMalformedData) {
+  const std::vector<uint8_t> data = SerializeEntropyPreset(*preset_);
+  EntropyPreset parsed;
+  std::vector<uint8_t> bad = data;
+  bad[0] = 'X';
+  EXPECT_FALSE(ParseEntropyPreset(bad.data(), bad.size(), &parsed));
+  bad = data;
+  bad.push_back(0);
+  EXPECT_FALSE(ParseEntropyPreset(bad.data(), bad.size(), &parsed));
+  // A varint of more than 64 bits.
+  bad.assign(data.begin(), data.begin() + 4);
+  bad.insert(bad.end(), 10, 0xFF);
+  EXPECT_FALSE(ParseEntropyPreset(bad.data(), bad.size(), &parsed));
+
+  EntropyPreset wrong = *preset_;
+  wrong.dc.context_map.pop_back();
+  bad = SerializeEntropyPreset(wrong);
+  EXPECT_FALSE(ParseEntropyPreset(bad.data(), bad.size(), &parsed));
+  wrong = *preset_;
+  wrong.ac.histograms.push_back(wrong.ac.histograms.back());
+  bad = SerializeEntropyPreset(wrong);
+  EXPECT_FALSE(ParseEntropyPreset(bad.data(), bad.size(), &parsed));
+  wrong = *preset_;
+  wrong.ac.histograms[0].data_[5] = 0;
+  bad = SerializeEntropyPreset(wrong);
+  EXPECT_FALSE(ParseEntropyPreset(bad.data(), bad.size(), &parsed));
+  wrong = *preset_;
+  wrong.ac.histograms[0].data_[5] = 1 << 25;
+  bad = SerializeEntropyPreset(wrong);
+  EXPECT_FALSE(ParseEntropyPreset(bad.data(), bad.size(), &parsed));
+}
+
+// Every corrupted byte either fails to parse or gives a preset that can be
+// used, without reading outside of the data.
+TEST_F(EntropyPresetTest, CorruptedBytesGiveUsablePresets) {
+  const std::vector<uint8_t> data = SerializeEntropyPreset(*preset_);
+  for (size_t pos = 4; pos < data.size(); ++pos) {
+    for (uint8_t flip : {0x01, 0x80, 0xFF}) {
+      std::vector<uint8_t> bad = data;
+      bad[pos] ^= flip;
+      EntropyPreset parsed;
+      if (!ParseEntropyPreset(bad.data(), bad.size(), &parsed)) continue;
+      for (const PresetCode* code : {&parsed.dc, &parsed.ac}) {
+        for (uint8_t cluster : code->context_map) {
+          ASSERT_LT(cluster, code->histograms.size()) << pos;
+        }
+        for (const Histogram& histogram : code->histograms) {
+          ASSERT_EQ(kPresetAlphabetSize, histogram.data_.size()) << pos;
+        }
+      }
+    }
+  }
+}
+
+// Encodes with a parsed preset, on images of one and of several groups and
+// both pipelines, which must give the same file as the preset it was
+// serialized from.
+TEST_F(EntropyPresetTest, EncodeWithParsedPreset) {
+  const std::vector<uint8_t> data = SerializeEntropyPreset(*preset_);
+  EntropyPreset parsed;
+  ASSERT_TRUE(ParseEntropyPreset(data.data(), data.size(), &parsed));
+  Encoder encoder(4);
+  for (size_t xsize : {64, 600}) {
+    const Image3F image = test::TestImage(xsize, 300, 2);
+    std::vector<uint8_t> without_preset;
+    ASSERT_TRUE(encoder.Encode(image, 1.0f, &without_preset));
+    encoder.SetEntropyPreset(preset_);
+    std::vector<uint8_t> expected;
+    ASSERT_TRUE(encoder.Encode(image, 1.0f, &expected));
+    encoder.SetEntropyPreset(&parsed);
+    std::vector<uint8_t> encoded;
+    ASSERT_TRUE(encoder.Encode(image, 1.0f, &encoded));
+    EXPECT_TRUE(test::SameBytes(expected, encoded)) << xsize;
+    EXPECT_FALSE(test::SameBytes(without_preset, encoded)) << xsize;
+    encoder.SetEntropyPreset(nullptr);
+  }
+}
+
+}  // namespace
+}  // namespace jxl
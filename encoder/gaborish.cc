@@ -16,7 +16,9 @@
 
 namespace jxl {
 
-void GaborishInverse(Image3F* in_out, float mul, ThreadPool* pool) {
+namespace {
+
+WeightsSymmetric5 GaborishInverseWeights(float mul) {
   JXL_ASSERT(mul >= 0.0f);
 
   // Only an approximation. One or even two 3x3, and rank-1 (separable) 5x5
@@ -52,20 +54,22 @@ void GaborishInverse(Image3F* in_out, float mul, ThreadPool* pool) {
     weights.D[i] *= normalize;
     weights.L[i] *= normalize;
   }
+  return weights;
+}
+
+}  // namespace
 
-  // Reduce memory footprint by only allocating a single plane and swapping it
-  // into the output Image3F. Better still would be tiling.
-  // Note that we cannot *allocate* a plane, as doing so might cause Image3F to
-  // have planes of different stride. Instead, we copy one plane in a temporary
-  // image and reuse the existing planes of the in/out image.
-  ImageF temp = CopyImage(in_out->Plane(2));
-  Symmetric5(in_out->Plane(0), Rect(*in_out), weights, pool, &in_out->Plane(2));
-  Symmetric5(in_out->Plane(1), Rect(*in_out), weights, pool, &in_out->Plane(0));
-  Symmetric5(temp, Rect(*in_out), weights, pool, &in_out->Plane(1));
-  // Now planes are 1, 2, 0.
-  in_out->Plane(0).Swap(in_out->Plane(1));
-  // 2 1 0
-  in_out->Plane(0).Swap(in_out->Plane(2));
+void GaborishInverse(Image3F* in_out, float mul, ThreadPool* pool) {
+  const WeightsSymmetric5 weights = GaborishInverseWeights(mul);
+  Symmetric5InPlace(weights, pool, in_out);
+}
+
+void GaborishInverse(const Image3F& in, const Rect& rect, float mul,
+                     ThreadPool* pool, Image3F* out) {
+  const WeightsSymmetric5 weights = GaborishInverseWeights(mul);
+  for (size_t c = 0; c < 3; ++c) {
+    Symmetric5(in.Plane(c), rect, weights, pool, &out->Plane(c));
+  }
 }
 
 }  // namespace jxl
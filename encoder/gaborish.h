@@ -22,6 +22,13 @@ namespace jxl {
 // The input is typically in XYB space.
 void GaborishInverse(Image3F* in_out, float mul, ThreadPool* pool);
 
+// Same as above, but not in-place: only the rows of `rect` are computed and
+// stored in `out`, which must be at least as large as `rect`. The rows of `in`
+// around `rect` (two are enough) are used as the border, which allows
+// processing a large image in horizontal bands.
+void GaborishInverse(const Image3F& in, const Rect& rect, float mul,
+                     ThreadPool* pool, Image3F* out);
+
 }  // namespace jxl
 
 #endif  // ENCODER_GABORISH_H_
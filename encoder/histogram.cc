@@ -0,0 +1,79 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/histogram.h"
+
+#include <algorithm>
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "encoder/histogram.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "encoder/common.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Add;
+
+// Adds the `size` counts of `in` to those of `out`.
+void AddCounts(const int32_t* JXL_RESTRICT in, size_t size,
+               int32_t* JXL_RESTRICT out) {
+  const HWY_CAPPED(int32_t, Histogram::kRounding) d;
+  size_t i = 0;
+  for (; i + Lanes(d) <= size; i += Lanes(d)) {
+    StoreU(Add(LoadU(d, out + i), LoadU(d, in + i)), d, out + i);
+  }
+  for (; i < size; ++i) {
+    out[i] += in[i];
+  }
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+
+HWY_EXPORT(AddCounts);
+
+Status MergeHistograms(const std::vector<const HistogramBuilder*>& in,
+                       ThreadPool* pool, HistogramBuilder* out) {
+  if (in.empty()) return true;
+  const size_t num_contexts = out->histograms.size();
+  // Enough contexts per task to amortize the dispatch, few enough to split
+  // the AC contexts among many threads.
+  constexpr size_t kContextsPerTask = 256;
+  return RunOnPool(
+      pool, 0, DivCeil(num_contexts, kContextsPerTask), ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /*thread*/) {
+        const size_t begin = task * kContextsPerTask;
+        const size_t end = std::min(begin + kContextsPerTask, num_contexts);
+        for (size_t i = begin; i < end; ++i) {
+          Histogram& histogram = out->histograms[i];
+          size_t size = histogram.data_.size();
+          for (const HistogramBuilder* builder : in) {
+            size = std::max(size, builder->histograms[i].data_.size());
+          }
+          histogram.data_.resize(size);
+          for (const HistogramBuilder* builder : in) {
+            const Histogram& other = builder->histograms[i];
+            HWY_DYNAMIC_DISPATCH(AddCounts)
+            (other.data_.data(), other.data_.size(), histogram.data_.data());
+            histogram.total_count_ += other.total_count_;
+          }
+        }
+      },
+      "MergeHistograms");
+}
+
+}  // namespace jxl
+#endif  // HWY_ONCE
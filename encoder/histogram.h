@@ -11,6 +11,8 @@
 
 #include <vector>
 
+#include "encoder/base/data_parallel.h"
+#include "encoder/base/status.h"
 #include "encoder/common.h"
 #include "encoder/token.h"
 
@@ -29,6 +31,17 @@ struct Histogram {
     ++data_[symbol];
     ++total_count_;
   }
+  // Adds `counts[symbol]` occurrences of every symbol below `num_symbols`.
+  void AddCounts(const int32_t* counts, size_t num_symbols) {
+    while (num_symbols > 0 && counts[num_symbols - 1] == 0) --num_symbols;
+    if (data_.size() < num_symbols) {
+      data_.resize(DivCeil(num_symbols, kRounding) * kRounding);
+    }
+    for (size_t i = 0; i < num_symbols; ++i) {
+      data_[i] += counts[i];
+      total_count_ += counts[i];
+    }
+  }
   void AddHistogram(const Histogram& other) {
     if (other.data_.size() > data_.size()) {
       data_.resize(other.data_.size());
@@ -64,11 +77,18 @@ struct HistogramBuilder {
 };
 
 template <typename T>
-std::vector<Histogram> BuildHistograms(size_t num_contexts, std::vector<T>& v) {
+std::vector<Histogram> BuildHistograms(size_t num_contexts,
+                                       const std::vector<T>& v) {
   HistogramBuilder builder(num_contexts);
   builder.Add(v);
   return builder.histograms;
 }
 
+// Adds the histograms of every builder of `in` to those of `out`, which must
+// have the same number of contexts. The contexts are split among the threads
+// of `pool`.
+Status MergeHistograms(const std::vector<const HistogramBuilder*>& in,
+                       ThreadPool* pool, HistogramBuilder* out);
+
 }  // namespace jxl
 #endif  // ENCODER_HISTOGRAM_H_
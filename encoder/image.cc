@@ -133,25 +133,34 @@ constexpr inline size_t RoundUpToBlockDim(size_t dim) {
   return (dim + 7) & ~size_t(7);
 }
 
-void PadImageToBlockMultipleInPlace(Image3F* JXL_RESTRICT in) {
+void PadImageToBlockMultipleInPlace(Image3F* JXL_RESTRICT in,
+                                    ThreadPool* pool) {
   const size_t xsize_orig = in->xsize();
   const size_t ysize_orig = in->ysize();
   const size_t xsize = RoundUpToBlockDim(xsize_orig);
   const size_t ysize = RoundUpToBlockDim(ysize_orig);
   // Expands image size to the originally-allocated size.
   in->ShrinkTo(xsize, ysize);
-  for (size_t c = 0; c < 3; c++) {
-    for (size_t y = 0; y < ysize_orig; y++) {
-      float* JXL_RESTRICT row = in->PlaneRow(c, y);
-      for (size_t x = xsize_orig; x < xsize; x++) {
-        row[x] = row[xsize_orig - 1];
+  // The rows below the image are copies of the last one, which is in the
+  // last block row, so the block rows are independent.
+  const auto pad_block_row = [&](const uint32_t by, const size_t /*thread*/) {
+    const size_t y0 = by * kBlockDim;
+    const size_t y1 = y0 + kBlockDim;
+    for (size_t c = 0; c < 3; c++) {
+      for (size_t y = y0; y < std::min(y1, ysize_orig); y++) {
+        float* JXL_RESTRICT row = in->PlaneRow(c, y);
+        for (size_t x = xsize_orig; x < xsize; x++) {
+          row[x] = row[xsize_orig - 1];
+        }
+      }
+      const float* JXL_RESTRICT row_src = in->ConstPlaneRow(c, ysize_orig - 1);
+      for (size_t y = std::max(y0, ysize_orig); y < y1; y++) {
+        memcpy(in->PlaneRow(c, y), row_src, xsize * sizeof(float));
       }
     }
-    const float* JXL_RESTRICT row_src = in->ConstPlaneRow(c, ysize_orig - 1);
-    for (size_t y = ysize_orig; y < ysize; y++) {
-      memcpy(in->PlaneRow(c, y), row_src, xsize * sizeof(float));
-    }
-  }
+  };
+  JXL_CHECK(RunOnPool(pool, 0, ysize / kBlockDim, ThreadPool::NoInit,
+                      pad_block_row, "PadImageToBlockMultiple"));
 }
 
 }  // namespace jxl
@@ -20,6 +20,7 @@
 
 #include "encoder/base/cache_aligned.h"
 #include "encoder/base/compiler_specific.h"
+#include "encoder/base/data_parallel.h"
 #include "encoder/base/status.h"
 #include "encoder/common.h"
 
@@ -409,6 +410,65 @@ using Image3I = Image3<int32_t>;
 using Image3F = Image3<float>;
 using Image3D = Image3<double>;
 
+// View of interleaved RGB or RGBA pixels with 8 or 16 bits per sample (in the
+// native byte order) and the sRGB transfer function, as decoded from PNG or
+// JPEG files. The pixels are owned by the caller. Alpha is ignored.
+class InterleavedImage {
+ public:
+  // `bytes_per_row` defaults to the size of the pixels of a row. 16-bit
+  // samples must be 2-byte aligned.
+  InterleavedImage(const void* pixels, size_t xsize, size_t ysize,
+                   size_t num_channels, size_t bits_per_sample,
+                   size_t bytes_per_row = 0)
+      : pixels_(static_cast<const uint8_t*>(pixels)),
+        xsize_(xsize),
+        ysize_(ysize),
+        num_channels_(num_channels),
+        bits_per_sample_(bits_per_sample),
+        bytes_per_row_(bytes_per_row != 0
+                           ? bytes_per_row
+                           : xsize * num_channels * (bits_per_sample / 8)) {}
+
+  size_t xsize() const { return xsize_; }
+  size_t ysize() const { return ysize_; }
+  size_t num_channels() const { return num_channels_; }
+  size_t bits_per_sample() const { return bits_per_sample_; }
+  size_t bytes_per_row() const { return bytes_per_row_; }
+
+  const uint8_t* ConstRow(size_t y) const {
+    JXL_DASSERT(y < ysize_);
+    return pixels_ + y * bytes_per_row_;
+  }
+
+  // Returns whether the format is supported by the encoder.
+  Status Check() const {
+    if (num_channels_ != 3 && num_channels_ != 4) {
+      return JXL_FAILURE("Unsupported number of channels: %" PRIu64,
+                         static_cast<uint64_t>(num_channels_));
+    }
+    if (bits_per_sample_ != 8 && bits_per_sample_ != 16) {
+      return JXL_FAILURE("Unsupported bits per sample: %" PRIu64,
+                         static_cast<uint64_t>(bits_per_sample_));
+    }
+    const size_t pixel_size = num_channels_ * (bits_per_sample_ / 8);
+    if (bytes_per_row_ < xsize_ * pixel_size ||
+        (bits_per_sample_ == 16 &&
+         (reinterpret_cast<uintptr_t>(pixels_) % 2 != 0 ||
+          bytes_per_row_ % 2 != 0))) {
+      return JXL_FAILURE("Invalid pixel layout");
+    }
+    return true;
+  }
+
+ private:
+  const uint8_t* pixels_;
+  size_t xsize_;
+  size_t ysize_;
+  size_t num_channels_;
+  size_t bits_per_sample_;
+  size_t bytes_per_row_;
+};
+
 template <typename T>
 void CopyImageTo(const Plane<T>& from, Plane<T>* JXL_RESTRICT to) {
   JXL_ASSERT(SameSize(from, *to));
@@ -420,6 +480,27 @@ void CopyImageTo(const Plane<T>& from, Plane<T>* JXL_RESTRICT to) {
   }
 }
 
+// Copies `rect_from` of `from` to `rect_to` of `to`.
+template <typename T>
+void CopyImageTo(const Rect& rect_from, const Plane<T>& from,
+                 const Rect& rect_to, Plane<T>* JXL_RESTRICT to) {
+  JXL_DASSERT(SameSize(rect_from, rect_to));
+  if (rect_from.xsize() == 0) return;
+  for (size_t y = 0; y < rect_to.ysize(); ++y) {
+    const T* JXL_RESTRICT row_from = rect_from.ConstRow(from, y);
+    T* JXL_RESTRICT row_to = rect_to.Row(to, y);
+    memcpy(row_to, row_from, rect_to.xsize() * sizeof(T));
+  }
+}
+
+template <typename T>
+void CopyImageTo(const Rect& rect_from, const Image3<T>& from,
+                 const Rect& rect_to, Image3<T>* JXL_RESTRICT to) {
+  for (size_t c = 0; c < 3; ++c) {
+    CopyImageTo(rect_from, from.Plane(c), rect_to, &to->Plane(c));
+  }
+}
+
 // DEPRECATED - prefer to preallocate result.
 template <typename T>
 Plane<T> CopyImage(const Plane<T>& from) {
@@ -572,8 +653,10 @@ void ZeroFillPlane(Plane<T>* image, Rect rect) {
 }
 
 // Same as above, but operates in-place. Assumes that the `in` image was
-// allocated large enough.
-void PadImageToBlockMultipleInPlace(Image3F* JXL_RESTRICT in);
+// allocated large enough. Every block row is padded by a separate task of
+// `pool`.
+void PadImageToBlockMultipleInPlace(Image3F* JXL_RESTRICT in,
+                                    ThreadPool* pool = nullptr);
 
 }  // namespace jxl
 
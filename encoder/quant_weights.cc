@@ -9,11 +9,64 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
 #include <hwy/aligned_allocator.h>
 
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "encoder/quant_weights.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "encoder/dct_scales.h"
+#include "encoder/fast_math-inl.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// Computes the quantization weights of a `rows` x `cols` transform from its
+// distance bands, the same way the decoder computes the default matrices:
+// the weights at distances 0, 1, .. num_bands - 1 from the DC are given by the
+// bands, and interpolated geometrically in between.
+void GetQuantWeights(size_t rows, size_t cols, const float* distance_bands,
+                     size_t num_bands, float* out) {
+  float bands[kMaxDistanceBands];
+  bands[0] = distance_bands[0];
+  for (size_t i = 1; i < num_bands; i++) {
+    const float v = distance_bands[i];
+    bands[i] = bands[i - 1] * (v > 0 ? 1.0f + v : 1.0f / (1.0f - v));
+  }
+  const float scale = (num_bands - 1) / (kSqrt2 + 1e-6f);
+  const float rcpcol = scale / (cols - 1);
+  const float rcprow = scale / (rows - 1);
+  for (size_t y = 0; y < rows; y++) {
+    const float dy = y * rcprow;
+    for (size_t x = 0; x < cols; x++) {
+      const float dx = x * rcpcol;
+      const float distance = std::sqrt(dx * dx + dy * dy);
+      const size_t idx = static_cast<size_t>(distance);
+      const float frac = distance - idx;
+      out[y * cols + x] =
+          bands[idx] * FastPowf(bands[idx + 1] / bands[idx], frac);
+    }
+  }
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
 namespace jxl {
 
+HWY_EXPORT(GetQuantWeights);
+
 namespace {
+// Dequantization matrices of DCT and DCT16X8 (shared with DCT8X16).
 constexpr float kQuantWeights[] = {
     3.1746033e-04, 3.1746057e-04, 3.1854658e-04, 3.7755401e-04, 4.4749113e-04,
     5.3038419e-04, 6.2863121e-04, 7.4507861e-04, 3.1746057e-04, 3.1746062e-04,
@@ -132,28 +185,159 @@ constexpr float kQuantWeights[] = {
     3.7175436e-02, 4.7613274e-02, 6.1909460e-02, 8.1609353e-02, 1.0892317e-01,
     1.4702357e-01,
 };
-constexpr size_t kTableSizeInBlocks[] = {1, 1, 1, 2, 2, 2, 2, 2, 2};
-constexpr size_t kTableOffsetInBlocks[] = {0, 1, 2, 3, 5, 7, 3, 5, 7};
-constexpr size_t kTotalTableSize = 9 * kDCTBlockSize;
+
+// Parameters of the default quantization weights of the larger DCTs, for
+// the transposed (rows <= cols) coefficient layout.
+struct DctQuantParams {
+  size_t rows;
+  size_t cols;
+  size_t num_bands;
+  float distance_bands[3][kMaxDistanceBands];
+};
+
+constexpr DctQuantParams kDCT16X16Params = {
+    16,
+    16,
+    7,
+    {{8996.8725711814115328f, -1.3000777393353804f, -0.49424529824571225f,
+      -0.439093774457103443f, -0.6350101832695744f, -0.90177264050827612f,
+      -1.6162099239887414f},
+     {3191.48366296844234752f, -0.67424582104194355f, -0.80745813428471001f,
+      -0.44925837484843441f, -0.35865440981033403f, -0.31322389111877305f,
+      -0.37615025315725483f},
+     {1157.50408145487200256f, -2.0531423165804414f, -1.4f,
+      -0.50687130033378396f, -0.42708730624733904f, -1.4856834539296244f,
+      -4.9209142884401604f}},
+};
+
+constexpr DctQuantParams kDCT32X32Params = {
+    32,
+    32,
+    8,
+    {{15718.40830982518931456f, -1.025f, -0.98f, -0.9012f, -0.4f,
+      -0.48819395464f, -0.421064f, -0.27f},
+     {7305.7636810695983104f, -0.8041958212306401f, -0.7633036457487539f,
+      -0.55660379990111464f, -0.49785304658857626f, -0.43699592683512467f,
+      -0.40180866526242109f, -0.27321683125358037f},
+     {3803.53173721215041536f, -3.060733579805728f, -2.0413270132490346f,
+      -2.0235650159727417f, -0.5495389509954993f, -0.4f, -0.4f, -0.3f}},
+};
+
+constexpr DctQuantParams kDCT32X16Params = {
+    16,
+    32,
+    8,
+    {{13844.97076442300573f, -0.97113799999999995f, -0.658f, -0.42026f,
+      -0.22712f, -0.2206f, -0.226f, -0.6f},
+     {4798.964084220744293f, -0.61125308982767057f, -0.83770786552491361f,
+      -0.79014862079498627f, -0.2692727459704829f, -0.38272769465388551f,
+      -0.22924222653091453f, -0.20719098826199578f},
+     {1807.236946760964614f, -1.2f, -1.2f, -0.7f, -0.7f, -0.7f, -0.4f,
+      -0.5f}},
+};
+
+// DCT4X4 uses the weights of a 4x4 DCT for each of the 2x2 coefficients that
+// the four 4x4 transforms of the block have at the same frequency.
+constexpr DctQuantParams kDCT4X4Params = {
+    4,
+    4,
+    4,
+    {{2200.0f, 0.0f, 0.0f, 0.0f},
+     {392.0f, 0.0f, 0.0f, 0.0f},
+     {112.0f, -0.25f, -0.25f, -0.5f}},
+};
+
+// IDENTITY weights of the pixel differences, the differences of the 4x4 DCs
+// (coefficients 1 and 8) and their diagonal (coefficient 9).
+constexpr float kIdentityWeights[3][3] = {
+    {280.0f, 3160.0f, 3160.0f},
+    {60.0f, 864.0f, 864.0f},
+    {18.0f, 200.0f, 200.0f},
+};
+
+constexpr size_t kTableOffsetInBlocks[] = {
+    0,  1,  2,   // DCT
+    3,  5,  7,   // DCT16X8
+    3,  5,  7,   // DCT8X16
+    9,  13, 17,  // DCT16X16
+    21, 37, 53,  // DCT32X32
+    69, 77, 85,  // DCT32X16
+    69, 77, 85,  // DCT16X32
+    93, 94, 95,  // DCT4X4
+    96, 97, 98,  // IDENTITY
+};
+static_assert(sizeof(kTableOffsetInBlocks) / sizeof(*kTableOffsetInBlocks) ==
+                  3 * AcStrategy::kNumValidStrategies,
+              "Update table offsets");
+constexpr size_t kTotalTableSize = 99 * kDCTBlockSize;
+
+void SetDctTable(const DctQuantParams& params, const size_t* offsets,
+                 float* table) {
+  std::vector<float> weights(params.rows * params.cols);
+  for (size_t c = 0; c < 3; c++) {
+    HWY_DYNAMIC_DISPATCH(GetQuantWeights)
+    (params.rows, params.cols, params.distance_bands[c], params.num_bands,
+     weights.data());
+    for (size_t i = 0; i < params.rows * params.cols; ++i) {
+      table[offsets[c] * kDCTBlockSize + i] = 1.0f / weights[i];
+    }
+  }
+}
+
 }  // namespace
 
 DequantMatrices::DequantMatrices() {
   table_storage_ = hwy::AllocateAligned<float>(2 * kTotalTableSize);
-  memcpy(table_storage_.get(), kQuantWeights, sizeof(kQuantWeights));
-  float* inv_table = table_storage_.get() + kTotalTableSize;
+  float* table = table_storage_.get();
+  memcpy(table, kQuantWeights, sizeof(kQuantWeights));
+  using Type = AcStrategy::Type;
+  SetDctTable(kDCT16X16Params, &kTableOffsetInBlocks[Type::DCT16X16 * 3],
+              table);
+  SetDctTable(kDCT32X32Params, &kTableOffsetInBlocks[Type::DCT32X32 * 3],
+              table);
+  SetDctTable(kDCT32X16Params, &kTableOffsetInBlocks[Type::DCT32X16 * 3],
+              table);
+  for (size_t c = 0; c < 3; c++) {
+    float weights4x4[16];
+    HWY_DYNAMIC_DISPATCH(GetQuantWeights)
+    (4, 4, kDCT4X4Params.distance_bands[c], kDCT4X4Params.num_bands,
+     weights4x4);
+    float* dct4x4 =
+        table + kTableOffsetInBlocks[Type::DCT4X4 * 3 + c] * kDCTBlockSize;
+    for (size_t y = 0; y < kBlockDim; y++) {
+      for (size_t x = 0; x < kBlockDim; x++) {
+        dct4x4[y * kBlockDim + x] = 1.0f / weights4x4[(y / 2) * 4 + x / 2];
+      }
+    }
+    float* identity =
+        table + kTableOffsetInBlocks[Type::IDENTITY * 3 + c] * kDCTBlockSize;
+    std::fill(identity, identity + kDCTBlockSize,
+              1.0f / kIdentityWeights[c][0]);
+    identity[1] = identity[kBlockDim] = 1.0f / kIdentityWeights[c][1];
+    identity[kBlockDim + 1] = 1.0f / kIdentityWeights[c][2];
+  }
+  float* inv_table = table + kTotalTableSize;
   for (size_t i = 0; i < kTotalTableSize; ++i) {
-    inv_table[i] = 1.0 / table_storage_[i];
+    inv_table[i] = 1.0 / table[i];
   }
   for (size_t i = 0, n = 0; i < AcStrategy::kNumValidStrategies; i++) {
+    // The lowest frequencies are encoded as part of the DC.
+    const AcStrategy acs =
+        AcStrategy::FromRawStrategy(static_cast<AcStrategy::Type>(i));
+    const size_t cx = std::max(acs.covered_blocks_x(), acs.covered_blocks_y());
+    const size_t cy = std::min(acs.covered_blocks_x(), acs.covered_blocks_y());
     for (size_t c = 0; c < 3; c++, n++) {
       table_offsets_[n] = kTableOffsetInBlocks[n] * kDCTBlockSize;
-      for (size_t b = 0; b < kTableSizeInBlocks[n]; ++b) {
-        inv_table[table_offsets_[n] + b] = 0.0f;
+      for (size_t y = 0; y < cy; ++y) {
+        for (size_t x = 0; x < cx; ++x) {
+          inv_table[table_offsets_[n] + y * cx * kBlockDim + x] = 0.0f;
+        }
       }
     }
   }
-  table_ = table_storage_.get();
+  table_ = table;
   inv_table_ = inv_table;
 }
 
 }  // namespace jxl
+#endif  // HWY_ONCE
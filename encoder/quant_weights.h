@@ -31,6 +31,9 @@ const float kDCQuant[3] = {
     1.0f / kInvDCQuant[2],
 };
 
+// Maximum number of distance bands of the parametrized DCT matrices.
+constexpr size_t kMaxDistanceBands = 8;
+
 class DequantMatrices {
  public:
   DequantMatrices();
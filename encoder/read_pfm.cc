@@ -7,13 +7,123 @@
 #include "encoder/read_pfm.h"
 
 #include <limits.h>
+#include <stdio.h>
+#include <string.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define JXL_PFM_MMAP 1
+#else
+#define JXL_PFM_MMAP 0
+#endif
+
+#if JXL_PFM_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <utility>
 #include <vector>
 
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "encoder/read_pfm.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
 #include "encoder/base/byte_order.h"
+#include "encoder/base/data_parallel.h"
+#include "encoder/base/printf_macros.h"
+#include "encoder/base/status.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::And;
+using hwy::HWY_NAMESPACE::Mul;
+using hwy::HWY_NAMESPACE::Or;
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::ShiftLeft;
+using hwy::HWY_NAMESPACE::ShiftRight;
+using hwy::HWY_NAMESPACE::Vec;
+
+// Reverses the byte order of each lane.
+template <class DU>
+JXL_INLINE Vec<DU> BSwap32(DU du, Vec<DU> v) {
+  const auto lo = Or(ShiftLeft<24>(v), And(ShiftLeft<8>(v), Set(du, 0xFF0000)));
+  const auto hi = Or(ShiftRight<24>(v), And(ShiftRight<8>(v), Set(du, 0xFF00)));
+  return Or(lo, hi);
+}
+
+// Converts the interleaved RGB samples of `row_in` to the planes of `rows`.
+template <bool kSwap>
+void DeinterleaveRow(const float* JXL_RESTRICT row_in, size_t xsize,
+                     size_t y, Image3F* JXL_RESTRICT rows) {
+  const HWY_FULL(float) d;
+  const Rebind<int32_t, decltype(d)> di;
+  const Rebind<uint32_t, decltype(d)> du;
+  const size_t N = Lanes(d);
+  const auto offsets = Mul(Iota(di, 0), Set(di, 3));
+  for (size_t c = 0; c < 3; ++c) {
+    float* JXL_RESTRICT row_out = rows->PlaneRow(c, y);
+    size_t x = 0;
+    for (; x + N <= xsize; x += N) {
+      auto v = GatherIndex(d, row_in + 3 * x + c, offsets);
+      if (kSwap) v = BitCast(d, BSwap32(du, BitCast(du, v)));
+      Store(v, d, row_out + x);
+    }
+    for (; x < xsize; ++x) {
+      const float v = row_in[3 * x + c];
+      row_out[x] = kSwap ? BSwapFloat(v) : v;
+    }
+  }
+}
+
+// See PFMFile::ReadRows.
+Status DeinterleaveRows(const uint8_t* pixels, size_t ysize, bool swap,
+                        size_t y0, ThreadPool* pool, Image3F* rows) {
+  const size_t xsize = rows->xsize();
+  const size_t row_bytes = xsize * 3 * sizeof(float);
+  const bool aligned =
+      reinterpret_cast<uintptr_t>(pixels) % alignof(float) == 0;
+  // Rows that are not float-aligned in the file are copied here first.
+  std::vector<std::vector<float>> buffers;
+  const auto init = [&](const size_t num_threads) {
+    if (!aligned) buffers.resize(num_threads);
+    return true;
+  };
+  const auto process_row = [&](const uint32_t y, const size_t thread) {
+    // PFM stores the bottom row first.
+    const uint8_t* row_bytes_in = pixels + (ysize - 1 - y0 - y) * row_bytes;
+    const float* row_in = reinterpret_cast<const float*>(row_bytes_in);
+    if (!aligned) {
+      std::vector<float>& buffer = buffers[thread];
+      buffer.resize(xsize * 3);
+      memcpy(buffer.data(), row_bytes_in, row_bytes);
+      row_in = buffer.data();
+    }
+    if (swap) {
+      DeinterleaveRow<true>(row_in, xsize, y, rows);
+    } else {
+      DeinterleaveRow<false>(row_in, xsize, y, rows);
+    }
+  };
+  return RunOnPool(pool, 0, rows->ysize(), init, process_row,
+                   "DeinterleavePFM");
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
 
+#if HWY_ONCE
 namespace jxl {
 
+HWY_EXPORT(DeinterleaveRows);
+
 namespace {
 class Parser {
  public:
@@ -45,6 +155,22 @@ class Parser {
     return true;
   }
 
+  // Same as above for binary PPM files (P6).
+  bool ParseHeaderPPM(const uint8_t** pos, size_t* xsize, size_t* ysize,
+                      size_t* maxval) {
+    if (pos_[0] != 'P' || pos_[1] != '6') return false;
+    pos_ += 2;
+
+    if (!SkipSingleWhitespace() || !ParseUnsigned(xsize) || !SkipBlank() ||
+        !ParseUnsigned(ysize) || !SkipSingleWhitespace() ||
+        !ParseUnsigned(maxval) || !SkipSingleWhitespace()) {
+      return false;
+    }
+
+    *pos = pos_;
+    return true;
+  }
+
   bool ParseUnsigned(size_t* number) {
     if (pos_ == end_) {
       fprintf(stderr, "PNM: reached end before number.\n");
@@ -174,42 +300,147 @@ bool ReadFile(const char* filename, std::vector<uint8_t>* out) {
 
 }  // namespace
 
+PFMFile::~PFMFile() {
+#if JXL_PFM_MMAP
+  if (data_ != nullptr) munmap(const_cast<uint8_t*>(data_), size_);
+#endif
+}
+
+bool PFMFile::Open(const char* fn) {
+#if JXL_PFM_MMAP
+  const int fd = open(fn, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s\n", fn);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "Could not read %s\n", fn);
+    close(fd);
+    return false;
+  }
+  size_ = st.st_size;
+  void* data = size_ == 0 ? MAP_FAILED
+                          : mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after the file is closed.
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s\n", fn);
+    return false;
+  }
+  data_ = static_cast<const uint8_t*>(data);
+#else
+  if (!ReadFile(fn, &buffer_)) {
+    fprintf(stderr, "Could not read %s\n", fn);
+    return false;
+  }
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+#endif
+  if (size_ < 2) {
+    fprintf(stderr, "PFM file too small.\n");
+    return false;
+  }
+
+  Parser parser(data_, size_);
+  bool big_endian;
+  if (!parser.ParseHeaderPFM(&pixels_, &xsize_, &ysize_, &big_endian)) {
+    return false;
+  }
+  const size_t header_size = pixels_ - data_;
+  if (xsize_ == 0 || ysize_ == 0 ||
+      xsize_ > (size_ - header_size) / (3 * sizeof(float)) / ysize_) {
+    fprintf(stderr, "PFM file too small for %" PRIuS "x%" PRIuS " pixels.\n",
+            xsize_, ysize_);
+    return false;
+  }
+  // The samples are in the byte order of the file.
+  swap_ = big_endian == IsLittleEndian();
+  return true;
+}
+
+bool PFMFile::ReadRows(size_t y0, ThreadPool* pool, Image3F* rows) const {
+  JXL_ASSERT(rows->xsize() == xsize_);
+  JXL_ASSERT(y0 + rows->ysize() <= ysize_);
+  if (rows->ysize() == 0) return true;
+#if JXL_PFM_MMAP
+  // The rows are stored bottom to top, so the requested ones are in
+  // [begin, end) of the file, and read back to front.
+  const size_t row_bytes = xsize_ * 3 * sizeof(float);
+  const uint8_t* begin = pixels_ + (ysize_ - y0 - rows->ysize()) * row_bytes;
+  const uint8_t* end = begin + rows->ysize() * row_bytes;
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  const uintptr_t prefetch_begin =
+      reinterpret_cast<uintptr_t>(begin) & ~(page - 1);
+  madvise(reinterpret_cast<void*>(prefetch_begin),
+          reinterpret_cast<uintptr_t>(end) - prefetch_begin, MADV_WILLNEED);
+#endif
+  JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(DeinterleaveRows)(
+      pixels_, ysize_, swap_, y0, pool, rows));
+#if JXL_PFM_MMAP
+  // Each row is expected to be read once: release the pages that only hold
+  // these rows, so that the file never needs to be resident as a whole.
+  const uintptr_t release_begin =
+      (reinterpret_cast<uintptr_t>(begin) + page - 1) & ~(page - 1);
+  const uintptr_t release_end = reinterpret_cast<uintptr_t>(end) & ~(page - 1);
+  if (release_end > release_begin) {
+    madvise(reinterpret_cast<void*>(release_begin),
+            release_end - release_begin, MADV_DONTNEED);
+  }
+#endif
+  return true;
+}
+
 bool ReadPFM(const char* fn, Image3F* image) {
+  return ReadPFM(fn, nullptr, image);
+}
+
+bool ReadPFM(const char* fn, ThreadPool* pool, Image3F* image) {
+  PFMFile file;
+  if (!file.Open(fn)) return false;
+  Image3F img(file.xsize(), file.ysize());
+  if (!file.ReadRows(0, pool, &img)) return false;
+  *image = std::move(img);
+  return true;
+}
+
+bool ReadPPM(const char* fn, std::vector<uint8_t>* pixels, size_t* xsize,
+             size_t* ysize, size_t* bits_per_sample) {
   std::vector<uint8_t> data;
   if (!ReadFile(fn, &data)) {
     fprintf(stderr, "Could not read %s\n", fn);
     return false;
   }
   if (data.size() < 2) {
-    fprintf(stderr, "PFM file too small.\n");
+    fprintf(stderr, "PPM file too small.\n");
     return false;
   }
-
   Parser parser(data.data(), data.size());
-  size_t xsize, ysize;
-  bool big_endian;
-  const uint8_t* pos = nullptr;
-  if (!parser.ParseHeaderPFM(&pos, &xsize, &ysize, &big_endian)) {
-    return false;
-  }
-
-  Image3F img(xsize, ysize);
-  const float* input = reinterpret_cast<const float*>(pos);
-  const size_t stride = xsize * 3;
-  for (size_t y = 0; y < ysize; ++y) {
-    size_t y_in = ysize - 1 - y;
-    const float* row_in = &input[y_in * stride];
-    for (size_t c = 0; c < 3; ++c) {
-      float* row_out = img.PlaneRow(c, y);
-      for (size_t x = 0; x < xsize; ++x) {
-        row_out[x] = row_in[x * 3 + c];
-        if (big_endian) row_out[x] = BSwapFloat(row_out[x]);
-      }
+  const uint8_t* pos;
+  size_t maxval;
+  if (!parser.ParseHeaderPPM(&pos, xsize, ysize, &maxval)) return false;
+  if (maxval != 255 && maxval != 65535) {
+    fprintf(stderr, "PPM: unsupported maximum value %" PRIuS ".\n", maxval);
+    return false;
+  }
+  *bits_per_sample = maxval == 255 ? 8 : 16;
+  const size_t pixel_size = 3 * (*bits_per_sample / 8);
+  const size_t header_size = pos - data.data();
+  if (*xsize == 0 || *ysize == 0 ||
+      *xsize > (data.size() - header_size) / pixel_size / *ysize) {
+    fprintf(stderr, "PPM file too small for %" PRIuS "x%" PRIuS " pixels.\n",
+            *xsize, *ysize);
+    return false;
+  }
+  pixels->assign(pos, pos + *xsize * *ysize * pixel_size);
+  // The 16-bit samples of the file are big endian.
+  if (*bits_per_sample == 16 && IsLittleEndian()) {
+    for (size_t i = 0; i < pixels->size(); i += 2) {
+      std::swap((*pixels)[i], (*pixels)[i + 1]);
     }
   }
-
-  *image = std::move(img);
   return true;
 }
 
 }  // namespace jxl
+#endif  // HWY_ONCE
@@ -7,12 +7,66 @@
 #ifndef ENCODER_READ_PFM_H_
 #define ENCODER_READ_PFM_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "encoder/base/data_parallel.h"
 #include "encoder/image.h"
 
 namespace jxl {
 
 bool ReadPFM(const char* fn, jxl::Image3F* image);
 
+// Same as above, but converts the rows to planar format in parallel on `pool`,
+// which may be null.
+bool ReadPFM(const char* fn, ThreadPool* pool, jxl::Image3F* image);
+
+// Reads a binary PPM file with 8 or 16 bits per sample (maximum value 255 or
+// 65535) into `pixels` as interleaved RGB samples in the native byte order,
+// the layout of InterleavedImage.
+bool ReadPPM(const char* fn, std::vector<uint8_t>* pixels, size_t* xsize,
+             size_t* ysize, size_t* bits_per_sample);
+
+// PFM file that is mapped into memory instead of being read, so that its
+// pixels are only loaded when they are requested with ReadRows(). This lets
+// EncodeFileStreaming() encode images that do not fit into memory, see
+// ImageRowsCallback.
+class PFMFile {
+ public:
+  PFMFile() = default;
+  ~PFMFile();
+
+  PFMFile(const PFMFile&) = delete;
+  PFMFile& operator=(const PFMFile&) = delete;
+
+  // Maps the file and parses its header. Returns false if the file cannot be
+  // read or is not a PFM file.
+  bool Open(const char* fn);
+
+  size_t xsize() const { return xsize_; }
+  size_t ysize() const { return ysize_; }
+
+  // Fills `rows`, which must have the width of the image, with the image rows
+  // [y0, y0 + rows->ysize()) in planar format and native byte order, using
+  // `pool` (may be null). The memory holding these rows in the file is
+  // released afterwards, so every row should only be read once.
+  bool ReadRows(size_t y0, ThreadPool* pool, Image3F* rows) const;
+
+ private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  // Contents of the file on systems without mmap.
+  std::vector<uint8_t> buffer_;
+  // First byte after the header.
+  const uint8_t* pixels_ = nullptr;
+  size_t xsize_ = 0;
+  size_t ysize_ = 0;
+  // Whether the samples are in the other byte order than the system.
+  bool swap_ = false;
+};
+
 }  // namespace jxl
 
 #endif  // ENCODER_READ_PFM_H_
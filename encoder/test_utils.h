@@ -0,0 +1,123 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef ENCODER_TEST_UTILS_H_
+#define ENCODER_TEST_UTILS_H_
+
+// Synthetic input images and entropy presets of the encoder tests.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include "encoder/base/data_parallel.h"
+#include "encoder/enc_frame.h"
+#include "encoder/entropy_preset.h"
+#include "encoder/image.h"
+#include "encoder/quant_weights.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace test {
+
+// Stores the linear sRGB samples, in [0, 1], of a pixel of a synthetic image
+// in `rgb`: smooth gradients, hard edges, noisy squares and thin lines, which
+// between them give every stage of the encoder something to do. `seed`
+// changes the noise.
+inline void TestPixel(size_t x, size_t y, size_t xsize, size_t ysize,
+                      uint32_t seed, float rgb[3]) {
+  rgb[0] = 0.5f + 0.4f * std::sin(x * 0.05f) * std::cos(y * 0.03f);
+  rgb[1] = 0.3f + 0.4f * y / ysize;
+  rgb[2] = 0.6f - 0.3f * x / xsize;
+  if ((x / 48 + y / 48) % 2) std::swap(rgb[0], rgb[1]);
+  if (x % 64 >= 16 && x % 64 < 40 && y % 64 >= 16 && y % 64 < 40) {
+    uint32_t h = (x * 73856093u) ^ (y * 19349663u) ^ (seed * 83492791u);
+    h = (h ^ (h >> 13)) * 0x5bd1e995u;
+    const float noise = ((h ^ (h >> 15)) & 0xFFFF) * (0.3f / 65536);
+    rgb[0] = 0.2f + noise;
+    rgb[1] = 0.2f + noise;
+    rgb[2] = 0.25f + noise;
+  }
+  if ((x + 2 * y) % 37 == 0 || (3 * x + 53 * ysize - y) % 53 == 0) {
+    rgb[0] = rgb[1] = 0.05f;
+    rgb[2] = 0.1f;
+  }
+}
+
+inline Image3F TestImage(size_t xsize, size_t ysize, uint32_t seed = 0) {
+  Image3F image(xsize, ysize);
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      float rgb[3];
+      TestPixel(x, y, xsize, ysize, seed, rgb);
+      for (size_t c = 0; c < 3; ++c) image.PlaneRow(c, y)[x] = rgb[c];
+    }
+  }
+  return image;
+}
+
+// The same image as interleaved sRGB samples with `bits_per_sample` 8 or 16,
+// to be wrapped in an InterleavedImage. The linear values are stored as they
+// are, without the sRGB transfer function, which is enough for testing.
+inline std::vector<uint8_t> TestPixels(size_t xsize, size_t ysize,
+                                       size_t bits_per_sample,
+                                       uint32_t seed = 0) {
+  const size_t bytes = bits_per_sample / 8;
+  const uint32_t maxval = (1u << bits_per_sample) - 1;
+  std::vector<uint8_t> pixels(xsize * ysize * 3 * bytes);
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      float rgb[3];
+      TestPixel(x, y, xsize, ysize, seed, rgb);
+      for (size_t c = 0; c < 3; ++c) {
+        const uint16_t value =
+            static_cast<uint16_t>(std::lround(rgb[c] * maxval));
+        uint8_t* p = &pixels[((y * xsize + x) * 3 + c) * bytes];
+        // Native byte order, as InterleavedImage expects.
+        if (bytes == 1) {
+          *p = static_cast<uint8_t>(value);
+        } else {
+          memcpy(p, &value, sizeof(value));
+        }
+      }
+    }
+  }
+  return pixels;
+}
+
+// An entropy preset trained on `image` at distance 1.
+inline EntropyPreset TrainPreset(const Image3F& image, ThreadPool* pool) {
+  DequantMatrices matrices;
+  FrameHistograms histograms;
+  EXPECT_TRUE(AddFrameHistograms(1.0f, EncoderEffort::kDefault, image,
+                                 matrices, pool, &histograms));
+  EntropyPreset preset;
+  preset.dc = TrainPresetCode(histograms.dc.histograms);
+  preset.ac = TrainPresetCode(histograms.ac.histograms);
+  return preset;
+}
+
+// Compares two encoded files, reporting their sizes and the first byte that
+// differs instead of all their bytes.
+inline ::testing::AssertionResult SameBytes(const std::vector<uint8_t>& a,
+                                            const std::vector<uint8_t>& b) {
+  size_t pos = 0;
+  while (pos < a.size() && pos < b.size() && a[pos] == b[pos]) ++pos;
+  if (pos == a.size() && pos == b.size()) {
+    return ::testing::AssertionSuccess();
+  }
+  return ::testing::AssertionFailure()
+         << a.size() << " and " << b.size() << " bytes differ at byte " << pos;
+}
+
+}  // namespace test
+}  // namespace jxl
+
+#endif  // ENCODER_TEST_UTILS_H_
@@ -7,9 +7,13 @@
 #ifndef ENCODER_TOKEN_H_
 #define ENCODER_TOKEN_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <vector>
+
 #include "encoder/base/bits.h"
+#include "encoder/base/status.h"
 
 namespace jxl {
 
@@ -21,6 +25,80 @@ struct Token {
   uint32_t value;
 };
 
+// Sequence of tokens stored in 4 bytes per token instead of 8, used for the AC
+// coefficients, which make up almost all tokens of a frame. The context is
+// kept in the upper kContextBits bits and the value in the lower bits; the
+// rare values that do not fit are marked with kEscape and stored separately,
+// in token order.
+class PackedTokens {
+ public:
+  static constexpr uint32_t kContextBits = 13;
+  static constexpr uint32_t kValueBits = 32 - kContextBits;
+  static constexpr uint32_t kEscape = (1u << kValueBits) - 1;
+
+  size_t size() const { return packed_.size(); }
+  bool empty() const { return packed_.empty(); }
+  void reserve(size_t n) { packed_.reserve(n); }
+  void swap(PackedTokens& other) {
+    packed_.swap(other.packed_);
+    large_values_.swap(other.large_values_);
+  }
+
+  // Appends all tokens of `other`.
+  void Append(const PackedTokens& other) {
+    packed_.insert(packed_.end(), other.packed_.begin(), other.packed_.end());
+    large_values_.insert(large_values_.end(), other.large_values_.begin(),
+                         other.large_values_.end());
+  }
+
+  // Replaces the context of the token at index `i`.
+  void SetContext(size_t i, uint32_t context) {
+    JXL_DASSERT(context < (1u << kContextBits));
+    packed_[i] = (context << kValueBits) | (packed_[i] & kEscape);
+  }
+
+  JXL_INLINE void emplace_back(uint32_t context, uint32_t value) {
+    JXL_DASSERT(context < (1u << kContextBits));
+    if (JXL_UNLIKELY(value >= kEscape)) {
+      large_values_.push_back(value);
+      value = kEscape;
+    }
+    packed_.push_back((context << kValueBits) | value);
+  }
+
+  // Calls visit(Token) for every token, first to last.
+  template <typename Visitor>
+  void ForEach(const Visitor& visit) const {
+    size_t large_pos = 0;
+    for (const uint32_t packed : packed_) {
+      visit(Unpack(packed, &large_pos, 1));
+    }
+  }
+
+  // Calls visit(Token) for every token, last to first.
+  template <typename Visitor>
+  void ForEachReverse(const Visitor& visit) const {
+    size_t large_pos = large_values_.size() - 1;
+    for (size_t i = packed_.size(); i > 0; --i) {
+      visit(Unpack(packed_[i - 1], &large_pos, -1));
+    }
+  }
+
+ private:
+  JXL_INLINE Token Unpack(uint32_t packed, size_t* large_pos,
+                          ptrdiff_t step) const {
+    uint32_t value = packed & kEscape;
+    if (JXL_UNLIKELY(value == kEscape)) {
+      value = large_values_[*large_pos];
+      *large_pos += step;
+    }
+    return Token(packed >> kValueBits, value);
+  }
+
+  std::vector<uint32_t> packed_;
+  std::vector<uint32_t> large_values_;
+};
+
 // N = 0 - 15:          (token=N, nbits=0, bits='')
 // N = 16 (10000):      (token=16, nbits=2, bits='00')
 // N = 17 (10001):      (token=16, nbits=2, bits='01')
@@ -0,0 +1,124 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+// Trains an entropy preset for cjxl_tiny --preset on a set of images, which
+// should be representative of those that will be encoded with it.
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <thread>  //NOLINT
+#include <vector>
+
+#include "encoder/base/data_parallel.h"
+#include "encoder/enc_frame.h"
+#include "encoder/entropy_preset.h"
+#include "encoder/image.h"
+#include "encoder/quant_weights.h"
+#include "encoder/read_pfm.h"
+
+namespace {
+
+void PrintHelp(char* arg0) {
+  fprintf(stderr,
+          "Usage: %s <preset out> [-d distance] [--effort E] <file in>...\n\n"
+          "  NOTE: <file in> are .pfm files in linear SRGB colorspace, the\n"
+          "        preset is trained for the given distance and effort.\n",
+          arg0);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* file_out = nullptr;
+  std::vector<const char*> files_in;
+  float distance = 1.0;
+  jxl::EncoderEffort effort = jxl::EncoderEffort::kDefault;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp("-h", argv[i]) || !strcmp("--help", argv[i])) {
+      PrintHelp(argv[0]);
+      return EXIT_SUCCESS;
+    }
+    if (argv[i][0] == '-' && argv[i][1] == 'd') {
+      char* arg = argv[i][2] != '\0' ? &argv[i][2] : argv[++i];
+      if (i == argc) {
+        fprintf(stderr, "-d requires an argument\n");
+        return EXIT_FAILURE;
+      }
+      char* end;
+      distance = static_cast<float>(strtod(arg, &end));
+      if (*end != '\0') {
+        fprintf(stderr, "Unable to interpret as float: %s\n", arg);
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
+    if (!strcmp("--effort", argv[i])) {
+      if (++i == argc) {
+        fprintf(stderr, "--effort requires an argument\n");
+        return EXIT_FAILURE;
+      }
+      if (!strcmp("lightning", argv[i])) {
+        effort = jxl::EncoderEffort::kLightning;
+      } else if (!strcmp("default", argv[i])) {
+        effort = jxl::EncoderEffort::kDefault;
+      } else if (!strcmp("slower", argv[i])) {
+        effort = jxl::EncoderEffort::kSlower;
+      } else {
+        fprintf(stderr, "Invalid value for --effort: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
+    if (!file_out) {
+      file_out = argv[i];
+    } else {
+      files_in.push_back(argv[i]);
+    }
+  }
+  if (files_in.empty()) {
+    PrintHelp(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  jxl::ThreadPool pool(std::thread::hardware_concurrency());
+  jxl::DequantMatrices matrices;
+  jxl::FrameHistograms histograms;
+  for (const char* file_in : files_in) {
+    jxl::Image3F image;
+    if (!jxl::ReadPFM(file_in, &pool, &image)) {
+      fprintf(stderr, "Error reading PFM input file %s.\n", file_in);
+      return EXIT_FAILURE;
+    }
+    if (!jxl::AddFrameHistograms(distance, effort, image, matrices, &pool,
+                                 &histograms)) {
+      fprintf(stderr, "Failed to compute the histograms of %s.\n", file_in);
+      return EXIT_FAILURE;
+    }
+  }
+
+  jxl::EntropyPreset preset;
+  preset.dc = jxl::TrainPresetCode(histograms.dc.histograms);
+  preset.ac = jxl::TrainPresetCode(histograms.ac.histograms);
+  const std::vector<uint8_t> bytes = jxl::SerializeEntropyPreset(preset);
+  FILE* file = fopen(file_out, "wb");
+  if (!file) {
+    fprintf(stderr, "Could not open %s for writing\nError: %s", file_out,
+            strerror(errno));
+    return EXIT_FAILURE;
+  }
+  const bool ok = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+  if (fclose(file) != 0 || !ok) {
+    fprintf(stderr, "Could not write to file\nError: %s", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "Trained on %d images, %d DC and %d AC clusters.\n",
+          static_cast<int>(files_in.size()),
+          static_cast<int>(preset.dc.histograms.size()),
+          static_cast<int>(preset.ac.histograms.size()));
+  return EXIT_SUCCESS;
+}
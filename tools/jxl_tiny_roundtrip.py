@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+
+# Copyright (c) the JPEG XL Project Authors.
+#
+# Use of this source code is governed by a BSD-style
+# license that can be found in the LICENSE file or at
+# https://developers.google.com/open-source/licenses/bsd
+
+
+"""jxl_tiny_roundtrip.py: Helpers of the round-trip checks in ci.sh.
+
+Only uses the standard library, so that the checks need nothing but djxl and
+butteraugli_main besides the build.
+"""
+
+import argparse
+import array
+import json
+import math
+import random
+import sys
+
+
+def SynthPixel(x, y, xsize, ysize, rng):
+  """Returns the RGB value in [0, 1] of a pixel of the synthetic image: smooth
+  gradients, hard edges, textured squares and thin lines, which between them
+  give every AC strategy something to code."""
+  r = 0.5 + 0.4 * math.sin(x * 0.05) * math.cos(y * 0.03)
+  g = 0.3 + 0.4 * y / ysize
+  b = 0.6 - 0.3 * x / xsize
+  if (x // 48 + y // 48) % 2:
+    r, g = g, r
+  if 16 <= x % 64 < 40 and 16 <= y % 64 < 40 and (x // 64 + y // 64) % 3 == 0:
+    n = rng.random() * 0.3
+    r, g, b = 0.2 + n, 0.2 + n, 0.25 + n
+  if (x + 2 * y) % 37 == 0 or (3 * x - y) % 53 == 0:
+    r, g, b = 0.05, 0.05, 0.1
+  return r, g, b
+
+
+def Synth(args):
+  """Writes a synthetic image as PFM (linear samples) or binary PPM."""
+  rng = random.Random(args.xsize * 65536 + args.ysize)
+  rows = []
+  for y in range(args.ysize):
+    rows.append([SynthPixel(x, y, args.xsize, args.ysize, rng)
+                 for x in range(args.xsize)])
+  with open(args.output, 'wb') as f:
+    if args.output.endswith('.pfm'):
+      f.write(b'PF\n%d %d\n-1.0\n' % (args.xsize, args.ysize))
+      samples = array.array('f')
+      # PFM rows are stored bottom to top.
+      for row in reversed(rows):
+        for rgb in row:
+          samples.extend(rgb)
+      if sys.byteorder != 'little':
+        samples.byteswap()
+    else:
+      maxval = (1 << args.bits) - 1
+      f.write(b'P6\n%d %d\n%d\n' % (args.xsize, args.ysize, maxval))
+      samples = array.array('B' if args.bits <= 8 else 'H')
+      for row in rows:
+        for rgb in row:
+          samples.extend(int(round(v * maxval)) for v in rgb)
+      # PPM samples wider than a byte are big endian.
+      if samples.itemsize > 1 and sys.byteorder != 'big':
+        samples.byteswap()
+    f.write(samples.tobytes())
+
+
+def ReadPPM(path):
+  """Returns the size, maximum value and samples of a binary PPM file."""
+  with open(path, 'rb') as f:
+    data = f.read()
+  fields = []
+  pos = 0
+  while len(fields) < 4:
+    while data[pos:pos + 1].isspace():
+      pos += 1
+    end = pos
+    while not data[end:end + 1].isspace():
+      end += 1
+    fields.append(data[pos:end])
+    pos = end
+  pos += 1
+  if fields[0] != b'P6':
+    raise ValueError('%s is not a binary PPM file' % path)
+  xsize, ysize, maxval = (int(v) for v in fields[1:])
+  samples = array.array('B' if maxval < 256 else 'H')
+  samples.frombytes(data[pos:pos + xsize * ysize * 3 * samples.itemsize])
+  if samples.itemsize > 1 and sys.byteorder != 'big':
+    samples.byteswap()
+  return xsize, ysize, maxval, samples
+
+
+def Compare(args):
+  """Checks that no sample of two PPM files differs by more than a bound."""
+  expected = ReadPPM(args.expected)
+  actual = ReadPPM(args.actual)
+  if expected[:3] != actual[:3]:
+    sys.exit('%s is %dx%d with maximum %d, %s is %dx%d with maximum %d' %
+             ((args.expected,) + expected[:3] + (args.actual,) + actual[:3]))
+  error = max(abs(a - b) for a, b in zip(expected[3], actual[3]))
+  print('%s: maximum error %d' % (args.actual, error))
+  if error > args.max_error:
+    sys.exit('%s: maximum error %d > %d' % (args.actual, error,
+                                           args.max_error))
+
+
+def FirstPass(args):
+  """Writes the part of a two-pass JPEG XL file before its second pass."""
+  with open(args.stats_json) as f:
+    sections = json.load(f)['sections']
+  names = [section['name'] for section in sections]
+  # The sections are listed in the order of the file, the second pass last.
+  num_refinements = names.count('AC refinement')
+  if (num_refinements == 0 or
+      names[-num_refinements:] != ['AC refinement'] * num_refinements):
+    sys.exit('%s has no second pass at its end' % args.stats_json)
+  refinement_bytes = sum(
+      section['bytes'] for section in sections[-num_refinements:])
+  with open(args.input, 'rb') as f:
+    data = f.read()
+  if sum(section['bytes'] for section in sections) != len(data):
+    sys.exit('%s does not describe %s' % (args.stats_json, args.input))
+  with open(args.output, 'wb') as f:
+    f.write(data[:len(data) - refinement_bytes])
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__)
+  subparsers = parser.add_subparsers(dest='command')
+  subparsers.required = True
+
+  synth = subparsers.add_parser('synth', help=Synth.__doc__)
+  synth.add_argument('output', help='.pfm or .ppm file to write')
+  synth.add_argument('xsize', type=int)
+  synth.add_argument('ysize', type=int)
+  synth.add_argument('--bits', type=int, default=8,
+                     help='bits per sample of a PPM output')
+  synth.set_defaults(func=Synth)
+
+  compare = subparsers.add_parser('compare', help=Compare.__doc__)
+  compare.add_argument('expected')
+  compare.add_argument('actual')
+  compare.add_argument('--max_error', type=int, default=0)
+  compare.set_defaults(func=Compare)
+
+  first_pass = subparsers.add_parser('first_pass', help=FirstPass.__doc__)
+  first_pass.add_argument('input', help='.jxl file written with --two_passes')
+  first_pass.add_argument('stats_json', help='--stats_json of the encoder')
+  first_pass.add_argument('output')
+  first_pass.set_defaults(func=FirstPass)
+
+  args = parser.parse_args()
+  args.func(args)
+
+
+if __name__ == '__main__':
+  main()